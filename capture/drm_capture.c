@@ -0,0 +1,188 @@
+/*
+ * Program: drm_capture
+ *
+ * Grab whatever a CRTC is currently scanning out and write it to disk
+ * as PNG, QOI or raw pixels. The live FB is mapped through PRIME, copied
+ * out with streaming loads and then encoded on a worker pool in stripes
+ */
+
+#include "drm.h"
+#include "drm_mode.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <log.h>
+#include <drm_common.h>
+#include <capture.h>
+#include <encode.h>
+#include <pool.h>
+
+static double now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+//Find the FB on crtc_id or on the first CRTC that is scanning anything out
+static uint32_t find_fb(int fd, uint32_t crtc_id) {
+	drmModeResPtr res = drmModeGetResources(fd);
+	uint32_t fb = 0;
+
+	if(!res) {
+		logger_error("Failed to get resources %m");
+		return 0;
+	}
+
+	for(int i = 0; i < res->count_crtcs && !fb; i++) {
+		if(crtc_id && res->crtcs[i] != crtc_id) {
+			continue;
+		}
+
+		drmModeCrtcPtr crtc = drmModeGetCrtc(fd, res->crtcs[i]);
+		if(crtc) {
+			fb = crtc->buffer_id;
+			drmModeFreeCrtc(crtc);
+		}
+	}
+
+	drmModeFreeResources(res);
+	return fb;
+}
+
+void usage(const char *progname) {
+	printf("%s [-h] [-p <PATH_TO_DRM_DEV>] [-c <CRTC_ID>] [-f png|qoi|raw] [-l <LEVEL>] [-j <THREADS>] [-o <FILE>]\n", progname);
+	printf("Options:\n-h = prints this help message\
+			\n-p = path to drm device (default /dev/dri/card0)\
+			\n-c = CRTC to capture (default first active CRTC)\
+			\n-f = output format (default png)\
+			\n-l = zlib level for png (default 1)\
+			\n-j = encoder threads, 0 = one per cpu (default 0)\
+			\n-o = output file (default capture.<format>)\n");
+}
+
+int main(int argc, char **argv) {
+	const char *dev_path = "/dev/dri/card0";
+	const char *out_path = NULL;
+	char def_path[32];
+	encode_format_t fmt = ENCODE_PNG;
+	uint32_t crtc_id = 0;
+	uint32_t threads = 0;
+	int level = 1;
+	int ret = 1;
+	int arg;
+
+	while((arg = getopt(argc, argv, ":p:c:f:l:j:o:h")) != -1) {
+		switch(arg) {
+		case 'p':
+			dev_path = optarg;
+			break;
+		case 'c':
+			crtc_id = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			if(encode_format_from_str(optarg, &fmt)) {
+				printf("Unknown format %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'l':
+			level = atoi(optarg);
+			break;
+		case 'j':
+			threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 1;
+		case ':':
+			printf("-%c requires an argument\n", optopt);
+			return 1;
+		case '?':
+			printf("Unknown argument used -%c\n", optopt);
+			return 1;
+		}
+	}
+
+	if(!out_path) {
+		snprintf(def_path, sizeof(def_path), "capture.%s", encode_format_ext(fmt));
+		out_path = def_path;
+	}
+
+	int fd = open_drm(dev_path, DRM_CAP_DUMB_BUFFER);
+	if(fd < 0) {
+		return 1;
+	}
+
+	pool_t *pool = pool_create(threads);
+	if(!pool) {
+		close(fd);
+		return 1;
+	}
+
+	uint32_t fb_id = find_fb(fd, crtc_id);
+	if(!fb_id) {
+		logger_fatal("No active framebuffer to capture");
+		goto out_pool;
+	}
+
+	capture_fb_t cap;
+	double t0 = now_ms();
+	if(capture_fb_open(fd, fb_id, &cap)) {
+		goto out_pool;
+	}
+
+	double t1 = now_ms();
+	size_t size = (size_t)cap.pitch * cap.height;
+	uint8_t *copy = aligned_alloc(64, (size + 63) & ~(size_t)63);
+	if(!copy) {
+		logger_fatal("Failed to allocate %zu byte copy %m", size);
+		capture_fb_close(fd, &cap);
+		goto out_pool;
+	}
+
+	capture_fb_copy(&cap, pool, copy);
+	double t2 = now_ms();
+
+	image_t img = {
+		.width = cap.width,
+		.height = cap.height,
+		.pitch = cap.pitch,
+		.format = cap.format,
+		.data = copy,
+	};
+
+	//The scanout buffer is released before any of the slow encoding starts
+	capture_fb_close(fd, &cap);
+
+	FILE *out = fopen(out_path, "wb");
+	if(!out) {
+		logger_fatal("Failed to open %s %m", out_path);
+		free(copy);
+		goto out_pool;
+	}
+
+	ret = encode_image(pool, &img, fmt, level, out) ? 1 : 0;
+	double t3 = now_ms();
+	fclose(out);
+	free(copy);
+
+	logger_info("FB %u %ux%u %.4s -> %s (%u threads)", fb_id, img.width, img.height, (char *)&img.format, out_path, pool_threads(pool));
+	logger_info("map %.2fms | copy %.2fms (%.0f MB/s) | encode %.2fms | total %.2fms",
+			t1 - t0, t2 - t1, size / ((t2 - t1) * 1e3), t3 - t2, t3 - t0);
+
+out_pool:
+	pool_destroy(pool);
+	close(fd);
+	return ret;
+}
@@ -55,7 +55,7 @@ bo_t *buffer_create_dumb(int fd, uint32_t bpp, uint32_t height, uint32_t width)
 	return bo;
 }
 
-int buffer_map(int fd, bo_t *bo) {
+int bo_map(int fd, bo_t *bo) {
 	struct drm_mode_map_dumb mreq;
 	//clear out mreq 
 	memset(&mreq, 0, sizeof(mreq));
@@ -0,0 +1,267 @@
+#include "./capture.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+#include <log.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/dma-buf.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CAPTURE_HAVE_SSE41 1
+#endif
+
+//Rows per copy job, big enough to amortise the job hand out
+#define CAPTURE_COPY_ROWS 64
+
+/* Scanout buffers are usually mapped write combined so plain loads
+ * are uncached and painfully slow. MOVNTDQA streaming loads pull a
+ * whole 64 byte line into a fill buffer at a time which is the fast
+ * way to read WC memory back
+ */
+#ifdef CAPTURE_HAVE_SSE41
+__attribute__((target("sse4.1")))
+static void capture_copy_sse41(void *dst, const void *src, size_t size) {
+	const uint8_t *s = src;
+	uint8_t *d = dst;
+
+	//movntdqa needs a 16 byte aligned source
+	size_t head = (16 - ((uintptr_t)s & 15)) & 15;
+	if(head > size) {
+		head = size;
+	}
+	memcpy(d, s, head);
+	s += head;
+	d += head;
+	size -= head;
+
+	_mm_mfence();
+	for(; size >= 64; size -= 64, s += 64, d += 64) {
+		__m128i a = _mm_stream_load_si128((__m128i *)(s + 0));
+		__m128i b = _mm_stream_load_si128((__m128i *)(s + 16));
+		__m128i c = _mm_stream_load_si128((__m128i *)(s + 32));
+		__m128i e = _mm_stream_load_si128((__m128i *)(s + 48));
+		_mm_storeu_si128((__m128i *)(d + 0), a);
+		_mm_storeu_si128((__m128i *)(d + 16), b);
+		_mm_storeu_si128((__m128i *)(d + 32), c);
+		_mm_storeu_si128((__m128i *)(d + 48), e);
+	}
+
+	memcpy(d, s, size);
+}
+#endif
+
+void capture_copy_stream(void *dst, const void *src, size_t size) {
+#ifdef CAPTURE_HAVE_SSE41
+	if(__builtin_cpu_supports("sse4.1")) {
+		capture_copy_sse41(dst, src, size);
+		return;
+	}
+#endif
+	memcpy(dst, src, size);
+}
+
+static uint32_t capture_format_bpp(uint32_t format) {
+	switch(format) {
+		case DRM_FORMAT_XRGB8888:
+		case DRM_FORMAT_ARGB8888:
+		case DRM_FORMAT_XBGR8888:
+		case DRM_FORMAT_ABGR8888:
+			return 32;
+		default:
+			return 0;
+	}
+}
+
+static int capture_map_prime(int fd, capture_fb_t *cap) {
+	uint64_t prime = 0;
+
+	if(drmGetCap(fd, DRM_CAP_PRIME, &prime) < 0 || !(prime & DRM_PRIME_CAP_EXPORT)) {
+		return -1;
+	}
+
+	if(drmPrimeHandleToFD(fd, cap->handle, DRM_CLOEXEC, &cap->prime_fd) < 0) {
+		logger_debug("PRIME export of FB %u failed %m", cap->fb_id);
+		cap->prime_fd = -1;
+		return -1;
+	}
+
+	cap->map = mmap(NULL, cap->map_size, PROT_READ, MAP_SHARED, cap->prime_fd, 0);
+	if(cap->map == MAP_FAILED) {
+		logger_debug("dma-buf mmap of FB %u failed %m", cap->fb_id);
+		cap->map = NULL;
+		close(cap->prime_fd);
+		cap->prime_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int capture_map_dumb(int fd, capture_fb_t *cap) {
+	struct drm_mode_map_dumb mreq;
+	memset(&mreq, 0, sizeof(mreq));
+
+	mreq.handle = cap->handle;
+	if(drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq)) {
+		return -1;
+	}
+
+	cap->map = mmap(NULL, cap->map_size, PROT_READ, MAP_SHARED, fd, mreq.offset);
+	if(cap->map == MAP_FAILED) {
+		cap->map = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Map the framebuffer fb_id for reading
+ *
+ * Needs DRM master (or CAP_SYS_ADMIN) otherwise the kernel hides the
+ * FB's handles. Only linear single plane 32bpp formats are supported
+ *
+ * Returns:
+ * 0 on success
+ * -1 if the FB couldn't be queried or has no handle
+ * -2 if the format/layout isn't supported
+ * -3 if the buffer couldn't be mapped
+ */
+int capture_fb_open(int fd, uint32_t fb_id, capture_fb_t *cap) {
+	memset(cap, 0, sizeof(*cap));
+	cap->prime_fd = -1;
+	cap->fb_id = fb_id;
+
+	drmModeFB2Ptr fb2 = drmModeGetFB2(fd, fb_id);
+	if(!fb2) {
+		logger_error("Failed to get FB %u %m", fb_id);
+		return -1;
+	}
+
+	if(!fb2->handles[0]) {
+		logger_error("FB %u has no handle, are we DRM master?", fb_id);
+		drmModeFreeFB2(fb2);
+		return -1;
+	}
+
+	cap->handle = fb2->handles[0];
+	cap->width = fb2->width;
+	cap->height = fb2->height;
+	cap->pitch = fb2->pitches[0];
+	cap->offset = fb2->offsets[0];
+	cap->format = fb2->pixel_format;
+
+	bool linear = !(fb2->flags & DRM_MODE_FB_MODIFIERS) || fb2->modifier == DRM_FORMAT_MOD_LINEAR;
+	drmModeFreeFB2(fb2);
+
+	if(!linear || !capture_format_bpp(cap->format)) {
+		logger_error("FB %u format %.4s is not a linear 32bpp format", fb_id, (char *)&cap->format);
+		capture_fb_close(fd, cap);
+		return -2;
+	}
+
+	cap->map_size = (size_t)cap->offset + (size_t)cap->pitch * cap->height;
+	if(capture_map_prime(fd, cap) && capture_map_dumb(fd, cap)) {
+		logger_error("Failed to map FB %u for reading", fb_id);
+		capture_fb_close(fd, cap);
+		return -3;
+	}
+
+	return 0;
+}
+
+typedef struct capture_copy_job {
+	const uint8_t *src;
+	uint8_t *dst;
+	size_t stride;
+	size_t dst_stride;
+	size_t row_bytes;
+	uint32_t height;
+} capture_copy_job_t;
+
+static void capture_copy_rows(void *arg, uint32_t index) {
+	capture_copy_job_t *job = arg;
+	uint32_t y = index * CAPTURE_COPY_ROWS;
+	uint32_t rows = job->height - y < CAPTURE_COPY_ROWS ? job->height - y : CAPTURE_COPY_ROWS;
+	size_t off = (size_t)y * job->stride;
+
+	//Same layout, the band is one contiguous copy
+	if(job->dst_stride == job->stride && job->row_bytes == job->stride) {
+		capture_copy_stream(job->dst + off, job->src + off, (size_t)rows * job->stride);
+		return;
+	}
+
+	for(uint32_t i = 0; i < rows; i++) {
+		capture_copy_stream(job->dst + (size_t)(y + i) * job->dst_stride,
+				job->src + off + (size_t)i * job->stride, job->row_bytes);
+	}
+}
+
+/* Copy the whole framebuffer into dst (pitch * height bytes) keeping
+ * the FB pitch. The copy is split across the pool so the scanout
+ * buffer is only touched for as short a time as possible
+ */
+int capture_fb_copy(capture_fb_t *cap, pool_t *pool, void *dst) {
+	return capture_fb_copy_to(cap, pool, dst, cap->pitch, cap->width, cap->height);
+}
+
+/* Copy the top left width x height pixels of the framebuffer (clipped
+ * to its size) into dst with dst_pitch between rows
+ */
+int capture_fb_copy_to(capture_fb_t *cap, pool_t *pool, void *dst, uint32_t dst_pitch,
+		uint32_t width, uint32_t height) {
+	struct dma_buf_sync sync = { .flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ };
+	uint32_t bpp = capture_format_bpp(cap->format);
+	capture_copy_job_t job = {
+		.src = (uint8_t *)cap->map + cap->offset,
+		.dst = dst,
+		.stride = cap->pitch,
+		.dst_stride = dst_pitch,
+		.row_bytes = (size_t)(width < cap->width ? width : cap->width) * bpp / 8,
+		.height = height < cap->height ? height : cap->height,
+	};
+
+	//A whole FB copy also takes the padding at the end of each row
+	if(dst_pitch == cap->pitch && width >= cap->width) {
+		job.row_bytes = cap->pitch;
+	}
+
+	if(cap->prime_fd >= 0 && ioctl(cap->prime_fd, DMA_BUF_IOCTL_SYNC, &sync)) {
+		logger_warn("dma-buf sync start failed %m");
+	}
+
+	pool_run(pool, (job.height + CAPTURE_COPY_ROWS - 1) / CAPTURE_COPY_ROWS, capture_copy_rows, &job);
+
+	sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+	if(cap->prime_fd >= 0 && ioctl(cap->prime_fd, DMA_BUF_IOCTL_SYNC, &sync)) {
+		logger_warn("dma-buf sync end failed %m");
+	}
+
+	return 0;
+}
+
+void capture_fb_close(int fd, capture_fb_t *cap) {
+	if(cap->map) {
+		munmap(cap->map, cap->map_size);
+		cap->map = NULL;
+	}
+
+	if(cap->prime_fd >= 0) {
+		close(cap->prime_fd);
+		cap->prime_fd = -1;
+	}
+
+	//GetFB2 hands us a fresh GEM handle that we own
+	if(cap->handle) {
+		drmCloseBufferHandle(fd, cap->handle);
+		cap->handle = 0;
+	}
+}
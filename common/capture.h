@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "./pool.h"
+
+/*
+ * Read back access to a framebuffer that is currently on screen.
+ * The FB's GEM handle is exported as a dma-buf and mapped read only,
+ * falling back to a dumb buffer map when the driver can't PRIME export.
+ */
+typedef struct capture_fb {
+	uint32_t fb_id;
+	uint32_t width;
+	uint32_t height;
+	uint32_t pitch;
+	uint32_t offset;
+	uint32_t format;
+
+	uint32_t handle;
+	int prime_fd;
+
+	void *map;
+	size_t map_size;
+} capture_fb_t;
+
+int capture_fb_open(int fd, uint32_t fb_id, capture_fb_t *cap);
+int capture_fb_copy(capture_fb_t *cap, pool_t *pool, void *dst);
+int capture_fb_copy_to(capture_fb_t *cap, pool_t *pool, void *dst, uint32_t dst_pitch,
+		uint32_t width, uint32_t height);
+void capture_fb_close(int fd, capture_fb_t *cap);
+
+void capture_copy_stream(void *dst, const void *src, size_t size);
@@ -0,0 +1,511 @@
+#include "./color.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <log.h>
+
+#include "./buffers.h"
+#include "./pool.h"
+#include "./props.h"
+
+//SSE2 is part of x86-64 so there is nothing to check at runtime
+#ifdef __SSE2__
+#include <emmintrin.h>
+#define COLOR_HAVE_SSE2 1
+#endif
+
+//Rows per job on the CPU path
+#define COLOR_ROWS 32
+
+/* Parse nine comma separated numbers, the rows of the matrix one after
+ * the other (e.g. "1,0,0,0,1,0,0,0,1" is the identity)
+ *
+ * Returns 0 on success, -1 for anything else
+ */
+int color_ctm_from_str(const char *str, double ctm[9]) {
+	char *end;
+
+	for(int i = 0; i < 9; i++) {
+		ctm[i] = strtod(str, &end);
+		if(end == str || (i < 8 && *end != ',') || (i == 8 && *end)) {
+			return -1;
+		}
+		str = end + 1;
+	}
+
+	return 0;
+}
+
+//Same curve out = in^exponent on every channel
+void color_lut_power(struct drm_color_lut *lut, uint32_t size, double exponent) {
+	for(uint32_t i = 0; i < size; i++) {
+		double x = size > 1 ? (double)i / (size - 1) : 1.0;
+		uint16_t v = lround(pow(x, exponent) * 0xffff);
+		lut[i] = (struct drm_color_lut){ .red = v, .green = v, .blue = v };
+	}
+}
+
+//FNV-1a, only used to spot unchanged LUTs
+static uint64_t color_hash(uint64_t hash, const void *data, size_t bytes) {
+	const uint8_t *p = data;
+
+	for(size_t i = 0; i < bytes; i++) {
+		hash = (hash ^ p[i]) * 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
+static uint64_t color_transform_hash(const color_transform_t *t) {
+	uint64_t hash = 0xcbf29ce484222325ull;
+	uint8_t present = (t->degamma != NULL) | (t->ctm != NULL) << 1 | (t->gamma != NULL) << 2;
+
+	hash = color_hash(hash, &present, sizeof(present));
+	if(t->degamma) {
+		hash = color_hash(hash, &t->degamma_size, sizeof(t->degamma_size));
+		hash = color_hash(hash, t->degamma, t->degamma_size * sizeof(*t->degamma));
+	}
+
+	if(t->ctm) {
+		hash = color_hash(hash, t->ctm, 9 * sizeof(*t->ctm));
+	}
+
+	if(t->gamma) {
+		hash = color_hash(hash, &t->gamma_size, sizeof(t->gamma_size));
+		hash = color_hash(hash, t->gamma, t->gamma_size * sizeof(*t->gamma));
+	}
+
+	return hash;
+}
+
+static uint16_t color_lut_channel(const struct drm_color_lut *entry, int channel) {
+	return channel == 0 ? entry->red : channel == 1 ? entry->green : entry->blue;
+}
+
+//One channel of the curve at x (0 - 1), linearly interpolated, identity for no LUT
+static double color_lut_eval(const struct drm_color_lut *lut, uint32_t size, int channel, double x) {
+	if(!lut || !size) {
+		return x;
+	}
+
+	if(size == 1) {
+		return color_lut_channel(&lut[0], channel) / 65535.0;
+	}
+
+	double pos = x * (size - 1);
+	uint32_t i = pos >= size - 1 ? size - 2 : (uint32_t)pos;
+	double frac = pos - i;
+
+	return (color_lut_channel(&lut[i], channel) * (1 - frac) +
+			color_lut_channel(&lut[i + 1], channel) * frac) / 65535.0;
+}
+
+//The curve at the number of entries the CRTC takes
+static struct drm_color_lut *color_lut_resample(const struct drm_color_lut *lut, uint32_t size, uint32_t entries) {
+	struct drm_color_lut *out = calloc(entries, sizeof(*out));
+	if(!out) {
+		logger_error("Failed to allocate LUT %m");
+		return NULL;
+	}
+
+	for(uint32_t i = 0; i < entries; i++) {
+		double x = entries > 1 ? (double)i / (entries - 1) : 1.0;
+		out[i].red = lround(color_lut_eval(lut, size, 0, x) * 0xffff);
+		out[i].green = lround(color_lut_eval(lut, size, 1, x) * 0xffff);
+		out[i].blue = lround(color_lut_eval(lut, size, 2, x) * 0xffff);
+	}
+
+	return out;
+}
+
+//CTM entries are S31.32 sign-magnitude, not two's complement
+static struct drm_color_ctm *color_ctm_pack(const double *ctm) {
+	struct drm_color_ctm *out = calloc(1, sizeof(*out));
+	if(!out) {
+		logger_error("Failed to allocate CTM %m");
+		return NULL;
+	}
+
+	for(int i = 0; i < 9; i++) {
+		out->matrix[i] = (uint64_t)llround(fabs(ctm[i]) * 4294967296.0) & ~(1ull << 63);
+		if(ctm[i] < 0) {
+			out->matrix[i] |= 1ull << 63;
+		}
+	}
+
+	return out;
+}
+
+/* Look up the colour properties of crtc_id, crtc_props is NULL for
+ * legacy clients which only get the gamma ramp
+ *
+ * Returns NULL on failure
+ */
+color_t *color_create(int fd, uint32_t crtc_id, const props_t *crtc_props) {
+	color_t *color = calloc(1, sizeof(*color));
+	if(!color) {
+		logger_error("Failed to allocate colour state %m");
+		return NULL;
+	}
+
+	color->fd = fd;
+	color->crtc_id = crtc_id;
+	color->crtc_props = crtc_props;
+	color->stages[COLOR_DEGAMMA].prop = "DEGAMMA_LUT";
+	color->stages[COLOR_CTM].prop = "CTM";
+	color->stages[COLOR_GAMMA].prop = "GAMMA_LUT";
+
+	if(crtc_props) {
+		uint64_t size = 0;
+
+		if(props_id(crtc_props, "DEGAMMA_LUT") && !props_value(crtc_props, "DEGAMMA_LUT_SIZE", &size)) {
+			color->stages[COLOR_DEGAMMA].size = size;
+		}
+
+		if(props_id(crtc_props, "CTM")) {
+			color->stages[COLOR_CTM].size = 1;
+		}
+
+		if(props_id(crtc_props, "GAMMA_LUT") && !props_value(crtc_props, "GAMMA_LUT_SIZE", &size)) {
+			color->stages[COLOR_GAMMA].size = size;
+		}
+	}
+
+	drmModeCrtcPtr crtc = drmModeGetCrtc(fd, crtc_id);
+	if(crtc) {
+		color->legacy_size = crtc->gamma_size;
+		drmModeFreeCrtc(crtc);
+	}
+	color->legacy_gamma = !color->stages[COLOR_GAMMA].size && color->legacy_size > 1;
+
+	logger_debug("CRTC %u: degamma %u, ctm %s, gamma %u%s", crtc_id, color->stages[COLOR_DEGAMMA].size,
+			color->stages[COLOR_CTM].size ? "yes" : "no",
+			color->legacy_gamma ? color->legacy_size : color->stages[COLOR_GAMMA].size,
+			color->legacy_gamma ? " (legacy)" : "");
+	return color;
+}
+
+/* The blobs are dropped but whatever the CRTC is showing keeps its own
+ * reference, the curves stay up until the next client replaces them
+ */
+void color_destroy(color_t *color) {
+	if(!color) {
+		return;
+	}
+
+	for(int i = 0; i < COLOR_STAGES; i++) {
+		if(color->stages[i].blob) {
+			drmModeDestroyPropertyBlob(color->fd, color->stages[i].blob);
+		}
+		free(color->stages[i].data);
+	}
+	free(color);
+}
+
+//Takes ownership of data, the stage only goes dirty if its contents changed
+static void color_stage_update(color_t *color, color_stage_t *stage, void *data, size_t bytes) {
+	uint64_t hash = data ? color_hash(0xcbf29ce484222325ull, data, bytes) : 0;
+
+	if(hash == stage->hash && !data == !stage->data) {
+		color->skipped += data != NULL;
+		free(data);
+		return;
+	}
+
+	free(stage->data);
+	stage->data = data;
+	stage->bytes = bytes;
+	stage->hash = hash;
+	stage->dirty = true;
+	stage->uploaded = false;
+}
+
+static uint8_t color_to_8bit(double v) {
+	return v <= 0 ? 0 : v >= 1 ? 255 : lround(v * 255);
+}
+
+/* Tables for the CPU path. Without a matrix the curves of each channel
+ * fold into one 8 bit -> 8 bit table, with one the degamma output stays
+ * at 12 bits through the matrix so dark gradients don't band
+ */
+static void color_build_cpu(color_t *color, const color_transform_t *t) {
+	color->cpu_ctm = t->ctm != NULL;
+
+	for(int c = 0; c < 3; c++) {
+		for(uint32_t v = 0; v < 256; v++) {
+			double linear = color_lut_eval(t->degamma, t->degamma_size, c, v / 255.0);
+			color->lut[c][v] = color_to_8bit(color_lut_eval(t->gamma, t->gamma_size, c, linear));
+			color->linear[c][v] = lround(linear * (COLOR_CPU_LEVELS - 1));
+		}
+
+		for(uint32_t i = 0; i < COLOR_CPU_LEVELS; i++) {
+			double x = (double)i / (COLOR_CPU_LEVELS - 1);
+			color->encode[c][i] = color_to_8bit(color_lut_eval(t->gamma, t->gamma_size, c, x));
+		}
+	}
+
+	for(int i = 0; i < 9; i++) {
+		color->matrix[i] = t->ctm ? t->ctm[i] : i % 4 == 0;
+	}
+}
+
+/* Switch to a new transform. The hardware gets all of it or none of it:
+ * a CRTC missing any stage the transform uses is left bypassed and the
+ * transform runs in color_apply. Setting the same transform again is
+ * free, and so is any stage whose contents didn't change
+ *
+ * Returns 0 on success, -1 on allocation failure
+ */
+int color_set(color_t *color, const color_transform_t *t) {
+	const color_stage_t *st = color->stages;
+	uint64_t hash = color_transform_hash(t);
+
+	if(color->valid && hash == color->hash) {
+		color->skipped++;
+		return 0;
+	}
+
+	//The legacy ramp is the last stage, it can only stand in for GAMMA_LUT on its own
+	bool gamma_hw = st[COLOR_GAMMA].size || (color->legacy_gamma && !t->degamma && !t->ctm);
+	bool hw = (!t->degamma || st[COLOR_DEGAMMA].size) &&
+		(!t->ctm || st[COLOR_CTM].size) && (!t->gamma || gamma_hw);
+	uint32_t gamma_size = st[COLOR_GAMMA].size ? st[COLOR_GAMMA].size : color->legacy_size;
+	void *data[COLOR_STAGES] = { NULL };
+	size_t bytes[COLOR_STAGES] = { 0 };
+
+	if(hw && t->degamma) {
+		data[COLOR_DEGAMMA] = color_lut_resample(t->degamma, t->degamma_size, st[COLOR_DEGAMMA].size);
+		bytes[COLOR_DEGAMMA] = st[COLOR_DEGAMMA].size * sizeof(struct drm_color_lut);
+	}
+
+	if(hw && t->ctm) {
+		data[COLOR_CTM] = color_ctm_pack(t->ctm);
+		bytes[COLOR_CTM] = sizeof(struct drm_color_ctm);
+	}
+
+	if(hw && t->gamma) {
+		data[COLOR_GAMMA] = color_lut_resample(t->gamma, t->gamma_size, gamma_size);
+		bytes[COLOR_GAMMA] = gamma_size * sizeof(struct drm_color_lut);
+	}
+
+	if((bytes[COLOR_DEGAMMA] && !data[COLOR_DEGAMMA]) || (bytes[COLOR_CTM] && !data[COLOR_CTM]) ||
+			(bytes[COLOR_GAMMA] && !data[COLOR_GAMMA])) {
+		for(int i = 0; i < COLOR_STAGES; i++) {
+			free(data[i]);
+		}
+		return -1;
+	}
+
+	for(int i = 0; i < COLOR_STAGES; i++) {
+		color_stage_update(color, &color->stages[i], data[i], bytes[i]);
+	}
+
+	if(!hw && !color->cpu) {
+		logger_info("CRTC %u: can't run the colour transform, falling back to the CPU", color->crtc_id);
+	}
+
+	color->cpu = !hw;
+	if(color->cpu) {
+		color_build_cpu(color, t);
+	}
+
+	color->hash = hash;
+	color->valid = true;
+	return 0;
+}
+
+/* Add the colour properties that changed (all of them with force, for
+ * a modeset that has to clear whatever the last client left) to req.
+ * They stay dirty until color_committed, so a failed commit sends them
+ * again with the next one
+ *
+ * Returns 0 on success, a negative errno if a blob couldn't be created
+ */
+int color_add(color_t *color, drmModeAtomicReqPtr req, bool force) {
+	for(int i = 0; i < COLOR_STAGES; i++) {
+		color_stage_t *stage = &color->stages[i];
+
+		if(!stage->size || (!stage->dirty && !force)) {
+			continue;
+		}
+
+		if(stage->dirty && !stage->uploaded) {
+			if(stage->blob) {
+				drmModeDestroyPropertyBlob(color->fd, stage->blob);
+				stage->blob = 0;
+			}
+
+			if(stage->data && drmModeCreatePropertyBlob(color->fd, stage->data, stage->bytes, &stage->blob)) {
+				int ret = -errno;
+				logger_error("CRTC %u: failed to create %s blob %m", color->crtc_id, stage->prop);
+				return ret;
+			}
+
+			color->uploads += stage->data != NULL;
+			stage->uploaded = true;
+		}
+
+		props_add(req, color->crtc_props, stage->prop, stage->blob);
+	}
+
+	return 0;
+}
+
+//The request from color_add went through, its blobs are on the CRTC now
+void color_committed(color_t *color) {
+	for(int i = 0; i < COLOR_STAGES; i++) {
+		color_stage_t *stage = &color->stages[i];
+
+		if(stage->size && stage->uploaded) {
+			stage->dirty = false;
+		}
+	}
+}
+
+/* Load the gamma ramp with drmModeCrtcSetGamma on CRTCs without
+ * GAMMA_LUT, a linear ramp when the stage is bypassed. Takes effect
+ * straight away rather than with the next flip
+ *
+ * Returns 0 on success or if there is nothing to do, a negative errno
+ * otherwise
+ */
+int color_apply_legacy(color_t *color, bool force) {
+	color_stage_t *stage = &color->stages[COLOR_GAMMA];
+	const struct drm_color_lut *lut = stage->data;
+	uint32_t size = color->legacy_size;
+
+	if(!color->legacy_gamma || (!stage->dirty && !force)) {
+		return 0;
+	}
+
+	uint16_t *ramp = malloc(3 * size * sizeof(*ramp));
+	if(!ramp) {
+		logger_error("Failed to allocate gamma ramp %m");
+		return -ENOMEM;
+	}
+
+	for(uint32_t i = 0; i < size; i++) {
+		uint16_t linear = (uint64_t)i * 0xffff / (size - 1);
+		ramp[i] = lut ? lut[i].red : linear;
+		ramp[size + i] = lut ? lut[i].green : linear;
+		ramp[2 * size + i] = lut ? lut[i].blue : linear;
+	}
+
+	int ret = drmModeCrtcSetGamma(color->fd, color->crtc_id, size, ramp, ramp + size, ramp + 2 * size) ? -errno : 0;
+	free(ramp);
+	if(ret) {
+		logger_error("CRTC %u: failed to set the gamma ramp: %s", color->crtc_id, strerror(-ret));
+		return ret;
+	}
+
+	color->uploads += lut != NULL;
+	stage->dirty = false;
+	return 0;
+}
+
+typedef struct color_job {
+	const color_t *color;
+	bo_t *bo;
+} color_job_t;
+
+static inline uint32_t color_ctm_pixel(const color_t *color, uint32_t px) {
+	const float *m = color->matrix;
+	float r = color->linear[0][(px >> 16) & 0xff];
+	float g = color->linear[1][(px >> 8) & 0xff];
+	float b = color->linear[2][px & 0xff];
+	uint32_t out = px & 0xff000000;
+
+	for(int c = 0; c < 3; c++) {
+		float v = m[c * 3] * r + m[c * 3 + 1] * g + m[c * 3 + 2] * b;
+		v = v < 0 ? 0 : v > COLOR_CPU_LEVELS - 1 ? COLOR_CPU_LEVELS - 1 : v;
+		out |= (uint32_t)color->encode[c][lrintf(v)] << (16 - 8 * c);
+	}
+
+	return out;
+}
+
+/* Matrix path, 4 pixels at a time. SSE2 has no gather so the table
+ * lookups on either side of the matrix are still one lane at a time
+ */
+static void color_ctm_row(const color_t *color, uint32_t *row, uint32_t width) {
+	uint32_t x = 0;
+
+#ifdef COLOR_HAVE_SSE2
+	const uint16_t (*lin)[256] = color->linear;
+	const __m128 lo = _mm_setzero_ps();
+	const __m128 hi = _mm_set1_ps(COLOR_CPU_LEVELS - 1);
+	__m128 m[9];
+
+	for(int i = 0; i < 9; i++) {
+		m[i] = _mm_set1_ps(color->matrix[i]);
+	}
+
+	for(; x + 4 <= width; x += 4) {
+		const uint32_t *px = row + x;
+		__m128 r = _mm_cvtepi32_ps(_mm_setr_epi32(lin[0][(px[0] >> 16) & 0xff], lin[0][(px[1] >> 16) & 0xff],
+					lin[0][(px[2] >> 16) & 0xff], lin[0][(px[3] >> 16) & 0xff]));
+		__m128 g = _mm_cvtepi32_ps(_mm_setr_epi32(lin[1][(px[0] >> 8) & 0xff], lin[1][(px[1] >> 8) & 0xff],
+					lin[1][(px[2] >> 8) & 0xff], lin[1][(px[3] >> 8) & 0xff]));
+		__m128 b = _mm_cvtepi32_ps(_mm_setr_epi32(lin[2][px[0] & 0xff], lin[2][px[1] & 0xff],
+					lin[2][px[2] & 0xff], lin[2][px[3] & 0xff]));
+		uint32_t out[4] = { px[0] & 0xff000000, px[1] & 0xff000000, px[2] & 0xff000000, px[3] & 0xff000000 };
+
+		for(int c = 0; c < 3; c++) {
+			__m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[c * 3], r), _mm_mul_ps(m[c * 3 + 1], g)),
+					_mm_mul_ps(m[c * 3 + 2], b));
+			int32_t idx[4];
+
+			v = _mm_min_ps(_mm_max_ps(v, lo), hi);
+			_mm_storeu_si128((__m128i *)idx, _mm_cvtps_epi32(v));
+			for(int i = 0; i < 4; i++) {
+				out[i] |= (uint32_t)color->encode[c][idx[i]] << (16 - 8 * c);
+			}
+		}
+
+		_mm_storeu_si128((__m128i *)(row + x), _mm_loadu_si128((const __m128i *)out));
+	}
+#endif
+	for(; x < width; x++) {
+		row[x] = color_ctm_pixel(color, row[x]);
+	}
+}
+
+static void color_rows(void *arg, uint32_t index) {
+	color_job_t *job = arg;
+	const color_t *color = job->color;
+	bo_t *bo = job->bo;
+	uint32_t y1 = (index + 1) * COLOR_ROWS < bo->height ? (index + 1) * COLOR_ROWS : bo->height;
+
+	for(uint32_t y = index * COLOR_ROWS; y < y1; y++) {
+		uint32_t *row = (uint32_t *)((uint8_t *)bo->buffer + (size_t)y * bo->pitch);
+
+		if(color->cpu_ctm) {
+			color_ctm_row(color, row, bo->width);
+			continue;
+		}
+
+		for(uint32_t x = 0; x < bo->width; x++) {
+			uint32_t px = row[x];
+			row[x] = (px & 0xff000000) | (uint32_t)color->lut[0][(px >> 16) & 0xff] << 16 |
+				(uint32_t)color->lut[1][(px >> 8) & 0xff] << 8 | color->lut[2][px & 0xff];
+		}
+	}
+}
+
+//Run the transform over a 32 bpp XRGB/ARGB surface in place, rows spread over the pool
+void color_apply(color_t *color, pool_t *pool, bo_t *bo) {
+	color_job_t job = { .color = color, .bo = bo };
+
+	if(bo->bpp != 32) {
+		logger_error("Can't colour correct a %u bpp surface", bo->bpp);
+		return;
+	}
+
+	pool_run(pool, (bo->height + COLOR_ROWS - 1) / COLOR_ROWS, color_rows, &job);
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xf86drmMode.h>
+
+#include "./buffers.h"
+#include "./pool.h"
+#include "./props.h"
+
+//Levels of the linear intermediate on the CPU path (12 bit)
+#define COLOR_CPU_LEVELS 4096
+
+/*
+ * Colour pipeline in the order the display engine runs it: per channel
+ * degamma curve, 3x3 matrix (row major, out = m * in) on the linearised
+ * values, per channel gamma curve. Any stage left NULL is bypassed. The
+ * LUTs can be any size, they are resampled to whatever the CRTC takes
+ */
+typedef struct color_transform {
+	const struct drm_color_lut *degamma;
+	uint32_t degamma_size;
+	const double *ctm;
+	const struct drm_color_lut *gamma;
+	uint32_t gamma_size;
+} color_transform_t;
+
+typedef enum color_stage_id {
+	COLOR_DEGAMMA,
+	COLOR_CTM,
+	COLOR_GAMMA,
+	COLOR_STAGES,
+} color_stage_id_t;
+
+/*
+ * What one CRTC property holds. size is the LUT size the CRTC takes (1
+ * for the CTM), 0 if the CRTC doesn't have the property. data is the
+ * blob payload, NULL to bypass the stage. dirty stays set until a
+ * commit carrying the stage went through, uploaded once blob holds data
+ */
+typedef struct color_stage {
+	const char *prop;
+	uint32_t size;
+	void *data;
+	size_t bytes;
+	uint64_t hash;
+	uint32_t blob;
+	bool dirty;
+	bool uploaded;
+} color_stage_t;
+
+/*
+ * Colour management for one CRTC. The transform goes to the GAMMA_LUT,
+ * DEGAMMA_LUT and CTM blobs with the next atomic commit, or through
+ * drmModeCrtcSetGamma when the CRTC only has a legacy gamma ramp. When
+ * the hardware can't run the whole transform it is bypassed and
+ * color_apply runs it on the CPU instead. Blobs are only recreated
+ * when their contents change
+ */
+typedef struct color {
+	int fd;
+	uint32_t crtc_id;
+	const props_t *crtc_props;
+	//Size of the legacy gamma ramp, used when there is no GAMMA_LUT
+	uint32_t legacy_size;
+	bool legacy_gamma;
+
+	color_stage_t stages[COLOR_STAGES];
+	uint64_t hash;
+	bool valid;
+	bool cpu;
+
+	//CPU path, with no matrix both curves fold into lut
+	bool cpu_ctm;
+	uint8_t lut[3][256];
+	uint16_t linear[3][256];
+	float matrix[9];
+	uint8_t encode[3][COLOR_CPU_LEVELS];
+
+	uint64_t uploads;
+	uint64_t skipped;
+} color_t;
+
+int color_ctm_from_str(const char *str, double ctm[9]);
+void color_lut_power(struct drm_color_lut *lut, uint32_t size, double exponent);
+
+color_t *color_create(int fd, uint32_t crtc_id, const props_t *crtc_props);
+void color_destroy(color_t *color);
+int color_set(color_t *color, const color_transform_t *transform);
+int color_add(color_t *color, drmModeAtomicReqPtr req, bool force);
+void color_committed(color_t *color);
+int color_apply_legacy(color_t *color, bool force);
+void color_apply(color_t *color, pool_t *pool, bo_t *bo);
@@ -0,0 +1,374 @@
+#include "./cursor.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+#include <log.h>
+
+#include "./buffers.h"
+#include "./props.h"
+
+//Size every driver takes when it doesn't report DRM_CAP_CURSOR_WIDTH/HEIGHT
+#define CURSOR_DEFAULT_SIZE 64
+
+//Cursor plane that can be put on the CRTC, 0 if there is none
+static uint32_t cursor_pick_plane(int fd, uint32_t crtc_index) {
+	drmModePlaneResPtr pres = drmModeGetPlaneResources(fd);
+	uint32_t id = 0;
+
+	if(!pres) {
+		return 0;
+	}
+
+	for(uint32_t i = 0; i < pres->count_planes && !id; i++) {
+		drmModePlanePtr plane = drmModeGetPlane(fd, pres->planes[i]);
+		if(!plane) {
+			continue;
+		}
+
+		props_t *props = props_get(fd, plane->plane_id, DRM_MODE_OBJECT_PLANE);
+		uint64_t type = DRM_PLANE_TYPE_OVERLAY;
+		if(props) {
+			props_value(props, "type", &type);
+			props_free(props);
+		}
+
+		if(type == DRM_PLANE_TYPE_CURSOR && (plane->possible_crtcs & (1 << crtc_index))) {
+			id = plane->plane_id;
+		}
+		drmModeFreePlane(plane);
+	}
+
+	drmModeFreePlaneResources(pres);
+	return id;
+}
+
+/* Set up a hardware cursor on a CRTC
+ *
+ * PARAMS:
+ * crtc_id - CRTC the cursor is shown on
+ * crtc_index - its index in drmModeRes, to match plane possible_crtcs
+ * caps - cursor size limits, NULL for the 64x64 default
+ *
+ * Returns NULL on failure
+ */
+cursor_t *cursor_create(int fd, uint32_t crtc_id, uint32_t crtc_index, const drm_caps_t *caps) {
+	cursor_t *cursor = calloc(1, sizeof(*cursor));
+	if(!cursor) {
+		logger_error("Failed to allocate cursor %m");
+		return NULL;
+	}
+
+	cursor->fd = fd;
+	cursor->crtc_id = crtc_id;
+	cursor->current = -1;
+	cursor->width = caps && caps->cursor_width ? caps->cursor_width : CURSOR_DEFAULT_SIZE;
+	cursor->height = caps && caps->cursor_height ? caps->cursor_height : CURSOR_DEFAULT_SIZE;
+
+	drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+	cursor->atomic = drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0;
+
+	if(cursor->atomic) {
+		cursor->plane_id = cursor_pick_plane(fd, crtc_index);
+		if(cursor->plane_id) {
+			cursor->plane_props = props_get(fd, cursor->plane_id, DRM_MODE_OBJECT_PLANE);
+		}
+
+		//Legacy cursor ioctls still work for atomic clients, the kernel
+		//routes them to whatever plane backs the cursor
+		if(!cursor->plane_props) {
+			logger_warn("CRTC %u: no cursor plane, using legacy cursor ioctls", crtc_id);
+			cursor->atomic = false;
+		}
+	}
+
+	return cursor;
+}
+
+void cursor_destroy(cursor_t *cursor) {
+	if(cursor->visible) {
+		cursor_hide(cursor);
+	}
+
+	for(int i = 0; i < CURSOR_MAX_SPRITES; i++) {
+		cursor_sprite_t *sprite = &cursor->sprites[i];
+		if(sprite->fb_id) {
+			drmModeRmFB(cursor->fd, sprite->fb_id);
+		}
+
+		if(sprite->bo) {
+			buffer_unmap(sprite->bo);
+			buffer_destroy_dumb(cursor->fd, sprite->bo);
+			free(sprite->bo);
+		}
+	}
+
+	props_free(cursor->plane_props);
+	free(cursor);
+}
+
+//FNV-1a over the image and its hotspot
+static uint64_t cursor_hash(const uint32_t *argb, uint32_t width, uint32_t height,
+		uint32_t hot_x, uint32_t hot_y) {
+	uint64_t hash = 0xcbf29ce484222325ull;
+	uint32_t head[4] = { width, height, hot_x, hot_y };
+	const uint8_t *bytes = (const uint8_t *)head;
+
+	for(size_t i = 0; i < sizeof(head); i++) {
+		hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+	}
+
+	bytes = (const uint8_t *)argb;
+	for(size_t i = 0; i < (size_t)width * height * 4; i++) {
+		hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
+//Empty slot if there is one, else the least recently used sprite not on screen
+static int cursor_pick_slot(cursor_t *cursor) {
+	int best = -1;
+
+	for(int i = 0; i < CURSOR_MAX_SPRITES; i++) {
+		if(!cursor->sprites[i].bo) {
+			return i;
+		}
+
+		if(i != cursor->current && (best < 0 || cursor->sprites[i].used < cursor->sprites[best].used)) {
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static int cursor_alloc_sprite(cursor_t *cursor, cursor_sprite_t *sprite) {
+	uint32_t handles[4] = { 0 };
+	uint32_t pitches[4] = { 0 };
+	uint32_t offsets[4] = { 0 };
+
+	sprite->bo = buffer_create_dumb(cursor->fd, 32, cursor->height, cursor->width);
+	if(!sprite->bo) {
+		return -1;
+	}
+
+	if(bo_map(cursor->fd, sprite->bo)) {
+		buffer_destroy_dumb(cursor->fd, sprite->bo);
+		free(sprite->bo);
+		sprite->bo = NULL;
+		return -1;
+	}
+
+	//Legacy cursors are set by GEM handle, only the plane needs an FB
+	if(cursor->atomic) {
+		handles[0] = sprite->bo->handle;
+		pitches[0] = sprite->bo->pitch;
+		if(drmModeAddFB2(cursor->fd, cursor->width, cursor->height, DRM_FORMAT_ARGB8888,
+					handles, pitches, offsets, &sprite->fb_id, 0)) {
+			logger_error("Failed to add cursor FB %m");
+			buffer_unmap(sprite->bo);
+			buffer_destroy_dumb(cursor->fd, sprite->bo);
+			free(sprite->bo);
+			sprite->bo = NULL;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Upload a premultiplied ARGB8888 image (tightly packed, width * 4 pitch)
+ * as a cursor sprite. Images already uploaded are found by hash and not
+ * copied again, so callers can upload every time they switch sprites
+ *
+ * Returns the sprite index or a negative errno
+ */
+int cursor_upload(cursor_t *cursor, const uint32_t *argb, uint32_t width, uint32_t height,
+		uint32_t hot_x, uint32_t hot_y) {
+	if(width > cursor->width || height > cursor->height || hot_x >= width || hot_y >= height) {
+		logger_error("Cursor sprite %ux%u doesn't fit %ux%u", width, height, cursor->width, cursor->height);
+		return -EINVAL;
+	}
+
+	uint64_t key = cursor_hash(argb, width, height, hot_x, hot_y);
+	for(int i = 0; i < CURSOR_MAX_SPRITES; i++) {
+		if(cursor->sprites[i].bo && cursor->sprites[i].key == key) {
+			cursor->sprites[i].used = ++cursor->uses;
+			return i;
+		}
+	}
+
+	int slot = cursor_pick_slot(cursor);
+	if(slot < 0) {
+		return -ENOSPC;
+	}
+
+	cursor_sprite_t *sprite = &cursor->sprites[slot];
+	if(!sprite->bo && cursor_alloc_sprite(cursor, sprite)) {
+		return -ENOMEM;
+	}
+
+	//The buffer is bigger than most sprites, clear what the image doesn't cover
+	uint8_t *dst = sprite->bo->buffer;
+	for(uint32_t y = 0; y < cursor->height; y++) {
+		uint32_t *row = (uint32_t *)(dst + (size_t)y * sprite->bo->pitch);
+		uint32_t copy = y < height ? width : 0;
+
+		memcpy(row, argb + (size_t)y * width, copy * 4);
+		memset(row + copy, 0, (cursor->width - copy) * 4);
+	}
+
+	sprite->key = key;
+	sprite->hot_x = hot_x;
+	sprite->hot_y = hot_y;
+	sprite->used = ++cursor->uses;
+	return slot;
+}
+
+/* Add the cursor state that hasn't reached KMS yet to an atomic request,
+ * so it can ride along with a primary plane flip. Call cursor_committed
+ * once the request went through
+ *
+ * Returns the number of properties added, -1 on legacy drivers
+ */
+int cursor_add(cursor_t *cursor, drmModeAtomicReqPtr req) {
+	cursor_sprite_t *sprite = cursor->current >= 0 ? &cursor->sprites[cursor->current] : NULL;
+	props_t *props = cursor->plane_props;
+	int count = 0;
+
+	if(!cursor->atomic) {
+		return -1;
+	}
+
+	if(cursor->dirty_fb) {
+		bool on = cursor->visible && sprite;
+		props_add(req, props, "CRTC_ID", on ? cursor->crtc_id : 0);
+		props_add(req, props, "FB_ID", on ? sprite->fb_id : 0);
+		count += 2;
+
+		if(on) {
+			props_add(req, props, "SRC_X", 0);
+			props_add(req, props, "SRC_Y", 0);
+			props_add(req, props, "SRC_W", (uint64_t)cursor->width << 16);
+			props_add(req, props, "SRC_H", (uint64_t)cursor->height << 16);
+			props_add(req, props, "CRTC_W", cursor->width);
+			props_add(req, props, "CRTC_H", cursor->height);
+			count += 6;
+		}
+	}
+
+	//CRTC_X/Y are signed, a cursor can hang off the top left edge
+	if(cursor->dirty && cursor->visible && sprite) {
+		props_add(req, props, "CRTC_X", (uint64_t)(int64_t)(cursor->x - (int32_t)sprite->hot_x));
+		props_add(req, props, "CRTC_Y", (uint64_t)(int64_t)(cursor->y - (int32_t)sprite->hot_y));
+		count += 2;
+	}
+
+	return count;
+}
+
+void cursor_committed(cursor_t *cursor) {
+	cursor->dirty = false;
+	cursor->dirty_fb = false;
+}
+
+static int cursor_flush_legacy(cursor_t *cursor) {
+	cursor_sprite_t *sprite = cursor->current >= 0 ? &cursor->sprites[cursor->current] : NULL;
+	bool on = cursor->visible && sprite;
+
+	if(cursor->dirty_fb) {
+		uint32_t handle = on ? sprite->bo->handle : 0;
+		int ret = drmModeSetCursor2(cursor->fd, cursor->crtc_id, handle, cursor->width, cursor->height,
+				on ? sprite->hot_x : 0, on ? sprite->hot_y : 0);
+
+		//Kernels before SetCursor2 only know the hotspot-less ioctl
+		if(ret && errno == EINVAL) {
+			ret = drmModeSetCursor(cursor->fd, cursor->crtc_id, handle, cursor->width, cursor->height);
+		}
+
+		if(ret) {
+			return -errno;
+		}
+	}
+
+	if(on && drmModeMoveCursor(cursor->fd, cursor->crtc_id,
+				cursor->x - (int32_t)sprite->hot_x, cursor->y - (int32_t)sprite->hot_y)) {
+		return -errno;
+	}
+
+	cursor_committed(cursor);
+	return 0;
+}
+
+/* Push pending cursor state to KMS in a commit of its own. The commit
+ * is nonblocking, if the CRTC still has a commit in flight this returns
+ * -EBUSY and the state stays pending for the next commit or flush
+ */
+static int cursor_flush(cursor_t *cursor, uint32_t flags) {
+	if(!cursor->dirty && !cursor->dirty_fb) {
+		return 0;
+	}
+
+	if(!cursor->atomic) {
+		return cursor_flush_legacy(cursor);
+	}
+
+	drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+	if(!req) {
+		return -ENOMEM;
+	}
+
+	int ret = 0;
+	if(cursor_add(cursor, req) > 0 && drmModeAtomicCommit(cursor->fd, req, flags, NULL)) {
+		ret = -errno;
+	}
+	drmModeAtomicFree(req);
+
+	if(!ret) {
+		cursor_committed(cursor);
+	}
+	return ret;
+}
+
+int cursor_show(cursor_t *cursor, int sprite) {
+	if(sprite < 0 || sprite >= CURSOR_MAX_SPRITES || !cursor->sprites[sprite].bo) {
+		return -EINVAL;
+	}
+
+	//A hotspot change moves the image even when x/y stay put
+	cursor->dirty_fb = cursor->dirty_fb || !cursor->visible || sprite != cursor->current;
+	cursor->dirty = true;
+	cursor->current = sprite;
+	cursor->visible = true;
+	return cursor_flush(cursor, DRM_MODE_ATOMIC_NONBLOCK);
+}
+
+int cursor_hide(cursor_t *cursor) {
+	cursor->visible = false;
+	cursor->dirty_fb = true;
+
+	//Blocking, the sprite FBs may be removed straight after
+	return cursor_flush(cursor, 0);
+}
+
+//Move the hotspot to x, y in CRTC coordinates
+int cursor_move(cursor_t *cursor, int32_t x, int32_t y) {
+	if(cursor->x == x && cursor->y == y && !cursor->dirty) {
+		return 0;
+	}
+
+	cursor->x = x;
+	cursor->y = y;
+	cursor->dirty = true;
+	if(!cursor->visible) {
+		return 0;
+	}
+
+	return cursor_flush(cursor, DRM_MODE_ATOMIC_NONBLOCK);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xf86drmMode.h>
+
+#include "./buffers.h"
+#include "./drm_common.h"
+#include "./props.h"
+
+#define CURSOR_MAX_SPRITES 4
+
+/*
+ * Sprite uploaded into a cursor sized ARGB8888 buffer. key is a hash of
+ * the pixels so uploading the same image again reuses the buffer
+ */
+typedef struct cursor_sprite {
+	bo_t *bo;
+	uint32_t fb_id;
+	uint64_t key;
+	uint64_t used;
+	uint32_t hot_x;
+	uint32_t hot_y;
+} cursor_sprite_t;
+
+/*
+ * Hardware cursor on one CRTC. Atomic drivers get the CRTC's cursor
+ * plane and a move only changes CRTC_X/CRTC_Y, legacy drivers use
+ * drmModeSetCursor2/drmModeMoveCursor. Neither touches the primary plane
+ */
+typedef struct cursor {
+	int fd;
+	bool atomic;
+	uint32_t crtc_id;
+	uint32_t plane_id;
+	props_t *plane_props;
+
+	uint32_t width;
+	uint32_t height;
+
+	cursor_sprite_t sprites[CURSOR_MAX_SPRITES];
+	uint64_t uses;
+	int current;
+
+	int32_t x;
+	int32_t y;
+	bool visible;
+
+	//Plane state that still has to reach KMS, a move that hit a busy
+	//CRTC goes out with the next commit
+	bool dirty;
+	bool dirty_fb;
+} cursor_t;
+
+cursor_t *cursor_create(int fd, uint32_t crtc_id, uint32_t crtc_index, const drm_caps_t *caps);
+void cursor_destroy(cursor_t *cursor);
+
+int cursor_upload(cursor_t *cursor, const uint32_t *argb, uint32_t width, uint32_t height,
+		uint32_t hot_x, uint32_t hot_y);
+int cursor_show(cursor_t *cursor, int sprite);
+int cursor_hide(cursor_t *cursor);
+int cursor_move(cursor_t *cursor, int32_t x, int32_t y);
+int cursor_add(cursor_t *cursor, drmModeAtomicReqPtr req);
+void cursor_committed(cursor_t *cursor);
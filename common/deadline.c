@@ -0,0 +1,128 @@
+#include "./deadline.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <xf86drm.h>
+#include <log.h>
+
+#include "./timing.h"
+
+//Time between the commit ioctl and the vblank the driver needs to latch it
+#define DEADLINE_MIN_MARGIN_NS 1000000ull
+
+void deadline_init(deadline_t *dl, uint64_t period_ns) {
+	memset(dl, 0, sizeof(*dl));
+	dl->period_ns = period_ns ? period_ns : 16666667ull;
+	dl->min_margin_ns = DEADLINE_MIN_MARGIN_NS;
+	dl->margin_ns = DEADLINE_MIN_MARGIN_NS;
+	//Start pessimistic, half a frame, the estimate comes down quickly
+	dl->render_ns = dl->period_ns / 2;
+}
+
+//Re-anchor the vblank prediction on the CRTC's current vblank
+int deadline_sync(deadline_t *dl, int fd, uint32_t crtc_id) {
+	uint64_t seq, ns;
+
+	if(drmCrtcGetSequence(fd, crtc_id, &seq, &ns)) {
+		return -errno;
+	}
+
+	dl->vblank_seq = seq;
+	dl->vblank_ns = ns;
+	return 0;
+}
+
+static void deadline_sleep_until(uint64_t ns) {
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000ull,
+		.tv_nsec = ns % 1000000000ull,
+	};
+
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+/* Sleep until the latest moment a frame can be started and still make
+ * a vblank, returns the sequence number of the vblank being aimed for
+ */
+uint64_t deadline_wait(deadline_t *dl) {
+	uint64_t lead = dl->render_ns + 2 * dl->render_dev_ns + dl->margin_ns;
+	uint64_t now = timing_now_ns();
+	uint64_t ahead = 1;
+
+	if(now + lead > dl->vblank_ns) {
+		ahead = (now + lead - dl->vblank_ns) / dl->period_ns + 1;
+	}
+
+	uint64_t target_ns = dl->vblank_ns + ahead * dl->period_ns;
+	dl->target_seq = dl->vblank_seq + ahead;
+
+	if(target_ns - lead > now) {
+		deadline_sleep_until(target_ns - lead);
+	}
+
+	dl->start_ns = timing_now_ns();
+	return dl->target_seq;
+}
+
+//Baseline for comparison, start right away and aim for the next vblank
+void deadline_begin_now(deadline_t *dl) {
+	dl->start_ns = timing_now_ns();
+	dl->target_seq = dl->vblank_seq + 1;
+}
+
+//Call once the frame has been rendered and committed
+void deadline_rendered(deadline_t *dl) {
+	uint64_t took = timing_now_ns() - dl->start_ns;
+	uint64_t dev = took > dl->render_ns ? took - dl->render_ns : dl->render_ns - took;
+
+	//EWMA with alpha 1/8 for the mean and 1/4 for the deviation
+	dl->render_ns = (dl->render_ns * 7 + took) / 8;
+	dl->render_dev_ns = (dl->render_dev_ns * 3 + dev) / 4;
+}
+
+/* Feed back the vblank the frame actually landed on (from the page
+ * flip event). Landing late counts as a miss and widens the margin,
+ * a run of hits slowly gives the time back
+ */
+void deadline_presented(deadline_t *dl, uint64_t sequence, uint64_t ns) {
+	//Refine the period from the kernel timestamps
+	if(dl->vblank_ns && sequence > dl->vblank_seq && ns > dl->vblank_ns) {
+		uint64_t period = (ns - dl->vblank_ns) / (sequence - dl->vblank_seq);
+		dl->period_ns = (dl->period_ns * 15 + period) / 16;
+	}
+
+	dl->frames++;
+	if(dl->start_ns && ns > dl->start_ns) {
+		hist_record(&dl->latency, ns - dl->start_ns);
+	}
+
+	if(sequence > dl->target_seq) {
+		dl->misses++;
+		dl->hits = 0;
+		dl->margin_ns += dl->period_ns / 8;
+		if(dl->margin_ns > dl->period_ns) {
+			dl->margin_ns = dl->period_ns;
+		}
+	} else if(++dl->hits >= 60) {
+		dl->hits = 0;
+		dl->margin_ns = dl->margin_ns * 7 / 8;
+		if(dl->margin_ns < dl->min_margin_ns) {
+			dl->margin_ns = dl->min_margin_ns;
+		}
+	}
+
+	dl->vblank_seq = sequence;
+	dl->vblank_ns = ns;
+}
+
+void deadline_summary(const deadline_t *dl, const char *name) {
+	logger_info("%s: %lu frames | missed %lu (%.2f%%) | start->flip p50 %.2fms p99 %.2fms",
+			name, dl->frames, dl->misses,
+			dl->frames ? dl->misses * 100.0 / dl->frames : 0.0,
+			hist_percentile(&dl->latency, 50) / 1e6, hist_percentile(&dl->latency, 99) / 1e6);
+	logger_info("%s: render est %.2fms +- %.2fms | margin %.2fms | period %.3fms",
+			name, dl->render_ns / 1e6, dl->render_dev_ns / 1e6,
+			dl->margin_ns / 1e6, dl->period_ns / 1e6);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "./timing.h"
+
+/*
+ * Just in time frame scheduler. Predicts upcoming vblanks from the last
+ * known one plus a measured refresh period and starts rendering as late
+ * as it can while still making the next vblank, so a frame is shown at
+ * most one render time after it was started instead of up to a refresh
+ * period later
+ */
+typedef struct deadline {
+	uint64_t period_ns;
+	uint64_t vblank_ns;
+	uint64_t vblank_seq;
+
+	//Moving estimate of render+commit time and its mean deviation
+	uint64_t render_ns;
+	uint64_t render_dev_ns;
+	//Extra slack, grows on a miss and decays on hits
+	uint64_t margin_ns;
+	uint64_t min_margin_ns;
+
+	uint64_t start_ns;
+	uint64_t target_seq;
+	uint32_t hits;
+
+	uint64_t frames;
+	uint64_t misses;
+	hist_t latency;
+} deadline_t;
+
+void deadline_init(deadline_t *dl, uint64_t period_ns);
+int deadline_sync(deadline_t *dl, int fd, uint32_t crtc_id);
+uint64_t deadline_wait(deadline_t *dl);
+void deadline_begin_now(deadline_t *dl);
+void deadline_rendered(deadline_t *dl);
+void deadline_presented(deadline_t *dl, uint64_t sequence, uint64_t ns);
+void deadline_summary(const deadline_t *dl, const char *name);
@@ -2,12 +2,41 @@
 
 #include <log.h>
 #include <stdint.h>
+#include <string.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 #include <fcntl.h>
 #include <unistd.h>
 
+#ifndef DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP
+#define DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP 0x15
+#endif
+
+static void drm_probe_caps(int fd, drm_caps_t *caps) {
+	memset(caps, 0, sizeof(*caps));
+
+	//A cap the kernel doesn't know about just stays 0
+	drmGetCap(fd, DRM_CAP_PRIME, &caps->prime);
+	drmGetCap(fd, DRM_CAP_TIMESTAMP_MONOTONIC, &caps->timestamp_monotonic);
+	drmGetCap(fd, DRM_CAP_ASYNC_PAGE_FLIP, &caps->async_page_flip);
+	drmGetCap(fd, DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP, &caps->atomic_async_page_flip);
+	drmGetCap(fd, DRM_CAP_CURSOR_WIDTH, &caps->cursor_width);
+	drmGetCap(fd, DRM_CAP_CURSOR_HEIGHT, &caps->cursor_height);
+}
+
 int open_drm(const char *path, uint64_t cap) {
+	return open_drm_caps(path, cap, NULL);
+}
+
+/* Open a drm device and check it supports cap, if caps isn't NULL
+ * it's filled in with the device's optional capabilities
+ *
+ * Returns:
+ * fd on success >= 0
+ * -1 if device failed to open
+ * -2 if cap wasn't supported
+ */
+int open_drm_caps(const char *path, uint64_t cap, drm_caps_t *caps) {
 	uint64_t hasCap = 0;
 	int ret;
 	int fd = open(path, O_CLOEXEC | O_RDWR);
@@ -24,7 +53,9 @@ int open_drm(const char *path, uint64_t cap) {
 		return -2;
 	}
 
+	if(caps) {
+		drm_probe_caps(fd, caps);
+	}
+
 	return fd;
 }
-
-
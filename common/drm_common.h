@@ -2,4 +2,18 @@
 
 #include <stdint.h>
 
+/*
+ * Optional capabilities read once when the device is opened so the
+ * presentation code can pick its paths without more drmGetCap calls
+ */
+typedef struct drm_caps {
+	uint64_t prime;
+	uint64_t timestamp_monotonic;
+	uint64_t async_page_flip;
+	uint64_t atomic_async_page_flip;
+	uint64_t cursor_width;
+	uint64_t cursor_height;
+} drm_caps_t;
+
 int open_drm(const char *path, uint64_t cap);
+int open_drm_caps(const char *path, uint64_t cap, drm_caps_t *caps);
@@ -0,0 +1,409 @@
+#include "./encode.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <drm_fourcc.h>
+#include <log.h>
+#include <zlib.h>
+
+/*
+ * Both PNG and QOI are encoded as independent horizontal stripes on the
+ * worker pool and then stitched back together in order:
+ *
+ * PNG - each stripe is its own raw deflate stream ended with a sync flush
+ * so the streams can simply be concatenated, the zlib adler32 and the IDAT
+ * crc32 are joined with adler32_combine/crc32_combine.
+ *
+ * QOI - each stripe starts from the last pixel of the previous stripe and
+ * only emits QOI_OP_INDEX for entries it wrote itself, so the decoder's
+ * running index is never relied on across a stripe boundary.
+ */
+#define ENCODE_STRIPE_ROWS 64
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+#define QOI_OP_RGBA 0xff
+
+typedef struct stripe {
+	uint8_t *data;
+	size_t size;
+	uint32_t check; //adler32 of the filtered rows (PNG only)
+	uint32_t crc; //crc32 of data (PNG only)
+	size_t raw_size;
+	int err;
+} stripe_t;
+
+typedef struct encode_job {
+	const image_t *img;
+	stripe_t *stripes;
+	uint32_t count;
+	int level;
+	bool alpha;
+	bool bgr;
+} encode_job_t;
+
+int encode_format_from_str(const char *str, encode_format_t *fmt) {
+	if(strcmp(str, "png") == 0) {
+		*fmt = ENCODE_PNG;
+	} else if(strcmp(str, "qoi") == 0) {
+		*fmt = ENCODE_QOI;
+	} else if(strcmp(str, "raw") == 0) {
+		*fmt = ENCODE_RAW;
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+const char *encode_format_ext(encode_format_t fmt) {
+	switch(fmt) {
+		case ENCODE_PNG:
+			return "png";
+		case ENCODE_QOI:
+			return "qoi";
+		case ENCODE_RAW:
+		default:
+			return "raw";
+	}
+}
+
+static inline void put_be32(uint8_t *p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+//Unpack one 32bpp pixel into r, g, b, a byte order
+static inline uint32_t encode_rgba(const encode_job_t *job, uint32_t px) {
+	uint32_t r = (px >> 16) & 0xff;
+	uint32_t b = px & 0xff;
+	uint32_t g = (px >> 8) & 0xff;
+	uint32_t a = job->alpha ? px >> 24 : 0xff;
+
+	if(job->bgr) {
+		uint32_t t = r;
+		r = b;
+		b = t;
+	}
+
+	return r | (g << 8) | (b << 16) | (a << 24);
+}
+
+static inline const uint32_t *encode_row(const image_t *img, uint32_t y) {
+	return (const uint32_t *)(img->data + (size_t)y * img->pitch);
+}
+
+static void encode_png_stripe(void *arg, uint32_t index) {
+	encode_job_t *job = arg;
+	const image_t *img = job->img;
+	stripe_t *stripe = &job->stripes[index];
+	uint32_t y0 = index * ENCODE_STRIPE_ROWS;
+	uint32_t y1 = y0 + ENCODE_STRIPE_ROWS > img->height ? img->height : y0 + ENCODE_STRIPE_ROWS;
+	uint32_t bpp = job->alpha ? 4 : 3;
+	size_t row_size = 1 + (size_t)img->width * bpp;
+	z_stream zs;
+
+	stripe->raw_size = row_size * (y1 - y0);
+	uint8_t *raw = malloc(stripe->raw_size);
+	if(!raw) {
+		stripe->err = -1;
+		return;
+	}
+
+	//Sub filter, cheap and still lets deflate find the flat runs
+	//typical of UI content
+	uint8_t *p = raw;
+	for(uint32_t y = y0; y < y1; y++) {
+		const uint32_t *row = encode_row(img, y);
+		uint8_t prev[4] = { 0 };
+
+		*p++ = 1;
+		for(uint32_t x = 0; x < img->width; x++) {
+			uint32_t px = encode_rgba(job, row[x]);
+			for(uint32_t c = 0; c < bpp; c++) {
+				uint8_t v = px >> (c * 8);
+				*p++ = v - prev[c];
+				prev[c] = v;
+			}
+		}
+	}
+	stripe->check = adler32(1, raw, stripe->raw_size);
+
+	memset(&zs, 0, sizeof(zs));
+	if(deflateInit2(&zs, job->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		free(raw);
+		stripe->err = -1;
+		return;
+	}
+
+	//Leave room for the sync flush marker on top of deflateBound
+	size_t bound = deflateBound(&zs, stripe->raw_size) + 16;
+	stripe->data = malloc(bound);
+	if(!stripe->data) {
+		deflateEnd(&zs);
+		free(raw);
+		stripe->err = -1;
+		return;
+	}
+
+	zs.next_in = raw;
+	zs.avail_in = stripe->raw_size;
+	zs.next_out = stripe->data;
+	zs.avail_out = bound;
+
+	int flush = index == job->count - 1 ? Z_FINISH : Z_SYNC_FLUSH;
+	int ret = deflate(&zs, flush);
+	if((flush == Z_FINISH && ret != Z_STREAM_END) || (flush != Z_FINISH && ret != Z_OK) || zs.avail_in) {
+		stripe->err = -1;
+	}
+
+	stripe->size = bound - zs.avail_out;
+	stripe->crc = crc32(0, stripe->data, stripe->size);
+	deflateEnd(&zs);
+	free(raw);
+}
+
+static int encode_png_write(const encode_job_t *job, FILE *out) {
+	static const uint8_t sig[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	//zlib header, deflate with a 32K window and the "fastest" level hint
+	static const uint8_t zhdr[2] = { 0x78, 0x01 };
+	uint8_t ihdr[4 + 4 + 13 + 4];
+	uint8_t buf[4];
+	uint32_t check = 1;
+	uint32_t crc;
+	size_t idat = sizeof(zhdr) + 4;
+
+	put_be32(ihdr, 13);
+	memcpy(ihdr + 4, "IHDR", 4);
+	put_be32(ihdr + 8, job->img->width);
+	put_be32(ihdr + 12, job->img->height);
+	ihdr[16] = 8;
+	ihdr[17] = job->alpha ? 6 : 2;
+	ihdr[18] = 0;
+	ihdr[19] = 0;
+	ihdr[20] = 0;
+	put_be32(ihdr + 21, crc32(0, ihdr + 4, 17));
+
+	crc = crc32(0, (const uint8_t *)"IDAT", 4);
+	crc = crc32(crc, zhdr, sizeof(zhdr));
+	for(uint32_t i = 0; i < job->count; i++) {
+		idat += job->stripes[i].size;
+		check = adler32_combine(check, job->stripes[i].check, job->stripes[i].raw_size);
+		crc = crc32_combine(crc, job->stripes[i].crc, job->stripes[i].size);
+	}
+
+	if(idat > 0x7fffffff) {
+		logger_error("PNG IDAT too large");
+		return -1;
+	}
+
+	fwrite(sig, 1, sizeof(sig), out);
+	fwrite(ihdr, 1, sizeof(ihdr), out);
+
+	put_be32(buf, idat);
+	fwrite(buf, 1, 4, out);
+	fwrite("IDAT", 1, 4, out);
+	fwrite(zhdr, 1, sizeof(zhdr), out);
+	for(uint32_t i = 0; i < job->count; i++) {
+		fwrite(job->stripes[i].data, 1, job->stripes[i].size, out);
+	}
+	put_be32(buf, check);
+	crc = crc32(crc, buf, 4);
+	fwrite(buf, 1, 4, out);
+	put_be32(buf, crc);
+	fwrite(buf, 1, 4, out);
+
+	put_be32(buf, 0);
+	fwrite(buf, 1, 4, out);
+	fwrite("IEND", 1, 4, out);
+	put_be32(buf, crc32(0, (const uint8_t *)"IEND", 4));
+	fwrite(buf, 1, 4, out);
+
+	return ferror(out) ? -1 : 0;
+}
+
+static inline uint32_t qoi_hash(uint32_t px) {
+	return ((px & 0xff) * 3 + ((px >> 8) & 0xff) * 5 + ((px >> 16) & 0xff) * 7 + (px >> 24) * 11) % 64;
+}
+
+static void encode_qoi_stripe(void *arg, uint32_t index) {
+	encode_job_t *job = arg;
+	const image_t *img = job->img;
+	stripe_t *stripe = &job->stripes[index];
+	uint32_t y0 = index * ENCODE_STRIPE_ROWS;
+	uint32_t y1 = y0 + ENCODE_STRIPE_ROWS > img->height ? img->height : y0 + ENCODE_STRIPE_ROWS;
+	uint32_t table[64];
+	uint64_t valid = 0;
+	uint32_t run = 0;
+	uint32_t prev = 0xff000000;
+
+	//Worst case is a QOI_OP_RGBA for every pixel
+	stripe->data = malloc((size_t)img->width * (y1 - y0) * 5);
+	if(!stripe->data) {
+		stripe->err = -1;
+		return;
+	}
+
+	if(y0) {
+		prev = encode_rgba(job, encode_row(img, y0 - 1)[img->width - 1]);
+	}
+
+	uint8_t *p = stripe->data;
+	for(uint32_t y = y0; y < y1; y++) {
+		const uint32_t *row = encode_row(img, y);
+		for(uint32_t x = 0; x < img->width; x++) {
+			uint32_t px = encode_rgba(job, row[x]);
+
+			if(px == prev) {
+				if(++run == 62) {
+					*p++ = QOI_OP_RUN | (run - 1);
+					run = 0;
+				}
+				continue;
+			}
+
+			if(run) {
+				*p++ = QOI_OP_RUN | (run - 1);
+				run = 0;
+			}
+
+			uint32_t h = qoi_hash(px);
+			if(((valid >> h) & 1) && table[h] == px) {
+				*p++ = QOI_OP_INDEX | h;
+				prev = px;
+				continue;
+			}
+
+			table[h] = px;
+			valid |= 1ull << h;
+
+			if((px >> 24) == (prev >> 24)) {
+				int8_t dr = (int8_t)((px & 0xff) - (prev & 0xff));
+				int8_t dg = (int8_t)(((px >> 8) & 0xff) - ((prev >> 8) & 0xff));
+				int8_t db = (int8_t)(((px >> 16) & 0xff) - ((prev >> 16) & 0xff));
+				int8_t dr_dg = dr - dg;
+				int8_t db_dg = db - dg;
+
+				if(dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2) {
+					*p++ = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+				} else if(dr_dg > -9 && dr_dg < 8 && dg > -33 && dg < 32 && db_dg > -9 && db_dg < 8) {
+					*p++ = QOI_OP_LUMA | (dg + 32);
+					*p++ = (dr_dg + 8) << 4 | (db_dg + 8);
+				} else {
+					*p++ = QOI_OP_RGB;
+					*p++ = px;
+					*p++ = px >> 8;
+					*p++ = px >> 16;
+				}
+			} else {
+				*p++ = QOI_OP_RGBA;
+				*p++ = px;
+				*p++ = px >> 8;
+				*p++ = px >> 16;
+				*p++ = px >> 24;
+			}
+			prev = px;
+		}
+	}
+
+	//Runs never continue across stripes
+	if(run) {
+		*p++ = QOI_OP_RUN | (run - 1);
+	}
+
+	stripe->size = p - stripe->data;
+}
+
+static int encode_qoi_write(const encode_job_t *job, FILE *out) {
+	static const uint8_t end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+	uint8_t hdr[14];
+
+	memcpy(hdr, "qoif", 4);
+	put_be32(hdr + 4, job->img->width);
+	put_be32(hdr + 8, job->img->height);
+	hdr[12] = job->alpha ? 4 : 3;
+	hdr[13] = 0;
+
+	fwrite(hdr, 1, sizeof(hdr), out);
+	for(uint32_t i = 0; i < job->count; i++) {
+		fwrite(job->stripes[i].data, 1, job->stripes[i].size, out);
+	}
+	fwrite(end, 1, sizeof(end), out);
+
+	return ferror(out) ? -1 : 0;
+}
+
+//Raw is the pixels exactly as scanned out with the padding removed
+static int encode_raw_write(const image_t *img, FILE *out) {
+	size_t row = (size_t)img->width * 4;
+
+	if(img->pitch == row) {
+		fwrite(img->data, 1, row * img->height, out);
+	} else {
+		for(uint32_t y = 0; y < img->height; y++) {
+			fwrite(img->data + (size_t)y * img->pitch, 1, row, out);
+		}
+	}
+
+	return ferror(out) ? -1 : 0;
+}
+
+/* Encode img into out
+ *
+ * PARAMS:
+ * pool - worker pool to spread the stripes over, may be NULL
+ * level - zlib level for PNG, 1 is the fast default
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int encode_image(pool_t *pool, const image_t *img, encode_format_t fmt, int level, FILE *out) {
+	encode_job_t job = {
+		.img = img,
+		.level = level,
+		.alpha = img->format == DRM_FORMAT_ARGB8888 || img->format == DRM_FORMAT_ABGR8888,
+		.bgr = img->format == DRM_FORMAT_XBGR8888 || img->format == DRM_FORMAT_ABGR8888,
+		.count = (img->height + ENCODE_STRIPE_ROWS - 1) / ENCODE_STRIPE_ROWS,
+	};
+	int ret = 0;
+
+	if(fmt == ENCODE_RAW) {
+		return encode_raw_write(img, out);
+	}
+
+	if(!img->width || !img->height) {
+		return -1;
+	}
+
+	job.stripes = calloc(job.count, sizeof(*job.stripes));
+	if(!job.stripes) {
+		logger_error("Failed to allocate encode stripes %m");
+		return -1;
+	}
+
+	pool_run(pool, job.count, fmt == ENCODE_PNG ? encode_png_stripe : encode_qoi_stripe, &job);
+
+	for(uint32_t i = 0; i < job.count; i++) {
+		if(job.stripes[i].err) {
+			logger_error("Failed to encode stripe %u", i);
+			ret = -1;
+		}
+	}
+
+	if(!ret) {
+		ret = fmt == ENCODE_PNG ? encode_png_write(&job, out) : encode_qoi_write(&job, out);
+	}
+
+	for(uint32_t i = 0; i < job.count; i++) {
+		free(job.stripes[i].data);
+	}
+	free(job.stripes);
+	return ret;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "./pool.h"
+
+typedef enum encode_format {
+	ENCODE_RAW,
+	ENCODE_PNG,
+	ENCODE_QOI,
+} encode_format_t;
+
+/*
+ * A CPU side copy of a 32bpp framebuffer, format is the DRM fourcc
+ * (XRGB/ARGB/XBGR/ABGR 8888) so the encoders know the channel order
+ */
+typedef struct image {
+	uint32_t width;
+	uint32_t height;
+	uint32_t pitch;
+	uint32_t format;
+	const uint8_t *data;
+} image_t;
+
+int encode_format_from_str(const char *str, encode_format_t *fmt);
+const char *encode_format_ext(encode_format_t fmt);
+int encode_image(pool_t *pool, const image_t *img, encode_format_t fmt, int level, FILE *out);
@@ -0,0 +1,78 @@
+#include "./fence.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <log.h>
+
+#include <sys/ioctl.h>
+
+//sw_sync's uapi lives in the kernel tree rather than the uapi headers
+struct sw_sync_create_fence_data {
+	uint32_t value;
+	char name[32];
+	int32_t fence;
+};
+
+#define SW_SYNC_IOC_MAGIC 'W'
+#define SW_SYNC_IOC_CREATE_FENCE _IOWR(SW_SYNC_IOC_MAGIC, 0, struct sw_sync_create_fence_data)
+#define SW_SYNC_IOC_INC _IOW(SW_SYNC_IOC_MAGIC, 1, uint32_t)
+
+/* Wait for a sync_file to signal
+ *
+ * Returns 0 once signalled, -ETIME on timeout or a negative errno
+ */
+int fence_wait(int fence, int timeout_ms) {
+	struct pollfd pfd = { .fd = fence, .events = POLLIN };
+
+	for(;;) {
+		int ret = poll(&pfd, 1, timeout_ms);
+		if(ret > 0) {
+			return pfd.revents & (POLLERR | POLLNVAL) ? -EINVAL : 0;
+		}
+
+		if(ret == 0) {
+			return -ETIME;
+		}
+
+		if(errno != EINTR && errno != EAGAIN) {
+			return -errno;
+		}
+	}
+}
+
+int sw_sync_timeline_create() {
+	int fd = open("/sys/kernel/debug/sync/sw_sync", O_RDWR | O_CLOEXEC);
+	if(fd < 0) {
+		int err = errno;
+		logger_warn("Failed to open sw_sync (needs debugfs and CONFIG_SW_SYNC) %m");
+		return -err;
+	}
+
+	return fd;
+}
+
+//Fence that signals once the timeline reaches value
+int sw_sync_fence_create(int timeline, const char *name, uint32_t value) {
+	struct sw_sync_create_fence_data data;
+	memset(&data, 0, sizeof(data));
+
+	data.value = value;
+	strncpy(data.name, name, sizeof(data.name) - 1);
+	if(ioctl(timeline, SW_SYNC_IOC_CREATE_FENCE, &data)) {
+		return -errno;
+	}
+
+	return data.fence;
+}
+
+int sw_sync_timeline_inc(int timeline, uint32_t count) {
+	if(ioctl(timeline, SW_SYNC_IOC_INC, &count)) {
+		return -errno;
+	}
+
+	return 0;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * sync_file helpers. A sync_file fd becomes readable once its fence has
+ * signalled so it can go straight into poll/epoll next to other fds.
+ *
+ * sw_sync timelines (debugfs, CONFIG_SW_SYNC) give CPU side code a way
+ * to create fences it signals itself, e.g. a CPU renderer signalling
+ * "frame done" to KMS through IN_FENCE_FD
+ */
+int fence_wait(int fence, int timeout_ms);
+
+int sw_sync_timeline_create();
+int sw_sync_fence_create(int timeline, const char *name, uint32_t value);
+int sw_sync_timeline_inc(int timeline, uint32_t count);
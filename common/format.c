@@ -0,0 +1,292 @@
+#include "./format.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+#include <log.h>
+
+#include "./pool.h"
+
+#define FORMAT_CONVERT_ROWS 64
+
+//Cheapest first, format_choose takes the first one that is good enough
+static const format_info_t formats[] = {
+	{ DRM_FORMAT_RGB332, "RGB332", 8, { 3, 3, 2 }, { 5, 2, 0 } },
+	{ DRM_FORMAT_RGB565, "RGB565", 16, { 5, 6, 5 }, { 11, 5, 0 } },
+	{ DRM_FORMAT_BGR565, "BGR565", 16, { 5, 6, 5 }, { 0, 5, 11 } },
+	{ DRM_FORMAT_XRGB1555, "XRGB1555", 16, { 5, 5, 5 }, { 10, 5, 0 } },
+	{ DRM_FORMAT_RGB888, "RGB888", 24, { 8, 8, 8 }, { 16, 8, 0 } },
+	{ DRM_FORMAT_XRGB8888, "XRGB8888", 32, { 8, 8, 8 }, { 16, 8, 0 } },
+	{ DRM_FORMAT_XBGR8888, "XBGR8888", 32, { 8, 8, 8 }, { 0, 8, 16 } },
+	{ DRM_FORMAT_XRGB2101010, "XRGB2101010", 32, { 10, 10, 10 }, { 20, 10, 0 } },
+};
+
+#define FORMAT_COUNT (sizeof(formats) / sizeof(formats[0]))
+
+//Fewest bits any channel may have for each quality level
+static const uint8_t quality_bits[] = {
+	[FORMAT_QUALITY_LOW] = 2,
+	[FORMAT_QUALITY_MEDIUM] = 5,
+	[FORMAT_QUALITY_HIGH] = 8,
+	[FORMAT_QUALITY_DEEP] = 10,
+};
+
+static const uint8_t bayer8[8][8] = {
+	{ 0, 32, 8, 40, 2, 34, 10, 42 },
+	{ 48, 16, 56, 24, 50, 18, 58, 26 },
+	{ 12, 44, 4, 36, 14, 46, 6, 38 },
+	{ 60, 28, 52, 20, 62, 30, 54, 22 },
+	{ 3, 35, 11, 43, 1, 33, 9, 41 },
+	{ 51, 19, 59, 27, 49, 17, 57, 25 },
+	{ 15, 47, 7, 39, 13, 45, 5, 37 },
+	{ 63, 31, 55, 23, 61, 29, 53, 21 },
+};
+
+const format_info_t *format_info(uint32_t fourcc) {
+	for(size_t i = 0; i < FORMAT_COUNT; i++) {
+		if(formats[i].fourcc == fourcc) {
+			return &formats[i];
+		}
+	}
+
+	return NULL;
+}
+
+int format_quality_from_str(const char *str, format_quality_t *quality) {
+	if(strcmp(str, "low") == 0) {
+		*quality = FORMAT_QUALITY_LOW;
+	} else if(strcmp(str, "medium") == 0) {
+		*quality = FORMAT_QUALITY_MEDIUM;
+	} else if(strcmp(str, "high") == 0) {
+		*quality = FORMAT_QUALITY_HIGH;
+	} else if(strcmp(str, "deep") == 0) {
+		*quality = FORMAT_QUALITY_DEEP;
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+int format_dither_from_str(const char *str, format_dither_t *dither) {
+	if(strcmp(str, "none") == 0) {
+		*dither = FORMAT_DITHER_NONE;
+	} else if(strcmp(str, "bayer") == 0) {
+		*dither = FORMAT_DITHER_BAYER;
+	} else if(strcmp(str, "noise") == 0) {
+		*dither = FORMAT_DITHER_NOISE;
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+uint64_t format_frame_bytes(const format_info_t *fmt, const drmModeModeInfo *mode) {
+	return (uint64_t)mode->hdisplay * mode->vdisplay * fmt->bpp / 8;
+}
+
+//Bytes per second the display engine reads to scan the format out
+uint64_t format_bandwidth(const format_info_t *fmt, const drmModeModeInfo *mode) {
+	uint64_t pixels = (uint64_t)mode->htotal * mode->vtotal;
+	if(!pixels) {
+		return 0;
+	}
+
+	return format_frame_bytes(fmt, mode) * mode->clock * 1000 / pixels;
+}
+
+static uint8_t format_min_bits(const format_info_t *fmt) {
+	uint8_t bits = fmt->bits[0];
+	bits = fmt->bits[1] < bits ? fmt->bits[1] : bits;
+	return fmt->bits[2] < bits ? fmt->bits[2] : bits;
+}
+
+static bool format_plane_supports(drmModePlanePtr plane, uint32_t fourcc) {
+	//Without a plane to ask only the format every driver has is safe
+	if(!plane) {
+		return fourcc == DRM_FORMAT_XRGB8888;
+	}
+
+	for(uint32_t i = 0; i < plane->count_formats; i++) {
+		if(plane->formats[i] == fourcc) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Pick the format with the least scanout bandwidth that the plane can
+ * show and that has at least the channel depth quality asks for
+ *
+ * Falls back to XRGB8888 if nothing on the plane is good enough
+ */
+const format_info_t *format_choose(int fd, uint32_t plane_id, const drmModeModeInfo *mode,
+		format_quality_t quality) {
+	const format_info_t *xrgb = format_info(DRM_FORMAT_XRGB8888);
+	const format_info_t *best = NULL;
+	drmModePlanePtr plane = plane_id ? drmModeGetPlane(fd, plane_id) : NULL;
+
+	for(size_t i = 0; i < FORMAT_COUNT; i++) {
+		const format_info_t *fmt = &formats[i];
+		if(!format_plane_supports(plane, fmt->fourcc)) {
+			continue;
+		}
+
+		bool good = format_min_bits(fmt) >= quality_bits[quality];
+		logger_debug("%-12s %2u bpp %6.2f MiB/frame %7.1f MiB/s%s", fmt->name, fmt->bpp,
+				format_frame_bytes(fmt, mode) / 1048576.0, format_bandwidth(fmt, mode) / 1048576.0,
+				good ? "" : " (below quality)");
+
+		if(good && (!best || fmt->bpp < best->bpp)) {
+			best = fmt;
+		}
+	}
+
+	drmModeFreePlane(plane);
+
+	if(!best) {
+		logger_warn("Plane %u has no format with %u bit channels, using %s", plane_id,
+				quality_bits[quality], xrgb->name);
+		return xrgb;
+	}
+
+	return best;
+}
+
+/* Build the threshold tile for a dither kernel. NONE is a flat half
+ * step so plain conversion rounds instead of truncating
+ */
+void format_dither_init(format_dither_map_t *map, format_dither_t kind) {
+	map->kind = kind;
+
+	for(uint32_t y = 0; y < FORMAT_DITHER_TILE; y++) {
+		for(uint32_t x = 0; x < FORMAT_DITHER_TILE; x++) {
+			switch(kind) {
+			case FORMAT_DITHER_NONE:
+				map->tile[y][x] = 128;
+				break;
+			case FORMAT_DITHER_BAYER:
+				map->tile[y][x] = bayer8[y % 8][x % 8] * 4 + 2;
+				break;
+			case FORMAT_DITHER_NOISE: {
+				//Jimenez's interleaved gradient noise
+				double n = 52.9829189 * fmod(0.06711056 * x + 0.00583715 * y, 1.0);
+				map->tile[y][x] = (uint8_t)(fmod(n, 1.0) * 256.0);
+				break;
+			}
+			}
+		}
+	}
+}
+
+/* Reduce an 8 bit channel to bits, adding threshold t (0-255) as a
+ * fraction of one output step before flooring. Scaling by the output
+ * range rather than shifting keeps the average on the level the display
+ * will expand back to. Deeper channels are widened instead
+ */
+static inline uint32_t format_quantize(uint32_t c, uint32_t bits, uint32_t t) {
+	if(bits >= 8) {
+		return c << (bits - 8) | c >> (16 - bits);
+	}
+
+	return (c * ((1u << bits) - 1) * 256 + t * 255) / (255 * 256);
+}
+
+//The common 16 bpp case, with the depths constant the divides become multiplies
+static void format_row_rgb565(uint8_t *dst, const uint32_t *src, const uint8_t *thresh,
+		uint32_t ox, uint32_t width) {
+	uint16_t *out = (uint16_t *)dst;
+
+	for(uint32_t x = 0; x < width; x++) {
+		uint32_t p = src[x];
+		uint32_t t = thresh[(x + ox) & (FORMAT_DITHER_TILE - 1)];
+		uint32_t r = format_quantize(p >> 16 & 0xff, 5, t);
+		uint32_t g = format_quantize(p >> 8 & 0xff, 6, t);
+		uint32_t b = format_quantize(p & 0xff, 5, t);
+		out[x] = r << 11 | g << 5 | b;
+	}
+}
+
+static void format_row_generic(const format_info_t *fmt, uint8_t *dst, const uint32_t *src,
+		const uint8_t *thresh, uint32_t ox, uint32_t width) {
+	uint32_t bytes = fmt->bpp / 8;
+
+	for(uint32_t x = 0; x < width; x++) {
+		uint32_t p = src[x];
+		uint32_t t = thresh[(x + ox) & (FORMAT_DITHER_TILE - 1)];
+		uint32_t v = format_quantize(p >> 16 & 0xff, fmt->bits[0], t) << fmt->shift[0] |
+			format_quantize(p >> 8 & 0xff, fmt->bits[1], t) << fmt->shift[1] |
+			format_quantize(p & 0xff, fmt->bits[2], t) << fmt->shift[2];
+
+		//DRM formats are little endian whatever their size
+		for(uint32_t i = 0; i < bytes; i++) {
+			dst[x * bytes + i] = v >> (i * 8);
+		}
+	}
+}
+
+typedef struct format_job {
+	const format_info_t *fmt;
+	const format_dither_map_t *dither;
+	uint8_t *dst;
+	const uint8_t *src;
+	uint32_t dst_pitch;
+	uint32_t src_pitch;
+	uint32_t width;
+	uint32_t height;
+	uint32_t ox;
+	uint32_t oy;
+} format_job_t;
+
+static void format_convert_rows(void *arg, uint32_t index) {
+	format_job_t *job = arg;
+	uint32_t y0 = index * FORMAT_CONVERT_ROWS;
+	uint32_t y1 = y0 + FORMAT_CONVERT_ROWS < job->height ? y0 + FORMAT_CONVERT_ROWS : job->height;
+
+	for(uint32_t y = y0; y < y1; y++) {
+		const uint32_t *src = (const uint32_t *)(job->src + (size_t)y * job->src_pitch);
+		uint8_t *dst = job->dst + (size_t)y * job->dst_pitch;
+		const uint8_t *thresh = job->dither->tile[(y + job->oy) & (FORMAT_DITHER_TILE - 1)];
+
+		//Staging kept only for the other CPU steps, nothing to convert
+		if(job->fmt->fourcc == DRM_FORMAT_XRGB8888) {
+			memcpy(dst, src, (size_t)job->width * 4);
+		} else if(job->fmt->fourcc == DRM_FORMAT_RGB565) {
+			format_row_rgb565(dst, src, thresh, job->ox, job->width);
+		} else {
+			format_row_generic(job->fmt, dst, src, thresh, job->ox, job->width);
+		}
+	}
+}
+
+/* Convert an XRGB8888 image into fmt, dithering with a map from
+ * format_dither_init. frame moves the noise pattern each frame so it
+ * averages out over time, Bayer dithering stays put
+ */
+void format_convert(pool_t *pool, const format_dither_map_t *dither, uint64_t frame,
+		const format_info_t *fmt, void *dst, uint32_t dst_pitch,
+		const void *src, uint32_t src_pitch, uint32_t width, uint32_t height) {
+	format_job_t job = {
+		.fmt = fmt,
+		.dither = dither,
+		.dst = dst,
+		.src = src,
+		.dst_pitch = dst_pitch,
+		.src_pitch = src_pitch,
+		.width = width,
+		.height = height,
+	};
+
+	if(dither->kind == FORMAT_DITHER_NOISE) {
+		job.ox = frame * 5;
+		job.oy = frame * 3;
+	}
+
+	pool_run(pool, (height + FORMAT_CONVERT_ROWS - 1) / FORMAT_CONVERT_ROWS, format_convert_rows, &job);
+}
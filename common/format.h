@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+#include <xf86drmMode.h>
+
+#include "./pool.h"
+
+/*
+ * Packed RGB scanout formats the presenter can convert XRGB8888 into.
+ * bits/shift are per channel in R, G, B order
+ */
+typedef struct format_info {
+	uint32_t fourcc;
+	const char *name;
+	uint32_t bpp;
+	uint8_t bits[3];
+	uint8_t shift[3];
+} format_info_t;
+
+/*
+ * Lowest channel depth the caller will accept. MEDIUM allows 16 bpp
+ * formats which need dithering to hide banding in gradients
+ */
+typedef enum format_quality {
+	FORMAT_QUALITY_LOW,
+	FORMAT_QUALITY_MEDIUM,
+	FORMAT_QUALITY_HIGH,
+	FORMAT_QUALITY_DEEP,
+} format_quality_t;
+
+typedef enum format_dither {
+	FORMAT_DITHER_NONE,
+	//8x8 ordered (Bayer) matrix, stable from frame to frame
+	FORMAT_DITHER_BAYER,
+	//Interleaved gradient noise, blue-noise like and shifted every frame
+	FORMAT_DITHER_NOISE,
+} format_dither_t;
+
+#define FORMAT_DITHER_TILE 64
+
+//Per pixel thresholds (0-255) tiled over the frame
+typedef struct format_dither_map {
+	format_dither_t kind;
+	uint8_t tile[FORMAT_DITHER_TILE][FORMAT_DITHER_TILE];
+} format_dither_map_t;
+
+const format_info_t *format_info(uint32_t fourcc);
+int format_quality_from_str(const char *str, format_quality_t *quality);
+int format_dither_from_str(const char *str, format_dither_t *dither);
+
+uint64_t format_frame_bytes(const format_info_t *fmt, const drmModeModeInfo *mode);
+uint64_t format_bandwidth(const format_info_t *fmt, const drmModeModeInfo *mode);
+const format_info_t *format_choose(int fd, uint32_t plane_id, const drmModeModeInfo *mode,
+		format_quality_t quality);
+
+void format_dither_init(format_dither_map_t *map, format_dither_t kind);
+void format_convert(pool_t *pool, const format_dither_map_t *dither, uint64_t frame,
+		const format_info_t *fmt, void *dst, uint32_t dst_pitch,
+		const void *src, uint32_t src_pitch, uint32_t width, uint32_t height);
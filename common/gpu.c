@@ -0,0 +1,269 @@
+#include "./gpu.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <log.h>
+
+#include <sys/eventfd.h>
+
+#include "./drm_common.h"
+#include "./loop.h"
+#include "./present.h"
+#include "./route.h"
+#include "./timing.h"
+#include "./trace.h"
+
+static void gpu_free(gpu_t *gpu) {
+	for(uint32_t i = 0; i < gpu->count; i++) {
+		present_destroy(gpu->outputs[i]);
+	}
+
+	if(gpu->wake_fd >= 0) {
+		close(gpu->wake_fd);
+	}
+
+	if(gpu->fd >= 0) {
+		close(gpu->fd);
+	}
+	free(gpu);
+}
+
+//Open a primary node and set up a presenter on every connected connector
+static gpu_t *gpu_open(const char *path, uint32_t buffers) {
+	route_t route;
+	gpu_t *gpu = calloc(1, sizeof(*gpu));
+	if(!gpu) {
+		logger_error("Failed to allocate GPU %m");
+		return NULL;
+	}
+
+	snprintf(gpu->path, sizeof(gpu->path), "%s", path);
+	gpu->wake_fd = -1;
+	gpu->fd = open_drm_caps(path, DRM_CAP_DUMB_BUFFER, &gpu->caps);
+	if(gpu->fd < 0) {
+		gpu_free(gpu);
+		return NULL;
+	}
+
+	gpu->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(gpu->wake_fd < 0 || route_probe(gpu->fd, &route)) {
+		logger_warn("%s: no KMS resources", path);
+		gpu_free(gpu);
+		return NULL;
+	}
+
+	route_solve(&route);
+	for(uint32_t i = 0; i < route.count_outputs && gpu->count < GPU_MAX_OUTPUTS; i++) {
+		const route_output_t *out = &route.outputs[i];
+
+		//The presenter drives one connector per CRTC, clones stay dark
+		if(out->crtc < 0 || out->clone_of >= 0) {
+			logger_warn("%s: no CRTC of its own for connector %u", path, out->conn_id);
+			continue;
+		}
+
+		present_t *p = present_create(gpu->fd, out->conn_id, route.crtcs[out->crtc], buffers);
+		if(p) {
+			gpu->outputs[gpu->count++] = p;
+		}
+	}
+
+	return gpu;
+}
+
+/* Open every device drmGetDevices2 reports with a primary node and at
+ * least one connected output, render only devices are skipped
+ *
+ * Returns NULL if there are none
+ */
+gpu_runtime_t *gpu_runtime_open(uint32_t buffers) {
+	drmDevicePtr devs[GPU_MAX_DEVICES];
+
+	gpu_runtime_t *rt = calloc(1, sizeof(*rt));
+	if(!rt) {
+		logger_error("Failed to allocate GPU runtime %m");
+		return NULL;
+	}
+
+	rt->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	int count = drmGetDevices2(0, devs, GPU_MAX_DEVICES);
+	if(rt->done_fd < 0 || count < 0) {
+		logger_error("Failed to list DRM devices %m");
+		gpu_runtime_close(rt);
+		return NULL;
+	}
+
+	for(int i = 0; i < count; i++) {
+		if(!(devs[i]->available_nodes & (1 << DRM_NODE_PRIMARY))) {
+			continue;
+		}
+
+		gpu_t *gpu = gpu_open(devs[i]->nodes[DRM_NODE_PRIMARY], buffers);
+		if(gpu && !gpu->count) {
+			logger_info("%s: nothing connected, skipping", gpu->path);
+			gpu_free(gpu);
+		} else if(gpu) {
+			gpu->done_fd = rt->done_fd;
+			rt->gpus[rt->count++] = gpu;
+		}
+	}
+	drmFreeDevices(devs, count);
+
+	if(!rt->count) {
+		logger_error("No KMS device with a connected output");
+		gpu_runtime_close(rt);
+		return NULL;
+	}
+
+	return rt;
+}
+
+void gpu_runtime_close(gpu_runtime_t *rt) {
+	gpu_runtime_stop(rt);
+	gpu_runtime_join(rt);
+
+	for(uint32_t i = 0; i < rt->count; i++) {
+		gpu_free(rt->gpus[i]);
+	}
+
+	if(rt->done_fd >= 0) {
+		close(rt->done_fd);
+	}
+	free(rt);
+}
+
+/* Start a frame on every output that has nothing in flight. Legacy
+ * modesets complete without an event so keep going until each output
+ * is waiting on a flip or has run its frames
+ *
+ * Returns true once every output is finished
+ */
+static bool gpu_kick(gpu_t *gpu) {
+	bool stop = atomic_load_explicit(&gpu->stop, memory_order_relaxed);
+	bool finished = true;
+
+	for(uint32_t i = 0; i < gpu->count; i++) {
+		present_t *p = gpu->outputs[i];
+
+		while(!stop && p->pending < 0 && p->frame < gpu->frames) {
+			if(present_frame(p)) {
+				logger_error("%s: output %u stopped after %lu frames", gpu->path, p->conn_id, p->frame);
+				p->frame = gpu->frames;
+			}
+		}
+
+		if(p->pending >= 0 || (!stop && p->frame < gpu->frames)) {
+			finished = false;
+		}
+	}
+
+	return finished;
+}
+
+static void gpu_drm_ready(loop_t *loop, int fd, uint32_t events, void *user) {
+	gpu_t *gpu = user;
+
+	present_handle_events(fd);
+	if(gpu_kick(gpu)) {
+		loop_quit(loop);
+	}
+}
+
+static void gpu_wake(loop_t *loop, int fd, uint32_t events, void *user) {
+	gpu_t *gpu = user;
+	uint64_t count;
+
+	if(read(fd, &count, sizeof(count)) == sizeof(count) && gpu_kick(gpu)) {
+		loop_quit(loop);
+	}
+}
+
+static void *gpu_main(void *data) {
+	gpu_t *gpu = data;
+	uint64_t one = 1;
+
+	trace_thread_name("gpu");
+	gpu->loop = loop_create();
+	if(gpu->loop && loop_add_fd(gpu->loop, gpu->fd, EPOLLIN, gpu_drm_ready, gpu) &&
+			loop_add_fd(gpu->loop, gpu->wake_fd, EPOLLIN, gpu_wake, gpu)) {
+		gpu->start_ns = timing_now_ns();
+		if(!gpu_kick(gpu)) {
+			loop_run(gpu->loop);
+		}
+		gpu->end_ns = timing_now_ns();
+	}
+
+	loop_destroy(gpu->loop);
+	gpu->loop = NULL;
+
+	if(write(gpu->done_fd, &one, sizeof(one)) != sizeof(one)) {
+		logger_warn("%s: failed to signal completion %m", gpu->path);
+	}
+	return NULL;
+}
+
+/* Start one thread per device, each drives frames on all of its
+ * outputs as fast as their flips complete. done_fd counts up to
+ * rt->started as the threads finish, devices whose thread failed to
+ * start never signal it
+ *
+ * Returns 0 on success, -1 if no thread could be started
+ */
+int gpu_runtime_start(gpu_runtime_t *rt, uint64_t frames, present_render_fn render, void *user) {
+	rt->started = 0;
+
+	for(uint32_t i = 0; i < rt->count; i++) {
+		gpu_t *gpu = rt->gpus[i];
+
+		gpu->frames = frames;
+		for(uint32_t j = 0; j < gpu->count; j++) {
+			gpu->outputs[j]->render = render;
+			gpu->outputs[j]->user = user;
+		}
+
+		if(pthread_create(&gpu->thread, NULL, gpu_main, gpu)) {
+			logger_error("%s: failed to start thread", gpu->path);
+			continue;
+		}
+		gpu->started = true;
+		rt->started++;
+	}
+
+	return rt->started ? 0 : -1;
+}
+
+//Ask every device thread to finish its in flight flips and exit
+void gpu_runtime_stop(gpu_runtime_t *rt) {
+	uint64_t one = 1;
+
+	for(uint32_t i = 0; i < rt->count; i++) {
+		gpu_t *gpu = rt->gpus[i];
+		if(!gpu->started) {
+			continue;
+		}
+
+		atomic_store(&gpu->stop, true);
+		if(write(gpu->wake_fd, &one, sizeof(one)) != sizeof(one)) {
+			logger_warn("%s: failed to wake thread %m", gpu->path);
+		}
+	}
+}
+
+void gpu_runtime_join(gpu_runtime_t *rt) {
+	for(uint32_t i = 0; i < rt->count; i++) {
+		gpu_t *gpu = rt->gpus[i];
+		if(gpu->started) {
+			pthread_join(gpu->thread, NULL);
+			gpu->started = false;
+		}
+	}
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "./drm_common.h"
+#include "./loop.h"
+#include "./present.h"
+
+#define GPU_MAX_DEVICES 16
+#define GPU_MAX_OUTPUTS 8
+
+/*
+ * One KMS device with every connected output on it. All of its state
+ * (fd, presenters, event loop) is only touched by its own thread once
+ * started, so devices never contend with each other
+ */
+typedef struct gpu {
+	int fd;
+	char path[64];
+	drm_caps_t caps;
+
+	present_t *outputs[GPU_MAX_OUTPUTS];
+	uint32_t count;
+
+	pthread_t thread;
+	bool started;
+	loop_t *loop;
+	//eventfd written by gpu_runtime_stop to wake the loop
+	int wake_fd;
+	atomic_bool stop;
+	//Owned by the runtime, written once when the thread is done
+	int done_fd;
+
+	uint64_t frames;
+	uint64_t start_ns;
+	uint64_t end_ns;
+} gpu_t;
+
+typedef struct gpu_runtime {
+	gpu_t *gpus[GPU_MAX_DEVICES];
+	uint32_t count;
+	//Device threads gpu_runtime_start got going, done_fd counts up to this
+	uint32_t started;
+	//eventfd counting finished device threads, pollable from a loop
+	int done_fd;
+} gpu_runtime_t;
+
+gpu_runtime_t *gpu_runtime_open(uint32_t buffers);
+void gpu_runtime_close(gpu_runtime_t *rt);
+int gpu_runtime_start(gpu_runtime_t *rt, uint64_t frames, present_render_fn render, void *user);
+void gpu_runtime_stop(gpu_runtime_t *rt);
+void gpu_runtime_join(gpu_runtime_t *rt);
@@ -0,0 +1,87 @@
+#include "./handoff.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+#include <log.h>
+
+#include "./buffers.h"
+#include "./capture.h"
+#include "./pool.h"
+
+//Same timings, the name and type (preferred, driver, userdef) don't matter
+bool handoff_mode_equal(const drmModeModeInfo *a, const drmModeModeInfo *b) {
+	return a->clock == b->clock &&
+		a->hdisplay == b->hdisplay && a->hsync_start == b->hsync_start &&
+		a->hsync_end == b->hsync_end && a->htotal == b->htotal && a->hskew == b->hskew &&
+		a->vdisplay == b->vdisplay && a->vsync_start == b->vsync_start &&
+		a->vsync_end == b->vsync_end && a->vtotal == b->vtotal && a->vscan == b->vscan &&
+		a->flags == b->flags;
+}
+
+/* Compare what crtc_id and conn_id are doing now with showing mode on
+ * them. h->match is only set if the connector's encoder already feeds
+ * the CRTC, the CRTC already runs mode and it is scanning out a buffer
+ * from 0,0
+ *
+ * Returns 0 if the current state could be read (matching or not), -1
+ * otherwise
+ */
+int handoff_probe(int fd, uint32_t conn_id, uint32_t crtc_id, const drmModeModeInfo *mode, handoff_t *h) {
+	drmModeConnectorPtr conn = drmModeGetConnector(fd, conn_id);
+	drmModeCrtcPtr crtc = drmModeGetCrtc(fd, crtc_id);
+	drmModeEncoderPtr enc = conn && conn->encoder_id ? drmModeGetEncoder(fd, conn->encoder_id) : NULL;
+	int ret = conn && crtc ? 0 : -1;
+
+	memset(h, 0, sizeof(*h));
+	if(ret) {
+		logger_error("Failed to read the state of CRTC %u %m", crtc_id);
+	} else if(!enc || enc->crtc_id != crtc_id) {
+		logger_debug("Handoff: connector %u isn't on CRTC %u", conn_id, crtc_id);
+	} else if(!crtc->mode_valid || !crtc->buffer_id) {
+		logger_debug("Handoff: CRTC %u is off", crtc_id);
+	} else if(!handoff_mode_equal(&crtc->mode, mode)) {
+		logger_debug("Handoff: CRTC %u runs %s, not %s", crtc_id, crtc->mode.name, mode->name);
+	} else if(crtc->x || crtc->y) {
+		logger_debug("Handoff: CRTC %u is panned to %u,%u", crtc_id, crtc->x, crtc->y);
+	} else {
+		h->match = true;
+		h->fb_id = crtc->buffer_id;
+		h->width = crtc->width;
+		h->height = crtc->height;
+	}
+
+	drmModeFreeEncoder(enc);
+	drmModeFreeCrtc(crtc);
+	drmModeFreeConnector(conn);
+	return ret;
+}
+
+/* Copy the framebuffer that was on screen into dst (32 bpp XRGB), so
+ * the first frame can carry on from whatever was being shown. Needs DRM
+ * master for the FB's handle
+ *
+ * Returns 0 on success, -1 if there was nothing to copy or it can't be
+ * read as XRGB8888
+ */
+int handoff_copy(int fd, const handoff_t *h, pool_t *pool, bo_t *dst) {
+	capture_fb_t cap;
+
+	if(!h->fb_id || dst->bpp != 32 || capture_fb_open(fd, h->fb_id, &cap)) {
+		return -1;
+	}
+
+	//ABGR layouts would come out with red and blue swapped
+	if(cap.format != DRM_FORMAT_XRGB8888 && cap.format != DRM_FORMAT_ARGB8888) {
+		logger_warn("Handoff: can't copy FB %u in %.4s", h->fb_id, (char *)&cap.format);
+		capture_fb_close(fd, &cap);
+		return -1;
+	}
+
+	capture_fb_copy_to(&cap, pool, dst->buffer, dst->pitch, dst->width, dst->height);
+	capture_fb_close(fd, &cap);
+	return 0;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xf86drmMode.h>
+
+#include "./buffers.h"
+#include "./pool.h"
+
+/*
+ * What is on a CRTC when we take it over (from fbcon, a boot splash or
+ * the last client). When the connector is already routed to the CRTC
+ * and the CRTC already runs the mode we want, match is set and the
+ * first commit can be a plain flip instead of a modeset, which skips
+ * the blank (and the link retraining some panels do on every modeset)
+ */
+typedef struct handoff {
+	bool match;
+	uint32_t fb_id;
+	uint32_t width;
+	uint32_t height;
+} handoff_t;
+
+bool handoff_mode_equal(const drmModeModeInfo *a, const drmModeModeInfo *b);
+int handoff_probe(int fd, uint32_t conn_id, uint32_t crtc_id, const drmModeModeInfo *mode, handoff_t *h);
+int handoff_copy(int fd, const handoff_t *h, pool_t *pool, bo_t *dst);
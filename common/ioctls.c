@@ -0,0 +1,249 @@
+#include "./ioctls.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <drm.h>
+#include <log.h>
+
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "./timing.h"
+
+//One slot per DRM ioctl number, the last one for everything else
+#define IOCTLS_SLOTS 257
+#define IOCTLS_OTHER 256
+
+#define IOCTLS_NAME(name) [_IOC_NR(DRM_IOCTL_##name)] = #name
+
+static const char *ioctls_names[256] = {
+	IOCTLS_NAME(VERSION),
+	IOCTLS_NAME(GEM_CLOSE),
+	IOCTLS_NAME(GET_CAP),
+	IOCTLS_NAME(SET_CLIENT_CAP),
+	IOCTLS_NAME(SET_MASTER),
+	IOCTLS_NAME(DROP_MASTER),
+	IOCTLS_NAME(PRIME_HANDLE_TO_FD),
+	IOCTLS_NAME(PRIME_FD_TO_HANDLE),
+	IOCTLS_NAME(WAIT_VBLANK),
+	IOCTLS_NAME(CRTC_GET_SEQUENCE),
+	IOCTLS_NAME(CRTC_QUEUE_SEQUENCE),
+	IOCTLS_NAME(MODE_GETRESOURCES),
+	IOCTLS_NAME(MODE_GETCRTC),
+	IOCTLS_NAME(MODE_SETCRTC),
+	IOCTLS_NAME(MODE_CURSOR),
+	IOCTLS_NAME(MODE_GETGAMMA),
+	IOCTLS_NAME(MODE_SETGAMMA),
+	IOCTLS_NAME(MODE_GETENCODER),
+	IOCTLS_NAME(MODE_GETCONNECTOR),
+	IOCTLS_NAME(MODE_GETPROPERTY),
+	IOCTLS_NAME(MODE_SETPROPERTY),
+	IOCTLS_NAME(MODE_GETPROPBLOB),
+	IOCTLS_NAME(MODE_GETFB),
+	IOCTLS_NAME(MODE_ADDFB),
+	IOCTLS_NAME(MODE_RMFB),
+	IOCTLS_NAME(MODE_PAGE_FLIP),
+	IOCTLS_NAME(MODE_DIRTYFB),
+	IOCTLS_NAME(MODE_CREATE_DUMB),
+	IOCTLS_NAME(MODE_MAP_DUMB),
+	IOCTLS_NAME(MODE_DESTROY_DUMB),
+	IOCTLS_NAME(MODE_GETPLANERESOURCES),
+	IOCTLS_NAME(MODE_GETPLANE),
+	IOCTLS_NAME(MODE_SETPLANE),
+	IOCTLS_NAME(MODE_ADDFB2),
+	IOCTLS_NAME(MODE_OBJ_GETPROPERTIES),
+	IOCTLS_NAME(MODE_OBJ_SETPROPERTY),
+	IOCTLS_NAME(MODE_CURSOR2),
+	IOCTLS_NAME(MODE_ATOMIC),
+	IOCTLS_NAME(MODE_CREATEPROPBLOB),
+	IOCTLS_NAME(MODE_DESTROYPROPBLOB),
+	IOCTLS_NAME(MODE_CREATE_LEASE),
+	IOCTLS_NAME(MODE_LIST_LESSEES),
+	IOCTLS_NAME(MODE_GET_LEASE),
+	IOCTLS_NAME(MODE_REVOKE_LEASE),
+	IOCTLS_NAME(MODE_GETFB2),
+};
+
+/*
+ * A thread's call count and histograms, the histograms allocated the
+ * first time it makes that ioctl. Threads are never unlinked so the
+ * count and summary still see the ones that have exited
+ */
+typedef struct ioctls_thread {
+	_Atomic uint64_t calls; //only written by the owning thread
+	_Atomic(hist_t *) hists[IOCTLS_SLOTS];
+	struct ioctls_thread *next;
+} ioctls_thread_t;
+
+static bool ioctls_on;
+static _Atomic(ioctls_thread_t *) ioctls_threads;
+static __thread ioctls_thread_t *ioctls_self;
+
+static void ioctls_at_exit(void) {
+	ioctls_summary();
+}
+
+__attribute__((constructor)) static void ioctls_init(void) {
+	const char *env = getenv(IOCTLS_ENV);
+
+	ioctls_on = env && *env && *env != '0';
+	if(ioctls_on) {
+		atexit(ioctls_at_exit);
+	}
+}
+
+//Once per thread, allocation failures just drop its calls from the count
+static ioctls_thread_t *ioctls_thread(void) {
+	ioctls_thread_t *self = calloc(1, sizeof(*self));
+	if(!self) {
+		return NULL;
+	}
+
+	self->next = atomic_load_explicit(&ioctls_threads, memory_order_relaxed);
+	while(!atomic_compare_exchange_weak_explicit(&ioctls_threads, &self->next, self,
+				memory_order_release, memory_order_relaxed));
+	ioctls_self = self;
+	return self;
+}
+
+//Allocation failures just drop the sample
+static hist_t *ioctls_hist(ioctls_thread_t *self, uint32_t slot) {
+	hist_t *hist = atomic_load_explicit(&self->hists[slot], memory_order_relaxed);
+	if(!hist && (hist = calloc(1, sizeof(*hist)))) {
+		atomic_store_explicit(&self->hists[slot], hist, memory_order_release);
+	}
+
+	return hist;
+}
+
+/* Overrides libc's ioctl for the whole process. Straight to the syscall
+ * rather than dlsym(RTLD_NEXT) so there is nothing to look up the first
+ * time round
+ */
+int ioctl(int fd, unsigned long request, ...) {
+	va_list args;
+
+	va_start(args, request);
+	void *arg = va_arg(args, void *);
+	va_end(args);
+
+	//Single writer, a plain add rather than a locked one on a shared line
+	ioctls_thread_t *self = ioctls_self ? ioctls_self : ioctls_thread();
+	if(self) {
+		atomic_store_explicit(&self->calls,
+				atomic_load_explicit(&self->calls, memory_order_relaxed) + 1, memory_order_relaxed);
+	}
+
+	if(!ioctls_on || !self) {
+		return syscall(SYS_ioctl, fd, request, arg);
+	}
+
+	uint64_t start = timing_now_ns();
+	int ret = syscall(SYS_ioctl, fd, request, arg);
+	uint64_t ns = timing_now_ns() - start;
+	int err = errno;
+
+	hist_t *hist = ioctls_hist(self, _IOC_TYPE(request) == DRM_IOCTL_BASE ? _IOC_NR(request) : IOCTLS_OTHER);
+	if(hist) {
+		hist_record(hist, ns);
+	}
+
+	errno = err;
+	return ret;
+}
+
+//Calls made so far by every thread
+uint64_t ioctls_count(void) {
+	uint64_t total = 0;
+
+	for(ioctls_thread_t *t = atomic_load_explicit(&ioctls_threads, memory_order_acquire); t; t = t->next) {
+		total += atomic_load_explicit(&t->calls, memory_order_relaxed);
+	}
+
+	return total;
+}
+
+bool ioctls_enabled(void) {
+	return ioctls_on;
+}
+
+typedef struct ioctls_row {
+	uint32_t slot;
+	uint64_t calls;
+	uint64_t sum;
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t max;
+} ioctls_row_t;
+
+static int ioctls_row_cmp(const void *a, const void *b) {
+	const ioctls_row_t *x = a;
+	const ioctls_row_t *y = b;
+	return x->sum < y->sum ? 1 : x->sum > y->sum ? -1 : 0;
+}
+
+/* Every thread's histograms merged per ioctl, most total time first.
+ * Runs at exit when enabled, can be called earlier for a snapshot
+ */
+void ioctls_summary(void) {
+	ioctls_row_t rows[IOCTLS_SLOTS];
+	uint32_t count = 0;
+	uint64_t calls = 0, sum = 0;
+	hist_t *merged = malloc(sizeof(*merged));
+
+	if(!ioctls_on || !merged) {
+		free(merged);
+		return;
+	}
+
+	for(uint32_t slot = 0; slot < IOCTLS_SLOTS; slot++) {
+		hist_reset(merged);
+		for(ioctls_thread_t *t = atomic_load_explicit(&ioctls_threads, memory_order_acquire); t; t = t->next) {
+			hist_t *hist = atomic_load_explicit(&t->hists[slot], memory_order_acquire);
+			if(hist) {
+				hist_merge(merged, hist);
+			}
+		}
+
+		uint64_t n = atomic_load_explicit(&merged->count, memory_order_relaxed);
+		if(!n) {
+			continue;
+		}
+
+		rows[count++] = (ioctls_row_t) {
+			.slot = slot,
+			.calls = n,
+			.sum = atomic_load_explicit(&merged->sum, memory_order_relaxed),
+			.p50 = hist_percentile(merged, 50),
+			.p99 = hist_percentile(merged, 99),
+			.max = atomic_load_explicit(&merged->max, memory_order_relaxed),
+		};
+		calls += n;
+		sum += rows[count - 1].sum;
+	}
+	free(merged);
+
+	qsort(rows, count, sizeof(*rows), ioctls_row_cmp);
+	logger_info("%-24s %8s %10s %6s %9s %9s %9s", "ioctl", "calls", "total ms", "%", "p50 us", "p99 us", "max us");
+	for(uint32_t i = 0; i < count; i++) {
+		const ioctls_row_t *row = &rows[i];
+		char unknown[16];
+		const char *name = row->slot == IOCTLS_OTHER ? "(not DRM)" : ioctls_names[row->slot];
+
+		if(!name) {
+			snprintf(unknown, sizeof(unknown), "%s 0x%02x",
+					row->slot >= DRM_COMMAND_BASE && row->slot < 0xa0 ? "DRIVER" : "DRM", row->slot);
+			name = unknown;
+		}
+
+		logger_info("%-24s %8lu %10.3f %5.1f%% %9.1f %9.1f %9.1f", name, row->calls, row->sum / 1e6,
+				sum ? row->sum * 100.0 / sum : 0.0, row->p50 / 1e3, row->p99 / 1e3, row->max / 1e3);
+	}
+	logger_info("%-24s %8lu %10.3f", "total", calls, sum / 1e6);
+}
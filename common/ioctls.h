@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define IOCTLS_ENV "DRM_TESTS_IOCTLS"
+
+/*
+ * Linking common/ioctls.c into a program puts its ioctl() in front of
+ * libc's, so every ioctl the program makes is counted on the way
+ * through to the kernel. libdrm's drmIoctl and every drmMode* call end
+ * up there, so this sees all of them
+ *
+ * With IOCTLS_ENV set in the environment each call is also timed into a
+ * histogram per ioctl number. Every thread writes its own counter and
+ * histograms (no locks or shared cache lines on the ioctl path), the
+ * count is summed on demand and the histograms merged into a table
+ * printed at exit. Unset it costs a thread local add and a branch
+ */
+uint64_t ioctls_count(void);
+bool ioctls_enabled(void);
+void ioctls_summary(void);
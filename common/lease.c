@@ -0,0 +1,427 @@
+//accept4, struct ucred and SO_PEERCRED
+#define _GNU_SOURCE
+
+#include "./lease.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <log.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "./loop.h"
+#include "./props.h"
+#include "./route.h"
+
+static bool lease_taken(const lease_manager_t *m, uint32_t id) {
+	for(uint32_t i = 0; i < LEASE_MAX_CLIENTS; i++) {
+		const lease_grant_t *g = &m->clients[i].grant;
+		if(g->lessee_id && (g->conn_id == id || g->crtc_id == id || g->plane_id == id || g->cursor_id == id)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* CRTC index for the output, the routing solver's pick if nobody holds
+ * it, otherwise any free CRTC one of the connector's encoders can drive
+ */
+static int lease_pick_crtc(const lease_manager_t *m, const route_t *route, const route_output_t *out) {
+	if(out->crtc >= 0 && out->clone_of < 0 && !lease_taken(m, route->crtcs[out->crtc])) {
+		return out->crtc;
+	}
+
+	for(uint32_t e = 0; e < route->count_encoders; e++) {
+		if(!(out->encoders & (1ull << e))) {
+			continue;
+		}
+
+		for(uint32_t c = 0; c < route->count_crtcs; c++) {
+			if((route->encoders[e].possible_crtcs & (1u << c)) && !lease_taken(m, route->crtcs[c])) {
+				return c;
+			}
+		}
+	}
+
+	return -1;
+}
+
+//Free plane of the given type for the CRTC, 0 if there is none
+static uint32_t lease_pick_plane(const lease_manager_t *m, uint32_t crtc_index, uint64_t type) {
+	drmModePlaneResPtr pres = drmModeGetPlaneResources(m->fd);
+	uint32_t found = 0;
+
+	if(!pres) {
+		return 0;
+	}
+
+	for(uint32_t i = 0; i < pres->count_planes && !found; i++) {
+		drmModePlanePtr plane = drmModeGetPlane(m->fd, pres->planes[i]);
+		if(!plane) {
+			continue;
+		}
+
+		props_t *props = props_get(m->fd, plane->plane_id, DRM_MODE_OBJECT_PLANE);
+		uint64_t plane_type = DRM_PLANE_TYPE_OVERLAY;
+		if(props) {
+			props_value(props, "type", &plane_type);
+			props_free(props);
+		}
+
+		if(plane_type == type && (plane->possible_crtcs & (1u << crtc_index)) && !lease_taken(m, plane->plane_id)) {
+			found = plane->plane_id;
+		}
+		drmModeFreePlane(plane);
+	}
+
+	drmModeFreePlaneResources(pres);
+	return found;
+}
+
+/* Lease one output to client. The routing is worked out fresh for every
+ * request so hotplugs since the last one are picked up
+ *
+ * Returns the lease fd, a negative errno on failure
+ */
+static int lease_grant(lease_manager_t *m, lease_client_t *client, uint32_t conn_id) {
+	lease_grant_t *g = &client->grant;
+	const route_output_t *out = NULL;
+	route_t route;
+
+	if(route_probe(m->fd, &route)) {
+		return -EIO;
+	}
+	route_solve(&route);
+
+	for(uint32_t i = 0; i < route.count_outputs && !out; i++) {
+		uint32_t id = route.outputs[i].conn_id;
+		if(conn_id ? id == conn_id : !lease_taken(m, id)) {
+			out = &route.outputs[i];
+		}
+	}
+
+	if(!out) {
+		return conn_id ? -ENOENT : -EBUSY;
+	}
+
+	if(lease_taken(m, out->conn_id)) {
+		return -EBUSY;
+	}
+
+	int crtc = lease_pick_crtc(m, &route, out);
+	if(crtc < 0) {
+		return -EBUSY;
+	}
+
+	//Universal plane clients can't flip without the primary plane
+	uint32_t plane_id = lease_pick_plane(m, crtc, DRM_PLANE_TYPE_PRIMARY);
+	if(!plane_id) {
+		return -EBUSY;
+	}
+
+	uint32_t cursor_id = lease_pick_plane(m, crtc, DRM_PLANE_TYPE_CURSOR);
+	uint32_t objects[4] = { out->conn_id, route.crtcs[crtc], plane_id, cursor_id };
+	uint32_t lessee_id = 0;
+
+	int fd = drmModeCreateLease(m->fd, objects, cursor_id ? 4 : 3, O_CLOEXEC, &lessee_id);
+	if(fd < 0) {
+		return fd;
+	}
+
+	g->lessee_id = lessee_id;
+	g->conn_id = out->conn_id;
+	g->crtc_id = route.crtcs[crtc];
+	g->plane_id = plane_id;
+	g->cursor_id = cursor_id;
+	m->granted++;
+
+	logger_info("Lease %u to pid %d: connector %u, CRTC %u, plane %u, cursor %u", lessee_id, client->pid,
+			g->conn_id, g->crtc_id, g->plane_id, g->cursor_id);
+	return fd;
+}
+
+static void lease_revoke(lease_manager_t *m, lease_client_t *client) {
+	if(client->grant.lessee_id) {
+		if(drmModeRevokeLease(m->fd, client->grant.lessee_id)) {
+			logger_warn("Failed to revoke lease %u %m", client->grant.lessee_id);
+		} else {
+			logger_info("Revoked lease %u of pid %d", client->grant.lessee_id, client->pid);
+			m->revoked++;
+		}
+	}
+
+	loop_remove(m->loop, client->source);
+	close(client->sock);
+	memset(client, 0, sizeof(*client));
+	client->sock = -1;
+}
+
+//Reply with the grant, the lease fd rides along as SCM_RIGHTS
+static int lease_send(int sock, const lease_grant_t *grant, int fd) {
+	char control[CMSG_SPACE(sizeof(int))] = { 0 };
+	struct iovec iov = { .iov_base = (void *)grant, .iov_len = sizeof(*grant) };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+	if(fd >= 0) {
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(*grant) ? 0 : -errno;
+}
+
+static lease_client_t *lease_client_for(lease_manager_t *m, int sock) {
+	for(uint32_t i = 0; i < LEASE_MAX_CLIENTS; i++) {
+		if(m->clients[i].source && m->clients[i].sock == sock) {
+			return &m->clients[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void lease_on_client(loop_t *loop, int sock, uint32_t events, void *user) {
+	lease_manager_t *m = user;
+	lease_client_t *client = lease_client_for(m, sock);
+	lease_request_t req;
+
+	if(!client) {
+		return;
+	}
+
+	ssize_t len = (events & EPOLLIN) ? recv(sock, &req, sizeof(req), 0) : 0;
+	if(len <= 0) {
+		//Hung up or gone, the lease goes with it
+		if(len < 0 && errno == EAGAIN) {
+			return;
+		}
+		lease_revoke(m, client);
+		return;
+	}
+
+	//One lease per connection, a second output needs a second connection
+	lease_grant_t reply = { .status = -EINVAL };
+	int fd = -1;
+	if(len == sizeof(req) && !client->grant.lessee_id) {
+		fd = lease_grant(m, client, req.conn_id);
+		reply = fd >= 0 ? client->grant : (lease_grant_t){ .status = fd };
+	}
+
+	if(reply.status) {
+		logger_warn("Refused pid %d a lease: %s", client->pid, strerror(-reply.status));
+	}
+
+	int ret = lease_send(sock, &reply, fd);
+	if(fd >= 0) {
+		//The client has its own copy now, or never will
+		close(fd);
+	}
+
+	if(ret) {
+		logger_warn("Failed to reply to pid %d: %s", client->pid, strerror(-ret));
+		lease_revoke(m, client);
+	}
+}
+
+static void lease_on_accept(loop_t *loop, int fd, uint32_t events, void *user) {
+	lease_manager_t *m = user;
+	lease_client_t *client = NULL;
+
+	int sock = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if(sock < 0) {
+		return;
+	}
+
+	for(uint32_t i = 0; i < LEASE_MAX_CLIENTS && !client; i++) {
+		if(!m->clients[i].source) {
+			client = &m->clients[i];
+		}
+	}
+
+	if(!client) {
+		logger_warn("Too many lease clients");
+		close(sock);
+		return;
+	}
+
+	struct ucred cred = { 0 };
+	socklen_t len = sizeof(cred);
+	getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len);
+
+	client->sock = sock;
+	client->pid = cred.pid;
+	client->source = loop_add_fd(loop, sock, EPOLLIN, lease_on_client, m);
+	if(!client->source) {
+		close(sock);
+		memset(client, 0, sizeof(*client));
+		client->sock = -1;
+	}
+}
+
+/* Start handing out leases of the outputs of fd (which has to be DRM
+ * master) to clients connecting to the unix socket at path
+ *
+ * Returns NULL on failure
+ */
+lease_manager_t *lease_manager_create(int fd, loop_t *loop, const char *path) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	if(strlen(path) >= sizeof(addr.sun_path)) {
+		logger_error("Socket path %s is too long", path);
+		return NULL;
+	}
+
+	lease_manager_t *m = calloc(1, sizeof(*m));
+	if(!m) {
+		logger_error("Failed to allocate lease manager %m");
+		return NULL;
+	}
+
+	m->fd = fd;
+	m->loop = loop;
+	strcpy(m->path, path);
+	strcpy(addr.sun_path, path);
+	for(uint32_t i = 0; i < LEASE_MAX_CLIENTS; i++) {
+		m->clients[i].sock = -1;
+	}
+
+	//Datagram boundaries, a request or a grant is always one message
+	m->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if(m->sock < 0) {
+		logger_error("Failed to create socket %m");
+		free(m);
+		return NULL;
+	}
+
+	unlink(path);
+	if(bind(m->sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(m->sock, LEASE_MAX_CLIENTS)) {
+		logger_error("Failed to listen on %s %m", path);
+		close(m->sock);
+		free(m);
+		return NULL;
+	}
+
+	m->source = loop_add_fd(loop, m->sock, EPOLLIN, lease_on_accept, m);
+	if(!m->source) {
+		close(m->sock);
+		unlink(path);
+		free(m);
+		return NULL;
+	}
+
+	logger_info("Leasing outputs on %s", path);
+	return m;
+}
+
+//Revokes every lease still out, the clients lose their outputs
+void lease_manager_destroy(lease_manager_t *m) {
+	if(!m) {
+		return;
+	}
+
+	for(uint32_t i = 0; i < LEASE_MAX_CLIENTS; i++) {
+		if(m->clients[i].source) {
+			lease_revoke(m, &m->clients[i]);
+		}
+	}
+
+	loop_remove(m->loop, m->source);
+	close(m->sock);
+	unlink(m->path);
+	free(m);
+}
+
+/* Ask the manager on path for a lease of conn_id (0 for any free
+ * output). Blocks until it answers
+ *
+ * Returns NULL on failure
+ */
+lease_t *lease_request(const char *path, uint32_t conn_id) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	lease_request_t req = { .conn_id = conn_id };
+	char control[CMSG_SPACE(sizeof(int))] = { 0 };
+
+	if(strlen(path) >= sizeof(addr.sun_path)) {
+		logger_error("Socket path %s is too long", path);
+		return NULL;
+	}
+	strcpy(addr.sun_path, path);
+
+	lease_t *lease = calloc(1, sizeof(*lease));
+	if(!lease) {
+		logger_error("Failed to allocate lease %m");
+		return NULL;
+	}
+	lease->fd = -1;
+
+	lease->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(lease->sock < 0 || connect(lease->sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		logger_error("Failed to connect to the lease manager on %s %m", path);
+		goto err;
+	}
+
+	if(send(lease->sock, &req, sizeof(req), MSG_NOSIGNAL) != sizeof(req)) {
+		logger_error("Failed to send lease request %m");
+		goto err;
+	}
+
+	struct iovec iov = { .iov_base = &lease->grant, .iov_len = sizeof(lease->grant) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+
+	if(recvmsg(lease->sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(lease->grant)) {
+		logger_error("No answer from the lease manager %m");
+		goto err;
+	}
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+		memcpy(&lease->fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+
+	if(lease->grant.status || lease->fd < 0) {
+		logger_error("Lease refused: %s", strerror(lease->grant.status ? -lease->grant.status : EPROTO));
+		goto err;
+	}
+
+	return lease;
+
+err:
+	lease_release(lease);
+	return NULL;
+}
+
+//Hand the outputs back, closing the socket has the manager revoke the lease
+void lease_release(lease_t *lease) {
+	if(!lease) {
+		return;
+	}
+
+	if(lease->fd >= 0) {
+		close(lease->fd);
+	}
+
+	if(lease->sock >= 0) {
+		close(lease->sock);
+	}
+	free(lease);
+}
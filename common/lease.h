@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "./loop.h"
+
+#define LEASE_MAX_CLIENTS 16
+#define LEASE_SOCKET "/tmp/drm_lease.sock"
+
+//Client -> manager, conn_id 0 asks for any connected output nobody holds
+typedef struct lease_request {
+	uint32_t conn_id;
+} lease_request_t;
+
+/*
+ * Manager -> client. status is 0 or a negative errno, on success the
+ * lease fd comes with it as SCM_RIGHTS and holds the connector, CRTC,
+ * primary plane and (if there is a free one) cursor plane listed here
+ */
+typedef struct lease_grant {
+	int32_t status;
+	uint32_t lessee_id;
+	uint32_t conn_id;
+	uint32_t crtc_id;
+	uint32_t plane_id;
+	uint32_t cursor_id;
+} lease_grant_t;
+
+typedef struct lease_client {
+	int sock;
+	pid_t pid;
+	loop_source_t *source;
+	//lessee_id is 0 until a lease has been granted
+	lease_grant_t grant;
+} lease_client_t;
+
+/*
+ * DRM master side. Hands each client on the unix socket its own lease
+ * of one output so every client can modeset and flip on it without
+ * going through the manager, and revokes the lease as soon as the
+ * client's end of the socket closes (which is also what happens when
+ * it exits or crashes)
+ */
+typedef struct lease_manager {
+	int fd;
+	int sock;
+	char path[108];
+	loop_t *loop;
+	loop_source_t *source;
+	lease_client_t clients[LEASE_MAX_CLIENTS];
+	uint32_t granted;
+	uint32_t revoked;
+} lease_manager_t;
+
+/*
+ * Client side. fd is the DRM fd of the lease (master of just the
+ * leased objects), sock has to stay open for as long as it is in use
+ */
+typedef struct lease {
+	int fd;
+	int sock;
+	lease_grant_t grant;
+} lease_t;
+
+lease_manager_t *lease_manager_create(int fd, loop_t *loop, const char *path);
+void lease_manager_destroy(lease_manager_t *m);
+
+lease_t *lease_request(const char *path, uint32_t conn_id);
+void lease_release(lease_t *lease);
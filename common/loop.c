@@ -0,0 +1,363 @@
+#include "./loop.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <libudev.h>
+#include <xf86drm.h>
+#include <log.h>
+
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+//Events taken per epoll_wait, more are picked up on the next round
+#define LOOP_MAX_EVENTS 32
+
+typedef enum loop_source_type {
+	LOOP_SOURCE_FD,
+	LOOP_SOURCE_DRM,
+	LOOP_SOURCE_UDEV,
+	LOOP_SOURCE_TIMER,
+	LOOP_SOURCE_SIGNAL,
+} loop_source_type_t;
+
+struct loop_source {
+	loop_source_type_t type;
+	int fd;
+	//The loop created fd and closes it on removal
+	bool owns_fd;
+	bool removed;
+	void *user;
+
+	union {
+		loop_fd_fn fd_fn;
+		loop_timer_fn timer_fn;
+		loop_signal_fn signal_fn;
+		loop_udev_fn udev_fn;
+	};
+
+	drmEventContext evctx;
+	int signo;
+	struct udev *udev;
+	struct udev_monitor *monitor;
+
+	loop_source_t *next;
+};
+
+struct loop {
+	int epoll_fd;
+	bool quit;
+	loop_source_t *sources;
+	//Removed while dispatching, freed once the batch is done
+	loop_source_t *dead;
+	bool dispatching;
+};
+
+loop_t *loop_create(void) {
+	loop_t *loop = calloc(1, sizeof(*loop));
+	if(!loop) {
+		logger_error("Failed to allocate event loop %m");
+		return NULL;
+	}
+
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(loop->epoll_fd < 0) {
+		logger_error("Failed to create epoll instance %m");
+		free(loop);
+		return NULL;
+	}
+
+	return loop;
+}
+
+static void loop_free_source(loop_source_t *source) {
+	if(source->monitor) {
+		udev_monitor_unref(source->monitor);
+	}
+
+	if(source->udev) {
+		udev_unref(source->udev);
+	}
+
+	if(source->owns_fd && source->fd >= 0) {
+		close(source->fd);
+	}
+	free(source);
+}
+
+static void loop_free_dead(loop_t *loop) {
+	while(loop->dead) {
+		loop_source_t *source = loop->dead;
+		loop->dead = source->next;
+		loop_free_source(source);
+	}
+}
+
+void loop_destroy(loop_t *loop) {
+	if(!loop) {
+		return;
+	}
+
+	while(loop->sources) {
+		loop_remove(loop, loop->sources);
+	}
+	loop_free_dead(loop);
+
+	close(loop->epoll_fd);
+	free(loop);
+}
+
+static loop_source_t *loop_add_source(loop_t *loop, loop_source_type_t type, int fd, bool owns_fd,
+		uint32_t events, void *user) {
+	loop_source_t *source = calloc(1, sizeof(*source));
+	if(!source) {
+		logger_error("Failed to allocate event source %m");
+		if(owns_fd) {
+			close(fd);
+		}
+		return NULL;
+	}
+
+	source->type = type;
+	source->fd = fd;
+	source->owns_fd = owns_fd;
+	source->user = user;
+
+	struct epoll_event ev = { .events = events, .data.ptr = source };
+	if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+		logger_error("Failed to watch fd %d %m", fd);
+		loop_free_source(source);
+		return NULL;
+	}
+
+	source->next = loop->sources;
+	loop->sources = source;
+	return source;
+}
+
+//Watch any pollable fd, the caller keeps ownership of it
+loop_source_t *loop_add_fd(loop_t *loop, int fd, uint32_t events, loop_fd_fn fn, void *user) {
+	loop_source_t *source = loop_add_source(loop, LOOP_SOURCE_FD, fd, false, events, user);
+	if(source) {
+		source->fd_fn = fn;
+	}
+
+	return source;
+}
+
+/* Run drmHandleEvent with evctx whenever the DRM fd is readable so page
+ * flip, vblank and CRTC sequence events reach their handlers as soon as
+ * the kernel queues them. The context is copied
+ */
+loop_source_t *loop_add_drm(loop_t *loop, int fd, const drmEventContext *evctx) {
+	loop_source_t *source = loop_add_source(loop, LOOP_SOURCE_DRM, fd, false, EPOLLIN, NULL);
+	if(source) {
+		source->evctx = *evctx;
+	}
+
+	return source;
+}
+
+/* Report udev events for a subsystem (e.g. "drm" for connector hotplug,
+ * which arrives as a "change" with HOTPLUG=1 on the card device)
+ */
+loop_source_t *loop_add_udev(loop_t *loop, const char *subsystem, loop_udev_fn fn, void *user) {
+	struct udev *udev = udev_new();
+	if(!udev) {
+		logger_error("Failed to create udev context");
+		return NULL;
+	}
+
+	struct udev_monitor *monitor = udev_monitor_new_from_netlink(udev, "udev");
+	if(!monitor || udev_monitor_filter_add_match_subsystem_devtype(monitor, subsystem, NULL) ||
+			udev_monitor_enable_receiving(monitor)) {
+		logger_error("Failed to set up udev monitor for %s", subsystem);
+		if(monitor) {
+			udev_monitor_unref(monitor);
+		}
+		udev_unref(udev);
+		return NULL;
+	}
+
+	loop_source_t *source = loop_add_source(loop, LOOP_SOURCE_UDEV, udev_monitor_get_fd(monitor),
+			false, EPOLLIN, user);
+	if(!source) {
+		udev_monitor_unref(monitor);
+		udev_unref(udev);
+		return NULL;
+	}
+
+	source->udev = udev;
+	source->monitor = monitor;
+	source->udev_fn = fn;
+	return source;
+}
+
+//Disarmed CLOCK_MONOTONIC timer, start it with loop_timer_set
+loop_source_t *loop_add_timer(loop_t *loop, loop_timer_fn fn, void *user) {
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(fd < 0) {
+		logger_error("Failed to create timerfd %m");
+		return NULL;
+	}
+
+	loop_source_t *source = loop_add_source(loop, LOOP_SOURCE_TIMER, fd, true, EPOLLIN, user);
+	if(source) {
+		source->timer_fn = fn;
+	}
+
+	return source;
+}
+
+/* Fire after ns (or at ns on CLOCK_MONOTONIC when absolute), then every
+ * interval_ns if that isn't 0. ns of 0 disarms the timer
+ */
+int loop_timer_set(loop_source_t *timer, uint64_t ns, uint64_t interval_ns, bool absolute) {
+	struct itimerspec its = {
+		.it_value = { .tv_sec = ns / 1000000000ull, .tv_nsec = ns % 1000000000ull },
+		.it_interval = { .tv_sec = interval_ns / 1000000000ull, .tv_nsec = interval_ns % 1000000000ull },
+	};
+
+	if(timerfd_settime(timer->fd, absolute ? TFD_TIMER_ABSTIME : 0, &its, NULL)) {
+		return -errno;
+	}
+
+	return 0;
+}
+
+/* Deliver signo through a signalfd instead of an async handler. The
+ * signal is blocked for the calling thread, so create the loop before
+ * starting other threads for them to inherit the mask
+ */
+loop_source_t *loop_add_signal(loop_t *loop, int signo, loop_signal_fn fn, void *user) {
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, signo);
+
+	if(pthread_sigmask(SIG_BLOCK, &mask, NULL)) {
+		logger_error("Failed to block signal %d", signo);
+		return NULL;
+	}
+
+	int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if(fd < 0) {
+		logger_error("Failed to create signalfd %m");
+		return NULL;
+	}
+
+	loop_source_t *source = loop_add_source(loop, LOOP_SOURCE_SIGNAL, fd, true, EPOLLIN, user);
+	if(source) {
+		source->signal_fn = fn;
+		source->signo = signo;
+	}
+
+	return source;
+}
+
+//Stop watching a source, safe to call from any callback including its own
+void loop_remove(loop_t *loop, loop_source_t *source) {
+	for(loop_source_t **it = &loop->sources; *it; it = &(*it)->next) {
+		if(*it == source) {
+			*it = source->next;
+			break;
+		}
+	}
+
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+	source->removed = true;
+	source->next = loop->dead;
+	loop->dead = source;
+
+	if(!loop->dispatching) {
+		loop_free_dead(loop);
+	}
+}
+
+static void loop_dispatch_source(loop_t *loop, loop_source_t *source, uint32_t events) {
+	switch(source->type) {
+	case LOOP_SOURCE_FD:
+		source->fd_fn(loop, source->fd, events, source->user);
+		break;
+	case LOOP_SOURCE_DRM:
+		drmHandleEvent(source->fd, &source->evctx);
+		break;
+	case LOOP_SOURCE_UDEV: {
+		//The monitor socket is nonblocking, drain everything queued
+		struct udev_device *dev;
+		while(!source->removed && (dev = udev_monitor_receive_device(source->monitor))) {
+			const char *action = udev_device_get_action(dev);
+			source->udev_fn(loop, dev, action ? action : "", source->user);
+			udev_device_unref(dev);
+		}
+		break;
+	}
+	case LOOP_SOURCE_TIMER: {
+		uint64_t expirations;
+		if(read(source->fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+			source->timer_fn(loop, source, expirations, source->user);
+		}
+		break;
+	}
+	case LOOP_SOURCE_SIGNAL: {
+		struct signalfd_siginfo info;
+		while(!source->removed && read(source->fd, &info, sizeof(info)) == sizeof(info)) {
+			source->signal_fn(loop, info.ssi_signo, source->user);
+		}
+		break;
+	}
+	}
+}
+
+/* Wait up to timeout_ms (-1 forever) for sources to become ready and
+ * run their callbacks
+ *
+ * Returns the number of sources dispatched or a negative errno
+ */
+int loop_dispatch(loop_t *loop, int timeout_ms) {
+	struct epoll_event events[LOOP_MAX_EVENTS];
+
+	int count = epoll_wait(loop->epoll_fd, events, LOOP_MAX_EVENTS, timeout_ms);
+	if(count < 0) {
+		return errno == EINTR ? 0 : -errno;
+	}
+
+	loop->dispatching = true;
+	for(int i = 0; i < count; i++) {
+		loop_source_t *source = events[i].data.ptr;
+
+		//An earlier callback in this batch may have removed it
+		if(!source->removed) {
+			loop_dispatch_source(loop, source, events[i].events);
+		}
+	}
+	loop->dispatching = false;
+
+	loop_free_dead(loop);
+	return count;
+}
+
+//Dispatch until loop_quit is called, returns 0 or a negative errno
+int loop_run(loop_t *loop) {
+	loop->quit = false;
+
+	while(!loop->quit) {
+		int ret = loop_dispatch(loop, -1);
+		if(ret < 0) {
+			logger_error("Event loop failed: %s", strerror(-ret));
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+void loop_quit(loop_t *loop) {
+	loop->quit = true;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xf86drm.h>
+
+#include <sys/epoll.h>
+
+struct udev_device;
+
+/*
+ * Single threaded epoll reactor. Every source is an fd (DRM device, udev
+ * monitor, timerfd, signalfd or anything else pollable) so the loop only
+ * ever sleeps in epoll_wait and wakes straight into the right callback.
+ * Sources may be added and removed from inside callbacks
+ */
+typedef struct loop loop_t;
+typedef struct loop_source loop_source_t;
+
+typedef void (*loop_fd_fn)(loop_t *loop, int fd, uint32_t events, void *user);
+typedef void (*loop_timer_fn)(loop_t *loop, loop_source_t *timer, uint64_t expirations, void *user);
+typedef void (*loop_signal_fn)(loop_t *loop, int signo, void *user);
+//action is "add", "remove" or "change", the device is only valid during the call
+typedef void (*loop_udev_fn)(loop_t *loop, struct udev_device *dev, const char *action, void *user);
+
+loop_t *loop_create(void);
+void loop_destroy(loop_t *loop);
+
+loop_source_t *loop_add_fd(loop_t *loop, int fd, uint32_t events, loop_fd_fn fn, void *user);
+loop_source_t *loop_add_drm(loop_t *loop, int fd, const drmEventContext *evctx);
+loop_source_t *loop_add_udev(loop_t *loop, const char *subsystem, loop_udev_fn fn, void *user);
+loop_source_t *loop_add_timer(loop_t *loop, loop_timer_fn fn, void *user);
+loop_source_t *loop_add_signal(loop_t *loop, int signo, loop_signal_fn fn, void *user);
+void loop_remove(loop_t *loop, loop_source_t *source);
+
+int loop_timer_set(loop_source_t *timer, uint64_t ns, uint64_t interval_ns, bool absolute);
+
+int loop_dispatch(loop_t *loop, int timeout_ms);
+int loop_run(loop_t *loop);
+void loop_quit(loop_t *loop);
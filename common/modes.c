@@ -0,0 +1,216 @@
+#include "./modes.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xf86drmMode.h>
+#include <log.h>
+
+//What mode_pick uses, set once from the command line before any output is opened
+static mode_request_t mode_default = { .policy = MODE_POLICY_PREFERRED };
+
+static const char *mode_policy_names[] = {
+	[MODE_POLICY_PREFERRED] = "preferred",
+	[MODE_POLICY_REFRESH] = "refresh",
+	[MODE_POLICY_EXACT] = "exact",
+	[MODE_POLICY_BANDWIDTH] = "bandwidth",
+};
+
+//Refresh rate in mHz from the timings, 0 for a mode with no totals
+uint32_t mode_refresh_mhz(const drmModeModeInfo *mode) {
+	uint64_t num = (uint64_t)mode->clock * 1000000;
+	uint64_t den = (uint64_t)mode->htotal * mode->vtotal;
+
+	if(mode->flags & DRM_MODE_FLAG_INTERLACE) {
+		num *= 2;
+	}
+
+	if(mode->flags & DRM_MODE_FLAG_DBLSCAN) {
+		den *= 2;
+	}
+
+	if(mode->vscan > 1) {
+		den *= mode->vscan;
+	}
+
+	return den ? (num + den / 2) / den : 0;
+}
+
+/* preferred, refresh, bandwidth or WIDTHxHEIGHT[@REFRESH]
+ *
+ * Returns 0 on success, -1 if str is none of those
+ */
+int mode_request_from_str(const char *str, mode_request_t *req) {
+	uint32_t width, height, refresh = 0;
+	char end;
+
+	memset(req, 0, sizeof(*req));
+	for(uint32_t i = 0; i < sizeof(mode_policy_names) / sizeof(mode_policy_names[0]); i++) {
+		if(i != MODE_POLICY_EXACT && !strcmp(str, mode_policy_names[i])) {
+			req->policy = i;
+			return 0;
+		}
+	}
+
+	int n = sscanf(str, "%ux%u@%u%c", &width, &height, &refresh, &end);
+	if((n != 2 && n != 3) || !width || !height) {
+		return -1;
+	}
+
+	req->policy = MODE_POLICY_EXACT;
+	req->width = width;
+	req->height = height;
+	req->refresh = refresh;
+	return 0;
+}
+
+void mode_set_default(const mode_request_t *req) {
+	mode_default = *req;
+}
+
+/* Index a connector's mode list
+ *
+ * Returns NULL on allocation failure
+ */
+mode_index_t *mode_index_create(const drmModeConnector *conn) {
+	mode_index_t *idx = calloc(1, sizeof(*idx));
+	if(!idx || !(idx->modes = calloc(conn->count_modes ? conn->count_modes : 1, sizeof(*idx->modes)))) {
+		logger_error("Failed to allocate mode index %m");
+		free(idx);
+		return NULL;
+	}
+
+	idx->conn_id = conn->connector_id;
+	idx->preferred = -1;
+	for(int i = 0; i < conn->count_modes; i++) {
+		const drmModeModeInfo *info = &conn->modes[i];
+		uint32_t mhz = mode_refresh_mhz(info);
+		if(!mhz || !info->hdisplay || !info->vdisplay) {
+			logger_debug("Connector %u: skipping broken mode %s", conn->connector_id, info->name);
+			continue;
+		}
+
+		mode_entry_t *e = &idx->modes[idx->count];
+		e->info = *info;
+		e->refresh_mhz = mhz;
+		e->interlaced = info->flags & DRM_MODE_FLAG_INTERLACE;
+		if(idx->preferred < 0 && (info->type & DRM_MODE_TYPE_PREFERRED)) {
+			idx->preferred = idx->count;
+		}
+		idx->count++;
+	}
+
+	if(idx->preferred < 0) {
+		idx->preferred = 0;
+	}
+
+	return idx;
+}
+
+void mode_index_destroy(mode_index_t *idx) {
+	if(!idx) {
+		return;
+	}
+
+	free(idx->modes);
+	free(idx);
+}
+
+/* Whether a beats b under policy, both already the right size.
+ * Progressive beats interlaced whatever the policy, then the refresh or
+ * clock the policy asks for, then the preferred flag
+ */
+static bool mode_better(mode_policy_t policy, const mode_entry_t *a, const mode_entry_t *b) {
+	if(a->interlaced != b->interlaced) {
+		return !a->interlaced;
+	}
+
+	if(policy == MODE_POLICY_BANDWIDTH && a->info.clock != b->info.clock) {
+		return a->info.clock < b->info.clock;
+	}
+
+	if(policy != MODE_POLICY_BANDWIDTH && a->refresh_mhz != b->refresh_mhz) {
+		return a->refresh_mhz > b->refresh_mhz;
+	}
+
+	//Same rate, reduced blanking needs less link bandwidth
+	if(a->info.clock != b->info.clock) {
+		return a->info.clock < b->info.clock;
+	}
+
+	return (a->info.type & DRM_MODE_TYPE_PREFERRED) && !(b->info.type & DRM_MODE_TYPE_PREFERRED);
+}
+
+/* Rank the indexed modes by req
+ *
+ * Returns the best mode, NULL if none matches (or there are none)
+ */
+const drmModeModeInfo *mode_select(const mode_index_t *idx, const mode_request_t *req) {
+	if(!idx->count) {
+		return NULL;
+	}
+
+	const mode_entry_t *preferred = &idx->modes[idx->preferred];
+	if(req->policy == MODE_POLICY_PREFERRED) {
+		return &preferred->info;
+	}
+
+	uint32_t width = req->width ? req->width : preferred->info.hdisplay;
+	uint32_t height = req->height ? req->height : preferred->info.vdisplay;
+	const mode_entry_t *best = NULL;
+
+	for(uint32_t i = 0; i < idx->count; i++) {
+		const mode_entry_t *e = &idx->modes[i];
+		if(e->info.hdisplay != width || e->info.vdisplay != height) {
+			continue;
+		}
+
+		//Within half a Hz, so 60 finds 59.94 as well
+		if(req->refresh && abs((int)e->refresh_mhz - (int)req->refresh * 1000) >= 500) {
+			continue;
+		}
+
+		if(!best || mode_better(req->policy, e, best)) {
+			best = e;
+		}
+	}
+
+	return best ? &best->info : NULL;
+}
+
+/* Choose the mode for a connector with the default request (see
+ * mode_set_default), falling back to the preferred mode if nothing
+ * matches it
+ *
+ * Returns 0 on success, -1 if the connector has no usable modes
+ */
+int mode_pick(const drmModeConnector *conn, drmModeModeInfo *mode) {
+	static const mode_request_t preferred = { .policy = MODE_POLICY_PREFERRED };
+	mode_index_t *idx = mode_index_create(conn);
+	if(!idx) {
+		return -1;
+	}
+
+	const drmModeModeInfo *info = mode_select(idx, &mode_default);
+	const char *policy = mode_policy_names[mode_default.policy];
+	if(!info && idx->count) {
+		logger_warn("Connector %u: no mode matches the requested one, using the preferred one",
+				conn->connector_id);
+		info = mode_select(idx, &preferred);
+		policy = mode_policy_names[MODE_POLICY_PREFERRED];
+	}
+
+	if(!info) {
+		logger_error("Connector %u has no usable modes", conn->connector_id);
+		mode_index_destroy(idx);
+		return -1;
+	}
+
+	*mode = *info;
+	logger_info("Connector %u: %s@%.2fHz (%s, %u modes)", conn->connector_id, mode->name,
+			mode_refresh_mhz(mode) / 1000.0, policy, idx->count);
+	mode_index_destroy(idx);
+	return 0;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xf86drmMode.h>
+
+/*
+ * How to pick a connector's mode. modes[0] is only usually the
+ * preferred one and rarely the fastest:
+ * PREFERRED - the mode the sink flags as preferred
+ * REFRESH   - highest refresh rate at the preferred (or requested) size
+ * EXACT     - width x height, at refresh if given and the highest otherwise
+ * BANDWIDTH - lowest pixel clock at the preferred (or requested) size
+ */
+typedef enum mode_policy {
+	MODE_POLICY_PREFERRED,
+	MODE_POLICY_REFRESH,
+	MODE_POLICY_EXACT,
+	MODE_POLICY_BANDWIDTH,
+} mode_policy_t;
+
+//width/height/refresh of 0 mean any
+typedef struct mode_request {
+	mode_policy_t policy;
+	uint32_t width;
+	uint32_t height;
+	uint32_t refresh;
+} mode_request_t;
+
+typedef struct mode_entry {
+	drmModeModeInfo info;
+	//Real refresh from the timings, vrefresh rounds 59.94 up to 60
+	uint32_t refresh_mhz;
+	bool interlaced;
+} mode_entry_t;
+
+/*
+ * A connector's modes with what every policy ranks them by worked out
+ * once, broken modes (no clock or totals) are left out
+ */
+typedef struct mode_index {
+	uint32_t conn_id;
+	uint32_t count;
+	mode_entry_t *modes;
+	//Flagged preferred, the first mode if none is
+	int preferred;
+} mode_index_t;
+
+uint32_t mode_refresh_mhz(const drmModeModeInfo *mode);
+int mode_request_from_str(const char *str, mode_request_t *req);
+void mode_set_default(const mode_request_t *req);
+
+mode_index_t *mode_index_create(const drmModeConnector *conn);
+void mode_index_destroy(mode_index_t *idx);
+const drmModeModeInfo *mode_select(const mode_index_t *idx, const mode_request_t *req);
+int mode_pick(const drmModeConnector *conn, drmModeModeInfo *mode);
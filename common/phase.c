@@ -0,0 +1,109 @@
+#include "./phase.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <log.h>
+
+#include "./ioctls.h"
+#include "./timing.h"
+
+void phase_start(phase_log_t *log) {
+	memset(log, 0, sizeof(*log));
+	log->start_ns = timing_now_ns();
+	log->last_ns = log->start_ns;
+	log->last_ioctls = ioctls_count();
+}
+
+//name has to outlive the log, a string literal
+void phase_mark(phase_log_t *log, const char *name) {
+	uint64_t now = timing_now_ns();
+	uint64_t ioctls = ioctls_count();
+
+	if(log->count < PHASE_MAX) {
+		phase_t *phase = &log->phases[log->count++];
+		phase->name = name;
+		phase->ns = now - log->last_ns;
+		phase->ioctls = ioctls - log->last_ioctls;
+	}
+
+	log->last_ns = now;
+	log->last_ioctls = ioctls;
+}
+
+//From phase_start to the last mark
+uint64_t phase_total_ns(const phase_log_t *log) {
+	return log->last_ns - log->start_ns;
+}
+
+static int phase_cmp(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+//Exact percentile of a handful of runs, sorts values
+static uint64_t phase_percentile(uint64_t *values, uint32_t count, double pct) {
+	qsort(values, count, sizeof(*values), phase_cmp);
+	uint32_t rank = (uint32_t)(pct / 100.0 * count + 0.999999);
+	return values[rank ? rank - 1 : 0];
+}
+
+/* Median and p99 of every phase and of the total over count runs of the
+ * same path, as log lines or as one JSON object on stdout. One run is
+ * just its breakdown
+ */
+void phase_summary(const phase_log_t *runs, uint32_t count, const char *total, bool json) {
+	uint64_t *values = count ? calloc(count, sizeof(*values)) : NULL;
+	if(!values) {
+		return;
+	}
+
+	if(json) {
+		printf("{\"runs\":%u,\"phases\":[", count);
+	}
+
+	for(uint32_t i = 0; i < runs[0].count; i++) {
+		for(uint32_t r = 0; r < count; r++) {
+			values[r] = runs[r].phases[i].ioctls;
+		}
+		uint64_t ioctls = phase_percentile(values, count, 50);
+
+		for(uint32_t r = 0; r < count; r++) {
+			values[r] = runs[r].phases[i].ns;
+		}
+		uint64_t median = phase_percentile(values, count, 50);
+		uint64_t p99 = phase_percentile(values, count, 99);
+
+		if(json) {
+			printf("%s{\"name\":\"%s\",\"median_ms\":%.3f,\"p99_ms\":%.3f,\"ioctls\":%lu}", i ? "," : "",
+					runs[0].phases[i].name, median / 1e6, p99 / 1e6, ioctls);
+		} else {
+			logger_info("%-10s median %8.3fms p99 %8.3fms %4lu ioctls", runs[0].phases[i].name,
+					median / 1e6, p99 / 1e6, ioctls);
+		}
+	}
+
+	uint64_t ioctls = 0;
+	for(uint32_t r = 0; r < count; r++) {
+		values[r] = phase_total_ns(&runs[r]);
+	}
+
+	for(uint32_t i = 0; i < runs[0].count; i++) {
+		ioctls += runs[0].phases[i].ioctls;
+	}
+
+	uint64_t median = phase_percentile(values, count, 50);
+	uint64_t p99 = phase_percentile(values, count, 99);
+	if(json) {
+		printf("],\"%s\":{\"median_ms\":%.3f,\"p99_ms\":%.3f,\"ioctls\":%lu}}\n", total, median / 1e6, p99 / 1e6, ioctls);
+		fflush(stdout);
+	} else {
+		logger_info("%s: median %.3fms p99 %.3fms over %u runs, %lu ioctls", total, median / 1e6, p99 / 1e6,
+				count, ioctls);
+	}
+
+	free(values);
+}
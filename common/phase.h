@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PHASE_MAX 16
+
+typedef struct phase {
+	const char *name;
+	uint64_t ns;
+	uint64_t ioctls;
+} phase_t;
+
+/*
+ * Where the time goes on a startup path. phase_mark closes the phase
+ * that ran since the last mark (or phase_start) with its CLOCK_MONOTONIC
+ * time and the number of ioctls it made (see ioctls.h)
+ */
+typedef struct phase_log {
+	phase_t phases[PHASE_MAX];
+	uint32_t count;
+	uint64_t start_ns;
+	uint64_t last_ns;
+	uint64_t last_ioctls;
+} phase_log_t;
+
+void phase_start(phase_log_t *log);
+void phase_mark(phase_log_t *log, const char *name);
+uint64_t phase_total_ns(const phase_log_t *log);
+void phase_summary(const phase_log_t *runs, uint32_t count, const char *total, bool json);
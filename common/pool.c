@@ -0,0 +1,172 @@
+#include "./pool.h"
+
+#include <log.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+struct pool {
+	pthread_t *threads;
+	uint32_t count;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+
+	//Bumped for every pool_run so sleeping workers know there is work
+	uint64_t generation;
+	uint32_t active;
+	bool quit;
+
+	pool_job_fn fn;
+	void *arg;
+	uint32_t jobs;
+	atomic_uint next;
+	atomic_uint finished;
+};
+
+static void pool_drain(pool_t *pool) {
+	for(;;) {
+		//Claim the index before looking at jobs/fn so a late worker
+		//always sees the batch the index belongs to
+		uint32_t i = atomic_fetch_add(&pool->next, 1);
+		if(i >= pool->jobs) {
+			break;
+		}
+
+		pool->fn(pool->arg, i);
+		atomic_fetch_add(&pool->finished, 1);
+	}
+}
+
+static void *pool_worker(void *data) {
+	pool_t *pool = data;
+	uint64_t seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for(;;) {
+		while(!pool->quit && pool->generation == seen) {
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		}
+
+		if(pool->quit) {
+			break;
+		}
+
+		seen = pool->generation;
+		pool->active++;
+		pthread_mutex_unlock(&pool->lock);
+
+		pool_drain(pool);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->active--;
+		pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/* Create a pool with the requested number of worker threads
+ * passing 0 uses one thread per online cpu, the thread calling
+ * pool_run always takes part so a pool of 1 uses 2 threads
+ */
+pool_t *pool_create(uint32_t threads) {
+	pool_t *pool = calloc(1, sizeof(*pool));
+	if(!pool) {
+		logger_error("Failed to allocate worker pool %m");
+		return NULL;
+	}
+
+	if(threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 1 ? cpus - 1 : 0;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	pool->threads = calloc(threads ? threads : 1, sizeof(pthread_t));
+	if(!pool->threads) {
+		logger_error("Failed to allocate worker threads %m");
+		pool_destroy(pool);
+		return NULL;
+	}
+
+	for(uint32_t i = 0; i < threads; i++) {
+		if(pthread_create(&pool->threads[i], NULL, pool_worker, pool)) {
+			logger_warn("Only started %u of %u worker threads", i, threads);
+			break;
+		}
+		pool->count++;
+	}
+
+	return pool;
+}
+
+void pool_destroy(pool_t *pool) {
+	if(!pool) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	for(uint32_t i = 0; i < pool->count; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->wake);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
+
+uint32_t pool_threads(pool_t *pool) {
+	return pool ? pool->count + 1 : 1;
+}
+
+/* Run fn(arg, i) for every i in [0, count) and return once they
+ * have all finished. Jobs are handed out one index at a time so
+ * uneven jobs still balance out across the workers
+ */
+void pool_run(pool_t *pool, uint32_t count, pool_job_fn fn, void *arg) {
+	if(count == 0) {
+		return;
+	}
+
+	if(!pool || pool->count == 0 || count == 1) {
+		for(uint32_t i = 0; i < count; i++) {
+			fn(arg, i);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->fn = fn;
+	pool->arg = arg;
+	pool->jobs = count;
+	atomic_store(&pool->next, 0);
+	atomic_store(&pool->finished, 0);
+	pool->generation++;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	pool_drain(pool);
+
+	//Wait for the last jobs and for every worker to leave pool_drain so
+	//none of them can pick up an index from the next batch early
+	pthread_mutex_lock(&pool->lock);
+	while(atomic_load(&pool->finished) < count || pool->active) {
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Small fixed size worker pool used to split per row work (encoding,
+ * copying, scaling) across cores. pool_run blocks the caller until every
+ * job index has been processed, the calling thread helps out while it waits.
+ */
+typedef struct pool pool_t;
+
+typedef void (*pool_job_fn)(void *arg, uint32_t index);
+
+pool_t *pool_create(uint32_t threads);
+void pool_destroy(pool_t *pool);
+uint32_t pool_threads(pool_t *pool);
+void pool_run(pool_t *pool, uint32_t count, pool_job_fn fn, void *arg);
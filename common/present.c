@@ -0,0 +1,1147 @@
+#include "./present.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+#include <log.h>
+
+#include "./buffers.h"
+#include "./color.h"
+#include "./cursor.h"
+#include "./fence.h"
+#include "./format.h"
+#include "./handoff.h"
+#include "./modes.h"
+#include "./props.h"
+#include "./rotate.h"
+#include "./route.h"
+#include "./scale.h"
+#include "./timing.h"
+#include "./trace.h"
+
+//First connected connector with at least one mode, 0 if there is none
+uint32_t present_find_connector(int fd) {
+	drmModeResPtr res = drmModeGetResources(fd);
+	uint32_t id = 0;
+
+	if(!res) {
+		return 0;
+	}
+
+	for(int i = 0; i < res->count_connectors && !id; i++) {
+		drmModeConnectorPtr conn = drmModeGetConnector(fd, res->connectors[i]);
+		if(conn && conn->connection == DRM_MODE_CONNECTED && conn->count_modes > 0) {
+			id = conn->connector_id;
+		}
+		drmModeFreeConnector(conn);
+	}
+
+	drmModeFreeResources(res);
+	return id;
+}
+
+/* CRTC the routing solver gives the connector when every connected
+ * connector is routed, so it's the one it's on already if that's valid
+ * and never one another head needs
+ */
+static uint32_t present_pick_crtc(int fd, uint32_t conn_id) {
+	route_t route;
+
+	if(route_probe(fd, &route)) {
+		return 0;
+	}
+
+	route_solve(&route);
+	return route_crtc_for(&route, conn_id);
+}
+
+//Primary plane for the CRTC, preferring whichever plane is on it right now
+static uint32_t present_pick_plane(int fd, uint32_t crtc_id, uint32_t crtc_index) {
+	drmModePlaneResPtr pres = drmModeGetPlaneResources(fd);
+	uint32_t best = 0;
+
+	if(!pres) {
+		return 0;
+	}
+
+	for(uint32_t i = 0; i < pres->count_planes; i++) {
+		drmModePlanePtr plane = drmModeGetPlane(fd, pres->planes[i]);
+		if(!plane) {
+			continue;
+		}
+
+		props_t *props = props_get(fd, plane->plane_id, DRM_MODE_OBJECT_PLANE);
+		uint64_t type = DRM_PLANE_TYPE_OVERLAY;
+		if(props) {
+			props_value(props, "type", &type);
+			props_free(props);
+		}
+
+		if(type == DRM_PLANE_TYPE_PRIMARY && (plane->possible_crtcs & (1 << crtc_index))) {
+			if(!best || plane->crtc_id == crtc_id) {
+				best = plane->plane_id;
+			}
+		}
+		drmModeFreePlane(plane);
+	}
+
+	drmModeFreePlaneResources(pres);
+	return best;
+}
+
+//Plain malloc'd XRGB8888 surface for rendering into off screen
+static bo_t *present_alloc_surface(uint32_t width, uint32_t height) {
+	bo_t *bo = calloc(1, sizeof(*bo));
+	if(!bo) {
+		logger_error("Failed to allocate staging buffer %m");
+		return NULL;
+	}
+
+	bo->width = width;
+	bo->height = height;
+	bo->pitch = width * 4;
+	bo->bpp = 32;
+	bo->size = (uint64_t)bo->pitch * bo->height;
+	bo->buffer = malloc(bo->size);
+	if(!bo->buffer) {
+		logger_error("Failed to allocate staging buffer %m");
+		free(bo);
+		return NULL;
+	}
+
+	return bo;
+}
+
+static void present_free_surface(bo_t *bo) {
+	if(bo) {
+		free(bo->buffer);
+		free(bo);
+	}
+}
+
+/* Frames are rendered at width x height. The CPU scales them to the
+ * full (rotated) mode size if cpu_scale and rotates them if cpu_rotate,
+ * whatever is left the plane does. Staging is the render target when
+ * anything has to happen on the CPU (format conversion included), with
+ * more than one step the frame goes through upscaled and rotated. A
+ * colour transform the CRTC can't run is applied to staging in place
+ */
+static int present_init_buffers(present_t *p) {
+	bool swap = rotate_swaps(p->rotation);
+	bool convert = p->format->fourcc != DRM_FORMAT_XRGB8888;
+	uint32_t width = p->width;
+	uint32_t height = p->height;
+
+	if(p->cpu_scale) {
+		width = swap ? p->mode.vdisplay : p->mode.hdisplay;
+		height = swap ? p->mode.hdisplay : p->mode.vdisplay;
+	}
+
+	if(p->cpu_scale && (p->cpu_rotate || convert)) {
+		p->upscaled = present_alloc_surface(width, height);
+		if(!p->upscaled) {
+			return -1;
+		}
+	}
+
+	if(p->cpu_rotate && swap) {
+		uint32_t tmp = width;
+		width = height;
+		height = tmp;
+	}
+
+	if(p->cpu_rotate && convert) {
+		p->rotated = present_alloc_surface(width, height);
+		if(!p->rotated) {
+			return -1;
+		}
+	}
+
+	if(convert || p->cpu_scale || p->cpu_rotate || (p->color && p->color->cpu)) {
+		p->staging = present_alloc_surface(p->width, p->height);
+		if(!p->staging) {
+			return -1;
+		}
+	}
+
+	for(uint32_t i = 0; i < p->count; i++) {
+		uint32_t handles[4] = { 0 };
+		uint32_t pitches[4] = { 0 };
+		uint32_t offsets[4] = { 0 };
+
+		p->bos[i] = buffer_create_dumb(p->fd, p->format->bpp, height, width);
+		if(!p->bos[i] || bo_map(p->fd, p->bos[i])) {
+			return -1;
+		}
+
+		handles[0] = p->bos[i]->handle;
+		pitches[0] = p->bos[i]->pitch;
+		if(drmModeAddFB2(p->fd, width, height, p->format->fourcc,
+					handles, pitches, offsets, &p->fbs[i], 0)) {
+			logger_error("Failed to add %s FB %m", p->format->name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void present_free_buffers(present_t *p) {
+	for(uint32_t i = 0; i < p->count; i++) {
+		if(p->fbs[i]) {
+			drmModeRmFB(p->fd, p->fbs[i]);
+			p->fbs[i] = 0;
+		}
+
+		if(p->bos[i]) {
+			buffer_unmap(p->bos[i]);
+			buffer_destroy_dumb(p->fd, p->bos[i]);
+			free(p->bos[i]);
+			p->bos[i] = NULL;
+		}
+	}
+
+	present_free_surface(p->staging);
+	present_free_surface(p->upscaled);
+	present_free_surface(p->rotated);
+	p->staging = NULL;
+	p->upscaled = NULL;
+	p->rotated = NULL;
+}
+
+static int present_init_atomic(present_t *p) {
+	p->conn_props = props_get(p->fd, p->conn_id, DRM_MODE_OBJECT_CONNECTOR);
+	p->crtc_props = props_get(p->fd, p->crtc_id, DRM_MODE_OBJECT_CRTC);
+	p->plane_props = props_get(p->fd, p->plane_id, DRM_MODE_OBJECT_PLANE);
+	if(!p->conn_props || !p->crtc_props || !p->plane_props) {
+		return -1;
+	}
+
+	if(drmModeCreatePropertyBlob(p->fd, &p->mode, sizeof(p->mode), &p->mode_blob)) {
+		logger_error("Failed to create mode blob %m");
+		return -1;
+	}
+
+	return 0;
+}
+
+//Plane state on its own, the plane scales the buffers up to the mode
+static void present_add_plane(present_t *p, drmModeAtomicReqPtr req) {
+	props_add(req, p->plane_props, "CRTC_ID", p->crtc_id);
+	props_add(req, p->plane_props, "SRC_X", 0);
+	props_add(req, p->plane_props, "SRC_Y", 0);
+	props_add(req, p->plane_props, "SRC_W", (uint64_t)p->bos[0]->width << 16);
+	props_add(req, p->plane_props, "SRC_H", (uint64_t)p->bos[0]->height << 16);
+	props_add(req, p->plane_props, "CRTC_X", 0);
+	props_add(req, p->plane_props, "CRTC_Y", 0);
+	props_add(req, p->plane_props, "CRTC_W", p->mode.hdisplay);
+	props_add(req, p->plane_props, "CRTC_H", p->mode.vdisplay);
+
+	//Also resets whatever rotation the last client left on the plane
+	if(props_id(p->plane_props, "rotation")) {
+		props_add(req, p->plane_props, "rotation", p->cpu_rotate ? DRM_MODE_ROTATE_0 : p->rotation);
+	}
+}
+
+//Also turns VRR off if the last client left it on and we don't want it
+static void present_add_vrr(present_t *p, drmModeAtomicReqPtr req) {
+	if(props_id(p->crtc_props, "VRR_ENABLED")) {
+		props_add(req, p->crtc_props, "VRR_ENABLED", p->vrr);
+	}
+}
+
+//Full connector/CRTC/plane state
+static void present_add_modeset(present_t *p, drmModeAtomicReqPtr req) {
+	props_add(req, p->conn_props, "CRTC_ID", p->crtc_id);
+	props_add(req, p->crtc_props, "MODE_ID", p->mode_blob);
+	props_add(req, p->crtc_props, "ACTIVE", 1);
+	present_add_vrr(p, req);
+	present_add_plane(p, req);
+}
+
+/* Set up presentation on a connector
+ *
+ * PARAMS:
+ * conn_id - a connected connector
+ * crtc_id - CRTC to drive it with, 0 to pick one
+ * buffers - number of buffers to flip between (2 - PRESENT_MAX_BUFFERS)
+ *
+ * Returns NULL on failure
+ */
+present_t *present_create(int fd, uint32_t conn_id, uint32_t crtc_id, uint32_t buffers) {
+	present_t *p = calloc(1, sizeof(*p));
+	if(!p) {
+		logger_error("Failed to allocate presenter %m");
+		return NULL;
+	}
+
+	p->fd = fd;
+	p->conn_id = conn_id;
+	p->front = -1;
+	p->pending = -1;
+	p->in_fence = -1;
+	p->out_fence = -1;
+	p->modeset = true;
+	p->count = buffers < 2 ? 2 : buffers > PRESENT_MAX_BUFFERS ? PRESENT_MAX_BUFFERS : buffers;
+	p->format = format_info(DRM_FORMAT_XRGB8888);
+	format_dither_init(&p->dither, FORMAT_DITHER_NONE);
+
+	drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+	p->atomic = drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0;
+
+	drmModeResPtr res = drmModeGetResources(fd);
+	drmModeConnectorPtr conn = drmModeGetConnector(fd, conn_id);
+	if(!res || !conn || conn->connection != DRM_MODE_CONNECTED || conn->count_modes < 1) {
+		logger_error("Connector %u isn't connected", conn_id);
+		goto err;
+	}
+
+	p->crtc_id = crtc_id ? crtc_id : present_pick_crtc(fd, conn_id);
+	for(int i = 0; i < res->count_crtcs; i++) {
+		if(res->crtcs[i] == p->crtc_id) {
+			p->crtc_index = i;
+		}
+	}
+
+	if(!p->crtc_id) {
+		logger_error("No CRTC for connector %u", conn_id);
+		goto err;
+	}
+
+	if(mode_pick(conn, &p->mode)) {
+		goto err;
+	}
+	p->width = p->mode.hdisplay;
+	p->height = p->mode.vdisplay;
+	p->scale = 100;
+	p->rotation = DRM_MODE_ROTATE_0;
+	p->saved_crtc = drmModeGetCrtc(fd, p->crtc_id);
+
+	if(p->atomic) {
+		p->plane_id = present_pick_plane(fd, p->crtc_id, p->crtc_index);
+		if(!p->plane_id || present_init_atomic(p)) {
+			logger_warn("Atomic setup failed, falling back to legacy page flips");
+			p->atomic = false;
+		}
+	}
+
+	if(present_init_buffers(p)) {
+		logger_error("Failed to allocate scanout buffers");
+		goto err;
+	}
+
+	timing_init(&p->timing, p->crtc_id, &p->mode);
+	timing_sample(fd, &p->timing);
+
+	drmModeFreeConnector(conn);
+	drmModeFreeResources(res);
+	return p;
+
+err:
+	drmModeFreeConnector(conn);
+	drmModeFreeResources(res);
+	present_destroy(p);
+	return NULL;
+}
+
+void present_destroy(present_t *p) {
+	present_wait(p, 100);
+
+	if(!p->modeset && p->saved_crtc) {
+		drmModeCrtcPtr crtc = p->saved_crtc;
+		if(drmModeSetCrtc(p->fd, crtc->crtc_id, crtc->buffer_id, crtc->x, crtc->y,
+					crtc->buffer_id ? &p->conn_id : NULL, crtc->buffer_id ? 1 : 0,
+					crtc->buffer_id ? &crtc->mode : NULL)) {
+			logger_warn("Failed to restore CRTC %u %m", crtc->crtc_id);
+		}
+	}
+
+	present_free_buffers(p);
+
+	if(p->mode_blob) {
+		drmModeDestroyPropertyBlob(p->fd, p->mode_blob);
+	}
+
+	if(p->in_fence >= 0) {
+		close(p->in_fence);
+	}
+
+	if(p->out_fence >= 0) {
+		close(p->out_fence);
+	}
+
+	props_free(p->conn_props);
+	props_free(p->crtc_props);
+	props_free(p->plane_props);
+	drmModeFreeCrtc(p->saved_crtc);
+	scaler_destroy(p->scaler);
+	color_destroy(p->color);
+	free(p);
+}
+
+/* Turn on OUT_FENCE_PTR for every commit and IN_FENCE_FD for commits
+ * given a fence with present_set_in_fence. Only the atomic vsync path
+ * can carry fences, elsewhere the in fence is waited on before committing
+ *
+ * Returns 0 on success, -1 if the driver doesn't expose the properties
+ */
+int present_enable_explicit_sync(present_t *p) {
+	if(!p->atomic || !props_id(p->crtc_props, "OUT_FENCE_PTR") || !props_id(p->plane_props, "IN_FENCE_FD")) {
+		logger_warn("CRTC %u: no explicit sync support", p->crtc_id);
+		return -1;
+	}
+
+	p->explicit_sync = true;
+	return 0;
+}
+
+//Hand a render completion sync_file to the next commit, takes ownership of fence
+void present_set_in_fence(present_t *p, int fence) {
+	if(p->in_fence >= 0) {
+		close(p->in_fence);
+	}
+	p->in_fence = fence;
+}
+
+/* Take the out fence of the last commit, it signals once that commit's
+ * buffer is on screen (and so the previous one can be reused). The
+ * caller owns the returned fd, -1 if there is none
+ */
+int present_take_out_fence(present_t *p) {
+	int fence = p->out_fence;
+	p->out_fence = -1;
+	return fence;
+}
+
+//A buffer that is neither on screen nor waiting to be, -1 if all are busy
+int present_next_buffer(present_t *p) {
+	for(uint32_t i = 1; i <= p->count; i++) {
+		int buffer = (p->front + i) % p->count;
+		if(buffer != p->front && buffer != p->pending) {
+			return buffer;
+		}
+	}
+
+	return -1;
+}
+
+//Paths that can't carry IN_FENCE_FD wait for the renderer on the CPU instead
+static void present_wait_in_fence(present_t *p) {
+	if(p->in_fence < 0) {
+		return;
+	}
+
+	if(fence_wait(p->in_fence, 1000)) {
+		logger_warn("CRTC %u: in fence didn't signal", p->crtc_id);
+	}
+	close(p->in_fence);
+	p->in_fence = -1;
+}
+
+/* Switch between vsynced and async flips
+ *
+ * Async flips need DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP to go through atomic,
+ * otherwise DRM_CAP_ASYNC_PAGE_FLIP lets them go through the legacy page
+ * flip ioctl (which also works for atomic clients). Without either the
+ * presenter stays vsynced
+ *
+ * Returns 0 if the requested mode is in use, -1 if it fell back to vsync
+ */
+int present_set_mode(present_t *p, present_mode_t mode, const drm_caps_t *caps) {
+	p->present_mode = PRESENT_MODE_VSYNC;
+	p->async_path = PRESENT_ASYNC_NONE;
+
+	if(mode == PRESENT_MODE_VSYNC) {
+		return 0;
+	}
+
+	if(p->atomic && caps->atomic_async_page_flip) {
+		p->async_path = PRESENT_ASYNC_ATOMIC;
+	} else if(caps->async_page_flip) {
+		p->async_path = PRESENT_ASYNC_LEGACY;
+	} else {
+		logger_warn("CRTC %u: driver can't do async flips, staying vsynced", p->crtc_id);
+		p->stats.async_fallbacks++;
+		return -1;
+	}
+
+	p->present_mode = PRESENT_MODE_ASYNC;
+	return 0;
+}
+
+/* Switch the scanout buffers to another format, only possible before
+ * the first commit. Frames are still rendered as XRGB8888 and converted
+ * with the chosen dither kernel, spread over p->pool if one is set
+ *
+ * Returns 0 on success, on failure the presenter is back on XRGB8888
+ */
+int present_set_format(present_t *p, uint32_t fourcc, format_dither_t dither) {
+	const format_info_t *fmt = format_info(fourcc);
+
+	if(!fmt || !p->modeset) {
+		logger_error("CRTC %u: can't switch to format %4.4s now", p->crtc_id, (char *)&fourcc);
+		return -1;
+	}
+
+	present_free_buffers(p);
+	p->format = fmt;
+	format_dither_init(&p->dither, dither);
+	if(!present_init_buffers(p)) {
+		return 0;
+	}
+
+	present_free_buffers(p);
+	p->format = format_info(DRM_FORMAT_XRGB8888);
+	if(present_init_buffers(p)) {
+		logger_error("CRTC %u: lost the scanout buffers", p->crtc_id);
+	}
+	return -1;
+}
+
+//Ask the driver whether the first buffer at its current size can go up as is
+static int present_test_modeset(present_t *p) {
+	drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+	if(!req) {
+		return -ENOMEM;
+	}
+
+	present_add_modeset(p, req);
+	props_add(req, p->plane_props, "FB_ID", p->fbs[0]);
+	int ret = drmModeAtomicCommit(p->fd, req, DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+	drmModeAtomicFree(req);
+
+	return ret ? -errno : 0;
+}
+
+/* Size the buffers for the current scale and rotation. The primary
+ * plane gets as much of the work as a TEST_ONLY commit says it can
+ * take, then the CPU takes over the scaling, the rotation or both.
+ * Legacy modesetting can't do either on the plane
+ *
+ * Returns 0 on success, on failure the presenter is back at native size
+ * and unrotated
+ */
+static int present_configure(present_t *p) {
+	static const struct { bool scale, rotate; } tries[] = {
+		{ false, false }, { true, false }, { false, true }, { true, true },
+	};
+	bool swap = rotate_swaps(p->rotation);
+	uint32_t full_width = swap ? p->mode.vdisplay : p->mode.hdisplay;
+	uint32_t full_height = swap ? p->mode.hdisplay : p->mode.vdisplay;
+	uint32_t supported = p->atomic ? rotate_supported(p->plane_props) : DRM_MODE_ROTATE_0;
+
+	p->width = (full_width * p->scale + 50) / 100;
+	p->height = (full_height * p->scale + 50) / 100;
+	bool scaled = p->width != full_width || p->height != full_height;
+	bool rotated = p->rotation != DRM_MODE_ROTATE_0;
+
+	for(size_t i = 0; i < sizeof(tries) / sizeof(tries[0]); i++) {
+		bool plane_scales = scaled && !tries[i].scale;
+		bool plane_rotates = rotated && !tries[i].rotate;
+
+		//Nothing for the CPU to take over, or the plane can't even claim to rotate
+		if((tries[i].scale && !scaled) || (tries[i].rotate && !rotated) ||
+				(plane_rotates && (supported & p->rotation) != p->rotation) ||
+				((plane_scales || plane_rotates) && !p->atomic)) {
+			continue;
+		}
+
+		if(tries[i].scale && !p->scaler && !(p->scaler = scaler_create())) {
+			continue;
+		}
+
+		present_free_buffers(p);
+		p->cpu_scale = tries[i].scale;
+		p->cpu_rotate = tries[i].rotate;
+		if(present_init_buffers(p)) {
+			continue;
+		}
+
+		int ret = plane_scales || plane_rotates ? present_test_modeset(p) : 0;
+		if(!ret && (scaled || rotated)) {
+			logger_info("CRTC %u: %ux%u -> %ux%u at %u degrees, scaled on the %s, rotated on the %s",
+					p->crtc_id, p->width, p->height, p->mode.hdisplay, p->mode.vdisplay,
+					rotate_degrees(p->rotation), p->cpu_scale ? "CPU" : "plane", p->cpu_rotate ? "CPU" : "plane");
+		}
+
+		if(!ret) {
+			return 0;
+		}
+		logger_debug("CRTC %u: plane refused %s%s (%s)", p->crtc_id, plane_scales ? "scaling " : "",
+				plane_rotates ? "rotation" : "", strerror(-ret));
+	}
+
+	present_free_buffers(p);
+	p->cpu_scale = false;
+	p->cpu_rotate = false;
+	p->scale = 100;
+	p->rotation = DRM_MODE_ROTATE_0;
+	p->width = p->mode.hdisplay;
+	p->height = p->mode.vdisplay;
+	if(present_init_buffers(p)) {
+		logger_error("CRTC %u: lost the scanout buffers", p->crtc_id);
+	}
+	return -1;
+}
+
+/* Render at percent of the (rotated) mode size and have the primary
+ * plane scale the buffers up to full screen, or the CPU with filter if
+ * it can't. Only possible before the first commit
+ *
+ * Returns 0 on success, on failure the presenter is back at native size
+ */
+int present_set_scale(present_t *p, uint32_t percent, scale_filter_t filter) {
+	if(!p->modeset || !percent || percent > 100) {
+		logger_error("CRTC %u: can't render at %u%% now", p->crtc_id, percent);
+		return -1;
+	}
+
+	p->scale = percent;
+	p->filter = filter;
+	return present_configure(p);
+}
+
+/* Show the frames rotated (DRM_MODE_ROTATE_* | DRM_MODE_REFLECT_*),
+ * through the plane rotation property when it lists the rotation and
+ * with a cache blocked CPU rotation into the scanout buffer otherwise.
+ * For 90 and 270 the frames are rendered portrait. Only possible before
+ * the first commit
+ *
+ * Returns 0 on success, on failure the presenter is back unrotated
+ */
+int present_set_rotation(present_t *p, uint32_t rotation) {
+	if(!p->modeset) {
+		logger_error("CRTC %u: can't rotate now", p->crtc_id);
+		return -1;
+	}
+
+	p->rotation = rotation;
+	return present_configure(p);
+}
+
+/* Colour correct the output with transform, which can be set again
+ * at any time (unchanged LUTs aren't uploaded again). The CRTC's
+ * DEGAMMA_LUT, CTM and GAMMA_LUT or its legacy gamma ramp pick it up
+ * with the next commit. If they can't run it the frames are corrected
+ * on the CPU, in staging when there is one (set the transform before
+ * the first commit to get one) and in the scanout buffer otherwise
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int present_set_color(present_t *p, const color_transform_t *transform) {
+	if(!p->color && !(p->color = color_create(p->fd, p->crtc_id, p->atomic ? p->crtc_props : NULL))) {
+		return -1;
+	}
+
+	bool cpu = p->color->cpu;
+	if(color_set(p->color, transform)) {
+		return -1;
+	}
+
+	//Scanout buffers are often write combined, reading them back is slow
+	if(p->color->cpu && !cpu && !p->staging && p->modeset) {
+		present_free_buffers(p);
+		if(present_init_buffers(p)) {
+			logger_error("CRTC %u: lost the scanout buffers", p->crtc_id);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Take the output over without a modeset if it is already showing our
+ * mode: the first commit only flips the plane to our buffer. With copy
+ * the framebuffer that was up is copied into the first frame before it
+ * is rendered. Only possible before the first commit
+ *
+ * Returns 0 if the first commit will be a flip, -1 if it has to be a
+ * modeset
+ */
+int present_enable_handoff(present_t *p, bool copy) {
+	if(!p->modeset || handoff_probe(p->fd, p->conn_id, p->crtc_id, &p->mode, &p->handoff)) {
+		return -1;
+	}
+
+	if(!p->handoff.match) {
+		logger_info("CRTC %u: not running %s already, a modeset is needed", p->crtc_id, p->mode.name);
+		return -1;
+	}
+
+	p->handoff_copy = copy;
+	logger_info("CRTC %u: already running %s, taking over FB %u without a modeset", p->crtc_id,
+			p->mode.name, p->handoff.fb_id);
+	return 0;
+}
+
+/* Run the CRTC with adaptive sync: a vsynced flip goes up as soon as it
+ * is committed instead of on the next fixed refresh, as long as that is
+ * inside the panel's range. The connector has to say vrr_capable and the
+ * CRTC has to have VRR_ENABLED, so atomic only. Only possible before the
+ * first commit. p->vrr_range is filled from the EDID either way
+ *
+ * Returns 0 on success, -1 if the output can't do VRR
+ */
+int present_enable_vrr(present_t *p) {
+	vrr_info_t info;
+
+	if(vrr_probe(p->fd, p->conn_id, &info)) {
+		return -1;
+	}
+	p->vrr_range = info.range;
+
+	if(!p->atomic || !p->modeset) {
+		logger_warn("CRTC %u: VRR needs atomic and has to be set before the first commit", p->crtc_id);
+		return -1;
+	}
+
+	if(!info.capable || !props_id(p->crtc_props, "VRR_ENABLED")) {
+		logger_warn("Connector %u: not VRR capable", p->conn_id);
+		return -1;
+	}
+
+	p->vrr = true;
+	logger_info("CRTC %u: VRR on, panel range %u-%uHz", p->crtc_id, info.range.min_hz, info.range.max_hz);
+	return 0;
+}
+
+/* Work out which scanline the new buffer started on, anything inside
+ * the active area means a visible tear
+ */
+static void present_count_tear(present_t *p) {
+	uint64_t seq, ns;
+	uint64_t period = p->timing.period_ns;
+
+	p->stats.async_flips++;
+	if(!period || drmCrtcGetSequence(p->fd, p->crtc_id, &seq, &ns)) {
+		return;
+	}
+
+	uint64_t line = ((timing_now_ns() - ns) % period) * p->mode.vtotal / period;
+	if(line < p->mode.vdisplay) {
+		p->stats.torn_flips++;
+	}
+}
+
+static int present_commit_async(present_t *p, int buffer) {
+	uint32_t flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_PAGE_FLIP_ASYNC;
+	int ret = 0;
+
+	present_wait_in_fence(p);
+
+	timing_commit(&p->timing);
+	if(p->async_path == PRESENT_ASYNC_ATOMIC) {
+		//Async atomic commits may only touch FB_ID
+		drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+		if(!req) {
+			return -ENOMEM;
+		}
+
+		props_add(req, p->plane_props, "FB_ID", p->fbs[buffer]);
+		ret = drmModeAtomicCommit(p->fd, req, flags | DRM_MODE_ATOMIC_NONBLOCK, p);
+		drmModeAtomicFree(req);
+	} else {
+		ret = drmModePageFlip(p->fd, p->crtc_id, p->fbs[buffer], flags, p);
+	}
+
+	if(ret) {
+		return -errno;
+	}
+
+	present_count_tear(p);
+	p->pending = buffer;
+	return 0;
+}
+
+static int present_commit_atomic(present_t *p, int buffer) {
+	uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+	drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+	if(!req) {
+		return -ENOMEM;
+	}
+
+	//The full plane/CRTC state only has to go in once, after that
+	//a flip is just a new FB_ID. On a handoff the CRTC side is
+	//already right and only the plane has to be taken over
+	if(p->modeset && p->handoff.match) {
+		present_add_vrr(p, req);
+		present_add_plane(p, req);
+	} else if(p->modeset) {
+		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+		present_add_modeset(p, req);
+	}
+	props_add(req, p->plane_props, "FB_ID", p->fbs[buffer]);
+	if(p->cursor) {
+		cursor_add(p->cursor, req);
+	}
+
+	//Changed LUTs ride along with the flip, async flips leave them for the next one
+	int ret = p->color ? color_add(p->color, req, p->modeset) : 0;
+	if(ret) {
+		drmModeAtomicFree(req);
+		return ret;
+	}
+
+	//The kernel waits on the in fence itself, the ioctl never blocks on
+	//rendering. Without explicit sync the plane may not have IN_FENCE_FD
+	//and the CPU has to wait before the flip goes in
+	if(p->explicit_sync && p->in_fence >= 0) {
+		props_add(req, p->plane_props, "IN_FENCE_FD", p->in_fence);
+	} else {
+		present_wait_in_fence(p);
+	}
+
+	if(p->explicit_sync) {
+		if(p->out_fence >= 0) {
+			close(p->out_fence);
+		}
+		p->out_fence = -1;
+		props_add(req, p->crtc_props, "OUT_FENCE_PTR", (uint64_t)(uintptr_t)&p->out_fence);
+	}
+
+	timing_commit(&p->timing);
+	ret = drmModeAtomicCommit(p->fd, req, flags, p);
+	drmModeAtomicFree(req);
+	if(ret) {
+		return -errno;
+	}
+
+	if(p->cursor) {
+		cursor_committed(p->cursor);
+	}
+
+	if(p->color) {
+		color_committed(p->color);
+		color_apply_legacy(p->color, p->modeset);
+	}
+
+	//The commit holds its own reference to the in fence
+	if(p->in_fence >= 0) {
+		close(p->in_fence);
+		p->in_fence = -1;
+	}
+
+	p->pending = buffer;
+	return 0;
+}
+
+static int present_commit_legacy(present_t *p, int buffer) {
+	present_wait_in_fence(p);
+	timing_commit(&p->timing);
+
+	//SetCrtc blocks until the mode is up and sends no event
+	if(p->modeset && !p->handoff.match) {
+		if(drmModeSetCrtc(p->fd, p->crtc_id, p->fbs[buffer], 0, 0, &p->conn_id, 1, &p->mode)) {
+			return -errno;
+		}
+
+		if(p->color) {
+			color_apply_legacy(p->color, true);
+		}
+		p->front = buffer;
+		return 0;
+	}
+
+	if(drmModePageFlip(p->fd, p->crtc_id, p->fbs[buffer], DRM_MODE_PAGE_FLIP_EVENT, p)) {
+		return -errno;
+	}
+
+	if(p->color) {
+		color_apply_legacy(p->color, p->modeset);
+	}
+
+	p->pending = buffer;
+	return 0;
+}
+
+/* Queue buffer for scanout, the first commit also does the modeset
+ *
+ * Returns 0 on success, -EBUSY if a flip is still pending, -EACCES
+ * while suspended (or once DRM master turns out to be gone) or
+ * another negative errno if the commit was rejected
+ */
+int present_commit(present_t *p, int buffer) {
+	if(p->suspended) {
+		return -EACCES;
+	}
+
+	if(p->pending >= 0) {
+		return -EBUSY;
+	}
+
+	int ret;
+	trace_begin("commit", p->crtc_id);
+	if(p->present_mode == PRESENT_MODE_ASYNC && !p->modeset) {
+		ret = present_commit_async(p, buffer);
+
+		//Drivers can still refuse individual async flips (e.g. after a
+		//format or modifier change), drop back to vsync rather than stall
+		if(ret == -EINVAL) {
+			logger_warn("CRTC %u: async flip rejected, falling back to vsync", p->crtc_id);
+			p->present_mode = PRESENT_MODE_VSYNC;
+			p->async_path = PRESENT_ASYNC_NONE;
+			p->stats.async_fallbacks++;
+		}
+	}
+
+	if(p->present_mode != PRESENT_MODE_ASYNC || p->modeset) {
+		ret = p->atomic ? present_commit_atomic(p, buffer) : present_commit_legacy(p, buffer);
+	}
+
+	//The driver wants a modeset after all (a format or size it can't
+	//flip to), do the full one
+	if(ret == -EINVAL && p->modeset && p->handoff.match) {
+		logger_warn("CRTC %u: handoff flip rejected, doing a full modeset", p->crtc_id);
+		p->handoff.match = false;
+		ret = p->atomic ? present_commit_atomic(p, buffer) : present_commit_legacy(p, buffer);
+	}
+	trace_end("commit", p->crtc_id);
+
+	//Someone else took master without telling us, wait for present_resume
+	if(ret == -EACCES) {
+		logger_warn("CRTC %u: lost DRM master, suspending", p->crtc_id);
+		p->suspended = true;
+		return ret;
+	}
+
+	if(ret) {
+		if(ret != -EBUSY) {
+			logger_error("Commit on CRTC %u failed: %s", p->crtc_id, strerror(-ret));
+		}
+		return ret;
+	}
+
+	p->modeset = false;
+	p->frame++;
+	return 0;
+}
+
+/* Stop committing before DRM master is dropped. The flip in flight
+ * is waited for so the buffer on screen is known, everything else
+ * (buffers, mappings, FB IDs, blobs, the property cache) stays as it is
+ *
+ * Returns 0 on success, -ETIMEDOUT if the pending flip never landed
+ */
+int present_suspend(present_t *p) {
+	int ret = present_wait(p, 100);
+
+	p->suspended = true;
+	return ret;
+}
+
+//Full atomic state with the front buffer, the kernel only does a full modeset if something changed
+static int present_restore_atomic(present_t *p) {
+	drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+	if(!req) {
+		return -ENOMEM;
+	}
+
+	present_add_modeset(p, req);
+	props_add(req, p->plane_props, "FB_ID", p->fbs[p->front]);
+	if(p->cursor) {
+		p->cursor->dirty = true;
+		p->cursor->dirty_fb = true;
+		cursor_add(p->cursor, req);
+	}
+
+	int ret = p->color ? color_add(p->color, req, true) : 0;
+	if(!ret) {
+		ret = drmModeAtomicCommit(p->fd, req, DRM_MODE_ATOMIC_ALLOW_MODESET, NULL) ? -errno : 0;
+	}
+	drmModeAtomicFree(req);
+
+	if(!ret && p->cursor) {
+		cursor_committed(p->cursor);
+	}
+
+	if(!ret && p->color) {
+		color_committed(p->color);
+	}
+
+	return ret;
+}
+
+/* Put the last committed frame back up once DRM master is ours again,
+ * with a single blocking commit (legacy: one SetCrtc). The time from
+ * the call to the frame being up goes into resume_ns
+ *
+ * Returns 0 on success, a negative errno if the commit failed
+ */
+int present_resume(present_t *p) {
+	uint64_t start = timing_now_ns();
+	int ret = 0;
+
+	if(!p->suspended) {
+		return 0;
+	}
+
+	//Nothing was up yet, the first commit does the modeset as usual
+	if(p->front >= 0 && p->atomic) {
+		ret = present_restore_atomic(p);
+	} else if(p->front >= 0) {
+		ret = drmModeSetCrtc(p->fd, p->crtc_id, p->fbs[p->front], 0, 0, &p->conn_id, 1, &p->mode) ? -errno : 0;
+	}
+
+	if(!ret && p->front >= 0 && p->color) {
+		color_apply_legacy(p->color, true);
+	}
+
+	if(ret) {
+		logger_error("CRTC %u: failed to restore the output: %s", p->crtc_id, strerror(-ret));
+		return ret;
+	}
+
+	//The gap isn't a frame interval
+	p->timing.last_ns = 0;
+	p->suspended = false;
+	hist_record(&p->resume_ns, timing_now_ns() - start);
+	return 0;
+}
+
+//Render into the next free buffer and flip to it
+int present_frame(present_t *p) {
+	if(p->suspended) {
+		return -EACCES;
+	}
+
+	if(p->pending >= 0) {
+		return -EBUSY;
+	}
+
+	int back = present_next_buffer(p);
+	bo_t *bo = p->bos[back];
+	if(p->handoff_copy && handoff_copy(p->fd, &p->handoff, p->pool, p->staging ? p->staging : bo)) {
+		logger_warn("CRTC %u: couldn't copy FB %u, starting from scratch", p->crtc_id, p->handoff.fb_id);
+		p->handoff_copy = false;
+	}
+
+	if(p->render) {
+		trace_begin("render", p->crtc_id);
+		p->render(p, p->staging ? p->staging : bo, p->user);
+		trace_end("render", p->crtc_id);
+	}
+	p->handoff_copy = false;
+
+	//Per pixel so it goes on the smallest surface, before scaling
+	if(p->color && p->color->cpu) {
+		uint64_t start = timing_now_ns();
+		trace_begin("color", p->crtc_id);
+		color_apply(p->color, p->pool, p->staging ? p->staging : bo);
+		trace_end("color", p->crtc_id);
+		hist_record(&p->color_ns, timing_now_ns() - start);
+	}
+
+	//Each CPU step writes the next surface, the last one the scanout
+	//buffer unless the format conversion still has to run. A failed
+	//step leaves it stale or half written so nothing gets committed
+	bo_t *frame = p->staging;
+	if(p->cpu_scale) {
+		uint64_t start = timing_now_ns();
+		bo_t *dst = p->upscaled ? p->upscaled : bo;
+		trace_begin("scale", p->crtc_id);
+		int ret = scaler_run(p->scaler, p->pool, p->filter, dst, frame);
+		trace_end("scale", p->crtc_id);
+		if(ret) {
+			logger_error("CRTC %u: failed to scale frame %lu", p->crtc_id, p->frame);
+			return -EINVAL;
+		}
+		hist_record(&p->scale_ns, timing_now_ns() - start);
+		frame = dst;
+	}
+
+	if(p->cpu_rotate) {
+		uint64_t start = timing_now_ns();
+		bo_t *dst = p->rotated ? p->rotated : bo;
+		trace_begin("rotate", p->crtc_id);
+		int ret = rotate_copy(p->pool, p->rotation, dst, frame);
+		trace_end("rotate", p->crtc_id);
+		if(ret) {
+			logger_error("CRTC %u: failed to rotate frame %lu", p->crtc_id, p->frame);
+			return -EINVAL;
+		}
+		hist_record(&p->rotate_ns, timing_now_ns() - start);
+		frame = dst;
+	}
+
+	if(frame && frame != bo) {
+		uint64_t start = timing_now_ns();
+		trace_begin("convert", p->crtc_id);
+		format_convert(p->pool, &p->dither, p->frame, p->format, bo->buffer, bo->pitch,
+				frame->buffer, frame->pitch, bo->width, bo->height);
+		trace_end("convert", p->crtc_id);
+		hist_record(&p->convert, timing_now_ns() - start);
+	}
+
+	return present_commit(p, back);
+}
+
+static void present_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+		unsigned int tv_usec, unsigned int crtc_id, void *data) {
+	present_t *p = data;
+
+	if(!p) {
+		return;
+	}
+
+	uint64_t ns = (uint64_t)tv_sec * 1000000000ull + (uint64_t)tv_usec * 1000ull;
+	uint64_t last = p->timing.last_ns;
+
+	p->front = p->pending;
+	p->pending = -1;
+	timing_flip(&p->timing, sequence, ns);
+
+	//On the timeline where the flip really happened, not when we heard about it
+	trace_instant_at("flip", p->crtc_id, ns);
+	if(last && ns > last) {
+		trace_counter("flip interval us", p->crtc_id, (ns - last) / 1000);
+	}
+}
+
+//Dispatch any queued DRM events for presenters on fd
+int present_handle_events(int fd) {
+	drmEventContext evctx = {
+		.version = 3,
+		.page_flip_handler2 = present_flip_handler,
+	};
+
+	trace_begin("events", 0);
+	int ret = drmHandleEvent(fd, &evctx);
+	trace_end("events", 0);
+	return ret;
+}
+
+//Block until the pending flip (if any) has completed
+int present_wait(present_t *p, int timeout_ms) {
+	struct pollfd pfd = { .fd = p->fd, .events = POLLIN };
+	int ret = 0;
+
+	if(p->pending < 0) {
+		return 0;
+	}
+
+	trace_begin("wait flip", p->crtc_id);
+	while(p->pending >= 0) {
+		ret = poll(&pfd, 1, timeout_ms);
+		if(ret < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if(ret <= 0) {
+			ret = -ETIMEDOUT;
+			break;
+		}
+
+		ret = 0;
+		present_handle_events(p->fd);
+	}
+	trace_end("wait flip", p->crtc_id);
+
+	return ret;
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xf86drmMode.h>
+
+#include "./buffers.h"
+#include "./color.h"
+#include "./cursor.h"
+#include "./drm_common.h"
+#include "./format.h"
+#include "./handoff.h"
+#include "./pool.h"
+#include "./props.h"
+#include "./scale.h"
+#include "./timing.h"
+#include "./vrr.h"
+
+#define PRESENT_MAX_BUFFERS 4
+
+/*
+ * KMS presentation path for one connector/CRTC pair. Buffers are dumb
+ * buffers (XRGB8888 unless present_set_format picks another format)
+ * flipped with atomic commits when the driver supports them and
+ * drmModePageFlip otherwise, every flip is timed through timing_t
+ */
+typedef struct present present_t;
+
+/*
+ * VSYNC flips land on the next vblank. ASYNC flips replace the scanout
+ * buffer immediately (DRM_MODE_PAGE_FLIP_ASYNC) trading tearing for latency
+ */
+typedef enum present_mode {
+	PRESENT_MODE_VSYNC,
+	PRESENT_MODE_ASYNC,
+} present_mode_t;
+
+typedef enum present_async_path {
+	PRESENT_ASYNC_NONE,
+	PRESENT_ASYNC_ATOMIC,
+	PRESENT_ASYNC_LEGACY,
+} present_async_path_t;
+
+typedef struct present_stats {
+	uint64_t async_flips;
+	//Async flips that landed while the active area was being scanned out
+	uint64_t torn_flips;
+	uint64_t async_fallbacks;
+} present_stats_t;
+
+typedef void (*present_render_fn)(present_t *out, bo_t *bo, void *user);
+
+struct present {
+	int fd;
+	bool atomic;
+
+	uint32_t conn_id;
+	uint32_t crtc_id;
+	uint32_t crtc_index;
+	uint32_t plane_id;
+	drmModeModeInfo mode;
+	uint32_t mode_blob;
+	drmModeCrtcPtr saved_crtc;
+
+	//Size the buffers are rendered at, scale percent of the mode (the
+	//other way round when rotated by 90 or 270). Whatever the primary
+	//plane can't do the CPU does: frames go into staging and are scaled
+	//and/or rotated into the scanout buffer
+	uint32_t width;
+	uint32_t height;
+	uint32_t scale;
+	uint32_t rotation;
+	bool cpu_scale;
+	bool cpu_rotate;
+	scale_filter_t filter;
+	scaler_t *scaler;
+	bo_t *upscaled;
+	bo_t *rotated;
+	hist_t scale_ns;
+	hist_t rotate_ns;
+
+	//Colour transform, in the CRTC's colour pipeline when it has one
+	//that can run it and over the rendered frame on the CPU otherwise
+	color_t *color;
+	hist_t color_ns;
+
+	props_t *conn_props;
+	props_t *crtc_props;
+	props_t *plane_props;
+
+	//Scanout format, anything but XRGB8888 is rendered into staging
+	//and converted (dithered) into the scanout buffer on the pool
+	const format_info_t *format;
+	format_dither_map_t dither;
+	bo_t *staging;
+	pool_t *pool;
+	hist_t convert;
+
+	//First commit flips onto the running mode rather than setting it,
+	//with handoff_copy the first frame starts from the old contents
+	handoff_t handoff;
+	bool handoff_copy;
+
+	//Set while DRM master is gone (VT switched away), nothing is
+	//committed until present_resume puts the last frame back up
+	bool suspended;
+	hist_t resume_ns;
+
+	//Adaptive sync, VRR_ENABLED goes in with the first commit so flips
+	//land as soon as they are committed anywhere inside vrr_range
+	bool vrr;
+	vrr_range_t vrr_range;
+
+	bo_t *bos[PRESENT_MAX_BUFFERS];
+	uint32_t fbs[PRESENT_MAX_BUFFERS];
+	uint32_t count;
+	int front;
+	int pending;
+	bool modeset;
+
+	//Explicit sync, in_fence is attached to the next commit as IN_FENCE_FD
+	//and every commit hands back out_fence through OUT_FENCE_PTR
+	bool explicit_sync;
+	int in_fence;
+	int32_t out_fence;
+
+	//Optional hardware cursor on the same CRTC, pending cursor moves
+	//ride along with vsynced atomic flips instead of hitting -EBUSY
+	cursor_t *cursor;
+
+	present_mode_t present_mode;
+	present_async_path_t async_path;
+	present_stats_t stats;
+
+	uint64_t frame;
+	timing_t timing;
+
+	present_render_fn render;
+	void *user;
+};
+
+uint32_t present_find_connector(int fd);
+present_t *present_create(int fd, uint32_t conn_id, uint32_t crtc_id, uint32_t buffers);
+void present_destroy(present_t *p);
+
+int present_set_mode(present_t *p, present_mode_t mode, const drm_caps_t *caps);
+int present_set_format(present_t *p, uint32_t fourcc, format_dither_t dither);
+int present_set_scale(present_t *p, uint32_t percent, scale_filter_t filter);
+int present_set_rotation(present_t *p, uint32_t rotation);
+int present_set_color(present_t *p, const color_transform_t *transform);
+int present_enable_handoff(present_t *p, bool copy);
+int present_enable_vrr(present_t *p);
+int present_suspend(present_t *p);
+int present_resume(present_t *p);
+int present_enable_explicit_sync(present_t *p);
+void present_set_in_fence(present_t *p, int fence);
+int present_take_out_fence(present_t *p);
+int present_next_buffer(present_t *p);
+int present_frame(present_t *p);
+int present_commit(present_t *p, int buffer);
+int present_wait(present_t *p, int timeout_ms);
+int present_handle_events(int fd);
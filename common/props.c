@@ -0,0 +1,112 @@
+#include "./props.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <log.h>
+
+props_t *props_get(int fd, uint32_t obj_id, uint32_t obj_type) {
+	drmModeObjectPropertiesPtr objs = drmModeObjectGetProperties(fd, obj_id, obj_type);
+	if(!objs) {
+		logger_error("Failed to get properties for object %u %m", obj_id);
+		return NULL;
+	}
+
+	props_t *props = calloc(1, sizeof(*props));
+	if(!props) {
+		logger_error("Failed to allocate property cache %m");
+		drmModeFreeObjectProperties(objs);
+		return NULL;
+	}
+
+	props->obj_id = obj_id;
+	props->obj_type = obj_type;
+	props->info = calloc(objs->count_props, sizeof(*props->info));
+	props->values = calloc(objs->count_props, sizeof(*props->values));
+	if(objs->count_props && (!props->info || !props->values)) {
+		logger_error("Failed to allocate property cache %m");
+		drmModeFreeObjectProperties(objs);
+		props_free(props);
+		return NULL;
+	}
+
+	for(uint32_t i = 0; i < objs->count_props; i++) {
+		drmModePropertyPtr prop = drmModeGetProperty(fd, objs->props[i]);
+		if(!prop) {
+			logger_warn("Failed to get property %u %m", objs->props[i]);
+			continue;
+		}
+
+		props->info[props->count] = prop;
+		props->values[props->count] = objs->prop_values[i];
+		props->count++;
+	}
+
+	drmModeFreeObjectProperties(objs);
+	return props;
+}
+
+void props_free(props_t *props) {
+	if(!props) {
+		return;
+	}
+
+	for(uint32_t i = 0; i < props->count; i++) {
+		drmModeFreeProperty(props->info[i]);
+	}
+
+	free(props->info);
+	free(props->values);
+	free(props);
+}
+
+static int props_index(const props_t *props, const char *name) {
+	for(uint32_t i = 0; i < props->count; i++) {
+		if(strcmp(props->info[i]->name, name) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+drmModePropertyPtr props_info(const props_t *props, const char *name) {
+	int i = props_index(props, name);
+	return i < 0 ? NULL : props->info[i];
+}
+
+//Returns 0 if the object doesn't have the property
+uint32_t props_id(const props_t *props, const char *name) {
+	int i = props_index(props, name);
+	return i < 0 ? 0 : props->info[i]->prop_id;
+}
+
+int props_value(const props_t *props, const char *name, uint64_t *value) {
+	int i = props_index(props, name);
+	if(i < 0) {
+		return -1;
+	}
+
+	*value = props->values[i];
+	return 0;
+}
+
+/* Add name = value for this object to an atomic request
+ *
+ * Returns:
+ * >= 0 on success (the request's cursor)
+ * -1 if the object has no such property
+ * < -1 if libdrm failed to grow the request
+ */
+int props_add(drmModeAtomicReqPtr req, const props_t *props, const char *name, uint64_t value) {
+	uint32_t id = props_id(props, name);
+	if(!id) {
+		logger_debug("Object %u has no property %s", props->obj_id, name);
+		return -1;
+	}
+
+	int ret = drmModeAtomicAddProperty(req, props->obj_id, id, value);
+	return ret < 0 ? -2 : ret;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+#include <xf86drmMode.h>
+
+/*
+ * Cache of a KMS object's properties so atomic requests can be built
+ * by name without calling drmModeGetProperty on every commit
+ */
+typedef struct props {
+	uint32_t obj_id;
+	uint32_t obj_type;
+	uint32_t count;
+	drmModePropertyPtr *info;
+	uint64_t *values;
+} props_t;
+
+props_t *props_get(int fd, uint32_t obj_id, uint32_t obj_type);
+void props_free(props_t *props);
+
+drmModePropertyPtr props_info(const props_t *props, const char *name);
+uint32_t props_id(const props_t *props, const char *name);
+int props_value(const props_t *props, const char *name, uint64_t *value);
+int props_add(drmModeAtomicReqPtr req, const props_t *props, const char *name, uint64_t value);
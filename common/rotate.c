@@ -0,0 +1,272 @@
+#include "./rotate.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <log.h>
+
+#include "./buffers.h"
+#include "./pool.h"
+#include "./props.h"
+
+//SSE2 is part of x86-64 so there is nothing to check at runtime
+#ifdef __SSE2__
+#include <emmintrin.h>
+#define ROTATE_HAVE_SSE2 1
+#endif
+
+//Square tiles, one source and one destination tile fit in L1 together
+#define ROTATE_TILE 32
+
+/* Parse a comma separated list of 0, 90, 180, 270, reflect-x and
+ * reflect-y, e.g. "90,reflect-x"
+ *
+ * Returns 0 on success, -1 for anything else
+ */
+int rotate_from_str(const char *str, uint32_t *rotation) {
+	uint32_t angle = DRM_MODE_ROTATE_0;
+	uint32_t reflect = 0;
+
+	while(*str) {
+		size_t len = strcspn(str, ",");
+
+		if(len == 1 && strncmp(str, "0", len) == 0) {
+			angle = DRM_MODE_ROTATE_0;
+		} else if(len == 2 && strncmp(str, "90", len) == 0) {
+			angle = DRM_MODE_ROTATE_90;
+		} else if(len == 3 && strncmp(str, "180", len) == 0) {
+			angle = DRM_MODE_ROTATE_180;
+		} else if(len == 3 && strncmp(str, "270", len) == 0) {
+			angle = DRM_MODE_ROTATE_270;
+		} else if(len == 9 && strncmp(str, "reflect-x", len) == 0) {
+			reflect |= DRM_MODE_REFLECT_X;
+		} else if(len == 9 && strncmp(str, "reflect-y", len) == 0) {
+			reflect |= DRM_MODE_REFLECT_Y;
+		} else {
+			return -1;
+		}
+
+		str += len + (str[len] == ',');
+	}
+
+	*rotation = angle | reflect;
+	return 0;
+}
+
+uint32_t rotate_degrees(uint32_t rotation) {
+	switch(rotation & DRM_MODE_ROTATE_MASK) {
+	case DRM_MODE_ROTATE_90:
+		return 90;
+	case DRM_MODE_ROTATE_180:
+		return 180;
+	case DRM_MODE_ROTATE_270:
+		return 270;
+	default:
+		return 0;
+	}
+}
+
+//Whether the framebuffer is the other way round from the display
+bool rotate_swaps(uint32_t rotation) {
+	return rotation & (DRM_MODE_ROTATE_90 | DRM_MODE_ROTATE_270);
+}
+
+/* Rotation bits the plane accepts, from the enum of its bitmask
+ * rotation property (each enum value is a bit number). Planes without
+ * the property can only do DRM_MODE_ROTATE_0
+ */
+uint32_t rotate_supported(const props_t *plane_props) {
+	drmModePropertyPtr prop = plane_props ? props_info(plane_props, "rotation") : NULL;
+	uint32_t supported = DRM_MODE_ROTATE_0;
+
+	if(!prop || !(prop->flags & DRM_MODE_PROP_BITMASK)) {
+		return supported;
+	}
+
+	for(int i = 0; i < prop->count_enums; i++) {
+		if(prop->enums[i].value < 32) {
+			supported |= 1u << prop->enums[i].value;
+		}
+	}
+
+	return supported;
+}
+
+/*
+ * Every rotation/reflection is an optional transpose followed by
+ * optional flips of the source axes:
+ *
+ * plain      dst(x, y) = src(fx(x), fy(y))
+ * transposed dst(x, y) = src(fx(y), fy(x))
+ *
+ * where fx(v) is v or src width - 1 - v when flip_x is set (fy the same
+ * for height). Rotation is counter clockwise like the plane property
+ */
+typedef struct rotate_job {
+	bool transpose;
+	bool flip_x;
+	bool flip_y;
+	uint8_t *dst;
+	const uint8_t *src;
+	uint32_t dst_pitch;
+	uint32_t src_pitch;
+	uint32_t dst_width;
+	uint32_t dst_height;
+	uint32_t src_width;
+	uint32_t src_height;
+} rotate_job_t;
+
+static inline const uint32_t *rotate_src_row(const rotate_job_t *job, uint32_t sy) {
+	if(job->flip_y) {
+		sy = job->src_height - 1 - sy;
+	}
+	return (const uint32_t *)(job->src + (size_t)sy * job->src_pitch);
+}
+
+static inline uint32_t rotate_src_col(const rotate_job_t *job, uint32_t sx) {
+	return job->flip_x ? job->src_width - 1 - sx : sx;
+}
+
+//No transpose, rows map to rows and at most get reversed
+static void rotate_rows(void *arg, uint32_t index) {
+	rotate_job_t *job = arg;
+	uint32_t y0 = index * ROTATE_TILE;
+	uint32_t y1 = y0 + ROTATE_TILE < job->dst_height ? y0 + ROTATE_TILE : job->dst_height;
+
+	for(uint32_t y = y0; y < y1; y++) {
+		const uint32_t *src = rotate_src_row(job, y);
+		uint32_t *dst = (uint32_t *)(job->dst + (size_t)y * job->dst_pitch);
+		uint32_t x = 0;
+
+		if(!job->flip_x) {
+			memcpy(dst, src, (size_t)job->dst_width * 4);
+			continue;
+		}
+
+#ifdef ROTATE_HAVE_SSE2
+		for(; x + 4 <= job->dst_width; x += 4) {
+			__m128i px = _mm_loadu_si128((const __m128i *)(src + job->src_width - 4 - x));
+			_mm_storeu_si128((__m128i *)(dst + x), _mm_shuffle_epi32(px, _MM_SHUFFLE(0, 1, 2, 3)));
+		}
+#endif
+		for(; x < job->dst_width; x++) {
+			dst[x] = src[job->src_width - 1 - x];
+		}
+	}
+}
+
+#ifdef ROTATE_HAVE_SSE2
+/* One 4x4 block of the transpose. Row i of the block is source row
+ * fy(x + i) read across fx(y) .. fx(y + 3), reversed into order when
+ * flip_x walks it backwards, then the block is transposed in registers
+ * so each destination row gets one 16 byte store
+ */
+static inline void rotate_block4(const rotate_job_t *job, uint32_t x, uint32_t y) {
+	uint32_t sx = job->flip_x ? job->src_width - 4 - y : y;
+	__m128i r[4];
+
+	for(uint32_t i = 0; i < 4; i++) {
+		r[i] = _mm_loadu_si128((const __m128i *)(rotate_src_row(job, x + i) + sx));
+		if(job->flip_x) {
+			r[i] = _mm_shuffle_epi32(r[i], _MM_SHUFFLE(0, 1, 2, 3));
+		}
+	}
+
+	__m128i t0 = _mm_unpacklo_epi32(r[0], r[1]);
+	__m128i t1 = _mm_unpacklo_epi32(r[2], r[3]);
+	__m128i t2 = _mm_unpackhi_epi32(r[0], r[1]);
+	__m128i t3 = _mm_unpackhi_epi32(r[2], r[3]);
+
+	uint8_t *dst = job->dst + (size_t)y * job->dst_pitch + x * 4;
+	_mm_storeu_si128((__m128i *)(dst), _mm_unpacklo_epi64(t0, t1));
+	_mm_storeu_si128((__m128i *)(dst + job->dst_pitch), _mm_unpackhi_epi64(t0, t1));
+	_mm_storeu_si128((__m128i *)(dst + 2 * (size_t)job->dst_pitch), _mm_unpacklo_epi64(t2, t3));
+	_mm_storeu_si128((__m128i *)(dst + 3 * (size_t)job->dst_pitch), _mm_unpackhi_epi64(t2, t3));
+}
+#endif
+
+/* Transposed copy of one band of destination rows, a tile at a time.
+ * Walking a destination row reads a source column, so without tiles
+ * every pixel would touch a new cache line (and TLB entry) of source
+ */
+static void rotate_transpose_rows(void *arg, uint32_t index) {
+	rotate_job_t *job = arg;
+	uint32_t y0 = index * ROTATE_TILE;
+	uint32_t y1 = y0 + ROTATE_TILE < job->dst_height ? y0 + ROTATE_TILE : job->dst_height;
+
+	for(uint32_t x0 = 0; x0 < job->dst_width; x0 += ROTATE_TILE) {
+		uint32_t x1 = x0 + ROTATE_TILE < job->dst_width ? x0 + ROTATE_TILE : job->dst_width;
+		//Corner of the tile the 4x4 blocks cover
+		uint32_t x4 = x0;
+		uint32_t y4 = y0;
+
+#ifdef ROTATE_HAVE_SSE2
+		x4 = x0 + ((x1 - x0) & ~3u);
+		y4 = y0 + ((y1 - y0) & ~3u);
+		for(uint32_t y = y0; y < y4; y += 4) {
+			for(uint32_t x = x0; x < x4; x += 4) {
+				rotate_block4(job, x, y);
+			}
+		}
+#endif
+
+		//Whatever the blocks didn't cover, one pixel at a time
+		for(uint32_t y = y0; y < y1; y++) {
+			uint32_t *dst = (uint32_t *)(job->dst + (size_t)y * job->dst_pitch);
+			uint32_t sx = rotate_src_col(job, y);
+
+			for(uint32_t x = y < y4 ? x4 : x0; x < x1; x++) {
+				dst[x] = rotate_src_row(job, x)[sx];
+			}
+		}
+	}
+}
+
+/* Copy src into dst rotated by rotation, the band of rows is spread
+ * over the pool. dst has to be src's size, with width and height
+ * swapped for 90 and 270, and both 32 bpp
+ *
+ * Returns 0 on success, -1 if the surfaces don't fit together
+ */
+int rotate_copy(pool_t *pool, uint32_t rotation, bo_t *dst, const bo_t *src) {
+	bool transpose = rotate_swaps(rotation);
+	rotate_job_t job = {
+		.transpose = transpose,
+		.dst = dst->buffer,
+		.src = src->buffer,
+		.dst_pitch = dst->pitch,
+		.src_pitch = src->pitch,
+		.dst_width = transpose ? src->height : src->width,
+		.dst_height = transpose ? src->width : src->height,
+		.src_width = src->width,
+		.src_height = src->height,
+	};
+
+	switch(rotation & DRM_MODE_ROTATE_MASK) {
+	case DRM_MODE_ROTATE_90:
+		job.flip_x = true;
+		break;
+	case DRM_MODE_ROTATE_180:
+		job.flip_x = true;
+		job.flip_y = true;
+		break;
+	case DRM_MODE_ROTATE_270:
+		job.flip_y = true;
+		break;
+	}
+
+	//Reflections happen in framebuffer space, before the rotation
+	job.flip_x ^= !!(rotation & DRM_MODE_REFLECT_X);
+	job.flip_y ^= !!(rotation & DRM_MODE_REFLECT_Y);
+
+	if(src->bpp != 32 || dst->bpp != 32 || dst->width < job.dst_width || dst->height < job.dst_height) {
+		logger_error("Can't rotate %ux%u into %ux%u", src->width, src->height, dst->width, dst->height);
+		return -1;
+	}
+
+	pool_run(pool, (job.dst_height + ROTATE_TILE - 1) / ROTATE_TILE,
+			transpose ? rotate_transpose_rows : rotate_rows, &job);
+	return 0;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "./buffers.h"
+#include "./pool.h"
+#include "./props.h"
+
+/*
+ * Rotations use the plane rotation property's own bits, one of
+ * DRM_MODE_ROTATE_0/90/180/270 (counter clockwise) optionally or'd with
+ * DRM_MODE_REFLECT_X/Y, which are applied to the framebuffer first
+ */
+int rotate_from_str(const char *str, uint32_t *rotation);
+uint32_t rotate_degrees(uint32_t rotation);
+bool rotate_swaps(uint32_t rotation);
+uint32_t rotate_supported(const props_t *plane_props);
+int rotate_copy(pool_t *pool, uint32_t rotation, bo_t *dst, const bo_t *src);
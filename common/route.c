@@ -0,0 +1,275 @@
+#include "./route.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <log.h>
+
+static int route_crtc_index(const route_t *route, uint32_t crtc_id) {
+	for(uint32_t i = 0; i < route->count_crtcs; i++) {
+		if(route->crtcs[i] == crtc_id) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static int route_encoder_index(const route_t *route, uint32_t encoder_id) {
+	for(uint32_t i = 0; i < route->count_encoders; i++) {
+		if(route->encoders[i].id == encoder_id) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/* Read every CRTC, encoder and connected connector and where they are
+ * routed right now
+ *
+ * Returns 0 on success, -1 if the resources couldn't be read
+ */
+int route_probe(int fd, route_t *route) {
+	drmModeResPtr res = drmModeGetResources(fd);
+	if(!res) {
+		logger_error("Failed to get resources %m");
+		return -1;
+	}
+
+	memset(route, 0, sizeof(*route));
+	for(int i = 0; i < res->count_crtcs && i < ROUTE_MAX_CRTCS; i++) {
+		route->crtcs[route->count_crtcs++] = res->crtcs[i];
+	}
+
+	int current[ROUTE_MAX_ENCODERS];
+	for(int i = 0; i < res->count_encoders && i < ROUTE_MAX_ENCODERS; i++) {
+		drmModeEncoderPtr enc = drmModeGetEncoder(fd, res->encoders[i]);
+		route_encoder_t *e = &route->encoders[route->count_encoders];
+
+		e->id = res->encoders[i];
+		current[route->count_encoders] = -1;
+		if(enc) {
+			e->possible_crtcs = enc->possible_crtcs;
+			e->possible_clones = enc->possible_clones;
+			current[route->count_encoders] = route_crtc_index(route, enc->crtc_id);
+			drmModeFreeEncoder(enc);
+		}
+		route->count_encoders++;
+	}
+
+	for(int i = 0; i < res->count_connectors && route->count_outputs < ROUTE_MAX_OUTPUTS; i++) {
+		drmModeConnectorPtr conn = drmModeGetConnector(fd, res->connectors[i]);
+		if(!conn || conn->connection != DRM_MODE_CONNECTED || conn->count_modes < 1) {
+			drmModeFreeConnector(conn);
+			continue;
+		}
+
+		route_output_t *out = &route->outputs[route->count_outputs++];
+		out->conn_id = conn->connector_id;
+		out->current_encoder = route_encoder_index(route, conn->encoder_id);
+		out->current_crtc = out->current_encoder >= 0 ? current[out->current_encoder] : -1;
+		out->crtc = -1;
+		out->encoder = -1;
+		out->clone_of = -1;
+
+		for(int j = 0; j < conn->count_encoders; j++) {
+			int e = route_encoder_index(route, conn->encoders[j]);
+			if(e >= 0) {
+				out->encoders |= 1ull << e;
+			}
+		}
+		drmModeFreeConnector(conn);
+	}
+
+	drmModeFreeResources(res);
+	return 0;
+}
+
+//CRTCs any of the output's encoders can drive
+static uint32_t route_reachable(const route_t *route, const route_output_t *out) {
+	uint32_t crtcs = 0;
+
+	for(uint64_t mask = out->encoders; mask; mask &= mask - 1) {
+		crtcs |= route->encoders[__builtin_ctzll(mask)].possible_crtcs;
+	}
+
+	return crtcs & ((route->count_crtcs < 32 ? 1u << route->count_crtcs : 0) - 1);
+}
+
+/* Kuhn's augmenting path search from output u. The output's current CRTC
+ * is tried first so a path only moves outputs that have to move
+ */
+static bool route_augment(route_t *route, const uint32_t *reach, int *owner, uint32_t u, uint32_t *seen) {
+	route_output_t *out = &route->outputs[u];
+	uint32_t candidates = reach[u] & ~*seen;
+
+	while(candidates) {
+		int c = out->current_crtc >= 0 && (candidates & (1u << out->current_crtc)) ?
+			out->current_crtc : __builtin_ctz(candidates);
+		candidates &= ~(1u << c);
+		*seen |= 1u << c;
+
+		if(owner[c] < 0 || route_augment(route, reach, owner, owner[c], seen)) {
+			owner[c] = u;
+			out->crtc = c;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+//Encoder of out that can drive crtc and isn't taken, preferring the current one
+static int route_pick_encoder(const route_t *route, const route_output_t *out, int crtc, uint64_t used) {
+	uint64_t usable = 0;
+
+	for(uint64_t mask = out->encoders & ~used; mask; mask &= mask - 1) {
+		int e = __builtin_ctzll(mask);
+		if(route->encoders[e].possible_crtcs & (1u << crtc)) {
+			usable |= 1ull << e;
+		}
+	}
+
+	if(out->current_encoder >= 0 && (usable & (1ull << out->current_encoder))) {
+		return out->current_encoder;
+	}
+
+	return usable ? __builtin_ctzll(usable) : -1;
+}
+
+/* Give every connected output a CRTC, keeping existing assignments
+ * wherever a maximum matching allows. Outputs left over once the CRTCs
+ * run out are cloned onto a matched output when their encoders are
+ * clone compatible (the caller still has to give them the same mode)
+ *
+ * Returns the number of outputs that got a CRTC, own or shared
+ */
+int route_solve(route_t *route) {
+	uint32_t reach[ROUTE_MAX_OUTPUTS];
+	int owner[ROUTE_MAX_CRTCS];
+	uint64_t used = 0;
+	int lit = 0;
+
+	for(uint32_t c = 0; c < ROUTE_MAX_CRTCS; c++) {
+		owner[c] = -1;
+	}
+
+	//Keep whatever is already lit and valid, first come first served
+	for(uint32_t u = 0; u < route->count_outputs; u++) {
+		route_output_t *out = &route->outputs[u];
+
+		reach[u] = route_reachable(route, out);
+		out->crtc = -1;
+		out->encoder = -1;
+		out->clone_of = -1;
+
+		int c = out->current_crtc;
+		if(c >= 0 && (reach[u] & (1u << c)) && owner[c] < 0) {
+			owner[c] = u;
+			out->crtc = c;
+		}
+	}
+
+	for(uint32_t u = 0; u < route->count_outputs; u++) {
+		uint32_t seen = 0;
+		if(route->outputs[u].crtc < 0) {
+			route_augment(route, reach, owner, u, &seen);
+		}
+	}
+
+	for(uint32_t u = 0; u < route->count_outputs; u++) {
+		route_output_t *out = &route->outputs[u];
+		if(out->crtc < 0) {
+			continue;
+		}
+
+		//Every encoder that reaches the CRTC is taken, a CRTC alone can't light it
+		out->encoder = route_pick_encoder(route, out, out->crtc, used);
+		if(out->encoder < 0) {
+			owner[out->crtc] = -1;
+			out->crtc = -1;
+			continue;
+		}
+		used |= 1ull << out->encoder;
+		lit++;
+	}
+
+	//Out of CRTCs, share one with a matched output if the encoders allow it
+	for(uint32_t u = 0; u < route->count_outputs; u++) {
+		route_output_t *out = &route->outputs[u];
+
+		for(uint32_t v = 0; v < route->count_outputs && out->crtc < 0; v++) {
+			const route_output_t *host = &route->outputs[v];
+			if(host->crtc < 0 || host->clone_of >= 0 || host->encoder < 0) {
+				continue;
+			}
+
+			int e = route_pick_encoder(route, out, host->crtc, used);
+			if(e >= 0 && (route->encoders[host->encoder].possible_clones & (1u << e))) {
+				out->crtc = host->crtc;
+				out->encoder = e;
+				out->clone_of = v;
+				used |= 1ull << e;
+				lit++;
+			}
+		}
+	}
+
+	return lit;
+}
+
+const route_output_t *route_find(const route_t *route, uint32_t conn_id) {
+	for(uint32_t i = 0; i < route->count_outputs; i++) {
+		if(route->outputs[i].conn_id == conn_id) {
+			return &route->outputs[i];
+		}
+	}
+
+	return NULL;
+}
+
+//CRTC the solver gave conn_id, 0 if it's dark or not connected
+uint32_t route_crtc_for(const route_t *route, uint32_t conn_id) {
+	const route_output_t *out = route_find(route, conn_id);
+	return out && out->crtc >= 0 ? route->crtcs[out->crtc] : 0;
+}
+
+uint32_t route_encoder_for(const route_t *route, uint32_t conn_id) {
+	const route_output_t *out = route_find(route, conn_id);
+	return out && out->encoder >= 0 ? route->encoders[out->encoder].id : 0;
+}
+
+//Lit outputs that would move off the CRTC they're on now
+uint32_t route_changes(const route_t *route) {
+	uint32_t changes = 0;
+
+	for(uint32_t i = 0; i < route->count_outputs; i++) {
+		const route_output_t *out = &route->outputs[i];
+		if(out->current_crtc >= 0 && out->crtc != out->current_crtc) {
+			changes++;
+		}
+	}
+
+	return changes;
+}
+
+void route_log(const route_t *route) {
+	for(uint32_t i = 0; i < route->count_outputs; i++) {
+		const route_output_t *out = &route->outputs[i];
+
+		if(out->crtc < 0) {
+			logger_warn("Connector %u: no CRTC left, stays dark", out->conn_id);
+		} else if(out->clone_of >= 0) {
+			logger_info("Connector %u: clone of connector %u on CRTC %u", out->conn_id,
+					route->outputs[out->clone_of].conn_id, route->crtcs[out->crtc]);
+		} else {
+			logger_info("Connector %u: encoder %u -> CRTC %u%s", out->conn_id,
+					out->encoder >= 0 ? route->encoders[out->encoder].id : 0, route->crtcs[out->crtc],
+					out->current_crtc >= 0 && out->current_crtc != out->crtc ? " (moved)" : "");
+		}
+	}
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//possible_crtcs and possible_clones are 32 bit masks in the kernel uapi
+#define ROUTE_MAX_CRTCS 32
+#define ROUTE_MAX_ENCODERS 32
+#define ROUTE_MAX_OUTPUTS 64
+
+typedef struct route_encoder {
+	uint32_t id;
+	uint32_t possible_crtcs;
+	//Bitmask of encoder indexes this one can share a CRTC with
+	uint32_t possible_clones;
+} route_encoder_t;
+
+/*
+ * A connected connector. encoders is a bitmask of indexes into
+ * route_t.encoders, current_* is what it's driven by right now (-1 for
+ * nothing) and crtc/encoder/clone_of are filled in by route_solve
+ */
+typedef struct route_output {
+	uint32_t conn_id;
+	uint64_t encoders;
+	int current_crtc;
+	int current_encoder;
+
+	int crtc;
+	int encoder;
+	//Output whose CRTC this one shares, -1 if it has its own
+	int clone_of;
+} route_output_t;
+
+/*
+ * Connector -> encoder -> CRTC routing as a bipartite matching between
+ * connected connectors and CRTCs. route_probe does the ioctls,
+ * route_solve is pure and cheap enough to rerun on every hotplug
+ */
+typedef struct route {
+	uint32_t crtcs[ROUTE_MAX_CRTCS];
+	uint32_t count_crtcs;
+	route_encoder_t encoders[ROUTE_MAX_ENCODERS];
+	uint32_t count_encoders;
+	route_output_t outputs[ROUTE_MAX_OUTPUTS];
+	uint32_t count_outputs;
+} route_t;
+
+int route_probe(int fd, route_t *route);
+int route_solve(route_t *route);
+const route_output_t *route_find(const route_t *route, uint32_t conn_id);
+uint32_t route_crtc_for(const route_t *route, uint32_t conn_id);
+uint32_t route_encoder_for(const route_t *route, uint32_t conn_id);
+uint32_t route_changes(const route_t *route);
+void route_log(const route_t *route);
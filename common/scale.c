@@ -0,0 +1,398 @@
+#include "./scale.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <log.h>
+
+#include "./buffers.h"
+#include "./pool.h"
+
+//SSE2 is part of x86-64 so there is nothing to check at runtime
+#ifdef __SSE2__
+#include <emmintrin.h>
+#define SCALE_HAVE_SSE2 1
+#endif
+
+//Output rows per job
+#define SCALE_ROWS 32
+
+//Weights are Q14, the intermediate rows hold 8 bit values as Q6
+#define SCALE_WEIGHT_BITS 14
+#define SCALE_MID_BITS 6
+
+int scale_filter_from_str(const char *str, scale_filter_t *filter) {
+	if(strcmp(str, "nearest") == 0) {
+		*filter = SCALE_NEAREST;
+	} else if(strcmp(str, "bilinear") == 0) {
+		*filter = SCALE_BILINEAR;
+	} else if(strcmp(str, "bicubic") == 0) {
+		*filter = SCALE_BICUBIC;
+	} else if(strcmp(str, "lanczos") == 0) {
+		*filter = SCALE_LANCZOS;
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+scaler_t *scaler_create(void) {
+	scaler_t *scaler = calloc(1, sizeof(*scaler));
+	if(!scaler) {
+		logger_error("Failed to allocate scaler %m");
+	}
+
+	return scaler;
+}
+
+static void scale_axis_free(scale_axis_t *axis) {
+	free(axis->start);
+	free(axis->weights);
+	memset(axis, 0, sizeof(*axis));
+}
+
+void scaler_destroy(scaler_t *scaler) {
+	if(!scaler) {
+		return;
+	}
+
+	for(uint32_t i = 0; i < SCALE_CACHE; i++) {
+		scale_axis_free(&scaler->cache[i]);
+	}
+	free(scaler);
+}
+
+//Kernel support in source pixels at a 1:1 ratio
+static double scale_radius(scale_filter_t filter) {
+	switch(filter) {
+	case SCALE_BILINEAR:
+		return 1.0;
+	case SCALE_BICUBIC:
+		return 2.0;
+	case SCALE_LANCZOS:
+		return 3.0;
+	default:
+		return 0.5;
+	}
+}
+
+static double scale_kernel(scale_filter_t filter, double x) {
+	x = fabs(x);
+
+	switch(filter) {
+	case SCALE_BILINEAR:
+		return x < 1.0 ? 1.0 - x : 0.0;
+	case SCALE_BICUBIC:
+		//Catmull-Rom, a = -0.5
+		if(x < 1.0) {
+			return (1.5 * x - 2.5) * x * x + 1.0;
+		}
+		return x < 2.0 ? ((-0.5 * x + 2.5) * x - 4.0) * x + 2.0 : 0.0;
+	case SCALE_LANCZOS:
+		if(x < 1e-8) {
+			return 1.0;
+		}
+		return x < 3.0 ? 3.0 * sin(M_PI * x) * sin(M_PI * x / 3.0) / (M_PI * M_PI * x * x) : 0.0;
+	default:
+		return x <= 0.5 ? 1.0 : 0.0;
+	}
+}
+
+/* Build the taps for src -> dst. Downscaling stretches the kernel over
+ * 1/ratio source pixels so it still low passes. Source pixels past the
+ * edges are folded onto the edge pixel and every window is slid inside
+ * the row, so the passes never have to bounds check
+ */
+static int scale_axis_build(scale_axis_t *axis, scale_filter_t filter, uint32_t src, uint32_t dst) {
+	double ratio = (double)src / dst;
+	double stretch = ratio > 1.0 ? ratio : 1.0;
+	double radius = scale_radius(filter) * stretch;
+	double weights[64];
+
+	//An even count lets the SIMD passes take taps two at a time
+	uint32_t taps = filter == SCALE_NEAREST ? 1 : ((uint32_t)ceil(radius * 2) + 1) & ~1u;
+	if(taps > 64) {
+		taps = 64;
+	}
+	if(taps > src) {
+		taps = src;
+	}
+
+	axis->filter = filter;
+	axis->src = src;
+	axis->dst = dst;
+	axis->taps = taps;
+	axis->start = malloc(dst * sizeof(*axis->start));
+	axis->weights = malloc((size_t)dst * taps * sizeof(*axis->weights));
+	if(!axis->start || !axis->weights) {
+		logger_error("Failed to allocate scale coefficients %m");
+		scale_axis_free(axis);
+		return -1;
+	}
+
+	for(uint32_t i = 0; i < dst; i++) {
+		double center = (i + 0.5) * ratio - 0.5;
+		int32_t lo = (int32_t)floor(center - radius) + 1;
+		int32_t hi = (int32_t)floor(center + radius);
+		double total = 0;
+
+		if(filter == SCALE_NEAREST) {
+			lo = hi = (int32_t)floor(center + 0.5);
+		}
+
+		int32_t start = lo < 0 ? 0 : lo;
+		if(start > (int32_t)(src - taps)) {
+			start = src - taps;
+		}
+		memset(weights, 0, sizeof(weights));
+
+		for(int32_t s = lo; s <= hi; s++) {
+			int32_t at = s < 0 ? 0 : s >= (int32_t)src ? (int32_t)src - 1 : s;
+			double w = filter == SCALE_NEAREST ? 1.0 : scale_kernel(filter, (s - center) / stretch);
+
+			//Only the widest downscales can reach past 64 taps, drop the tails
+			if(at - start >= 0 && at - start < (int32_t)taps) {
+				weights[at - start] += w;
+				total += w;
+			}
+		}
+
+		//Round to Q14 and put the rounding error on the biggest tap so
+		//flat areas come out exactly flat
+		int16_t *out = &axis->weights[(size_t)i * taps];
+		int32_t sum = 0;
+		uint32_t biggest = 0;
+		for(uint32_t t = 0; t < taps; t++) {
+			out[t] = (int16_t)lround(weights[t] / total * (1 << SCALE_WEIGHT_BITS));
+			sum += out[t];
+			if(out[t] > out[biggest]) {
+				biggest = t;
+			}
+		}
+		out[biggest] += (1 << SCALE_WEIGHT_BITS) - sum;
+		axis->start[i] = start;
+	}
+
+	return 0;
+}
+
+//Cached taps for src -> dst, rebuilding the least recently used slot on a miss
+static const scale_axis_t *scaler_axis(scaler_t *scaler, scale_filter_t filter, uint32_t src, uint32_t dst) {
+	scale_axis_t *victim = &scaler->cache[0];
+
+	scaler->clock++;
+	for(uint32_t i = 0; i < SCALE_CACHE; i++) {
+		scale_axis_t *axis = &scaler->cache[i];
+		if(axis->start && axis->filter == filter && axis->src == src && axis->dst == dst) {
+			axis->used = scaler->clock;
+			return axis;
+		}
+
+		if(axis->used < victim->used) {
+			victim = axis;
+		}
+	}
+
+	scale_axis_free(victim);
+	if(scale_axis_build(victim, filter, src, dst)) {
+		return NULL;
+	}
+	victim->used = scaler->clock;
+	return victim;
+}
+
+static inline int32_t scale_clamp(int32_t v, int32_t lo, int32_t hi) {
+	return v < lo ? lo : v > hi ? hi : v;
+}
+
+//Horizontal pass, one 8 bit source row into a Q6 row of dst pixels
+static void scale_row_h(const scale_axis_t *h, int16_t *out, const uint8_t *src) {
+	uint32_t taps = h->taps;
+
+#ifdef SCALE_HAVE_SSE2
+	if(!(taps & 1)) {
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i round = _mm_set1_epi32(1 << (SCALE_WEIGHT_BITS - SCALE_MID_BITS - 1));
+
+		for(uint32_t x = 0; x < h->dst; x++) {
+			const uint8_t *s = src + (size_t)h->start[x] * 4;
+			const int16_t *w = &h->weights[(size_t)x * taps];
+			__m128i acc = round;
+
+			//Two pixels per step, channels interleaved so pmaddwd does both taps
+			for(uint32_t t = 0; t < taps; t += 2) {
+				__m128i px = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(s + t * 4)), zero);
+				px = _mm_unpacklo_epi16(px, _mm_srli_si128(px, 8));
+				__m128i wt = _mm_set1_epi32((uint16_t)w[t] | (uint32_t)(uint16_t)w[t + 1] << 16);
+				acc = _mm_add_epi32(acc, _mm_madd_epi16(px, wt));
+			}
+
+			acc = _mm_srai_epi32(acc, SCALE_WEIGHT_BITS - SCALE_MID_BITS);
+			_mm_storel_epi64((__m128i *)(out + x * 4), _mm_packs_epi32(acc, acc));
+		}
+		return;
+	}
+#endif
+
+	for(uint32_t x = 0; x < h->dst; x++) {
+		const uint8_t *s = src + (size_t)h->start[x] * 4;
+		const int16_t *w = &h->weights[(size_t)x * taps];
+
+		for(uint32_t c = 0; c < 4; c++) {
+			int32_t acc = 1 << (SCALE_WEIGHT_BITS - SCALE_MID_BITS - 1);
+			for(uint32_t t = 0; t < taps; t++) {
+				acc += s[t * 4 + c] * w[t];
+			}
+			out[x * 4 + c] = scale_clamp(acc >> (SCALE_WEIGHT_BITS - SCALE_MID_BITS), INT16_MIN, INT16_MAX);
+		}
+	}
+}
+
+//Vertical pass, taps Q6 rows into one 8 bit output row of width pixels
+static void scale_row_v(const int16_t *const *rows, const int16_t *w, uint32_t taps,
+		uint8_t *out, uint32_t width) {
+	const uint32_t shift = SCALE_WEIGHT_BITS + SCALE_MID_BITS;
+	uint32_t x = 0;
+
+#ifdef SCALE_HAVE_SSE2
+	if(!(taps & 1)) {
+		const __m128i round = _mm_set1_epi32(1 << (shift - 1));
+		const int16_t *r[64];
+		__m128i wt[32];
+
+		//Same rows and weights for the whole output row, local copies
+		//so the stores to out (which may alias anything) don't force reloads
+		for(uint32_t t = 0; t < taps; t += 2) {
+			r[t] = rows[t];
+			r[t + 1] = rows[t + 1];
+			wt[t / 2] = _mm_set1_epi32((uint16_t)w[t] | (uint32_t)(uint16_t)w[t + 1] << 16);
+		}
+
+		//Four pixels (16 channels) at a time, rows interleaved in pairs for pmaddwd
+		for(; x + 4 <= width; x += 4) {
+			__m128i acc[4] = { round, round, round, round };
+
+			for(uint32_t t = 0; t < taps; t += 2) {
+				__m128i a0 = _mm_loadu_si128((const __m128i *)(r[t] + x * 4));
+				__m128i b0 = _mm_loadu_si128((const __m128i *)(r[t + 1] + x * 4));
+				__m128i a1 = _mm_loadu_si128((const __m128i *)(r[t] + x * 4 + 8));
+				__m128i b1 = _mm_loadu_si128((const __m128i *)(r[t + 1] + x * 4 + 8));
+				acc[0] = _mm_add_epi32(acc[0], _mm_madd_epi16(_mm_unpacklo_epi16(a0, b0), wt[t / 2]));
+				acc[1] = _mm_add_epi32(acc[1], _mm_madd_epi16(_mm_unpackhi_epi16(a0, b0), wt[t / 2]));
+				acc[2] = _mm_add_epi32(acc[2], _mm_madd_epi16(_mm_unpacklo_epi16(a1, b1), wt[t / 2]));
+				acc[3] = _mm_add_epi32(acc[3], _mm_madd_epi16(_mm_unpackhi_epi16(a1, b1), wt[t / 2]));
+			}
+
+			__m128i lo = _mm_packs_epi32(_mm_srai_epi32(acc[0], shift), _mm_srai_epi32(acc[1], shift));
+			__m128i hi = _mm_packs_epi32(_mm_srai_epi32(acc[2], shift), _mm_srai_epi32(acc[3], shift));
+			_mm_storeu_si128((__m128i *)(out + x * 4), _mm_packus_epi16(lo, hi));
+		}
+	}
+#endif
+
+	for(; x < width; x++) {
+		for(uint32_t c = 0; c < 4; c++) {
+			int32_t acc = 1 << (shift - 1);
+			for(uint32_t t = 0; t < taps; t++) {
+				acc += rows[t][x * 4 + c] * w[t];
+			}
+			out[x * 4 + c] = scale_clamp(acc >> shift, 0, 255);
+		}
+	}
+}
+
+typedef struct scale_job {
+	const scale_axis_t *h;
+	const scale_axis_t *v;
+	uint8_t *dst;
+	const uint8_t *src;
+	uint32_t dst_pitch;
+	uint32_t src_pitch;
+	uint32_t height;
+	bool failed;
+} scale_job_t;
+
+static void scale_nearest_rows(void *arg, uint32_t index) {
+	scale_job_t *job = arg;
+	uint32_t y0 = index * SCALE_ROWS;
+	uint32_t y1 = y0 + SCALE_ROWS < job->height ? y0 + SCALE_ROWS : job->height;
+
+	for(uint32_t y = y0; y < y1; y++) {
+		const uint32_t *src = (const uint32_t *)(job->src + (size_t)job->v->start[y] * job->src_pitch);
+		uint32_t *dst = (uint32_t *)(job->dst + (size_t)y * job->dst_pitch);
+
+		for(uint32_t x = 0; x < job->h->dst; x++) {
+			dst[x] = src[job->h->start[x]];
+		}
+	}
+}
+
+/* Horizontally scale just the source rows this band of output rows
+ * reads, then run the vertical taps over them. Neighbouring bands
+ * redo at most taps - 1 rows each, which beats sharing them between
+ * threads
+ */
+static void scale_filter_rows(void *arg, uint32_t index) {
+	scale_job_t *job = arg;
+	const scale_axis_t *v = job->v;
+	uint32_t y0 = index * SCALE_ROWS;
+	uint32_t y1 = y0 + SCALE_ROWS < job->height ? y0 + SCALE_ROWS : job->height;
+	uint32_t first = v->start[y0];
+	uint32_t count = v->start[y1 - 1] + v->taps - first;
+	size_t stride = (size_t)job->h->dst * 4;
+	const int16_t *rows[64];
+
+	int16_t *mid = malloc(count * stride * sizeof(*mid));
+	if(!mid) {
+		job->failed = true;
+		return;
+	}
+
+	for(uint32_t i = 0; i < count; i++) {
+		scale_row_h(job->h, mid + i * stride, job->src + (size_t)(first + i) * job->src_pitch);
+	}
+
+	for(uint32_t y = y0; y < y1; y++) {
+		for(uint32_t t = 0; t < v->taps; t++) {
+			rows[t] = mid + (v->start[y] - first + t) * stride;
+		}
+		scale_row_v(rows, &v->weights[(size_t)y * v->taps], v->taps,
+				job->dst + (size_t)y * job->dst_pitch, job->h->dst);
+	}
+
+	free(mid);
+}
+
+/* Scale src to fill dst, both 32 bpp. Channels are filtered
+ * independently so ARGB should be premultiplied for the sharper
+ * filters to not bleed colour from transparent pixels
+ *
+ * Returns 0 on success, -1 on a bad surface or out of memory
+ */
+int scaler_run(scaler_t *scaler, pool_t *pool, scale_filter_t filter, bo_t *dst, const bo_t *src) {
+	if(src->bpp != 32 || dst->bpp != 32 || !src->width || !src->height || !dst->width || !dst->height) {
+		logger_error("Can only scale 32 bpp surfaces");
+		return -1;
+	}
+
+	scale_job_t job = {
+		.h = scaler_axis(scaler, filter, src->width, dst->width),
+		.v = scaler_axis(scaler, filter, src->height, dst->height),
+		.dst = dst->buffer,
+		.src = src->buffer,
+		.dst_pitch = dst->pitch,
+		.src_pitch = src->pitch,
+		.height = dst->height,
+	};
+
+	if(!job.h || !job.v) {
+		return -1;
+	}
+
+	pool_run(pool, (dst->height + SCALE_ROWS - 1) / SCALE_ROWS,
+			filter == SCALE_NEAREST ? scale_nearest_rows : scale_filter_rows, &job);
+	return job.failed ? -1 : 0;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "./buffers.h"
+#include "./pool.h"
+
+typedef enum scale_filter {
+	SCALE_NEAREST,
+	SCALE_BILINEAR,
+	//Catmull-Rom, sharp with a little overshoot
+	SCALE_BICUBIC,
+	//3 lobe Lanczos, the sharpest and the most taps
+	SCALE_LANCZOS,
+} scale_filter_t;
+
+#define SCALE_CACHE 8
+
+/*
+ * Filter coefficients for one axis at one src -> dst ratio. Output pixel
+ * i reads taps source pixels from start[i] with Q14 weights
+ * weights[i * taps ...] summing to 1 << 14
+ */
+typedef struct scale_axis {
+	scale_filter_t filter;
+	uint32_t src;
+	uint32_t dst;
+	uint32_t taps;
+	int32_t *start;
+	int16_t *weights;
+	uint64_t used;
+} scale_axis_t;
+
+/*
+ * CPU scaler for 32 bpp XRGB/ARGB surfaces, separable so every filter
+ * is a horizontal then a vertical 1D pass. Coefficients are built once
+ * per axis ratio and kept in a small LRU cache, so a scaler should only
+ * be run from one thread at a time (the rows are spread over the pool)
+ */
+typedef struct scaler {
+	scale_axis_t cache[SCALE_CACHE];
+	uint64_t clock;
+} scaler_t;
+
+int scale_filter_from_str(const char *str, scale_filter_t *filter);
+scaler_t *scaler_create(void);
+void scaler_destroy(scaler_t *scaler);
+int scaler_run(scaler_t *scaler, pool_t *pool, scale_filter_t filter, bo_t *dst, const bo_t *src);
@@ -0,0 +1,464 @@
+#include "./span.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+#include <log.h>
+
+#include "./buffers.h"
+#include "./modes.h"
+#include "./props.h"
+#include "./route.h"
+#include "./timing.h"
+
+int span_layout_from_str(const char *str, span_layout_t *layout) {
+	if(strcmp(str, "row") == 0) {
+		*layout = SPAN_LAYOUT_ROW;
+	} else if(strcmp(str, "column") == 0) {
+		*layout = SPAN_LAYOUT_COLUMN;
+	} else if(strcmp(str, "mirror") == 0) {
+		*layout = SPAN_LAYOUT_MIRROR;
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+//Primary plane for the CRTC, preferring whichever plane is on it right now
+static uint32_t span_pick_plane(int fd, uint32_t crtc_id, uint32_t crtc_index) {
+	drmModePlaneResPtr pres = drmModeGetPlaneResources(fd);
+	uint32_t best = 0;
+
+	if(!pres) {
+		return 0;
+	}
+
+	for(uint32_t i = 0; i < pres->count_planes; i++) {
+		drmModePlanePtr plane = drmModeGetPlane(fd, pres->planes[i]);
+		if(!plane) {
+			continue;
+		}
+
+		props_t *props = props_get(fd, plane->plane_id, DRM_MODE_OBJECT_PLANE);
+		uint64_t type = DRM_PLANE_TYPE_OVERLAY;
+		if(props) {
+			props_value(props, "type", &type);
+			props_free(props);
+		}
+
+		if(type == DRM_PLANE_TYPE_PRIMARY && (plane->possible_crtcs & (1 << crtc_index))) {
+			if(!best || plane->crtc_id == crtc_id) {
+				best = plane->plane_id;
+			}
+		}
+		drmModeFreePlane(plane);
+	}
+
+	drmModeFreePlaneResources(pres);
+	return best;
+}
+
+/* Size the driver gives a width x height XRGB8888 dumb buffer, pitch
+ * alignment and all. Asked for rather than guessed, the buffer is gone
+ * again straight away
+ */
+static uint64_t span_dumb_size(int fd, uint32_t width, uint32_t height) {
+	bo_t *bo = buffer_create_dumb(fd, 32, height, width);
+	uint64_t size = (uint64_t)width * height * 4;
+
+	if(bo) {
+		size = bo->size;
+		buffer_destroy_dumb(fd, bo);
+		free(bo);
+	}
+
+	return size;
+}
+
+//Place every head on the canvas and work out how big it has to be
+static void span_place(span_t *span) {
+	span->width = 0;
+	span->height = 0;
+
+	for(uint32_t i = 0; i < span->count; i++) {
+		span_output_t *out = &span->outputs[i];
+		uint32_t w = out->mode.hdisplay;
+		uint32_t h = out->mode.vdisplay;
+
+		switch(span->layout) {
+		case SPAN_LAYOUT_ROW:
+			out->x = span->width;
+			out->y = 0;
+			span->width += w;
+			span->height = h > span->height ? h : span->height;
+			break;
+		case SPAN_LAYOUT_COLUMN:
+			out->x = 0;
+			out->y = span->height;
+			span->width = w > span->width ? w : span->width;
+			span->height += h;
+			break;
+		case SPAN_LAYOUT_MIRROR:
+			out->x = 0;
+			out->y = 0;
+			span->width = w > span->width ? w : span->width;
+			span->height = h > span->height ? h : span->height;
+			break;
+		}
+	}
+}
+
+static int span_init_output(span_t *span, span_output_t *out) {
+	drmModeConnectorPtr conn = drmModeGetConnector(span->fd, out->conn_id);
+	if(!conn || conn->count_modes < 1) {
+		drmModeFreeConnector(conn);
+		return -1;
+	}
+
+	int ret = mode_pick(conn, &out->mode);
+	drmModeFreeConnector(conn);
+	if(ret) {
+		return -1;
+	}
+
+	out->saved_crtc = drmModeGetCrtc(span->fd, out->crtc_id);
+	timing_init(&out->timing, out->crtc_id, &out->mode);
+	return 0;
+}
+
+static int span_init_atomic(span_t *span, span_output_t *out, uint32_t crtc_index) {
+	out->plane_id = span_pick_plane(span->fd, out->crtc_id, crtc_index);
+	out->conn_props = props_get(span->fd, out->conn_id, DRM_MODE_OBJECT_CONNECTOR);
+	out->crtc_props = props_get(span->fd, out->crtc_id, DRM_MODE_OBJECT_CRTC);
+	out->plane_props = out->plane_id ? props_get(span->fd, out->plane_id, DRM_MODE_OBJECT_PLANE) : NULL;
+	if(!out->conn_props || !out->crtc_props || !out->plane_props ||
+			drmModeCreatePropertyBlob(span->fd, &out->mode, sizeof(out->mode), &out->mode_blob)) {
+		logger_warn("Connector %u: atomic setup failed", out->conn_id);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int span_init_buffers(span_t *span) {
+	for(uint32_t i = 0; i < SPAN_BUFFERS; i++) {
+		uint32_t handles[4] = { 0 };
+		uint32_t pitches[4] = { 0 };
+		uint32_t offsets[4] = { 0 };
+
+		span->bos[i] = buffer_create_dumb(span->fd, 32, span->height, span->width);
+		if(!span->bos[i] || bo_map(span->fd, span->bos[i])) {
+			return -1;
+		}
+
+		handles[0] = span->bos[i]->handle;
+		pitches[0] = span->bos[i]->pitch;
+		if(drmModeAddFB2(span->fd, span->width, span->height, DRM_FORMAT_XRGB8888,
+					handles, pitches, offsets, &span->fbs[i], 0)) {
+			logger_error("Failed to add %ux%u spanning FB %m", span->width, span->height);
+			return -1;
+		}
+		span->span_bytes += span->bos[i]->size;
+	}
+
+	return 0;
+}
+
+/* Route every connected connector and lay them out on one canvas
+ *
+ * PARAMS:
+ * layout - where each head's window sits on the canvas
+ *
+ * Returns NULL if nothing is connected, the canvas is bigger than the
+ * device's max_width/max_height or the buffers can't be set up
+ */
+span_t *span_create(int fd, span_layout_t layout) {
+	route_t route;
+
+	span_t *span = calloc(1, sizeof(*span));
+	if(!span) {
+		logger_error("Failed to allocate span %m");
+		return NULL;
+	}
+
+	span->fd = fd;
+	span->layout = layout;
+	span->front = -1;
+	span->pending = -1;
+	span->modeset = true;
+
+	drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+	span->atomic = drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0;
+
+	drmModeResPtr res = drmModeGetResources(fd);
+	if(!res || route_probe(fd, &route)) {
+		logger_error("Failed to get resources %m");
+		goto err;
+	}
+	route_solve(&route);
+
+	for(uint32_t i = 0; i < route.count_outputs && span->count < SPAN_MAX_OUTPUTS; i++) {
+		const route_output_t *r = &route.outputs[i];
+
+		//A clone already shows its host's window
+		if(r->crtc < 0 || r->clone_of >= 0) {
+			continue;
+		}
+
+		span_output_t *out = &span->outputs[span->count];
+		out->conn_id = r->conn_id;
+		out->crtc_id = route.crtcs[r->crtc];
+		if(span_init_output(span, out)) {
+			continue;
+		}
+
+		if(span->atomic && span_init_atomic(span, out, r->crtc)) {
+			logger_warn("Falling back to legacy modesetting");
+			span->atomic = false;
+		}
+		span->count++;
+	}
+
+	if(!span->count) {
+		logger_error("No connected outputs");
+		goto err;
+	}
+
+	span_place(span);
+	if(span->width > res->max_width || span->height > res->max_height) {
+		logger_error("%ux%u canvas is over the device's %ux%u limit", span->width, span->height,
+				res->max_width, res->max_height);
+		goto err;
+	}
+
+	for(uint32_t i = 0; i < span->count; i++) {
+		const span_output_t *out = &span->outputs[i];
+		span->split_bytes += SPAN_BUFFERS * span_dumb_size(fd, out->mode.hdisplay, out->mode.vdisplay);
+	}
+
+	if(span_init_buffers(span)) {
+		logger_error("Failed to allocate the spanning buffers");
+		goto err;
+	}
+
+	drmModeFreeResources(res);
+	return span;
+
+err:
+	drmModeFreeResources(res);
+	span_destroy(span);
+	return NULL;
+}
+
+void span_destroy(span_t *span) {
+	span_wait(span, 100);
+
+	for(uint32_t i = 0; i < span->count; i++) {
+		span_output_t *out = &span->outputs[i];
+		drmModeCrtcPtr crtc = out->saved_crtc;
+
+		if(!span->modeset && crtc && drmModeSetCrtc(span->fd, crtc->crtc_id, crtc->buffer_id,
+					crtc->x, crtc->y, crtc->buffer_id ? &out->conn_id : NULL,
+					crtc->buffer_id ? 1 : 0, crtc->buffer_id ? &crtc->mode : NULL)) {
+			logger_warn("Failed to restore CRTC %u %m", crtc->crtc_id);
+		}
+
+		if(out->mode_blob) {
+			drmModeDestroyPropertyBlob(span->fd, out->mode_blob);
+		}
+		props_free(out->conn_props);
+		props_free(out->crtc_props);
+		props_free(out->plane_props);
+		drmModeFreeCrtc(out->saved_crtc);
+	}
+
+	for(uint32_t i = 0; i < SPAN_BUFFERS; i++) {
+		if(span->fbs[i]) {
+			drmModeRmFB(span->fd, span->fbs[i]);
+		}
+
+		if(span->bos[i]) {
+			buffer_unmap(span->bos[i]);
+			buffer_destroy_dumb(span->fd, span->bos[i]);
+			free(span->bos[i]);
+		}
+	}
+
+	free(span);
+}
+
+//The buffer that is neither on screen nor waiting to be, -1 while a flip is out
+int span_next_buffer(span_t *span) {
+	if(span->pending >= 0) {
+		return -1;
+	}
+
+	return span->front == 0 ? 1 : 0;
+}
+
+static int span_commit_atomic(span_t *span, int buffer) {
+	uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+	drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+	if(!req) {
+		return -ENOMEM;
+	}
+
+	if(span->modeset) {
+		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+	}
+
+	//Every head goes in one request so they all flip on the same commit
+	for(uint32_t i = 0; i < span->count; i++) {
+		const span_output_t *out = &span->outputs[i];
+
+		if(span->modeset) {
+			props_add(req, out->conn_props, "CRTC_ID", out->crtc_id);
+			props_add(req, out->crtc_props, "MODE_ID", out->mode_blob);
+			props_add(req, out->crtc_props, "ACTIVE", 1);
+			props_add(req, out->plane_props, "CRTC_ID", out->crtc_id);
+			props_add(req, out->plane_props, "SRC_X", (uint64_t)out->x << 16);
+			props_add(req, out->plane_props, "SRC_Y", (uint64_t)out->y << 16);
+			props_add(req, out->plane_props, "SRC_W", (uint64_t)out->mode.hdisplay << 16);
+			props_add(req, out->plane_props, "SRC_H", (uint64_t)out->mode.vdisplay << 16);
+			props_add(req, out->plane_props, "CRTC_X", 0);
+			props_add(req, out->plane_props, "CRTC_Y", 0);
+			props_add(req, out->plane_props, "CRTC_W", out->mode.hdisplay);
+			props_add(req, out->plane_props, "CRTC_H", out->mode.vdisplay);
+		}
+		props_add(req, out->plane_props, "FB_ID", span->fbs[buffer]);
+	}
+
+	int ret = drmModeAtomicCommit(span->fd, req, flags, span);
+	drmModeAtomicFree(req);
+	if(ret) {
+		return -errno;
+	}
+
+	for(uint32_t i = 0; i < span->count; i++) {
+		span->outputs[i].pending = true;
+	}
+	span->inflight = span->count;
+	span->pending = buffer;
+	return 0;
+}
+
+static int span_commit_legacy(span_t *span, int buffer) {
+	//SetCrtc blocks until the mode is up and sends no event
+	if(span->modeset) {
+		for(uint32_t i = 0; i < span->count; i++) {
+			span_output_t *out = &span->outputs[i];
+			if(drmModeSetCrtc(span->fd, out->crtc_id, span->fbs[buffer], out->x, out->y,
+						&out->conn_id, 1, &out->mode)) {
+				return -errno;
+			}
+		}
+
+		span->front = buffer;
+		return 0;
+	}
+
+	//The flip keeps each CRTC's x/y, only the FB changes
+	for(uint32_t i = 0; i < span->count; i++) {
+		span_output_t *out = &span->outputs[i];
+		if(drmModePageFlip(span->fd, out->crtc_id, span->fbs[buffer], DRM_MODE_PAGE_FLIP_EVENT, span)) {
+			int ret = -errno;
+			//Heads that did flip still have to land before the next commit
+			span->pending = span->inflight ? buffer : -1;
+			return ret;
+		}
+
+		out->pending = true;
+		span->inflight++;
+	}
+
+	span->pending = buffer;
+	return 0;
+}
+
+/* Put buffer on every head, the first commit also does the modeset
+ *
+ * Returns 0 on success, -EBUSY while a previous flip is still out or
+ * another negative errno if the commit was rejected
+ */
+int span_commit(span_t *span, int buffer) {
+	if(span->pending >= 0) {
+		return -EBUSY;
+	}
+
+	for(uint32_t i = 0; i < span->count; i++) {
+		timing_commit(&span->outputs[i].timing);
+	}
+
+	int ret = span->atomic ? span_commit_atomic(span, buffer) : span_commit_legacy(span, buffer);
+	if(ret) {
+		logger_error("Spanning commit failed: %s", strerror(-ret));
+		return ret;
+	}
+
+	span->modeset = false;
+	span->frame++;
+	return 0;
+}
+
+static void span_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+		unsigned int tv_usec, unsigned int crtc_id, void *data) {
+	span_t *span = data;
+
+	if(!span) {
+		return;
+	}
+
+	for(uint32_t i = 0; i < span->count; i++) {
+		span_output_t *out = &span->outputs[i];
+		if(out->crtc_id != crtc_id || !out->pending) {
+			continue;
+		}
+
+		out->pending = false;
+		span->inflight--;
+		timing_flip(&out->timing, sequence, (uint64_t)tv_sec * 1000000000ull + (uint64_t)tv_usec * 1000ull);
+	}
+
+	//The old buffer is only free once the last head has let go of it
+	if(!span->inflight && span->pending >= 0) {
+		span->front = span->pending;
+		span->pending = -1;
+	}
+}
+
+//Dispatch any queued DRM events for spans on fd
+int span_handle_events(int fd) {
+	drmEventContext evctx = {
+		.version = 3,
+		.page_flip_handler2 = span_flip_handler,
+	};
+
+	return drmHandleEvent(fd, &evctx);
+}
+
+//Block until every head has finished its pending flip
+int span_wait(span_t *span, int timeout_ms) {
+	struct pollfd pfd = { .fd = span->fd, .events = POLLIN };
+
+	while(span->pending >= 0) {
+		int ret = poll(&pfd, 1, timeout_ms);
+		if(ret < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if(ret <= 0) {
+			return -ETIMEDOUT;
+		}
+
+		span_handle_events(span->fd);
+	}
+
+	return 0;
+}
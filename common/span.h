@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <xf86drmMode.h>
+
+#include "./buffers.h"
+#include "./props.h"
+#include "./timing.h"
+
+#define SPAN_MAX_OUTPUTS 8
+#define SPAN_BUFFERS 2
+
+/*
+ * How the outputs are laid out on the canvas. ROW and COLUMN put them
+ * side by side, MIRROR puts every output at 0,0 so they all show the
+ * same region
+ */
+typedef enum span_layout {
+	SPAN_LAYOUT_ROW,
+	SPAN_LAYOUT_COLUMN,
+	SPAN_LAYOUT_MIRROR,
+} span_layout_t;
+
+//One head scanning out its x/y window of the shared canvas
+typedef struct span_output {
+	uint32_t conn_id;
+	uint32_t crtc_id;
+	uint32_t plane_id;
+	drmModeModeInfo mode;
+	uint32_t mode_blob;
+	drmModeCrtcPtr saved_crtc;
+
+	uint32_t x;
+	uint32_t y;
+
+	props_t *conn_props;
+	props_t *crtc_props;
+	props_t *plane_props;
+
+	bool pending;
+	timing_t timing;
+} span_output_t;
+
+/*
+ * A single desktop sized framebuffer shared by every head on a device.
+ * Each CRTC is pointed at its region through the x/y of drmModeSetCrtc
+ * or the plane SRC_X/SRC_Y under atomic, so one render covers every
+ * output and a flip swaps them all at once
+ */
+typedef struct span {
+	int fd;
+	bool atomic;
+	span_layout_t layout;
+
+	span_output_t outputs[SPAN_MAX_OUTPUTS];
+	uint32_t count;
+
+	uint32_t width;
+	uint32_t height;
+	bo_t *bos[SPAN_BUFFERS];
+	uint32_t fbs[SPAN_BUFFERS];
+	int front;
+	int pending;
+	//Heads whose flip event hasn't come in yet
+	uint32_t inflight;
+	bool modeset;
+	uint64_t frame;
+
+	//Scanout memory used by the canvas and what one buffer per head would take
+	uint64_t span_bytes;
+	uint64_t split_bytes;
+} span_t;
+
+int span_layout_from_str(const char *str, span_layout_t *layout);
+span_t *span_create(int fd, span_layout_t layout);
+void span_destroy(span_t *span);
+int span_next_buffer(span_t *span);
+int span_commit(span_t *span, int buffer);
+int span_handle_events(int fd);
+int span_wait(span_t *span, int timeout_ms);
@@ -0,0 +1,206 @@
+#include "./timing.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <log.h>
+
+static inline uint32_t hist_index(uint64_t value) {
+	if(value < HIST_SUB) {
+		return value;
+	}
+
+	uint32_t shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + (uint32_t)(value >> shift) - HIST_SUB;
+}
+
+//Lowest value that lands in bucket index
+static inline uint64_t hist_value(uint32_t index) {
+	if(index < 2 * HIST_SUB) {
+		return index;
+	}
+
+	uint32_t shift = index / HIST_SUB - 1;
+	return (uint64_t)(index % HIST_SUB + HIST_SUB) << shift;
+}
+
+//Single writer, so a relaxed load/store pair instead of a locked add
+static inline void hist_add(_Atomic uint64_t *counter, uint64_t value) {
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+			memory_order_relaxed);
+}
+
+void hist_record(hist_t *hist, uint64_t value) {
+	hist_add(&hist->buckets[hist_index(value)], 1);
+	hist_add(&hist->count, 1);
+	hist_add(&hist->sum, value);
+
+	if(value > atomic_load_explicit(&hist->max, memory_order_relaxed)) {
+		atomic_store_explicit(&hist->max, value, memory_order_relaxed);
+	}
+}
+
+uint64_t hist_percentile(const hist_t *hist, double pct) {
+	uint64_t count = atomic_load_explicit(&hist->count, memory_order_relaxed);
+	uint64_t target = count * pct / 100.0;
+	uint64_t seen = 0;
+
+	if(!count) {
+		return 0;
+	}
+
+	for(uint32_t i = 0; i < HIST_BUCKETS; i++) {
+		seen += atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+		if(seen > target) {
+			return hist_value(i);
+		}
+	}
+
+	return atomic_load_explicit(&hist->max, memory_order_relaxed);
+}
+
+uint64_t hist_mean(const hist_t *hist) {
+	uint64_t count = atomic_load_explicit(&hist->count, memory_order_relaxed);
+	return count ? atomic_load_explicit(&hist->sum, memory_order_relaxed) / count : 0;
+}
+
+void hist_reset(hist_t *hist) {
+	for(uint32_t i = 0; i < HIST_BUCKETS; i++) {
+		atomic_store_explicit(&hist->buckets[i], 0, memory_order_relaxed);
+	}
+	atomic_store_explicit(&hist->count, 0, memory_order_relaxed);
+	atomic_store_explicit(&hist->sum, 0, memory_order_relaxed);
+	atomic_store_explicit(&hist->max, 0, memory_order_relaxed);
+}
+
+//Add src's samples into dst, dst's writer has to be the caller
+void hist_merge(hist_t *dst, const hist_t *src) {
+	for(uint32_t i = 0; i < HIST_BUCKETS; i++) {
+		hist_add(&dst->buckets[i], atomic_load_explicit(&src->buckets[i], memory_order_relaxed));
+	}
+	hist_add(&dst->count, atomic_load_explicit(&src->count, memory_order_relaxed));
+	hist_add(&dst->sum, atomic_load_explicit(&src->sum, memory_order_relaxed));
+
+	uint64_t max = atomic_load_explicit(&src->max, memory_order_relaxed);
+	if(max > atomic_load_explicit(&dst->max, memory_order_relaxed)) {
+		atomic_store_explicit(&dst->max, max, memory_order_relaxed);
+	}
+}
+
+//Page flip event timestamps are CLOCK_MONOTONIC so everything else is too
+uint64_t timing_now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//Exact refresh period from the mode timings, vrefresh is rounded to 1Hz
+uint64_t timing_mode_period_ns(const drmModeModeInfo *mode) {
+	uint64_t pixels = (uint64_t)mode->htotal * mode->vtotal;
+
+	if(!mode->clock || !pixels) {
+		return mode->vrefresh ? 1000000000ull / mode->vrefresh : 0;
+	}
+
+	if(mode->flags & DRM_MODE_FLAG_INTERLACE) {
+		pixels /= 2;
+	}
+
+	if(mode->flags & DRM_MODE_FLAG_DBLSCAN) {
+		pixels *= 2;
+	}
+
+	return pixels * 1000000ull / mode->clock;
+}
+
+void timing_init(timing_t *timing, uint32_t crtc_id, const drmModeModeInfo *mode) {
+	memset(timing, 0, sizeof(*timing));
+	timing->crtc_id = crtc_id;
+	timing->period_ns = mode ? timing_mode_period_ns(mode) : 0;
+	timing->report_ns = timing_now_ns();
+}
+
+/* Seed the last vblank from drmCrtcGetSequence so the first flip
+ * already has something to be measured against
+ */
+int timing_sample(int fd, timing_t *timing) {
+	uint64_t seq, ns;
+
+	if(drmCrtcGetSequence(fd, timing->crtc_id, &seq, &ns)) {
+		return -1;
+	}
+
+	timing->last_seq = seq;
+	timing->last_ns = ns;
+	return 0;
+}
+
+void timing_commit(timing_t *timing) {
+	atomic_store_explicit(&timing->commit_ns, timing_now_ns(), memory_order_relaxed);
+}
+
+void timing_flip(timing_t *timing, uint64_t sequence, uint64_t ns) {
+	uint64_t commit = atomic_exchange_explicit(&timing->commit_ns, 0, memory_order_relaxed);
+
+	if(commit && ns > commit) {
+		hist_record(&timing->latency, ns - commit);
+	}
+
+	//The event sequence is only 32 bits wide
+	if(timing->last_ns && ns > timing->last_ns) {
+		uint64_t interval = ns - timing->last_ns;
+		uint32_t delta = (uint32_t)sequence - (uint32_t)timing->last_seq;
+
+		hist_record(&timing->interval, interval);
+		if(timing->period_ns) {
+			hist_record(&timing->jitter, interval > timing->period_ns ?
+					interval - timing->period_ns : timing->period_ns - interval);
+		}
+
+		if(delta > 1) {
+			hist_add(&timing->skipped, delta - 1);
+		}
+	}
+
+	timing->last_seq = sequence;
+	timing->last_ns = ns;
+	hist_add(&timing->flips, 1);
+}
+
+void timing_get_stats(const timing_t *timing, timing_stats_t *stats) {
+	stats->flips = atomic_load_explicit(&timing->flips, memory_order_relaxed);
+	stats->skipped = atomic_load_explicit(&timing->skipped, memory_order_relaxed);
+	stats->period_ns = timing->period_ns;
+	stats->latency_p50 = hist_percentile(&timing->latency, 50);
+	stats->latency_p99 = hist_percentile(&timing->latency, 99);
+	stats->interval_mean = hist_mean(&timing->interval);
+	stats->jitter_p99 = hist_percentile(&timing->jitter, 99);
+	stats->jitter_max = atomic_load_explicit(&timing->jitter.max, memory_order_relaxed);
+}
+
+void timing_summary(const timing_t *timing, const char *name) {
+	timing_stats_t stats;
+	timing_get_stats(timing, &stats);
+
+	logger_info("%s CRTC %u: flips %lu | skipped vblanks %lu | commit->flip p50 %.2fms p99 %.2fms",
+			name, timing->crtc_id, stats.flips, stats.skipped,
+			stats.latency_p50 / 1e6, stats.latency_p99 / 1e6);
+	logger_info("%s CRTC %u: interval mean %.3fms (period %.3fms) | jitter p99 %.1fus max %.1fus",
+			name, timing->crtc_id, stats.interval_mean / 1e6, stats.period_ns / 1e6,
+			stats.jitter_p99 / 1e3, stats.jitter_max / 1e3);
+}
+
+//Print a summary if at least every_ns has passed since the last one
+void timing_report(timing_t *timing, const char *name, uint64_t every_ns) {
+	uint64_t now = timing_now_ns();
+
+	if(now - timing->report_ns < every_ns) {
+		return;
+	}
+
+	timing->report_ns = now;
+	timing_summary(timing, name);
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <xf86drmMode.h>
+
+/*
+ * Log linear (HDR style) histogram of nanosecond values. 16 sub buckets
+ * per power of two keeps every bucket within ~6% of its value. Each
+ * histogram has a single writer (the thread handling that CRTC's events),
+ * recording is a clz and a few relaxed stores and any thread can read
+ * the counters without locking
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct hist {
+	_Atomic uint64_t buckets[HIST_BUCKETS];
+	_Atomic uint64_t count;
+	_Atomic uint64_t sum;
+	_Atomic uint64_t max;
+} hist_t;
+
+void hist_record(hist_t *hist, uint64_t value);
+uint64_t hist_percentile(const hist_t *hist, double pct);
+uint64_t hist_mean(const hist_t *hist);
+void hist_reset(hist_t *hist);
+void hist_merge(hist_t *dst, const hist_t *src);
+
+/*
+ * Presentation timing for one CRTC. timing_commit is called by whoever
+ * commits, timing_flip from the page flip event with the kernel's vblank
+ * sequence and timestamp
+ */
+typedef struct timing {
+	uint32_t crtc_id;
+	uint64_t period_ns;
+
+	_Atomic uint64_t commit_ns;
+	uint64_t last_seq;
+	uint64_t last_ns;
+
+	_Atomic uint64_t flips;
+	_Atomic uint64_t skipped;
+
+	hist_t latency;
+	hist_t interval;
+	hist_t jitter;
+
+	uint64_t report_ns;
+} timing_t;
+
+typedef struct timing_stats {
+	uint64_t flips;
+	uint64_t skipped;
+	uint64_t period_ns;
+	uint64_t latency_p50;
+	uint64_t latency_p99;
+	uint64_t interval_mean;
+	uint64_t jitter_p99;
+	uint64_t jitter_max;
+} timing_stats_t;
+
+uint64_t timing_now_ns();
+uint64_t timing_mode_period_ns(const drmModeModeInfo *mode);
+
+void timing_init(timing_t *timing, uint32_t crtc_id, const drmModeModeInfo *mode);
+int timing_sample(int fd, timing_t *timing);
+void timing_commit(timing_t *timing);
+void timing_flip(timing_t *timing, uint64_t sequence, uint64_t ns);
+void timing_get_stats(const timing_t *timing, timing_stats_t *stats);
+void timing_summary(const timing_t *timing, const char *name);
+void timing_report(timing_t *timing, const char *name, uint64_t every_ns);
@@ -0,0 +1,224 @@
+#include "./trace.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <log.h>
+
+#include <sys/syscall.h>
+
+#include "./timing.h"
+
+typedef struct trace_event {
+	uint64_t ns;
+	const char *name;
+	int64_t value;
+	uint32_t id;
+	char phase;
+} trace_event_t;
+
+/*
+ * One thread's events, only that thread writes to it. head counts every
+ * event ever recorded, the ring keeps the last mask + 1. Rings are never
+ * freed so threads that have exited still show up in the trace
+ */
+typedef struct trace_ring {
+	trace_event_t *events;
+	uint32_t mask;
+	_Atomic uint64_t head;
+	int tid;
+	char name[32];
+	struct trace_ring *next;
+} trace_ring_t;
+
+static _Atomic bool trace_on;
+static char *trace_path;
+static uint32_t trace_capacity = TRACE_CAPACITY;
+static _Atomic(trace_ring_t *) trace_rings;
+static __thread trace_ring_t *trace_self;
+static __thread char trace_name[32];
+
+static void trace_at_exit(void) {
+	if(trace_enabled()) {
+		trace_stop();
+	}
+}
+
+__attribute__((constructor)) static void trace_init(void) {
+	const char *path = getenv(TRACE_ENV);
+
+	if(path && *path && !trace_start(path, TRACE_CAPACITY)) {
+		atexit(trace_at_exit);
+	}
+}
+
+static trace_ring_t *trace_ring_create(void) {
+	trace_ring_t *ring = calloc(1, sizeof(*ring));
+	if(!ring || !(ring->events = calloc(trace_capacity, sizeof(*ring->events)))) {
+		free(ring);
+		return NULL;
+	}
+
+	ring->mask = trace_capacity - 1;
+	ring->tid = syscall(SYS_gettid);
+	memcpy(ring->name, trace_name, sizeof(ring->name));
+
+	ring->next = atomic_load_explicit(&trace_rings, memory_order_relaxed);
+	while(!atomic_compare_exchange_weak_explicit(&trace_rings, &ring->next, ring,
+				memory_order_release, memory_order_relaxed));
+	trace_self = ring;
+	return ring;
+}
+
+static void trace_record(char phase, const char *name, uint32_t id, uint64_t ns, int64_t value) {
+	trace_ring_t *ring = trace_self ? trace_self : trace_ring_create();
+	if(!ring) {
+		return;
+	}
+
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	ring->events[head & ring->mask] = (trace_event_t) {
+		.ns = ns,
+		.name = name,
+		.value = value,
+		.id = id,
+		.phase = phase,
+	};
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/* Start recording, rings already allocated keep their size and are
+ * emptied. capacity is rounded up to a power of two
+ *
+ * Returns 0 on success, -1 if tracing is already on
+ */
+int trace_start(const char *path, uint32_t capacity) {
+	if(trace_enabled()) {
+		return -1;
+	}
+
+	trace_capacity = 2;
+	while(trace_capacity < capacity && trace_capacity < (1u << 30)) {
+		trace_capacity <<= 1;
+	}
+
+	free(trace_path);
+	trace_path = strdup(path);
+	for(trace_ring_t *ring = atomic_load_explicit(&trace_rings, memory_order_acquire); ring; ring = ring->next) {
+		atomic_store_explicit(&ring->head, 0, memory_order_relaxed);
+	}
+
+	atomic_store_explicit(&trace_on, trace_path != NULL, memory_order_release);
+	return trace_path ? 0 : -1;
+}
+
+bool trace_enabled(void) {
+	return atomic_load_explicit(&trace_on, memory_order_relaxed);
+}
+
+//Shows up as the thread's name in the viewer, can be set before tracing starts
+void trace_thread_name(const char *name) {
+	snprintf(trace_name, sizeof(trace_name), "%s", name);
+	if(trace_self) {
+		memcpy(trace_self->name, trace_name, sizeof(trace_name));
+	}
+}
+
+void trace_begin(const char *name, uint32_t id) {
+	if(trace_enabled()) {
+		trace_record('B', name, id, timing_now_ns(), 0);
+	}
+}
+
+void trace_end(const char *name, uint32_t id) {
+	if(trace_enabled()) {
+		trace_record('E', name, id, timing_now_ns(), 0);
+	}
+}
+
+//Something that happened at ns (CLOCK_MONOTONIC) rather than now, e.g. a flip timestamp
+void trace_instant_at(const char *name, uint32_t id, uint64_t ns) {
+	if(trace_enabled()) {
+		trace_record('i', name, id, ns, 0);
+	}
+}
+
+//Each id is its own series of the counter
+void trace_counter(const char *name, uint32_t id, int64_t value) {
+	if(trace_enabled()) {
+		trace_record('C', name, id, timing_now_ns(), value);
+	}
+}
+
+static void trace_write_event(FILE *f, int pid, int tid, const trace_event_t *e) {
+	fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d", e->name, e->phase,
+			e->ns / 1e3, pid, tid);
+
+	if(e->phase == 'C') {
+		fprintf(f, ",\"args\":{\"%u\":%ld}}", e->id, e->value);
+	} else if(e->phase == 'i') {
+		fprintf(f, ",\"s\":\"t\",\"args\":{\"id\":%u}}", e->id);
+	} else if(e->id) {
+		fprintf(f, ",\"args\":{\"id\":%u}}", e->id);
+	} else {
+		fputc('}', f);
+	}
+}
+
+/* Stop recording and write every thread's ring out. Threads should be
+ * done (or at least idle) by now, an event being written while its
+ * ring is read can come out garbled
+ *
+ * Returns 0 on success, a negative errno if the file can't be written
+ */
+int trace_stop(void) {
+	uint64_t written = 0, dropped = 0;
+	int pid = getpid();
+
+	if(!trace_enabled()) {
+		return -EINVAL;
+	}
+	atomic_store_explicit(&trace_on, false, memory_order_release);
+
+	FILE *f = fopen(trace_path, "w");
+	if(!f) {
+		int err = errno;
+		logger_error("Failed to open trace %s %m", trace_path);
+		return -err;
+	}
+
+	//Process metadata first so every later event starts with a comma
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+			"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"drm-tests\"}}", pid);
+
+	for(trace_ring_t *ring = atomic_load_explicit(&trace_rings, memory_order_acquire); ring; ring = ring->next) {
+		uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		uint64_t start = head > ring->mask + 1ull ? head - ring->mask - 1 : 0;
+
+		if(ring->name[0]) {
+			fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+					pid, ring->tid, ring->name);
+		}
+
+		for(uint64_t i = start; i < head; i++) {
+			trace_write_event(f, pid, ring->tid, &ring->events[i & ring->mask]);
+		}
+		written += head - start;
+		dropped += start;
+	}
+
+	fprintf(f, "\n]}\n");
+	int ret = fclose(f) ? -errno : 0;
+	if(ret) {
+		logger_error("Failed to write trace %s %m", trace_path);
+	} else {
+		logger_info("Trace: %lu events (%lu overwritten) in %s", written, dropped, trace_path);
+	}
+
+	return ret;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TRACE_ENV "DRM_TESTS_TRACE"
+#define TRACE_CAPACITY (1 << 16)
+
+/*
+ * Timeline of what each thread was doing, written out as Chrome
+ * trace-event JSON (chrome://tracing, ui.perfetto.dev). Every thread
+ * records into its own ring of the last capacity events, so recording
+ * is a clock read and a few stores with no locks. Names have to be
+ * string literals (only the pointer is kept), id tells apart events of
+ * the same name from different CRTCs and can be 0
+ *
+ * TRACE_ENV=<PATH> in the environment starts tracing before main and
+ * writes PATH at exit
+ */
+int trace_start(const char *path, uint32_t capacity);
+int trace_stop(void);
+bool trace_enabled(void);
+
+void trace_thread_name(const char *name);
+void trace_begin(const char *name, uint32_t id);
+void trace_end(const char *name, uint32_t id);
+void trace_instant_at(const char *name, uint32_t id, uint64_t ns);
+void trace_counter(const char *name, uint32_t id, int64_t value);
@@ -0,0 +1,154 @@
+#include "./vrr.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <log.h>
+
+#include "./props.h"
+#include "./timing.h"
+
+#define EDID_BLOCK 128
+
+/* Display range limits (descriptor tag 0xFD) from the base EDID block.
+ * EDID 1.4 adds 255 to the rates when the offset flags are set
+ *
+ * Returns 0 on success, -1 if there is no range descriptor
+ */
+int vrr_range_from_edid(const uint8_t *edid, size_t len, vrr_range_t *range) {
+	static const uint8_t header[8] = { 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00 };
+
+	if(len < EDID_BLOCK || memcmp(edid, header, sizeof(header))) {
+		return -1;
+	}
+
+	//Four 18 byte descriptors, display descriptors start with 0, 0, 0
+	for(uint32_t off = 54; off + 18 <= 126; off += 18) {
+		const uint8_t *d = edid + off;
+		if(d[0] || d[1] || d[2] || d[3] != 0xfd) {
+			continue;
+		}
+
+		range->min_hz = d[5] + ((d[4] & 0x3) == 0x3 ? 255 : 0);
+		range->max_hz = d[6] + (d[4] & 0x2 ? 255 : 0);
+		return range->min_hz && range->max_hz >= range->min_hz ? 0 : -1;
+	}
+
+	return -1;
+}
+
+//"48-144", for panels that don't report a range
+int vrr_range_from_str(const char *str, vrr_range_t *range) {
+	uint32_t min, max;
+
+	if(sscanf(str, "%u-%u", &min, &max) != 2 || !min || max < min) {
+		return -1;
+	}
+
+	range->min_hz = min;
+	range->max_hz = max;
+	return 0;
+}
+
+/* Read vrr_capable and the EDID range of a connector
+ *
+ * Returns 0 on success (capable or not), -1 if the connector's
+ * properties couldn't be read
+ */
+int vrr_probe(int fd, uint32_t conn_id, vrr_info_t *info) {
+	props_t *props = props_get(fd, conn_id, DRM_MODE_OBJECT_CONNECTOR);
+	uint64_t capable = 0;
+	uint64_t blob_id = 0;
+
+	memset(info, 0, sizeof(*info));
+	if(!props) {
+		return -1;
+	}
+
+	props_value(props, "vrr_capable", &capable);
+	info->capable = capable;
+
+	if(!props_value(props, "EDID", &blob_id) && blob_id) {
+		drmModePropertyBlobPtr blob = drmModeGetPropertyBlob(fd, blob_id);
+		if(blob && vrr_range_from_edid(blob->data, blob->length, &info->range)) {
+			logger_debug("Connector %u: no range limits in the EDID", conn_id);
+		}
+		drmModeFreePropertyBlob(blob);
+	}
+
+	props_free(props);
+	return 0;
+}
+
+void vrr_stats_init(vrr_stats_t *stats, const vrr_range_t *range, uint64_t period_ns) {
+	memset(stats, 0, sizeof(*stats));
+	stats->range = *range;
+	stats->period_ns = period_ns;
+}
+
+/* A frame is ready at ns. The model shows it straight away unless the
+ * last one went up less than a max rate refresh ago. Past the min rate
+ * the panel refreshes the old frame on its own, and a frame arriving
+ * during that refresh has to wait for it to finish
+ */
+void vrr_frame_ready(vrr_stats_t *stats, uint64_t ns) {
+	uint64_t min_period = stats->range.max_hz ? 1000000000ull / stats->range.max_hz : stats->period_ns;
+	uint64_t max_period = stats->range.min_hz ? 1000000000ull / stats->range.min_hz : 0;
+
+	if(stats->last_ready && ns > stats->last_ready) {
+		stats->content_ns = ns - stats->last_ready;
+		hist_record(&stats->content, stats->content_ns);
+	}
+	stats->last_ready = ns;
+
+	if(!stats->last_model) {
+		stats->last_model = ns;
+		return;
+	}
+
+	uint64_t refresh = stats->last_model;
+	while(max_period && ns > refresh + max_period) {
+		refresh += max_period;
+	}
+
+	uint64_t shown = ns > refresh + min_period ? ns : refresh + min_period;
+	uint64_t interval = shown - stats->last_model;
+	hist_record(&stats->model, interval);
+	if(stats->content_ns && interval > stats->content_ns + stats->period_ns / 2) {
+		stats->model_late++;
+	}
+	stats->last_model = shown;
+}
+
+//The frame went up at ns (the flip event's timestamp)
+void vrr_frame_shown(vrr_stats_t *stats, uint64_t ns) {
+	if(stats->last_shown && ns > stats->last_shown) {
+		uint64_t interval = ns - stats->last_shown;
+
+		hist_record(&stats->shown, interval);
+		stats->frames++;
+		if(stats->content_ns && interval > stats->content_ns + stats->period_ns / 2) {
+			stats->late++;
+		}
+	}
+	stats->last_shown = ns;
+}
+
+void vrr_summary(const vrr_stats_t *stats, const char *name) {
+	uint64_t frames = stats->frames ? stats->frames : 1;
+
+	logger_info("%s: %lu frames | content p50 %.2fms p99 %.2fms | shown p50 %.2fms p99 %.2fms max %.2fms, %.1f%% late",
+			name, stats->frames, hist_percentile(&stats->content, 50) / 1e6, hist_percentile(&stats->content, 99) / 1e6,
+			hist_percentile(&stats->shown, 50) / 1e6, hist_percentile(&stats->shown, 99) / 1e6,
+			atomic_load(&stats->shown.max) / 1e6, stats->late * 100.0 / frames);
+
+	if(stats->range.max_hz) {
+		logger_info("%s: VRR %u-%uHz model | shown p50 %.2fms p99 %.2fms max %.2fms, %.1f%% late", name,
+				stats->range.min_hz, stats->range.max_hz, hist_percentile(&stats->model, 50) / 1e6,
+				hist_percentile(&stats->model, 99) / 1e6, atomic_load(&stats->model.max) / 1e6,
+				stats->model_late * 100.0 / frames);
+	}
+}
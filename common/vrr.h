@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "./timing.h"
+
+//Refresh rates the panel can run at, 0 - 0 if it never said
+typedef struct vrr_range {
+	uint32_t min_hz;
+	uint32_t max_hz;
+} vrr_range_t;
+
+/*
+ * What the connector says about adaptive sync. capable is the
+ * vrr_capable property, the range comes from the EDID's display range
+ * limits descriptor
+ */
+typedef struct vrr_info {
+	bool capable;
+	vrr_range_t range;
+} vrr_info_t;
+
+/*
+ * Frame pacing with and without VRR. Each frame is recorded when it is
+ * ready (rendered and committed) and when it is shown. content is the
+ * interval between ready frames, shown the interval the display gave
+ * them and model what a VRR panel with range would have given them, so
+ * fixed refresh output (vkms included) can be compared with VRR. A
+ * frame is late when it is shown more than half a refresh after the
+ * content interval asked for
+ */
+typedef struct vrr_stats {
+	vrr_range_t range;
+	uint64_t period_ns;
+
+	uint64_t last_ready;
+	uint64_t last_shown;
+	uint64_t last_model;
+	uint64_t content_ns;
+
+	hist_t content;
+	hist_t shown;
+	hist_t model;
+	uint64_t frames;
+	uint64_t late;
+	uint64_t model_late;
+} vrr_stats_t;
+
+int vrr_range_from_edid(const uint8_t *edid, size_t len, vrr_range_t *range);
+int vrr_range_from_str(const char *str, vrr_range_t *range);
+int vrr_probe(int fd, uint32_t conn_id, vrr_info_t *info);
+
+void vrr_stats_init(vrr_stats_t *stats, const vrr_range_t *range, uint64_t period_ns);
+void vrr_frame_ready(vrr_stats_t *stats, uint64_t ns);
+void vrr_frame_shown(vrr_stats_t *stats, uint64_t ns);
+void vrr_summary(const vrr_stats_t *stats, const char *name);
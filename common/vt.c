@@ -0,0 +1,194 @@
+#include "./vt.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <xf86drm.h>
+#include <log.h>
+
+#include <linux/kd.h>
+#include <linux/vt.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+
+/* Take over switching on the controlling terminal, which has to be a
+ * virtual console. It is also put in KD_GRAPHICS so the console doesn't
+ * draw over the outputs
+ *
+ * Returns NULL if we aren't on a VT or it can't be taken over
+ */
+vt_t *vt_create(int drm_fd, vt_fn on_release, vt_fn on_acquire, void *user) {
+	vt_t *vt = calloc(1, sizeof(*vt));
+	if(!vt) {
+		logger_error("Failed to allocate VT state %m");
+		return NULL;
+	}
+
+	vt->drm_fd = drm_fd;
+	vt->on_release = on_release;
+	vt->on_acquire = on_acquire;
+	vt->user = user;
+	vt->active = true;
+	vt->signal_fd = -1;
+
+	vt->tty = open("/dev/tty", O_RDWR | O_CLOEXEC | O_NOCTTY);
+	if(vt->tty < 0 || ioctl(vt->tty, VT_GETMODE, &vt->saved_mode)) {
+		logger_warn("Not on a virtual console, VT switches won't be handled");
+		goto err;
+	}
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	vt->signal_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	if(vt->signal_fd < 0) {
+		logger_error("Failed to create VT signalfd %m");
+		goto err;
+	}
+
+	struct vt_mode mode = {
+		.mode = VT_PROCESS,
+		.relsig = SIGUSR1,
+		.acqsig = SIGUSR2,
+	};
+	if(ioctl(vt->tty, VT_SETMODE, &mode)) {
+		logger_error("Failed to take over VT switching %m");
+		goto err;
+	}
+
+	if(ioctl(vt->tty, KDGETMODE, &vt->saved_kd) || ioctl(vt->tty, KDSETMODE, KD_GRAPHICS)) {
+		logger_warn("Failed to put the console in graphics mode %m");
+		vt->saved_kd = -1;
+	}
+
+	return vt;
+
+err:
+	if(vt->signal_fd >= 0) {
+		close(vt->signal_fd);
+	}
+
+	if(vt->tty >= 0) {
+		close(vt->tty);
+	}
+	free(vt);
+	return NULL;
+}
+
+//Hand switching back to the kernel
+void vt_destroy(vt_t *vt) {
+	if(!vt) {
+		return;
+	}
+
+	if(vt->saved_kd >= 0) {
+		ioctl(vt->tty, KDSETMODE, vt->saved_kd);
+	}
+	ioctl(vt->tty, VT_SETMODE, &vt->saved_mode);
+	close(vt->signal_fd);
+	close(vt->tty);
+	free(vt);
+}
+
+/* Let the switch away go ahead once nothing is in flight, DRM master
+ * has to be gone before the next VT's owner can take it
+ */
+static void vt_release(vt_t *vt) {
+	if(vt->on_release) {
+		vt->on_release(vt->user);
+	}
+
+	if(drmDropMaster(vt->drm_fd)) {
+		logger_warn("Failed to drop DRM master %m");
+	}
+
+	vt->active = false;
+	vt->switches++;
+	ioctl(vt->tty, VT_RELDISP, 1);
+}
+
+/* The switch is acked first, whoever had the VT may still hold master
+ * for a moment after that so keep trying for up to 10s
+ *
+ * Returns 0 on success, -EACCES if master never came back
+ */
+static int vt_acquire(vt_t *vt) {
+	ioctl(vt->tty, VT_RELDISP, VT_ACKACQ);
+	for(int tries = 0; drmSetMaster(vt->drm_fd); tries++) {
+		if(tries == 200) {
+			logger_error("Failed to take DRM master back %m");
+			return -EACCES;
+		}
+		usleep(50000);
+	}
+
+	vt->active = true;
+	if(vt->on_acquire) {
+		vt->on_acquire(vt->user);
+	}
+	return 0;
+}
+
+/* Handle whatever switch requests are queued, only waits while taking
+ * DRM master back
+ *
+ * Returns 0 on success, a negative errno if the signalfd failed or
+ * master couldn't be taken back
+ */
+int vt_dispatch(vt_t *vt) {
+	struct signalfd_siginfo info;
+
+	for(;;) {
+		ssize_t len = read(vt->signal_fd, &info, sizeof(info));
+		if(len < 0) {
+			return errno == EAGAIN ? 0 : -errno;
+		}
+
+		if(len != sizeof(info)) {
+			return -EIO;
+		}
+
+		if(info.ssi_signo == SIGUSR1 && vt->active) {
+			vt_release(vt);
+		} else if(info.ssi_signo == SIGUSR2 && !vt->active) {
+			int ret = vt_acquire(vt);
+			if(ret) {
+				return ret;
+			}
+		}
+	}
+}
+
+/* Sleep until we are switched back to
+ *
+ * Returns 0 once the VT is ours again, -ETIMEDOUT or the vt_dispatch
+ * error otherwise
+ */
+int vt_wait_active(vt_t *vt, int timeout_ms) {
+	struct pollfd pfd = { .fd = vt->signal_fd, .events = POLLIN };
+
+	while(!vt->active) {
+		int ret = poll(&pfd, 1, timeout_ms);
+		if(ret < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if(ret <= 0) {
+			return -ETIMEDOUT;
+		}
+
+		int err = vt_dispatch(vt);
+		if(err) {
+			return err;
+		}
+	}
+
+	return 0;
+}
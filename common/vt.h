@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <linux/vt.h>
+
+typedef void (*vt_fn)(void *user);
+
+/*
+ * Console switching handled by us (VT_PROCESS) rather than by the
+ * kernel blanking behind our back. Switching away calls on_release and
+ * drops DRM master before the switch is allowed to happen, switching
+ * back takes master again and calls on_acquire. The switch signals
+ * (SIGUSR1/SIGUSR2) are read from a signalfd, so create the vt before
+ * any threads so they all have the signals blocked
+ */
+typedef struct vt {
+	int tty;
+	int drm_fd;
+	int signal_fd;
+	bool active;
+	struct vt_mode saved_mode;
+	int saved_kd;
+
+	vt_fn on_release;
+	vt_fn on_acquire;
+	void *user;
+	uint64_t switches;
+} vt_t;
+
+vt_t *vt_create(int drm_fd, vt_fn on_release, vt_fn on_acquire, void *user);
+void vt_destroy(vt_t *vt);
+int vt_dispatch(vt_t *vt);
+int vt_wait_active(vt_t *vt, int timeout_ms);
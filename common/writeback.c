@@ -0,0 +1,459 @@
+#include "./writeback.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+#include <log.h>
+
+#include "./buffers.h"
+#include "./props.h"
+
+/*
+ * Writeback ring
+ *
+ * Every commit attaches one free buffer to the writeback connector through
+ * WRITEBACK_FB_ID and asks for an out fence through WRITEBACK_OUT_FENCE_PTR.
+ * As soon as the page flip event for a commit arrives the next free buffer
+ * is queued, so there is always a job lined up for the next vblank. When a
+ * buffer's fence signals it's handed straight to the consumer callback, the
+ * consumer reads the mapped buffer in place and it goes back to the ring
+ * when the callback returns (or later if the frame was held).
+ */
+typedef enum slot_state {
+	SLOT_FREE,
+	SLOT_QUEUED,
+	SLOT_CONSUMER,
+} slot_state_t;
+
+typedef struct slot {
+	slot_state_t state;
+	writeback_frame_t frame;
+	//The kernel writes an s32 through WRITEBACK_OUT_FENCE_PTR
+	int32_t fence;
+	bool flipped;
+} slot_t;
+
+struct writeback {
+	int fd;
+	uint32_t crtc_id;
+	uint32_t conn_id;
+	drmModeModeInfo mode;
+
+	props_t *conn_props;
+
+	slot_t slots[WRITEBACK_MAX_SLOTS];
+	uint32_t count;
+	int inflight; //slot attached to the commit still waiting on its flip event
+	bool modeset;
+	bool stalled;
+	int error; //commit failure from the flip handler, returned by the next dispatch
+
+	uint64_t last_seq;
+	writeback_stats_t stats;
+
+	writeback_frame_fn fn;
+	void *user;
+};
+
+static bool writeback_has_format(int fd, props_t *props, uint32_t format) {
+	uint64_t blob_id = 0;
+	bool found = false;
+
+	if(props_value(props, "WRITEBACK_PIXEL_FORMATS", &blob_id) || !blob_id) {
+		return false;
+	}
+
+	drmModePropertyBlobPtr blob = drmModeGetPropertyBlob(fd, blob_id);
+	if(!blob) {
+		return false;
+	}
+
+	uint32_t *formats = blob->data;
+	for(uint32_t i = 0; i < blob->length / sizeof(uint32_t); i++) {
+		if(formats[i] == format) {
+			found = true;
+			break;
+		}
+	}
+
+	drmModeFreePropertyBlob(blob);
+	return found;
+}
+
+//Find a writeback connector that can be driven by the CRTC at crtc_index
+static uint32_t writeback_find_connector(int fd, drmModeResPtr res, int crtc_index) {
+	uint32_t id = 0;
+
+	for(int i = 0; i < res->count_connectors && !id; i++) {
+		drmModeConnectorPtr conn = drmModeGetConnector(fd, res->connectors[i]);
+		if(!conn) {
+			continue;
+		}
+
+		if(conn->connector_type == DRM_MODE_CONNECTOR_WRITEBACK) {
+			for(int j = 0; j < conn->count_encoders && !id; j++) {
+				drmModeEncoderPtr enc = drmModeGetEncoder(fd, conn->encoders[j]);
+				if(enc && (enc->possible_crtcs & (1 << crtc_index))) {
+					id = conn->connector_id;
+				}
+				drmModeFreeEncoder(enc);
+			}
+		}
+
+		drmModeFreeConnector(conn);
+	}
+
+	return id;
+}
+
+static int writeback_init_slots(writeback_t *wb) {
+	for(uint32_t i = 0; i < wb->count; i++) {
+		slot_t *slot = &wb->slots[i];
+		uint32_t handles[4] = { 0 };
+		uint32_t pitches[4] = { 0 };
+		uint32_t offsets[4] = { 0 };
+
+		slot->frame.slot = i;
+		slot->frame.format = DRM_FORMAT_XRGB8888;
+		slot->frame.bo = buffer_create_dumb(wb->fd, 32, wb->mode.vdisplay, wb->mode.hdisplay);
+		if(!slot->frame.bo) {
+			return -1;
+		}
+
+		if(bo_map(wb->fd, slot->frame.bo)) {
+			return -1;
+		}
+
+		handles[0] = slot->frame.bo->handle;
+		pitches[0] = slot->frame.bo->pitch;
+		if(drmModeAddFB2(wb->fd, wb->mode.hdisplay, wb->mode.vdisplay, DRM_FORMAT_XRGB8888,
+					handles, pitches, offsets, &slot->frame.fb_id, 0)) {
+			logger_error("Failed to add writeback FB %m");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Create a writeback ring on the writeback connector able to capture crtc_id
+ *
+ * PARAMS:
+ * crtc_id - an active CRTC, its current mode decides the buffer size
+ * slots - number of buffers in the ring (2 - WRITEBACK_MAX_SLOTS)
+ * fn - called with every completed frame
+ *
+ * Returns NULL if the device has no usable writeback connector
+ */
+writeback_t *writeback_create(int fd, uint32_t crtc_id, uint32_t slots, writeback_frame_fn fn, void *user) {
+	if(drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1) ||
+			drmSetClientCap(fd, DRM_CLIENT_CAP_WRITEBACK_CONNECTORS, 1)) {
+		logger_error("Device doesn't support atomic writeback connectors");
+		return NULL;
+	}
+
+	writeback_t *wb = calloc(1, sizeof(*wb));
+	if(!wb) {
+		logger_error("Failed to allocate writeback %m");
+		return NULL;
+	}
+
+	//writeback_destroy closes any fence >= 0, even on the error paths below
+	for(uint32_t i = 0; i < WRITEBACK_MAX_SLOTS; i++) {
+		wb->slots[i].fence = -1;
+	}
+
+	wb->fd = fd;
+	wb->crtc_id = crtc_id;
+	wb->fn = fn;
+	wb->user = user;
+	wb->inflight = -1;
+	wb->modeset = true;
+	wb->count = slots < 2 ? 2 : slots > WRITEBACK_MAX_SLOTS ? WRITEBACK_MAX_SLOTS : slots;
+
+	drmModeResPtr res = drmModeGetResources(fd);
+	if(!res) {
+		logger_error("Failed to get resources %m");
+		free(wb);
+		return NULL;
+	}
+
+	int crtc_index = -1;
+	for(int i = 0; i < res->count_crtcs; i++) {
+		if(res->crtcs[i] == crtc_id) {
+			crtc_index = i;
+		}
+	}
+
+	if(crtc_index >= 0) {
+		wb->conn_id = writeback_find_connector(fd, res, crtc_index);
+	}
+	drmModeFreeResources(res);
+
+	if(!wb->conn_id) {
+		logger_error("No writeback connector for CRTC %u", crtc_id);
+		free(wb);
+		return NULL;
+	}
+
+	drmModeCrtcPtr crtc = drmModeGetCrtc(fd, crtc_id);
+	if(!crtc || !crtc->mode_valid) {
+		logger_error("CRTC %u isn't active, nothing to write back", crtc_id);
+		drmModeFreeCrtc(crtc);
+		free(wb);
+		return NULL;
+	}
+	wb->mode = crtc->mode;
+	drmModeFreeCrtc(crtc);
+
+	wb->conn_props = props_get(fd, wb->conn_id, DRM_MODE_OBJECT_CONNECTOR);
+	if(!wb->conn_props) {
+		writeback_destroy(wb);
+		return NULL;
+	}
+
+	if(!writeback_has_format(fd, wb->conn_props, DRM_FORMAT_XRGB8888)) {
+		logger_error("Writeback connector %u can't write XRGB8888", wb->conn_id);
+		writeback_destroy(wb);
+		return NULL;
+	}
+
+	if(writeback_init_slots(wb)) {
+		logger_error("Failed to allocate writeback buffers");
+		writeback_destroy(wb);
+		return NULL;
+	}
+
+	return wb;
+}
+
+void writeback_destroy(writeback_t *wb) {
+	//Unhook the connector again so the CRTC is left the way we found it
+	if(!wb->modeset) {
+		drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+		if(req) {
+			props_add(req, wb->conn_props, "CRTC_ID", 0);
+			drmModeAtomicCommit(wb->fd, req, DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+			drmModeAtomicFree(req);
+		}
+	}
+
+	for(uint32_t i = 0; i < wb->count; i++) {
+		slot_t *slot = &wb->slots[i];
+
+		if(slot->fence >= 0) {
+			close(slot->fence);
+		}
+
+		if(slot->frame.fb_id) {
+			drmModeRmFB(wb->fd, slot->frame.fb_id);
+		}
+
+		if(slot->frame.bo) {
+			buffer_unmap(slot->frame.bo);
+			buffer_destroy_dumb(wb->fd, slot->frame.bo);
+			free(slot->frame.bo);
+		}
+	}
+
+	props_free(wb->conn_props);
+	free(wb);
+}
+
+static int writeback_queue(writeback_t *wb) {
+	slot_t *slot = NULL;
+
+	for(uint32_t i = 0; i < wb->count; i++) {
+		if(wb->slots[i].state == SLOT_FREE) {
+			slot = &wb->slots[i];
+			break;
+		}
+	}
+
+	if(!slot) {
+		if(!wb->stalled) {
+			wb->stats.ring_full++;
+			wb->stalled = true;
+		}
+		return -EAGAIN;
+	}
+
+	drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+	if(!req) {
+		return -ENOMEM;
+	}
+
+	uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+	if(wb->modeset) {
+		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+	}
+
+	slot->fence = -1;
+	props_add(req, wb->conn_props, "CRTC_ID", wb->crtc_id);
+	props_add(req, wb->conn_props, "WRITEBACK_FB_ID", slot->frame.fb_id);
+	props_add(req, wb->conn_props, "WRITEBACK_OUT_FENCE_PTR", (uint64_t)(uintptr_t)&slot->fence);
+
+	int ret = drmModeAtomicCommit(wb->fd, req, flags, wb);
+	drmModeAtomicFree(req);
+	if(ret) {
+		ret = -errno;
+		if(ret != -EBUSY) {
+			logger_error("Writeback commit failed %m");
+		}
+		return ret;
+	}
+
+	wb->modeset = false;
+	wb->stalled = false;
+	wb->inflight = slot->frame.slot;
+	wb->stats.committed++;
+	slot->state = SLOT_QUEUED;
+	slot->flipped = false;
+	return 0;
+}
+
+static void writeback_deliver(writeback_t *wb, slot_t *slot) {
+	//Any vblank between two captured frames is a frame we lost
+	if(wb->last_seq && slot->frame.sequence > wb->last_seq + 1) {
+		wb->stats.dropped += slot->frame.sequence - wb->last_seq - 1;
+	}
+	wb->last_seq = slot->frame.sequence;
+	wb->stats.captured++;
+
+	slot->state = SLOT_CONSUMER;
+	slot->frame.held = false;
+	if(wb->fn) {
+		wb->fn(wb, &slot->frame, wb->user);
+	}
+
+	if(!slot->frame.held) {
+		slot->state = SLOT_FREE;
+	}
+}
+
+static void writeback_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+		unsigned int tv_usec, unsigned int crtc_id, void *data) {
+	writeback_t *wb = data;
+
+	if(wb->inflight < 0) {
+		return;
+	}
+
+	slot_t *slot = &wb->slots[wb->inflight];
+	slot->frame.sequence = sequence;
+	slot->frame.timestamp_ns = (uint64_t)tv_sec * 1000000000ull + (uint64_t)tv_usec * 1000ull;
+	slot->flipped = true;
+	wb->inflight = -1;
+
+	//Line up the next job straight away so the following vblank is covered,
+	//a full ring or a busy CRTC is retried from writeback_dispatch
+	int ret = writeback_queue(wb);
+	if(ret && ret != -EAGAIN && ret != -EBUSY) {
+		wb->error = ret;
+	}
+}
+
+//Kick off the first job, the pipeline keeps itself fed from then on
+int writeback_start(writeback_t *wb) {
+	return writeback_queue(wb);
+}
+
+/* Wait up to timeout_ms for the page flip event or a writeback fence
+ * and hand every finished frame to the consumer
+ *
+ * Returns 0 on success, -ETIMEDOUT if nothing arrived within timeout_ms
+ * or the negative errno of a failed commit
+ */
+int writeback_dispatch(writeback_t *wb, int timeout_ms) {
+	struct pollfd fds[WRITEBACK_MAX_SLOTS + 1];
+	slot_t *owners[WRITEBACK_MAX_SLOTS + 1];
+	drmEventContext evctx = {
+		.version = 3,
+		.page_flip_handler2 = writeback_flip_handler,
+	};
+	int count = 0;
+
+	fds[count].fd = wb->fd;
+	fds[count].events = POLLIN;
+	owners[count++] = NULL;
+
+	for(uint32_t i = 0; i < wb->count; i++) {
+		if(wb->slots[i].state == SLOT_QUEUED && wb->slots[i].fence >= 0) {
+			fds[count].fd = wb->slots[i].fence;
+			fds[count].events = POLLIN;
+			owners[count++] = &wb->slots[i];
+		}
+	}
+
+	int ret = poll(fds, count, timeout_ms);
+	if(ret < 0) {
+		return errno == EINTR ? 0 : -errno;
+	}
+
+	if(!ret) {
+		return -ETIMEDOUT;
+	}
+
+	if(fds[0].revents & POLLIN) {
+		drmHandleEvent(wb->fd, &evctx);
+	}
+
+	for(int i = 1; i < count; i++) {
+		slot_t *slot = owners[i];
+		if(!(fds[i].revents & (POLLIN | POLLERR))) {
+			continue;
+		}
+
+		close(slot->fence);
+		slot->fence = -1;
+
+		//Sequence numbers come from the flip event, handle a fence that
+		//beat its event on the next dispatch
+		if(!slot->flipped) {
+			continue;
+		}
+		writeback_deliver(wb, slot);
+	}
+
+	for(uint32_t i = 0; i < wb->count; i++) {
+		slot_t *slot = &wb->slots[i];
+		if(slot->state == SLOT_QUEUED && slot->flipped && slot->fence < 0) {
+			writeback_deliver(wb, slot);
+		}
+	}
+
+	if(wb->error) {
+		return wb->error;
+	}
+
+	//Restart the pipeline if it stalled on a full ring
+	if(wb->inflight < 0 && !wb->modeset) {
+		ret = writeback_queue(wb);
+		if(ret && ret != -EAGAIN && ret != -EBUSY) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+//Keep the frame's buffer out of the ring after the callback returns
+void writeback_hold(writeback_t *wb, writeback_frame_t *frame) {
+	frame->held = true;
+}
+
+void writeback_release(writeback_t *wb, writeback_frame_t *frame) {
+	frame->held = false;
+	wb->slots[frame->slot].state = SLOT_FREE;
+}
+
+void writeback_get_stats(writeback_t *wb, writeback_stats_t *stats) {
+	*stats = wb->stats;
+}
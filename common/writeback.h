@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "./buffers.h"
+
+#define WRITEBACK_MAX_SLOTS 8
+
+typedef struct writeback writeback_t;
+
+/*
+ * A finished writeback frame. bo is the buffer the display engine wrote
+ * into, it stays valid until the frame is released back to the ring
+ */
+typedef struct writeback_frame {
+	bo_t *bo;
+	uint32_t fb_id;
+	uint32_t format;
+	uint64_t sequence;
+	uint64_t timestamp_ns;
+	uint32_t slot;
+	bool held;
+} writeback_frame_t;
+
+typedef void (*writeback_frame_fn)(writeback_t *wb, writeback_frame_t *frame, void *user);
+
+typedef struct writeback_stats {
+	uint64_t committed;
+	uint64_t captured;
+	//vblanks that went by without landing in one of our buffers
+	uint64_t dropped;
+	//vblanks where every buffer was still owned by the consumer
+	uint64_t ring_full;
+} writeback_stats_t;
+
+writeback_t *writeback_create(int fd, uint32_t crtc_id, uint32_t slots, writeback_frame_fn fn, void *user);
+void writeback_destroy(writeback_t *wb);
+
+int writeback_start(writeback_t *wb);
+int writeback_dispatch(writeback_t *wb, int timeout_ms);
+void writeback_hold(writeback_t *wb, writeback_frame_t *frame);
+void writeback_release(writeback_t *wb, writeback_frame_t *frame);
+void writeback_get_stats(writeback_t *wb, writeback_stats_t *stats);
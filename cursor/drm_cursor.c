@@ -0,0 +1,205 @@
+/*
+ * Program: drm_cursor
+ *
+ * Put up a static frame on one output and sweep a hardware cursor
+ * across it. Each move is a commit touching only the cursor plane's
+ * CRTC_X/CRTC_Y (or drmModeMoveCursor on legacy drivers), the primary
+ * plane is never redrawn. Prints the cost of a move next to the cost
+ * of redrawing the full frame it replaces
+ */
+
+#include "drm.h"
+#include "drm_mode.h"
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include <unistd.h>
+#include <getopt.h>
+
+#include <log.h>
+#include <cursor.h>
+#include <deadline.h>
+#include <drm_common.h>
+#include <present.h>
+#include <timing.h>
+
+#define SPRITE_SIZE 32
+
+static void draw_background(bo_t *bo) {
+	for(uint32_t y = 0; y < bo->height; y++) {
+		uint32_t *row = (uint32_t *)((uint8_t *)bo->buffer + (size_t)y * bo->pitch);
+		for(uint32_t x = 0; x < bo->width; x++) {
+			row[x] = 0xff000000 | (x * 255 / bo->width) << 16 | (y * 255 / bo->height) << 8 | 0x60;
+		}
+	}
+}
+
+static void render_background(present_t *p, bo_t *bo, void *user) {
+	draw_background(bo);
+}
+
+//Arrow with its hotspot on the tip
+static void draw_arrow(uint32_t *argb) {
+	for(uint32_t y = 0; y < SPRITE_SIZE; y++) {
+		for(uint32_t x = 0; x < SPRITE_SIZE; x++) {
+			bool edge = x == 0 || x == y;
+			argb[y * SPRITE_SIZE + x] = x > y ? 0 : edge ? 0xff000000 : 0xffffffff;
+		}
+	}
+}
+
+//Crosshair with its hotspot in the middle
+static void draw_cross(uint32_t *argb) {
+	for(uint32_t y = 0; y < SPRITE_SIZE; y++) {
+		for(uint32_t x = 0; x < SPRITE_SIZE; x++) {
+			bool line = x == SPRITE_SIZE / 2 || y == SPRITE_SIZE / 2;
+			argb[y * SPRITE_SIZE + x] = line ? 0xffff4040 : 0;
+		}
+	}
+}
+
+void usage(const char *progname) {
+	printf("%s [-h] [-p <PATH_TO_DRM_DEV>] [-c <CONNECTOR_ID>] [-n <MOVES>]\n", progname);
+	printf("Options:\n-h = prints this help message\
+			\n-p = path to drm device (default /dev/dri/card0)\
+			\n-c = connector to use (default first connected)\
+			\n-n = number of cursor moves, one per vblank (default 600)\n");
+}
+
+int main(int argc, char **argv) {
+	const char *dev_path = "/dev/dri/card0";
+	uint32_t conn_id = 0;
+	uint64_t moves = 600;
+	uint32_t arrow[SPRITE_SIZE * SPRITE_SIZE];
+	uint32_t cross[SPRITE_SIZE * SPRITE_SIZE];
+	uint64_t deferred = 0;
+	hist_t *move_cost = calloc(1, sizeof(*move_cost));
+	drm_caps_t caps;
+	deadline_t sched;
+	int arg;
+
+	while((arg = getopt(argc, argv, ":p:c:n:h")) != -1) {
+		switch(arg) {
+		case 'p':
+			dev_path = optarg;
+			break;
+		case 'c':
+			conn_id = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			moves = strtoull(optarg, NULL, 0);
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 1;
+		case ':':
+			printf("-%c requires an argument\n", optopt);
+			return 1;
+		case '?':
+			printf("Unknown argument used -%c\n", optopt);
+			return 1;
+		}
+	}
+
+	if(!move_cost) {
+		logger_error("Failed to allocate histogram %m");
+		return 1;
+	}
+
+	int fd = open_drm_caps(dev_path, DRM_CAP_DUMB_BUFFER, &caps);
+	if(fd < 0) {
+		return 1;
+	}
+
+	if(!conn_id) {
+		conn_id = present_find_connector(fd);
+	}
+
+	present_t *p = present_create(fd, conn_id, 0, 2);
+	if(!p) {
+		close(fd);
+		return 1;
+	}
+	p->render = render_background;
+
+	//One full frame, everything after this is the cursor alone
+	uint64_t start = timing_now_ns();
+	if(present_frame(p) || present_wait(p, 1000)) {
+		present_destroy(p);
+		close(fd);
+		return 1;
+	}
+	uint64_t frame_ns = timing_now_ns() - start;
+
+	start = timing_now_ns();
+	draw_background(p->bos[present_next_buffer(p)]);
+	uint64_t redraw_ns = timing_now_ns() - start;
+
+	cursor_t *cursor = cursor_create(fd, p->crtc_id, p->crtc_index, &caps);
+	if(!cursor) {
+		present_destroy(p);
+		close(fd);
+		return 1;
+	}
+	p->cursor = cursor;
+
+	logger_info("Cursor on CRTC %u: %ux%u via %s", p->crtc_id, cursor->width, cursor->height,
+			cursor->atomic ? "cursor plane" : "legacy cursor ioctls");
+
+	draw_arrow(arrow);
+	draw_cross(cross);
+
+	deadline_init(&sched, p->timing.period_ns);
+	deadline_sync(&sched, fd, p->crtc_id);
+
+	for(uint64_t i = 0; i < moves; i++) {
+		//Switch sprite every second, after the first round these are cache hits
+		if(i % 60 == 0) {
+			int sprite = (i / 60) % 2 ?
+				cursor_upload(cursor, cross, SPRITE_SIZE, SPRITE_SIZE, SPRITE_SIZE / 2, SPRITE_SIZE / 2) :
+				cursor_upload(cursor, arrow, SPRITE_SIZE, SPRITE_SIZE, 0, 0);
+			int ret = sprite < 0 ? sprite : cursor_show(cursor, sprite);
+			if(ret && ret != -EBUSY) {
+				logger_error("Failed to show cursor sprite: %s", strerror(-ret));
+				break;
+			}
+		}
+
+		double angle = i * 0.05;
+		int32_t x = p->mode.hdisplay / 2 + cos(angle) * p->mode.hdisplay / 3;
+		int32_t y = p->mode.vdisplay / 2 + sin(angle) * p->mode.vdisplay / 3;
+
+		deadline_wait(&sched);
+		uint64_t t = timing_now_ns();
+		int ret = cursor_move(cursor, x, y);
+		hist_record(move_cost, timing_now_ns() - t);
+		deadline_rendered(&sched);
+
+		if(ret == -EBUSY) {
+			deferred++;
+		} else if(ret) {
+			logger_error("Cursor move failed: %s", strerror(-ret));
+			break;
+		}
+	}
+
+	logger_info("cursor move p50 %.1fus p99 %.1fus max %.1fus | %lu of %lu deferred by a busy CRTC",
+			hist_percentile(move_cost, 50) / 1000.0, hist_percentile(move_cost, 99) / 1000.0,
+			move_cost->max / 1000.0, deferred, move_cost->count);
+	logger_info("full frame instead: redraw %.1fus, first frame with modeset %.1fms",
+			redraw_ns / 1000.0, frame_ns / 1000000.0);
+
+	p->cursor = NULL;
+	cursor_destroy(cursor);
+	present_destroy(p);
+	free(move_cost);
+	close(fd);
+	return 0;
+}
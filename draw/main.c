@@ -1,45 +1,65 @@
 #include "drm.h"
 #include "drm_mode.h"
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 #include <stdlib.h>
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 
-#include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <getopt.h>
 
 #include <cairo/cairo.h>
 
+#include <buffers.h>
+#include <loop.h>
+#include <modes.h>
+#include <present.h>
+#include <route.h>
+#include <timing.h>
+#include <trace.h>
+
 
 static int g_verbose = 0;
 static bool g_master = false;
 #define likely(x)       __builtin_expect((x),1)
 #define unlikely(x)     __builtin_expect((x),0)
 
-typedef struct bo {
-	int fd;
-	int handle;
-	uint32_t height;
-	uint32_t width;
-	uint32_t pitch;
-	uint32_t bpp;
-	uint32_t id; 
-	uint64_t size;
-	off_t offset;
-	void *buffer;
-	cairo_surface_t *csurf;
-} bo_t;
+#define OUTPUT_BUFFERS 3
 
+/*
+ * One head. The render thread only ever draws into the buffer the commit
+ * thread assigned it and hands it back as ready, the presenter's
+ * front/pending state is only touched by the commit thread. The lock
+ * covers assigned, ready and quit
+ */
 typedef struct outputs {
-	drmModeCrtcPtr saved_crtc;
-	drmModeConnectorPtr connector;
-	drmModeEncoderPtr encoder;
-	bo_t *bo;
+	present_t *p;
+	pthread_t thread;
+	bool started;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int assigned;
+	int ready;
+	bool quit;
+
+	//Extra time spent in every render, to show one slow head doesn't hold up the rest
+	uint32_t delay_ms;
+	uint64_t rendered;
+	hist_t render_ns;
+	bool saved_png;
+
+	//eventfd the render thread pokes when a frame is ready
+	int wake_fd;
 } outputs_t;
 
 typedef struct drm_backend { 
@@ -48,15 +68,11 @@ typedef struct drm_backend {
 	drmModePlaneResPtr pres;
 	outputs_t *outputs;
 	int out_count;
-} drm_backend_t;
 
-typedef struct bo_creq {
-	int fd; 
-	uint32_t height;
-	uint32_t width;
-	uint32_t bpp;
-	uint32_t flags;
-} bo_creq_t;
+	uint64_t frames;
+	int wake_fd;
+	loop_t *loop;
+} drm_backend_t;
 
 void verbose(const char *fmt, ...) {
 	switch(g_verbose) {
@@ -70,74 +86,6 @@ void verbose(const char *fmt, ...) {
 	}
 }
 	
-int bo_map(bo_t *bo) {
-	struct drm_mode_map_dumb mreq = { 0 };
-	mreq.handle = bo->handle;
-
-	//Non of these should fail really if a correct bo type is passed in 
-	//but best to just check them 
-	if(drmIoctl(bo->fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq) < 0) {
-		return -1;
-	}
-
-	bo->offset = mreq.offset;
-	bo->buffer = mmap(NULL, bo->size, PROT_READ | PROT_WRITE, MAP_SHARED, bo->fd, bo->offset);
-	if(bo->buffer == MAP_FAILED) {
-		return -2;
-	}
-
-	return 0;
-}
-
-bo_t *bo_create(bo_creq_t bo_info) {
-	bo_t *bo = calloc(1, sizeof(*bo)); 
-	if(bo == NULL) {
-		NULL;
-	}
-
-	struct drm_mode_create_dumb creq = { 0 };
-	creq.height = bo_info.height;
-	creq.bpp = bo_info.bpp;
-	creq.width = bo_info.width;
-	creq.flags = bo_info.flags;
-
-	if(drmIoctl(bo_info.fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq) < 0) {
-		NULL; 
-	}
-
-	bo->width = creq.width;
-	bo->bpp = creq.bpp;
-	bo->height = creq.height;
-	bo->size = creq.size;
-	bo->pitch = creq.pitch;
-	bo->fd = bo_info.fd;
-	bo->handle = creq.handle;
-	
-	return bo;
-}
-
-int bo_unmap(bo_t *bo) {
-	if(bo->buffer == NULL) {
-		return -1;
-	}
-
-	return munmap(bo->buffer, bo->size);
-}
-
-int bo_destroy(bo_t *bo) {
-	struct drm_mode_destroy_dumb dreq = { 0 };
-	dreq.handle = bo->handle;
-	
-	//This shouldn't really fail but just check in case the user has passed in a bad ptr 
-	if(drmIoctl(bo->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq) < 0) {
-		return -1;
-	}
-	
-	//Free the bo 
-	free(bo);
-	return 0;
-}
-
 int drm_open(const char *path) {
 	int fd = open(path, O_CLOEXEC | O_RDWR);
 	//This shouldn't really happen and is a crash anyway 
@@ -168,40 +116,46 @@ int drm_open(const char *path) {
 	return fd; 
 }
 
-drmModeEncoderPtr drm_get_encoder(int fd, drmModeConnectorPtr conn) {
-	if(conn->encoder_id) {
-		return drmModeGetEncoder(fd, conn->encoder_id);
-	}
-	return drmModeGetEncoder(fd, conn->encoders[0]);
-}
-
-drmModeCrtcPtr drm_get_crtc(int fd, uint32_t crtc_id) {
-	if(crtc_id) {
-		return drmModeGetCrtc(fd, crtc_id);
-	}
-	return NULL;
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
 
-outputs_t *drm_get_outputs(int fd, drmModeResPtr res) {
+outputs_t *drm_get_outputs(int fd, drmModeResPtr res, int *count) {
 	outputs_t *outs = calloc(res->count_connectors, sizeof(*outs));
+	route_t route;
+
 	if(!outs) {
 		printf("Error Failed to allocate outputs\n");
 		return NULL;
 	}
 
-	for(int i = 0; i < res->count_connectors; i++) {
-		outs[i].connector = drmModeGetConnector(fd, res->connectors[i]);
-		
-		if(outs[i].connector->connection == DRM_MODE_CONNECTED) {
-			drmModeModeInfo mode = outs[i].connector->modes[0];
-			bo_creq_t creq = { 0 };
-			creq.fd = fd;
-			creq.width = mode.hdisplay;
-			creq.bpp = 32;
-			creq.height = mode.vdisplay;
-			outs[i].encoder = drm_get_encoder(fd, outs[i].connector);
-			outs[i].saved_crtc = drm_get_crtc(fd, outs[i].encoder->crtc_id);
-			outs[i].bo = bo_create(creq);
+	*count = 0;
+	if(route_probe(fd, &route)) {
+		return outs;
+	}
+
+	uint64_t start = now_ns();
+	route_solve(&route);
+	verbose("Routed %u outputs in %.1fus, %u moved\n", route.count_outputs,
+			(now_ns() - start) / 1000.0, route_changes(&route));
+
+	for(uint32_t i = 0; i < route.count_outputs; i++) {
+		const route_output_t *out = &route.outputs[i];
+		present_t *p = NULL;
+
+		if(out->crtc >= 0 && out->clone_of < 0) {
+			p = present_create(fd, out->conn_id, route.crtcs[out->crtc], OUTPUT_BUFFERS);
+		}
+
+		if(p) {
+			outs[*count].p = p;
+			outs[*count].assigned = -1;
+			outs[*count].ready = -1;
+			(*count)++;
+		} else {
+			printf("Error No usable CRTC for connector %u\n", out->conn_id);
 		}
 	}
 
@@ -265,78 +219,270 @@ void draw(bo_t *bo, uint32_t height, uint32_t pitch) {
 	}
 }
 
-int drm_prepare_buffers(int fd, outputs_t *out, int connectors) {
-	drmModeModeInfo mode;
-	drmModeConnectorPtr conn; 
-	bo_creq_t creq;
-
-	printf("%d\n", connectors);
-	for(int i = 0; i < connectors; i++) {
-		printf("%p %p\n", out[i].connector, &out[i]);
-		conn = out[i].connector;
-		if(conn->connection == DRM_MODE_CONNECTED) {
-			mode = conn->modes[0];
-			creq.fd = fd;
-			creq.bpp = 32;
-			creq.flags = 0;
-			creq.height = mode.vdisplay;
-			creq.width = mode.hdisplay;
-			out[i].bo = bo_create(creq);
-			printf("BO: %p\n", out[i].bo);
-			drmModeAddFB(out[i].bo->fd, mode.hdisplay, mode.vdisplay, 24, 32, out[i].bo->pitch, out[i].bo->handle, &out[i].bo->id);
-			bo_map(out[i].bo);
-			printf("Buffer: %p\n", out[i].bo->buffer);	
-			
-			out[i].bo->csurf = cairo_image_surface_create_for_data(out[i].bo->buffer, CAIRO_FORMAT_ARGB32, out[i].bo->width, out[i].bo->height, out[i].bo->pitch);
-			drmModeSetCrtc(out[i].bo->fd, out[i].saved_crtc->crtc_id, out[i].bo->id, 0, 0, &out[i].connector->connector_id, 1, &out[i].connector->modes[0]);
-			draw(out[i].bo, out[i].bo->height, out[i].bo->pitch);
-			drw_circle(out[i].bo, 200, 200, 100, 0x00);
-			drw_circle(out[i].bo, 200, 200, 90, 0xff);
-			drw_circle(out[i].bo, 200, 200, 20, 0x00);
-			drw_circle(out[i].bo, 400, 200, 100, 0x00); 
-			drw_circle(out[i].bo, 400, 200, 90, 0xff); 
-			drw_circle(out[i].bo, 400, 200, 20, 0x00);
-			cairo_surface_write_to_png(out[i].bo->csurf, "./image.png");
-			getchar();
-			drmModeSetCrtc(out[i].bo->fd, out[i].saved_crtc->crtc_id, out[i].saved_crtc->buffer_id, out[i].saved_crtc->x, out[i].saved_crtc->y, &out[i].connector->connector_id, 1, &out[i].saved_crtc->mode);
+void render_frame(outputs_t *out, bo_t *bo, uint64_t frame) {
+	int shift = (frame * 4) % (bo->width > 600 ? bo->width - 600 : 1);
+
+	draw(bo, bo->height, bo->pitch);
+	drw_circle(bo, 200 + shift, 200, 100, 0x00);
+	drw_circle(bo, 200 + shift, 200, 90, 0xff);
+	drw_circle(bo, 200 + shift, 200, 20, 0x00);
+	drw_circle(bo, 400 + shift, 200, 100, 0x00); 
+	drw_circle(bo, 400 + shift, 200, 90, 0xff); 
+	drw_circle(bo, 400 + shift, 200, 20, 0x00);
+
+	if(!out->saved_png) {
+		char path[64];
+		snprintf(path, sizeof(path), "./image-%u.png", out->p->conn_id);
+		cairo_surface_t *csurf = cairo_image_surface_create_for_data(bo->buffer, CAIRO_FORMAT_ARGB32,
+				bo->width, bo->height, bo->pitch);
+		cairo_surface_write_to_png(csurf, path);
+		cairo_surface_destroy(csurf);
+		out->saved_png = true;
+	}
+
+	if(out->delay_ms) {
+		usleep(out->delay_ms * 1000);
+	}
+}
+
+void *render_main(void *data) {
+	outputs_t *out = data;
+	uint64_t one = 1;
+
+	trace_thread_name("render");
+	pthread_mutex_lock(&out->lock);
+	for(;;) {
+		while(!out->quit && out->assigned < 0) {
+			pthread_cond_wait(&out->cond, &out->lock);
+		}
+
+		if(out->quit) {
+			break;
+		}
+
+		int buffer = out->assigned;
+		uint64_t frame = out->rendered;
+		pthread_mutex_unlock(&out->lock);
+
+		uint64_t start = now_ns();
+		trace_begin("render", out->p->crtc_id);
+		render_frame(out, out->p->bos[buffer], frame);
+		trace_end("render", out->p->crtc_id);
+		hist_record(&out->render_ns, now_ns() - start);
+
+		pthread_mutex_lock(&out->lock);
+		out->assigned = -1;
+		out->ready = buffer;
+		out->rendered++;
+		if(write(out->wake_fd, &one, sizeof(one)) != sizeof(one)) {
+			verbose("Failed to wake commit thread %m\n");
+		}
+	}
+	pthread_mutex_unlock(&out->lock);
+
+	return NULL;
+}
+
+/* Commit whatever each head has ready as soon as its own CRTC is free
+ * and give its render thread the next free buffer. Heads are committed
+ * one by one so a head that's still rendering never holds up another
+ *
+ * Returns true once every head has shown all its frames
+ */
+bool drm_service_outputs(drm_backend_t *backend) {
+	bool finished = true;
+
+	for(int i = 0; i < backend->out_count; i++) {
+		outputs_t *out = &backend->outputs[i];
+		present_t *p = out->p;
+
+		pthread_mutex_lock(&out->lock);
+		if(out->ready >= 0 && p->pending < 0 && p->frame < backend->frames) {
+			if(present_commit(p, out->ready)) {
+				printf("Error Commit failed on connector %u, stopping it\n", p->conn_id);
+				p->frame = backend->frames;
+			}
+			out->ready = -1;
 		}
+
+		if(p->frame < backend->frames && out->assigned < 0 && out->ready < 0) {
+			int buffer = present_next_buffer(p);
+			if(buffer >= 0) {
+				out->assigned = buffer;
+				pthread_cond_signal(&out->cond);
+			}
+		}
+
+		if(p->frame < backend->frames || p->pending >= 0) {
+			finished = false;
+		}
+		pthread_mutex_unlock(&out->lock);
 	}
 
-	return 0;
+	return finished;
 }
 
-int drm_init(const char *path) {
+void drm_ready(loop_t *loop, int fd, uint32_t events, void *user) {
+	drm_backend_t *backend = user;
+
+	present_handle_events(fd);
+	if(drm_service_outputs(backend)) {
+		loop_quit(loop);
+	}
+}
+
+void render_ready(loop_t *loop, int fd, uint32_t events, void *user) {
+	drm_backend_t *backend = user;
+	uint64_t count;
+
+	if(read(fd, &count, sizeof(count)) == sizeof(count) && drm_service_outputs(backend)) {
+		loop_quit(loop);
+	}
+}
+
+void on_signal(loop_t *loop, int signo, void *user) {
+	drm_backend_t *backend = user;
+
+	//Let in flight flips land so the CRTCs can be restored cleanly
+	for(int i = 0; i < backend->out_count; i++) {
+		backend->outputs[i].p->frame = backend->frames;
+	}
+	printf("Caught %s, stopping\n", strsignal(signo));
+	if(drm_service_outputs(backend)) {
+		loop_quit(loop);
+	}
+}
+
+void drm_cleanup(drm_backend_t *backend) {
+	for(int i = 0; i < backend->out_count; i++) {
+		outputs_t *out = &backend->outputs[i];
+
+		if(out->started) {
+			pthread_mutex_lock(&out->lock);
+			out->quit = true;
+			pthread_cond_signal(&out->cond);
+			pthread_mutex_unlock(&out->lock);
+			pthread_join(out->thread, NULL);
+		}
+
+		present_destroy(out->p);
+		pthread_cond_destroy(&out->cond);
+		pthread_mutex_destroy(&out->lock);
+	}
+
+	loop_destroy(backend->loop);
+	if(backend->wake_fd >= 0) {
+		close(backend->wake_fd);
+	}
+
+	free(backend->outputs);
+	drmModeFreePlaneResources(backend->pres);
+	drmModeFreeResources(backend->res);
+	close(backend->fd);
+	free(backend);
+}
+
+int drm_init(const char *path, uint64_t frames, uint32_t slow_ms) {
 	drm_backend_t *backend = calloc(1, sizeof(*backend));
+	if(!backend) {
+		return -1;
+	}
+	trace_thread_name("commit");
 	
 	//Get the file descriptor
 	backend->fd = drm_open(path);
 	if(backend->fd < 0) {
+		free(backend);
 		return -1;
 	}
 
+	//Before any render thread exists so they all inherit the blocked signals
+	backend->loop = loop_create();
+	backend->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	backend->frames = frames;
 	backend->res  = drmModeGetResources(backend->fd);
 	backend->pres = drmModeGetPlaneResources(backend->fd);
 	verbose("FD: %d\nRes: %p\nPres: %p", backend->fd,
 			backend->res, backend->pres);
+	if(!backend->loop || backend->wake_fd < 0 || !backend->res) {
+		drm_cleanup(backend);
+		return -1;
+	}
 	
-	backend->outputs = drm_get_outputs(backend->fd, backend->res);
-	drm_prepare_buffers(backend->fd, backend->outputs, backend->res->count_connectors);
+	backend->outputs = drm_get_outputs(backend->fd, backend->res, &backend->out_count);
+	if(!backend->outputs || !backend->out_count) {
+		printf("Error No connected outputs\n");
+		drm_cleanup(backend);
+		return -1;
+	}
+
+	loop_add_signal(backend->loop, SIGINT, on_signal, backend);
+	loop_add_signal(backend->loop, SIGTERM, on_signal, backend);
+	loop_add_fd(backend->loop, backend->fd, EPOLLIN, drm_ready, backend);
+	loop_add_fd(backend->loop, backend->wake_fd, EPOLLIN, render_ready, backend);
+
+	bool started = true;
+	for(int i = 0; i < backend->out_count; i++) {
+		outputs_t *out = &backend->outputs[i];
+
+		out->wake_fd = backend->wake_fd;
+		out->delay_ms = i == 0 ? slow_ms : 0;
+		pthread_mutex_init(&out->lock, NULL);
+		pthread_cond_init(&out->cond, NULL);
+		out->started = pthread_create(&out->thread, NULL, render_main, out) == 0;
+		if(!out->started) {
+			printf("Error connector %u: failed to start its render thread\n", out->p->conn_id);
+			started = false;
+			continue;
+		}
+		printf("Connector %u on CRTC %u %dx%d@%d%s\n", out->p->conn_id, out->p->crtc_id,
+				out->p->mode.hdisplay, out->p->mode.vdisplay, out->p->mode.vrefresh,
+				out->delay_ms ? " (slowed)" : "");
+	}
+
+	//An output nobody renders for would never reach its frame count
+	if(!started) {
+		drm_cleanup(backend);
+		return -1;
+	}
+
+	if(!drm_service_outputs(backend)) {
+		loop_run(backend->loop);
+	}
+
+	for(int i = 0; i < backend->out_count; i++) {
+		outputs_t *out = &backend->outputs[i];
+		char name[32];
+
+		snprintf(name, sizeof(name), "connector %u", out->p->conn_id);
+		timing_summary(&out->p->timing, name);
+		printf("%s: render p50 %.2fms p99 %.2fms\n", name,
+				hist_percentile(&out->render_ns, 50) / 1e6, hist_percentile(&out->render_ns, 99) / 1e6);
+	}
+
+	drm_cleanup(backend);
 	return 0;
 }
 
 void usage(const char *progname) {
-	printf("%s [-mvh] -p <PATH_TO_DRM_DEV>\n", progname);
+	printf("%s [-mvh] -p <PATH_TO_DRM_DEV> [-n <FRAMES>] [-s <MS>] [-M <MODE>]\n", progname);
 	printf("Options:\n-h = prints this help message\
 			\n-m = override drm master lock(may cause errors)\
 			\n-v = verbose output\
-			\n-p = provide path to drm device\n");
+			\n-p = provide path to drm device\
+			\n-n = frames to show on every output (default 600)\
+			\n-s = make the first output's renders this many ms slower\
+			\n-M = mode preferred, refresh, bandwidth or WIDTHxHEIGHT[@HZ] (default preferred)\n");
 }
 
 int main(int argc, char **argv) {
 	int arg = 0;
 	char *dev_path = "/dev/dri/card0"; //default
+	uint64_t frames = 600;
+	uint32_t slow_ms = 0;
+	mode_request_t req;
 	
-	while((arg = getopt(argc, argv, ":p:mvh")) != -1) {
+	while((arg = getopt(argc, argv, ":p:n:s:M:mvh")) != -1) {
 		switch(arg) {
 		case 'h': 
 			usage(argv[0]);
@@ -344,6 +490,19 @@ int main(int argc, char **argv) {
 		case 'p':
 			dev_path = optarg;
 			break;
+		case 'n':
+			frames = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			slow_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'M':
+			if(mode_request_from_str(optarg, &req)) {
+				printf("Unknown mode %s\n", optarg);
+				return 1;
+			}
+			mode_set_default(&req);
+			break;
 		case 'm':
 			//We want the master lock but allow the user
 			//to override as it's useful for 
@@ -363,5 +522,5 @@ int main(int argc, char **argv) {
 		}
 	}
 	
-	drm_init(dev_path);
+	return drm_init(dev_path, frames, slow_ms) ? 1 : 0;
 }
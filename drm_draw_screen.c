@@ -1,5 +1,19 @@
+/*
+ * Program: drm_draw_screen
+ *
+ * Light the first connected output with a gradient and hold it for 10
+ * seconds. Every init stage (open, resources, connector probe, routing,
+ * mode, dumb buffer, AddFB, mmap, fill and SetCrtc) is timed with
+ * CLOCK_MONOTONIC and its ioctls counted, the breakdown ends at the
+ * first pixel. -n runs the whole path that many times (restoring the
+ * CRTC in between) for median and p99 time to first pixel, -j prints
+ * the result as JSON on stdout. With DRM_TESTS_IOCTLS=1 in the
+ * environment a per-ioctl latency table is printed at exit
+ */
+
 #include "drm.h"
 #include "drm_mode.h"
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <xf86drm.h>
@@ -13,14 +27,23 @@
 
 #include <sys/mman.h>
 #include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <getopt.h>
+#include <libudev.h>
 
 #include "./common/buffers.h"
+#include "./common/loop.h"
+#include "./common/modes.h"
+#include "./common/phase.h"
+#include "./common/route.h"
 
 typedef struct output {
 	drmModeConnectorPtr connector;
 	drmModeCrtcPtr new_crtc;
 	drmModeEncoderPtr encoder;
 	drmModeCrtcPtr saved_crtc;
+	bo_t *bo;
 	uint32_t *buffer;
 	size_t buffer_size;
 	uint32_t fb_id;
@@ -77,6 +100,7 @@ void drm_cleanup(drm_t *dev) {
 	if(dev->out.buffer) {
 		munmap(dev->out.buffer, dev->out.buffer_size);	
 	}
+	free(dev->out.bo);
 
 	if(dev->out.saved_crtc) {
 		drmModeFreeCrtc(dev->out.saved_crtc);
@@ -100,17 +124,82 @@ void drm_cleanup(drm_t *dev) {
 	free(dev);
 }
 
-drm_t *init_drm() {
+typedef struct show {
+	uint32_t crtc_id;
+	uint64_t vblanks;
+} show_t;
+
+//Re-arm every vblank so the count shows how long the frame really stayed up
+static void show_vblank(int fd, uint64_t sequence, uint64_t ns, uint64_t user_data) {
+	show_t *show = (show_t *)(uintptr_t)user_data;
+
+	show->vblanks++;
+	drmCrtcQueueSequence(fd, show->crtc_id, DRM_CRTC_SEQUENCE_RELATIVE, 1, NULL, user_data);
+}
+
+static void show_timeout(loop_t *loop, loop_source_t *timer, uint64_t expirations, void *user) {
+	loop_quit(loop);
+}
+
+static void show_signal(loop_t *loop, int signo, void *user) {
+	logger_info("Caught %s, restoring CRTC", strsignal(signo));
+	loop_quit(loop);
+}
+
+static void show_hotplug(loop_t *loop, struct udev_device *dev, const char *action, void *user) {
+	const char *hotplug = udev_device_get_property_value(dev, "HOTPLUG");
+
+	if(hotplug && strcmp(hotplug, "1") == 0) {
+		logger_info("Hotplug on %s", udev_device_get_sysname(dev));
+	}
+}
+
+/* Keep the frame up for seconds, or until SIGINT/SIGTERM so the CRTC
+ * always gets restored, while servicing DRM and udev events
+ */
+static void show_for(int fd, uint32_t crtc_id, uint32_t seconds) {
+	show_t show = { .crtc_id = crtc_id };
+	drmEventContext evctx = {
+		.version = 4,
+		.sequence_handler = show_vblank,
+	};
+
+	loop_t *loop = loop_create();
+	if(!loop) {
+		return;
+	}
+
+	loop_add_drm(loop, fd, &evctx);
+	loop_add_signal(loop, SIGINT, show_signal, NULL);
+	loop_add_signal(loop, SIGTERM, show_signal, NULL);
+	loop_add_udev(loop, "drm", show_hotplug, NULL);
+
+	loop_source_t *timer = loop_add_timer(loop, show_timeout, NULL);
+	if(timer && !loop_timer_set(timer, seconds * 1000000000ull, 0, false)) {
+		drmCrtcQueueSequence(fd, crtc_id, DRM_CRTC_SEQUENCE_RELATIVE, 1, NULL, (uint64_t)(uintptr_t)&show);
+		loop_run(loop);
+	}
+
+	loop_destroy(loop);
+	logger_info("Frame was up for %lu vblanks", show.vblanks);
+}
+
+/* Bring the first connected output up, marking each stage in log, and
+ * keep the frame up for hold seconds before putting the old CRTC back
+ */
+drm_t *init_drm(const char *path, phase_log_t *log, uint32_t hold) {
 	drm_t *dev = calloc(1, sizeof(*dev));
 	if(!dev) {
 		return NULL;
 	}
 
-	dev->fd = open_drm("/dev/dri/card0", DRM_CAP_DUMB_BUFFER);
+	phase_start(log);
+	dev->fd = open_drm(path, DRM_CAP_DUMB_BUFFER);
 	if(dev->fd < 0) {
 		drm_cleanup(dev);
 		return NULL;
 	}
+	phase_mark(log, "open");
 	
 	//TODO: Functionise this drm init stuff 
 	dev->res = drmModeGetResources(dev->fd);
@@ -118,6 +207,7 @@ drm_t *init_drm() {
 		drm_cleanup(dev);
 		return NULL;
 	}
+	phase_mark(log, "resources");
 
 	//TODO allow multiple monitors to be displayed to as at the moment it's 
 	//just the first connected monitor 
@@ -138,62 +228,93 @@ drm_t *init_drm() {
 		drm_cleanup(dev);
 		return NULL;
 	}
+	phase_mark(log, "connector");
 
-	dev->out.encoder = drmModeGetEncoder(dev->fd, dev->out.connector->encoder_id);
+	//The connector may be dark (no encoder bound yet), route it rather than
+	//trusting whatever it's attached to
+	route_t route;
+	if(route_probe(dev->fd, &route) || route_solve(&route) < 1) {
+		logger_fatal("Failed to route outputs");
+		drm_cleanup(dev);
+		return NULL;
+	}
+
+	dev->out.encoder = drmModeGetEncoder(dev->fd, route_encoder_for(&route, dev->out.connector->connector_id));
 	if(dev->out.encoder == NULL) {
 		logger_fatal("Failed to get Encoder");
 		drm_cleanup(dev);
 		return NULL;
 	}
 
-	dev->out.saved_crtc = drmModeGetCrtc(dev->fd, dev->out.encoder->crtc_id);
+	dev->out.saved_crtc = drmModeGetCrtc(dev->fd, route_crtc_for(&route, dev->out.connector->connector_id));
 	if(dev->out.saved_crtc == NULL) { 
 		logger_fatal("Failed to get CRTC");
 		drm_cleanup(dev);
 		return NULL;
 	}
+	phase_mark(log, "route");
 
-	/*TODO: Maybe don't just take the first mode and look for preffered mode
-	 * also maybe check if there are any modes (there always should be but best to check 
-	 */
-	/*TODO: Move this code to it's own function*/
-	dev->out.mode = dev->out.connector->modes[0];
+	if(mode_pick(dev->out.connector, &dev->out.mode)) {
+		drm_cleanup(dev);
+		return NULL;
+	}
+	phase_mark(log, "mode");
 	
 	bo_t *bo = buffer_create_dumb(dev->fd, 32, dev->out.mode.vdisplay, dev->out.mode.hdisplay);
-	logger_info("BO: %p", bo);
+	if(!bo) {
+		logger_fatal("Failed to create dumb buffer");
+		drm_cleanup(dev);
+		return NULL;
+	}
+	dev->out.bo = bo;
+	phase_mark(log, "create");
 	
 	if(drmModeAddFB(dev->fd, bo->width, bo->height, 24, 32, bo->pitch, bo->handle, &dev->out.fb_id)) {
 		logger_fatal("Failed to add DRM FB");
 		drm_cleanup(dev);
 		return NULL; 
 	}
+	phase_mark(log, "addfb");
 
-	dev->out.buffer_size = bo->size; //save this for freeing later
-	bo_map(dev->fd, bo);
-	dev->out.buffer = bo->buffer;
-	if(drmModeSetCrtc(dev->fd, 
-				dev->out.saved_crtc->crtc_id, dev->out.fb_id, 0, 0, 
-				&dev->out.connector->connector_id, 1, &dev->out.mode)) {
-		logger_fatal("Failed to set CRTC: %m");
+	if(bo_map(dev->fd, bo)) {
+		logger_fatal("Failed to map dumb buffer");
 		drm_cleanup(dev);
 		return NULL;
 	}
-	
+	dev->out.buffer_size = bo->size; //save this for freeing later
+	dev->out.buffer = bo->buffer;
+	phase_mark(log, "mmap");
 
 	//TODO Draw something not sure what yet maybe try like a PNG though because that 
 	//would be cool
-	//based on 
+	//Filled before SetCrtc so the first pixel out is already the frame
 	for (int i = 0; i < bo->height; i++) {
 		for (int j = 0; j < bo->width; j++) {
 			uint8_t color = 0xFF * (i * j) / (bo->height * bo->width);
-			*(dev->out.buffer + i * bo->width + j) = (color << 16 | color);
+			*(dev->out.buffer + i * bo->pitch / 4 + j) = (color << 16 | color);
 		}
 	}
+	phase_mark(log, "fill");
 
-	//TODO maybe try implementing some sort of crash protection because atm if we crash the TTY just dies with us
-	sleep(10);
+	if(drmModeSetCrtc(dev->fd, 
+				dev->out.saved_crtc->crtc_id, dev->out.fb_id, 0, 0, 
+				&dev->out.connector->connector_id, 1, &dev->out.mode)) {
+		logger_fatal("Failed to set CRTC: %m");
+		drm_cleanup(dev);
+		return NULL;
+	}
+	phase_mark(log, "setcrtc");
+
+	if(hold) {
+		show_for(dev->fd, dev->out.saved_crtc->crtc_id, hold);
+	}
 
-	if(drmModeSetCrtc(dev->fd, dev->out.saved_crtc->crtc_id, dev->out.saved_crtc->buffer_id, dev->out.saved_crtc->x, dev->out.saved_crtc->y, &dev->out.connector->connector_id, 1, &dev->out.saved_crtc->mode)) {
+	//A CRTC that was dark when we found it goes back off rather than
+	//being handed its (invalid) old mode with no FB
+	drmModeCrtcPtr saved = dev->out.saved_crtc;
+	if(drmModeSetCrtc(dev->fd, saved->crtc_id, saved->buffer_id, saved->x, saved->y,
+				saved->buffer_id ? &dev->out.connector->connector_id : NULL, saved->buffer_id ? 1 : 0,
+				saved->buffer_id ? &saved->mode : NULL)) {
 		logger_fatal("Failed to reset CRTC: %m");
 		drm_cleanup(dev);
 		return NULL;
@@ -201,9 +322,64 @@ drm_t *init_drm() {
 	return dev;
 }
 
+void usage(const char *progname) {
+	printf("%s [-hj] [-p <PATH_TO_DRM_DEV>] [-n <RUNS>]\n", progname);
+	printf("Options:\n-h = prints this help message\
+			\n-p = path to drm device (default /dev/dri/card0)\
+			\n-n = run the init path this many times for median/p99, the frame isn't held (default 1)\
+			\n-j = print the startup breakdown as JSON on stdout\n");
+}
+
 int main(int argc, char **argv) {
-	void *var = init_drm();
+	const char *dev_path = "/dev/dri/card0";
+	uint32_t runs = 1;
+	bool json = false;
+	int arg;
+
+	while((arg = getopt(argc, argv, ":p:n:jh")) != -1) {
+		switch(arg) {
+		case 'p':
+			dev_path = optarg;
+			break;
+		case 'n':
+			runs = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			json = true;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 1;
+		case ':':
+			printf("-%c requires an argument\n", optopt);
+			return 1;
+		case '?':
+			printf("Unknown argument used -%c\n", optopt);
+			return 1;
+		}
+	}
+
+	runs = runs ? runs : 1;
+	phase_log_t *logs = calloc(runs, sizeof(*logs));
+	if(!logs) {
+		return 1;
+	}
+
+	//Only a single run shows the frame for a while, repeats go straight on
+	uint32_t done = 0;
+	while(done < runs) {
+		drm_t *dev = init_drm(dev_path, &logs[done], runs > 1 ? 0 : 10);
+		if(!dev) {
+			break;
+		}
+		drm_cleanup(dev);
+		done++;
+	}
+
+	if(done) {
+		phase_summary(logs, done, "first_pixel", json);
+	}
 
-	if(var != NULL) drm_cleanup(var);
-	return 0;
+	free(logs);
+	return done == runs ? 0 : 1;
 }
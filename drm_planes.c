@@ -10,6 +10,8 @@
 
 #include <stdlib.h>
 #include <log.h>
+#include <modes.h>
+#include <route.h>
 
 #include <sys/mman.h>
 #include <stdio.h>
@@ -140,25 +142,33 @@ drm_t *init_drm() {
 		return NULL;
 	}
 
-	dev->out.encoder = drmModeGetEncoder(dev->fd, dev->out.connector->encoder_id);
+	//The connector may be dark (no encoder bound yet), route it rather than
+	//trusting whatever it's attached to
+	route_t route;
+	if(route_probe(dev->fd, &route) || route_solve(&route) < 1) {
+		logger_fatal("Failed to route outputs");
+		drm_cleanup(dev);
+		return NULL;
+	}
+
+	dev->out.encoder = drmModeGetEncoder(dev->fd, route_encoder_for(&route, dev->out.connector->connector_id));
 	if(dev->out.encoder == NULL) {
 		logger_fatal("Failed to get Encoder");
 		drm_cleanup(dev);
 		return NULL;
 	}
 
-	dev->out.saved_crtc = drmModeGetCrtc(dev->fd, dev->out.encoder->crtc_id);
+	dev->out.saved_crtc = drmModeGetCrtc(dev->fd, route_crtc_for(&route, dev->out.connector->connector_id));
 	if(dev->out.saved_crtc == NULL) { 
 		logger_fatal("Failed to get CRTC");
 		drm_cleanup(dev);
 		return NULL;
 	}
 
-	/*TODO: Maybe don't just take the first mode and look for preffered mode
-	 * also maybe check if there are any modes (there always should be but best to check 
-	 */
-	/*TODO: Move this code to it's own function*/
-	dev->out.mode = dev->out.connector->modes[0];
+	if(mode_pick(dev->out.connector, &dev->out.mode)) {
+		drm_cleanup(dev);
+		return NULL;
+	}
 
 	struct drm_mode_create_dumb creq = { 0 };
 	struct drm_mode_map_dumb mreq = { 0 };
@@ -225,7 +235,12 @@ drm_t *init_drm() {
 	drmModeSetPlane(dev->fd, dev->pres->planes[0], dev->out.saved_crtc->crtc_id, 0, 
 			0, 50, 50, 320, 320, 100 << 16, 150 << 16, 320 << 16, 320 << 16);
 
-	if(drmModeSetCrtc(dev->fd, dev->out.saved_crtc->crtc_id, dev->out.saved_crtc->buffer_id, dev->out.saved_crtc->x, dev->out.saved_crtc->y, &dev->out.connector->connector_id, 1, &dev->out.saved_crtc->mode)) {
+	//A CRTC that was dark when we found it goes back off rather than
+	//being handed its (invalid) old mode with no FB
+	drmModeCrtcPtr saved = dev->out.saved_crtc;
+	if(drmModeSetCrtc(dev->fd, saved->crtc_id, saved->buffer_id, saved->x, saved->y,
+				saved->buffer_id ? &dev->out.connector->connector_id : NULL, saved->buffer_id ? 1 : 0,
+				saved->buffer_id ? &saved->mode : NULL)) {
 		logger_fatal("Failed to reset CRTC: %m");
 		drm_cleanup(dev);
 		return NULL;
@@ -18,6 +18,11 @@
 
 #include <sys/mman.h>
 #include <stdio.h>
+#include <signal.h>
+
+#include <loop.h>
+#include <modes.h>
+#include <route.h>
 
 typedef struct drm {
 	int fd;
@@ -109,6 +114,44 @@ void drm_cleanup(drm_t *dev) {
 	free(dev);
 }
 
+static void wait_stdin(loop_t *loop, int fd, uint32_t events, void *user) {
+	char buf[64];
+
+	//Any input (or EOF) ends the wait like getchar used to
+	if(read(fd, buf, sizeof(buf)) >= 0) {
+		loop_quit(loop);
+	}
+}
+
+static void wait_signal(loop_t *loop, int signo, void *user) {
+	loop_quit(loop);
+}
+
+//Block until enter is pressed or the process is asked to stop
+static void wait_for_exit(void) {
+	loop_t *loop = loop_create();
+	if(!loop) {
+		return;
+	}
+
+	//epoll refuses regular files and /dev/null, read those directly since
+	//they never block for long anyway
+	if(!loop_add_fd(loop, STDIN_FILENO, EPOLLIN, wait_stdin, NULL)) {
+		char buf[64];
+
+		loop_destroy(loop);
+		if(read(STDIN_FILENO, buf, sizeof(buf)) < 0) {
+			logger_warn("Failed to read stdin %m");
+		}
+		return;
+	}
+
+	loop_add_signal(loop, SIGINT, wait_signal, NULL);
+	loop_add_signal(loop, SIGTERM, wait_signal, NULL);
+	loop_run(loop);
+	loop_destroy(loop);
+}
+
 drm_t *init_drm(const char *path) {
 	drm_t *dev = calloc(1, sizeof(*dev));
 	if(!dev) {
@@ -153,24 +196,37 @@ drm_t *init_drm(const char *path) {
 		return NULL;
 	}
 
-	dev->encoder = drmModeGetEncoder(dev->fd, dev->connector->encoders[0]);
+	//Route every connected output so this one gets a CRTC nobody else needs
+	route_t route;
+	if(route_probe(dev->fd, &route) || route_solve(&route) < 1) {
+		logger_fatal("Failed to route outputs");
+		drm_cleanup(dev);
+		return NULL;
+	}
+	route_log(&route);
+
+	dev->encoder = drmModeGetEncoder(dev->fd, route_encoder_for(&route, dev->connector->connector_id));
 	if(!dev->encoder) {
 		logger_fatal("Failed to get encoder");
 		drm_cleanup(dev);
 		return NULL;
 	}
 	
-	dev->crtc = drmModeGetCrtc(dev->fd, dev->res->crtcs[0]);
+	dev->crtc = drmModeGetCrtc(dev->fd, route_crtc_for(&route, dev->connector->connector_id));
 	if(!dev->crtc) {
 		logger_fatal("Failed to get crtc");
 		drm_cleanup(dev);
 		return NULL;
 	}
 	
-	dev->mode = dev->connector->modes[0];
+	if(mode_pick(dev->connector, &dev->mode)) {
+		drm_cleanup(dev);
+		return NULL;
+	}
 
 	logger_info("%s", gbm_device_get_backend_name(dev->gbm_dev));
-	dev->bo = gbm_bo_create(dev->gbm_dev, 2560, 1440, GBM_FORMAT_XRGB8888, GBM_BO_USE_SCANOUT | GBM_BO_USE_WRITE);
+	dev->bo = gbm_bo_create(dev->gbm_dev, dev->mode.hdisplay, dev->mode.vdisplay, GBM_FORMAT_XRGB8888,
+			GBM_BO_USE_SCANOUT | GBM_BO_USE_WRITE);
 	if(!dev->bo) {
 		logger_fatal("Failed to create GBM_BO %m");
 		drm_cleanup(dev);
@@ -210,19 +266,35 @@ drm_t *init_drm(const char *path) {
 		}
 	}
 	
-	getchar();
+	wait_for_exit();
 	//Unmap the buffer 
 	gbm_bo_unmap(dev->bo, (void *)dev->buffer);
 
 	//Sleep for 4 seconds so we have a chance to see what's on 
 	//screen
 	
-	//reset the original CRTC 
-	drmModeSetCrtc(dev->fd, dev->crtc->crtc_id, dev->crtc->buffer_id, dev->crtc->x, dev->crtc->y, &dev->connector->connector_id, 1, &dev->crtc->mode);
+	//reset the original CRTC, switching it back off if it was dark
+	drmModeCrtcPtr saved = dev->crtc;
+	if(drmModeSetCrtc(dev->fd, saved->crtc_id, saved->buffer_id, saved->x, saved->y,
+				saved->buffer_id ? &dev->connector->connector_id : NULL, saved->buffer_id ? 1 : 0,
+				saved->buffer_id ? &saved->mode : NULL)) {
+		logger_error("Failed to reset CRTC %m");
+	}
 	return dev;
 }
 
 int main(int argc, char **argv) {
+	mode_request_t req;
+
+	//Optional second argument picks the mode, e.g. refresh or 1920x1080@144
+	if(argc > 2) {
+		if(mode_request_from_str(argv[2], &req)) {
+			printf("Unknown mode %s\n", argv[2]);
+			return 1;
+		}
+		mode_set_default(&req);
+	}
+
 	void *var = init_drm(argv[1]);
 
 
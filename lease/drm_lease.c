@@ -0,0 +1,170 @@
+/*
+ * Program: drm_lease
+ *
+ * Split one device's outputs between processes with DRM leases. With -s
+ * it runs the lease manager: it holds DRM master and hands each client
+ * that connects to the socket a lease of one output (connector, CRTC,
+ * primary and cursor plane), revoking it when the client goes away.
+ * Without -s it is a client: it asks for an output, flips a bar on it
+ * through its own lease fd (no compositor in between, the manager isn't
+ * involved once the lease is granted) and exits. On vkms run one client
+ * per output, any more are refused until one of them exits
+ */
+
+#include "drm.h"
+#include "drm_mode.h"
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include <unistd.h>
+#include <getopt.h>
+
+#include <log.h>
+#include <drm_common.h>
+#include <lease.h>
+#include <loop.h>
+#include <present.h>
+#include <timing.h>
+
+#define BAR_WIDTH 64
+
+//Every client a different colour so the outputs can be told apart
+static void render_bar(present_t *p, bo_t *bo, void *user) {
+	uint32_t color = *(uint32_t *)user;
+	uint32_t bar = (p->frame * 8) % bo->width;
+
+	for(uint32_t y = 0; y < bo->height; y++) {
+		uint32_t *row = (uint32_t *)((uint8_t *)bo->buffer + (size_t)y * bo->pitch);
+		for(uint32_t x = 0; x < bo->width; x++) {
+			row[x] = x - bar < BAR_WIDTH ? 0xffffffff : color;
+		}
+	}
+}
+
+static void on_signal(loop_t *loop, int signo, void *user) {
+	logger_info("Caught %s, stopping", strsignal(signo));
+	loop_quit(loop);
+}
+
+static int run_manager(const char *dev_path, const char *sock_path) {
+	int fd = open_drm(dev_path, DRM_CAP_DUMB_BUFFER);
+	if(fd < 0) {
+		return 1;
+	}
+
+	//Leasing needs master, which only one process can hold
+	if(drmSetMaster(fd) && !drmIsMaster(fd)) {
+		logger_error("%s: can't become DRM master %m", dev_path);
+		close(fd);
+		return 1;
+	}
+
+	loop_t *loop = loop_create();
+	lease_manager_t *m = loop ? lease_manager_create(fd, loop, sock_path) : NULL;
+	if(!m) {
+		loop_destroy(loop);
+		close(fd);
+		return 1;
+	}
+
+	loop_add_signal(loop, SIGINT, on_signal, m);
+	loop_add_signal(loop, SIGTERM, on_signal, m);
+	loop_run(loop);
+
+	logger_info("%u leases granted, %u revoked", m->granted, m->revoked);
+	lease_manager_destroy(m);
+	loop_destroy(loop);
+	close(fd);
+	return 0;
+}
+
+static int run_client(const char *sock_path, uint32_t conn_id, uint64_t frames) {
+	uint32_t color = 0xff000000 | ((uint32_t)getpid() * 2654435761u >> 8 & 0x7f7f7f);
+
+	lease_t *lease = lease_request(sock_path, conn_id);
+	if(!lease) {
+		return 1;
+	}
+
+	//The lease fd is master of the leased objects and sees nothing else
+	present_t *p = present_create(lease->fd, lease->grant.conn_id, lease->grant.crtc_id, 2);
+	if(!p) {
+		lease_release(lease);
+		return 1;
+	}
+	p->render = render_bar;
+	p->user = &color;
+
+	logger_info("Lease %u: presenting on connector %u CRTC %u %dx%d@%d (%s)", lease->grant.lessee_id,
+			p->conn_id, p->crtc_id, p->mode.hdisplay, p->mode.vdisplay, p->mode.vrefresh,
+			p->atomic ? "atomic" : "legacy");
+
+	while(p->frame < frames) {
+		if(present_frame(p)) {
+			break;
+		}
+
+		present_wait(p, 1000);
+		timing_report(&p->timing, "lease", 1000000000ull);
+	}
+
+	timing_summary(&p->timing, "lease");
+	present_destroy(p);
+	lease_release(lease);
+	return 0;
+}
+
+void usage(const char *progname) {
+	printf("%s [-hs] [-p <PATH_TO_DRM_DEV>] [-S <SOCKET>] [-c <CONNECTOR_ID>] [-n <FRAMES>]\n", progname);
+	printf("Options:\n-h = prints this help message\
+			\n-s = run the lease manager\
+			\n-p = path to drm device for the manager (default /dev/dri/card0)\
+			\n-S = manager socket (default " LEASE_SOCKET ")\
+			\n-c = connector to ask for (default any free one)\
+			\n-n = number of frames to present (default 600)\n");
+}
+
+int main(int argc, char **argv) {
+	const char *dev_path = "/dev/dri/card0";
+	const char *sock_path = LEASE_SOCKET;
+	uint32_t conn_id = 0;
+	uint64_t frames = 600;
+	bool manager = false;
+	int arg;
+
+	while((arg = getopt(argc, argv, ":p:S:c:n:sh")) != -1) {
+		switch(arg) {
+		case 'p':
+			dev_path = optarg;
+			break;
+		case 'S':
+			sock_path = optarg;
+			break;
+		case 'c':
+			conn_id = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			frames = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			manager = true;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 1;
+		case ':':
+			printf("-%c requires an argument\n", optopt);
+			return 1;
+		case '?':
+			printf("Unknown argument used -%c\n", optopt);
+			return 1;
+		}
+	}
+
+	return manager ? run_manager(dev_path, sock_path) : run_client(sock_path, conn_id, frames);
+}
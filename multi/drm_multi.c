@@ -0,0 +1,166 @@
+/*
+ * Program: drm_multi
+ *
+ * Drive a moving bar on every connected output of every KMS device at
+ * once. Each device gets its own thread, event loop and presenters so
+ * devices never wait on each other. Prints per output timing and the
+ * aggregate frame rate, which should grow with the number of devices.
+ * Several vkms instances (configfs, /sys/kernel/config/vkms) make a
+ * multi GPU box to test on
+ */
+
+#include "drm.h"
+#include "drm_mode.h"
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include <unistd.h>
+#include <getopt.h>
+
+#include <log.h>
+#include <gpu.h>
+#include <loop.h>
+#include <present.h>
+#include <timing.h>
+
+#define BAR_WIDTH 64
+
+typedef struct waiter {
+	gpu_runtime_t *rt;
+	uint32_t finished;
+} waiter_t;
+
+static void render_bar(present_t *p, bo_t *bo, void *user) {
+	uint32_t bar = (p->frame * 8) % bo->width;
+
+	for(uint32_t y = 0; y < bo->height; y++) {
+		uint32_t *row = (uint32_t *)((uint8_t *)bo->buffer + (size_t)y * bo->pitch);
+		for(uint32_t x = 0; x < bo->width; x++) {
+			row[x] = x - bar < BAR_WIDTH ? 0xffffffff : 0xff302028;
+		}
+	}
+}
+
+static void on_done(loop_t *loop, int fd, uint32_t events, void *user) {
+	waiter_t *w = user;
+	uint64_t count;
+
+	if(read(fd, &count, sizeof(count)) == sizeof(count)) {
+		w->finished += count;
+	}
+
+	//Only the threads that actually started ever signal
+	if(w->finished >= w->rt->started) {
+		loop_quit(loop);
+	}
+}
+
+static void on_signal(loop_t *loop, int signo, void *user) {
+	waiter_t *w = user;
+
+	logger_info("Caught %s, stopping", strsignal(signo));
+	gpu_runtime_stop(w->rt);
+}
+
+void usage(const char *progname) {
+	printf("%s [-h] [-n <FRAMES>] [-b <BUFFERS>]\n", progname);
+	printf("Options:\n-h = prints this help message\
+			\n-n = frames to present on each output (default 600)\
+			\n-b = buffers per output (default 2)\n");
+}
+
+int main(int argc, char **argv) {
+	uint64_t frames = 600;
+	uint32_t buffers = 2;
+	int arg;
+
+	while((arg = getopt(argc, argv, ":n:b:h")) != -1) {
+		switch(arg) {
+		case 'n':
+			frames = strtoull(optarg, NULL, 0);
+			break;
+		case 'b':
+			buffers = strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 1;
+		case ':':
+			printf("-%c requires an argument\n", optopt);
+			return 1;
+		case '?':
+			printf("Unknown argument used -%c\n", optopt);
+			return 1;
+		}
+	}
+
+	//Signals are blocked before any device thread exists so only this
+	//thread's signalfd ever sees them
+	loop_t *loop = loop_create();
+	if(!loop) {
+		return 1;
+	}
+
+	waiter_t w = { 0 };
+	loop_add_signal(loop, SIGINT, on_signal, &w);
+	loop_add_signal(loop, SIGTERM, on_signal, &w);
+
+	w.rt = gpu_runtime_open(buffers);
+	if(!w.rt) {
+		loop_destroy(loop);
+		return 1;
+	}
+
+	uint32_t outputs = 0;
+	for(uint32_t i = 0; i < w.rt->count; i++) {
+		gpu_t *gpu = w.rt->gpus[i];
+		for(uint32_t j = 0; j < gpu->count; j++) {
+			present_t *p = gpu->outputs[j];
+			logger_info("%s: connector %u on CRTC %u %dx%d@%d", gpu->path, p->conn_id, p->crtc_id,
+					p->mode.hdisplay, p->mode.vdisplay, p->mode.vrefresh);
+		}
+		outputs += gpu->count;
+	}
+
+	loop_add_fd(loop, w.rt->done_fd, EPOLLIN, on_done, &w);
+	uint64_t start = timing_now_ns();
+	if(gpu_runtime_start(w.rt, frames, render_bar, NULL)) {
+		gpu_runtime_close(w.rt);
+		loop_destroy(loop);
+		return 1;
+	}
+
+	loop_run(loop);
+	gpu_runtime_join(w.rt);
+	uint64_t elapsed = timing_now_ns() - start;
+
+	uint64_t total = 0;
+	for(uint32_t i = 0; i < w.rt->count; i++) {
+		gpu_t *gpu = w.rt->gpus[i];
+		uint64_t flips = 0;
+
+		for(uint32_t j = 0; j < gpu->count; j++) {
+			char name[96];
+			snprintf(name, sizeof(name), "%s conn %u", gpu->path, gpu->outputs[j]->conn_id);
+			timing_summary(&gpu->outputs[j]->timing, name);
+			flips += gpu->outputs[j]->timing.flips;
+		}
+
+		double secs = (gpu->end_ns - gpu->start_ns) / 1e9;
+		logger_info("%s: %lu flips over %u outputs in %.2fs (%.1f/s)", gpu->path, flips, gpu->count,
+				secs, secs > 0 ? flips / secs : 0.0);
+		total += flips;
+	}
+
+	logger_info("all: %lu flips on %u outputs across %u devices in %.2fs (%.1f/s)", total, outputs,
+			w.rt->count, elapsed / 1e9, total / (elapsed / 1e9));
+
+	gpu_runtime_close(w.rt);
+	loop_destroy(loop);
+	return 0;
+}
@@ -0,0 +1,615 @@
+/*
+ * Program: drm_present
+ *
+ * Flip a moving bar on one output as fast as the display allows and
+ * print the presentation timing (flip latency, frame interval jitter
+ * and skipped vblanks) once a second. The options switch on the
+ * scheduling, format, scaling, colour, handoff and VRR paths one at a
+ * time, -h lists them
+ */
+
+#include "drm.h"
+#include "drm_mode.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include <unistd.h>
+#include <getopt.h>
+
+#include <log.h>
+#include <drm_common.h>
+#include <color.h>
+#include <fence.h>
+#include <format.h>
+#include <pool.h>
+#include <present.h>
+#include <rotate.h>
+#include <scale.h>
+#include <deadline.h>
+#include <modes.h>
+#include <timing.h>
+#include <trace.h>
+#include <vt.h>
+#include <vrr.h>
+
+#define BAR_WIDTH 64
+
+typedef struct renderer {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool quit;
+
+	bo_t *bo;
+	uint64_t frame;
+	int timeline;
+} renderer_t;
+
+//With keep only the bar is drawn, over whatever the buffer holds
+static void draw_bar(bo_t *bo, uint64_t frame, bool keep) {
+	uint32_t bar = (frame * 8) % bo->width;
+
+	for(uint32_t y = 0; y < bo->height; y++) {
+		uint32_t *row = (uint32_t *)((uint8_t *)bo->buffer + (size_t)y * bo->pitch);
+		for(uint32_t x = 0; x < bo->width; x++) {
+			if(x - bar < BAR_WIDTH) {
+				row[x] = 0xffffffff;
+			} else if(!keep) {
+				row[x] = 0xff202830;
+			}
+		}
+	}
+}
+
+static void render_bar(present_t *p, bo_t *bo, void *user) {
+	hist_t *render = user;
+	uint64_t start = timing_now_ns();
+
+	draw_bar(bo, p->frame, p->handoff_copy);
+	hist_record(render, timing_now_ns() - start);
+}
+
+//Render thread, signals the sw_sync timeline once per finished frame
+static void *renderer_main(void *data) {
+	renderer_t *r = data;
+
+	trace_thread_name("renderer");
+	pthread_mutex_lock(&r->lock);
+	for(;;) {
+		while(!r->quit && !r->bo) {
+			pthread_cond_wait(&r->cond, &r->lock);
+		}
+
+		if(r->quit) {
+			break;
+		}
+
+		bo_t *bo = r->bo;
+		uint64_t frame = r->frame;
+		pthread_mutex_unlock(&r->lock);
+
+		trace_begin("render", 0);
+		draw_bar(bo, frame, false);
+		trace_end("render", 0);
+		sw_sync_timeline_inc(r->timeline, 1);
+
+		pthread_mutex_lock(&r->lock);
+		r->bo = NULL;
+		pthread_cond_broadcast(&r->cond);
+	}
+	pthread_mutex_unlock(&r->lock);
+
+	return NULL;
+}
+
+//Queue a frame once the renderer has finished the one before
+static void renderer_submit(renderer_t *r, bo_t *bo, uint64_t frame) {
+	pthread_mutex_lock(&r->lock);
+	while(r->bo) {
+		pthread_cond_wait(&r->cond, &r->lock);
+	}
+	r->bo = bo;
+	r->frame = frame;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/* Pipelined loop, the commit for a frame goes in as soon as the previous
+ * flip lands whether or not rendering has finished, KMS waits on the in
+ * fence. The out fence of each commit is polled next to the DRM fd
+ */
+static void run_fenced(present_t *p, uint64_t frames) {
+	renderer_t r = { .timeline = sw_sync_timeline_create() };
+	uint64_t confirmed = 0;
+	uint32_t value = 0;
+	int out_fence = -1;
+
+	if(r.timeline < 0) {
+		logger_error("sw_sync isn't available, can't run the fenced pipeline");
+		return;
+	}
+
+	if(present_enable_explicit_sync(p)) {
+		logger_warn("No IN_FENCE_FD/OUT_FENCE_PTR, fences will be waited on by the CPU");
+	}
+
+	pthread_mutex_init(&r.lock, NULL);
+	pthread_cond_init(&r.cond, NULL);
+	int ret = pthread_create(&r.thread, NULL, renderer_main, &r);
+	if(ret) {
+		logger_error("Failed to start the render thread: %s", strerror(ret));
+		pthread_cond_destroy(&r.cond);
+		pthread_mutex_destroy(&r.lock);
+		close(r.timeline);
+		return;
+	}
+
+	while(p->frame < frames) {
+		int buffer = present_next_buffer(p);
+
+		//Without a fence the commit would scan out a buffer still being drawn
+		int fence = sw_sync_fence_create(r.timeline, "render", ++value);
+		if(fence < 0) {
+			logger_error("Failed to create the render fence: %s", strerror(-fence));
+			break;
+		}
+		renderer_submit(&r, p->bos[buffer], p->frame);
+
+		while(p->pending >= 0) {
+			struct pollfd fds[2] = {
+				{ .fd = p->fd, .events = POLLIN },
+				{ .fd = out_fence, .events = POLLIN },
+			};
+
+			if(poll(fds, out_fence >= 0 ? 2 : 1, 1000) <= 0) {
+				break;
+			}
+
+			if(fds[0].revents & POLLIN) {
+				present_handle_events(p->fd);
+			}
+
+			if(out_fence >= 0 && fds[1].revents & POLLIN) {
+				confirmed++;
+				close(out_fence);
+				out_fence = -1;
+			}
+		}
+
+		present_set_in_fence(p, fence);
+		if(present_commit(p, buffer)) {
+			break;
+		}
+
+		if(out_fence >= 0) {
+			close(out_fence);
+		}
+		out_fence = present_take_out_fence(p);
+		timing_report(&p->timing, "fenced", 1000000000ull);
+	}
+
+	pthread_mutex_lock(&r.lock);
+	r.quit = true;
+	pthread_cond_broadcast(&r.cond);
+	pthread_mutex_unlock(&r.lock);
+	pthread_join(r.thread, NULL);
+
+	if(out_fence >= 0) {
+		close(out_fence);
+	}
+	close(r.timeline);
+	pthread_cond_destroy(&r.cond);
+	pthread_mutex_destroy(&r.lock);
+
+	logger_info("fenced: %lu frames committed, %lu confirmed on screen by out fence", p->frame, confirmed);
+}
+
+static void on_vt_release(void *user) {
+	present_suspend(user);
+}
+
+static void on_vt_acquire(void *user) {
+	present_resume(user);
+}
+
+/* Sit out the time without DRM master. On a VT the switch back resumes
+ * the presenter, otherwise nobody tells us so keep asking for master
+ * until whoever took it lets go
+ *
+ * Returns 0 once the output is back up
+ */
+static int wait_master(present_t *p, vt_t *vt) {
+	if(vt) {
+		if(vt_wait_active(vt, -1)) {
+			return -1;
+		}
+		return p->suspended ? -1 : 0;
+	}
+
+	for(int tries = 0; drmSetMaster(p->fd); tries++) {
+		if(tries == 200) {
+			logger_error("DRM master didn't come back in 10s");
+			return -1;
+		}
+		usleep(50000);
+	}
+
+	return present_resume(p);
+}
+
+void usage(const char *progname) {
+	printf("%s [-afhs] [-p <PATH_TO_DRM_DEV>] [-c <CONNECTOR_ID>] [-n <FRAMES>] [-q <QUALITY>] [-d <DITHER>] [-r <PERCENT>] [-i <FILTER>] [-R <ROTATION>] [-g <EXPONENT>] [-x <CTM>] [-E <MIN-MAX>] [-w <MS>] [-m <MODE>] [-HkVv]\n", progname);
+	printf("Options:\n-h = prints this help message\
+			\n-p = path to drm device (default /dev/dri/card0)\
+			\n-c = connector to present on (default first connected)\
+			\n-n = number of frames to present (default 600)\
+			\n-a = async (tearing) flips when the driver supports them, reports how many tore\
+			\n-f = render on a separate thread and hand frames over with IN_FENCE_FD/OUT_FENCE_PTR\
+			\n-q = scanout format quality low, medium, high or deep (default XRGB8888)\
+			\n-d = dither when converting down none, bayer or noise (default noise)\
+			\n-r = render at this percentage of the mode size, upscaled by the plane (default 100)\
+			\n-i = CPU scaler filter if the plane can't nearest, bilinear, bicubic or lanczos (default bilinear)\
+			\n-R = rotate 0, 90, 180 or 270 with optional ,reflect-x ,reflect-y (e.g. 90,reflect-x), on the CPU if the plane can't\
+			\n-g = gamma curve out = in^EXPONENT on every channel, on the CPU if the CRTC has no LUT\
+			\n-x = colour matrix, 9 comma separated numbers row by row, on the CPU if the CRTC has no CTM\
+			\n-H = skip the modeset if the output already runs the mode\
+			\n-k = with -H, start the first frame from what was on screen\
+			\n-V = handle VT switches, resuming with a single commit\
+			\n-v = adaptive sync (VRR) when the connector is capable\
+			\n-E = VRR range to model in Hz when the EDID has none (e.g. 48-144)\
+			\n-w = up to this many ms of random extra render work per frame, the summary models VRR pacing against it\
+			\n-m = mode preferred, refresh, bandwidth or WIDTHxHEIGHT[@HZ] (default preferred)\
+			\n-s = schedule frames just in time before vblank\n");
+	printf("Environment:\n%s=<PATH> = write a Chrome trace of every render, commit, flip and event dispatch to PATH\n",
+			TRACE_ENV);
+}
+
+int main(int argc, char **argv) {
+	const char *dev_path = "/dev/dri/card0";
+	uint32_t conn_id = 0;
+	uint64_t frames = 600;
+	bool deadline = false;
+	bool async = false;
+	bool fenced = false;
+	bool negotiate = false;
+	bool handoff = false;
+	bool keep = false;
+	bool switching = false;
+	bool vrr = false;
+	vrr_range_t range = { 0 };
+	uint32_t work_ms = 0;
+	vrr_stats_t pacing;
+	mode_request_t req;
+	vt_t *vt = NULL;
+	format_quality_t quality = FORMAT_QUALITY_HIGH;
+	format_dither_t dither = FORMAT_DITHER_NOISE;
+	uint32_t scale = 100;
+	scale_filter_t filter = SCALE_BILINEAR;
+	uint32_t rotation = DRM_MODE_ROTATE_0;
+	struct drm_color_lut curve[256];
+	double exponent = 0;
+	double ctm[9];
+	color_transform_t color = { 0 };
+	hist_t render = { 0 };
+	pool_t *pool = NULL;
+	drm_caps_t caps;
+	deadline_t sched;
+	int arg;
+
+	while((arg = getopt(argc, argv, ":p:c:n:q:d:r:i:R:g:x:E:w:m:afsHkVvh")) != -1) {
+		switch(arg) {
+		case 'p':
+			dev_path = optarg;
+			break;
+		case 'c':
+			conn_id = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			frames = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			deadline = true;
+			break;
+		case 'a':
+			async = true;
+			break;
+		case 'f':
+			fenced = true;
+			break;
+		case 'H':
+			handoff = true;
+			break;
+		case 'k':
+			keep = true;
+			break;
+		case 'V':
+			switching = true;
+			break;
+		case 'v':
+			vrr = true;
+			break;
+		case 'E':
+			if(vrr_range_from_str(optarg, &range)) {
+				printf("Bad VRR range %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'm':
+			if(mode_request_from_str(optarg, &req)) {
+				printf("Unknown mode %s\n", optarg);
+				return 1;
+			}
+			mode_set_default(&req);
+			break;
+		case 'w':
+			work_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			if(format_quality_from_str(optarg, &quality)) {
+				printf("Unknown quality %s\n", optarg);
+				return 1;
+			}
+			negotiate = true;
+			break;
+		case 'd':
+			if(format_dither_from_str(optarg, &dither)) {
+				printf("Unknown dither %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'r':
+			scale = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			if(rotate_from_str(optarg, &rotation)) {
+				printf("Unknown rotation %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'g':
+			exponent = strtod(optarg, NULL);
+			if(exponent <= 0) {
+				printf("Bad gamma exponent %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'x':
+			if(color_ctm_from_str(optarg, ctm)) {
+				printf("Bad colour matrix %s\n", optarg);
+				return 1;
+			}
+			color.ctm = ctm;
+			break;
+		case 'i':
+			if(scale_filter_from_str(optarg, &filter)) {
+				printf("Unknown filter %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 1;
+		case ':':
+			printf("-%c requires an argument\n", optopt);
+			return 1;
+		case '?':
+			printf("Unknown argument used -%c\n", optopt);
+			return 1;
+		}
+	}
+
+	trace_thread_name("present");
+	int fd = open_drm_caps(dev_path, DRM_CAP_DUMB_BUFFER, &caps);
+	if(fd < 0) {
+		return 1;
+	}
+
+	if(!conn_id) {
+		conn_id = present_find_connector(fd);
+	}
+
+	uint64_t started = timing_now_ns();
+	present_t *p = present_create(fd, conn_id, 0, fenced ? 3 : 2);
+	if(!p) {
+		close(fd);
+		return 1;
+	}
+	p->render = render_bar;
+	p->user = &render;
+
+	//Before any threads start, they all need the switch signals blocked
+	if(switching) {
+		vt = vt_create(fd, on_vt_release, on_vt_acquire, p);
+	}
+
+	//The fenced renderer draws straight into the scanout buffers
+	if((scale != 100 || rotation != DRM_MODE_ROTATE_0) && fenced) {
+		logger_warn("-r and -R may need the staging buffer, ignored with -f");
+	} else {
+		if(rotation != DRM_MODE_ROTATE_0) {
+			present_set_rotation(p, rotation);
+		}
+
+		if(scale != 100) {
+			present_set_scale(p, scale, filter);
+		}
+	}
+
+	if(exponent > 0) {
+		color_lut_power(curve, 256, exponent);
+		color.gamma = curve;
+		color.gamma_size = 256;
+	}
+
+	//Before the first commit so a CPU fallback gets a staging buffer
+	if(color.gamma || color.ctm) {
+		present_set_color(p, &color);
+		if(fenced && p->color && p->color->cpu) {
+			logger_warn("The CRTC can't run the colour transform and -f skips the CPU fallback");
+		}
+	}
+
+	if(async) {
+		present_set_mode(p, PRESENT_MODE_ASYNC, &caps);
+	}
+
+	if(handoff) {
+		present_enable_handoff(p, keep);
+	}
+
+	if(vrr) {
+		present_enable_vrr(p);
+	}
+
+	//-E wins over the EDID, nothing to model without either
+	if(!range.max_hz) {
+		range = p->vrr_range;
+	}
+
+	if(negotiate && fenced) {
+		logger_warn("-q needs the staging buffer, ignored with -f");
+	} else if(negotiate) {
+		const format_info_t *fmt = format_choose(fd, p->plane_id, &p->mode, quality);
+		if(fmt->fourcc != p->format->fourcc) {
+			present_set_format(p, fmt->fourcc, dither);
+		}
+	}
+
+	//Conversion and the CPU fallbacks all spread their rows over the pool
+	if(p->staging) {
+		pool = pool_create(0);
+		p->pool = pool;
+	}
+
+	logger_info("Presenting on connector %u CRTC %u %dx%d@%d from %ux%u (%s, %s, %s)", p->conn_id, p->crtc_id,
+			p->mode.hdisplay, p->mode.vdisplay, p->mode.vrefresh, p->width, p->height, p->atomic ? "atomic" : "legacy",
+			p->present_mode == PRESENT_MODE_ASYNC ? "async" : "vsync", p->format->name);
+
+	if(fenced) {
+		run_fenced(p, frames);
+		timing_summary(&p->timing, "fenced");
+		present_destroy(p);
+		vt_destroy(vt);
+		close(fd);
+		return 0;
+	}
+
+	deadline_init(&sched, p->timing.period_ns);
+	deadline_sync(&sched, fd, p->crtc_id);
+	vrr_stats_init(&pacing, &range, p->timing.period_ns);
+
+	while(p->frame < frames) {
+		uint64_t flips = p->timing.flips;
+
+		if(deadline) {
+			deadline_wait(&sched);
+		} else {
+			deadline_begin_now(&sched);
+		}
+
+		//Like a calibration daemon pushing its transform every frame,
+		//unchanged it costs a hash and no blob uploads
+		if(p->color) {
+			present_set_color(p, &color);
+		}
+
+		//Without master back the next frame would wait for a switch that already happened
+		if(vt && vt_dispatch(vt)) {
+			break;
+		}
+
+		//Uneven frame times, what VRR is there to smooth out
+		if(work_ms) {
+			usleep(rand() % (work_ms * 1000));
+		}
+
+		int ret = present_frame(p);
+		if(ret == -EACCES && !wait_master(p, vt)) {
+			deadline_sync(&sched, fd, p->crtc_id);
+			continue;
+		}
+
+		if(ret) {
+			break;
+		}
+		deadline_rendered(&sched);
+		vrr_frame_ready(&pacing, timing_now_ns());
+
+		present_wait(p, 1000);
+		if(p->frame == 1) {
+			logger_info("first frame on screen %.1fms after start (%s)", (timing_now_ns() - started) / 1e6,
+					p->handoff.match ? "handoff, no modeset" : "modeset");
+		}
+
+		if(p->timing.flips != flips) {
+			deadline_presented(&sched, p->timing.last_seq, p->timing.last_ns);
+			vrr_frame_shown(&pacing, p->timing.last_ns);
+		}
+
+		timing_report(&p->timing, "present", 1000000000ull);
+	}
+
+	timing_summary(&p->timing, "present");
+	deadline_summary(&sched, deadline ? "deadline" : "naive");
+	vrr_summary(&pacing, p->vrr ? "vrr" : "fixed");
+	if(async) {
+		logger_info("async flips %lu | torn %lu (%.1f%%) | fallbacks to vsync %lu",
+				p->stats.async_flips, p->stats.torn_flips,
+				p->stats.async_flips ? p->stats.torn_flips * 100.0 / p->stats.async_flips : 0.0,
+				p->stats.async_fallbacks);
+	}
+
+	if(p->format->fourcc != DRM_FORMAT_XRGB8888) {
+		const format_info_t *xrgb = format_info(DRM_FORMAT_XRGB8888);
+		uint64_t bytes = format_frame_bytes(p->format, &p->mode);
+		uint64_t full = format_frame_bytes(xrgb, &p->mode);
+		logger_info("%s: %.2f MiB/frame vs %.2f MiB/frame %s (-%.0f%%), %.1f MiB/s less scanout | convert p50 %.2fms p99 %.2fms",
+				p->format->name, bytes / 1048576.0, full / 1048576.0, xrgb->name, (full - bytes) * 100.0 / full,
+				(format_bandwidth(xrgb, &p->mode) - format_bandwidth(p->format, &p->mode)) / 1048576.0,
+				hist_percentile(&p->convert, 50) / 1e6, hist_percentile(&p->convert, 99) / 1e6);
+	}
+
+	//Each frame fills width x height, the plane or the CPU scaler does the rest
+	double area = (double)p->width * p->height / ((double)p->mode.hdisplay * p->mode.vdisplay);
+	logger_info("render %ux%u (%.0f%% of the pixels) | fill p50 %.2fms p99 %.2fms", p->width, p->height,
+			area * 100, hist_percentile(&render, 50) / 1e6, hist_percentile(&render, 99) / 1e6);
+	if(p->cpu_scale) {
+		logger_info("CPU scale to %ux%u on %u threads | p50 %.2fms p99 %.2fms", p->mode.hdisplay,
+				p->mode.vdisplay, pool_threads(pool), hist_percentile(&p->scale_ns, 50) / 1e6,
+				hist_percentile(&p->scale_ns, 99) / 1e6);
+	}
+
+	if(p->cpu_rotate) {
+		logger_info("CPU rotate by %u degrees on %u threads | p50 %.2fms p99 %.2fms", rotate_degrees(p->rotation),
+				pool_threads(pool), hist_percentile(&p->rotate_ns, 50) / 1e6, hist_percentile(&p->rotate_ns, 99) / 1e6);
+	}
+
+	if(p->resume_ns.count) {
+		logger_info("resumed %lu times | p50 %.2fms p99 %.2fms (frame %.2fms)", p->resume_ns.count,
+				hist_percentile(&p->resume_ns, 50) / 1e6, hist_percentile(&p->resume_ns, 99) / 1e6,
+				p->timing.period_ns / 1e6);
+	}
+
+	if(p->color && p->color->cpu) {
+		logger_info("CPU colour transform on %u threads | p50 %.2fms p99 %.2fms", pool_threads(pool),
+				hist_percentile(&p->color_ns, 50) / 1e6, hist_percentile(&p->color_ns, 99) / 1e6);
+	} else if(p->color) {
+		logger_info("colour transform on the CRTC | %lu uploads, %lu skipped as unchanged",
+				p->color->uploads, p->color->skipped);
+	}
+
+	present_destroy(p);
+	vt_destroy(vt);
+	pool_destroy(pool);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,215 @@
+/*
+ * Program: drm_span
+ *
+ * Show one desktop across every connected output of a device from a
+ * single framebuffer. Each CRTC scans out its own window of the canvas
+ * so a ball bouncing across the whole desktop is rendered once per frame
+ * however many heads there are. Prints the layout and how much scanout
+ * memory the shared canvas takes compared with a buffer set per output
+ */
+
+#include "drm.h"
+#include "drm_mode.h"
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include <unistd.h>
+#include <getopt.h>
+
+#include <log.h>
+#include <drm_common.h>
+#include <loop.h>
+#include <modes.h>
+#include <span.h>
+#include <timing.h>
+
+#define BALL_SIZE 96
+
+typedef struct state {
+	span_t *span;
+	uint64_t frames;
+	int32_t x, y;
+	int32_t dx, dy;
+	bool stopping;
+} state_t;
+
+static void fill_rect(bo_t *bo, int32_t x, int32_t y, uint32_t w, uint32_t h, uint32_t color) {
+	for(uint32_t row = 0; row < h; row++) {
+		uint32_t *line = (uint32_t *)((uint8_t *)bo->buffer + (size_t)(y + row) * bo->pitch);
+		for(uint32_t col = 0; col < w; col++) {
+			line[x + col] = color;
+		}
+	}
+}
+
+//The whole desktop in one pass, the heads never know about each other
+static void render(state_t *s, bo_t *bo) {
+	span_t *span = s->span;
+
+	fill_rect(bo, 0, 0, span->width, span->height, 0xff202830);
+
+	//Frame each head's window so the seams are visible
+	for(uint32_t i = 0; i < span->count; i++) {
+		const span_output_t *out = &span->outputs[i];
+		uint32_t w = out->mode.hdisplay;
+		uint32_t h = out->mode.vdisplay;
+
+		fill_rect(bo, out->x, out->y, w, 4, 0xff80a0c0);
+		fill_rect(bo, out->x, out->y + h - 4, w, 4, 0xff80a0c0);
+		fill_rect(bo, out->x, out->y, 4, h, 0xff80a0c0);
+		fill_rect(bo, out->x + w - 4, out->y, 4, h, 0xff80a0c0);
+	}
+
+	if(s->x + s->dx < 0 || s->x + s->dx + BALL_SIZE > (int32_t)span->width) {
+		s->dx = -s->dx;
+	}
+	if(s->y + s->dy < 0 || s->y + s->dy + BALL_SIZE > (int32_t)span->height) {
+		s->dy = -s->dy;
+	}
+	s->x += s->dx;
+	s->y += s->dy;
+	fill_rect(bo, s->x, s->y, BALL_SIZE, BALL_SIZE, 0xffe0a040);
+}
+
+//Draw and commit the next frame if the last one has landed on every head
+static void kick(loop_t *loop, state_t *s) {
+	span_t *span = s->span;
+
+	if(span->pending >= 0) {
+		return;
+	}
+
+	//Legacy modesets land without an event so go round again
+	while(!s->stopping && span->frame < s->frames && span->pending < 0) {
+		int buffer = span_next_buffer(span);
+		render(s, span->bos[buffer]);
+		if(span_commit(span, buffer)) {
+			s->stopping = true;
+		}
+	}
+
+	if(span->pending < 0) {
+		loop_quit(loop);
+	}
+}
+
+static void on_drm(loop_t *loop, int fd, uint32_t events, void *user) {
+	span_handle_events(fd);
+	kick(loop, user);
+}
+
+static void on_signal(loop_t *loop, int signo, void *user) {
+	state_t *s = user;
+
+	logger_info("Caught %s, stopping", strsignal(signo));
+	s->stopping = true;
+	kick(loop, s);
+}
+
+static void report(const span_t *span) {
+	static const char *layouts[] = { "row", "column", "mirror" };
+
+	logger_info("%ux%u %s canvas over %u outputs (%s)", span->width, span->height,
+			layouts[span->layout], span->count, span->atomic ? "atomic" : "legacy");
+	for(uint32_t i = 0; i < span->count; i++) {
+		const span_output_t *out = &span->outputs[i];
+		logger_info("connector %u on CRTC %u: %ux%u at %u,%u", out->conn_id, out->crtc_id,
+				out->mode.hdisplay, out->mode.vdisplay, out->x, out->y);
+	}
+
+	//Uneven heads leave dead canvas around the smaller ones, so this can go negative
+	int64_t saved = (int64_t)span->split_bytes - (int64_t)span->span_bytes;
+	logger_info("scanout memory: %.1f MiB spanning vs %.1f MiB per output, %s %.1f MiB (%.1f%%)",
+			span->span_bytes / 1048576.0, span->split_bytes / 1048576.0,
+			saved >= 0 ? "saved" : "costs", llabs(saved) / 1048576.0,
+			span->split_bytes ? 100.0 * llabs(saved) / span->split_bytes : 0.0);
+}
+
+void usage(const char *progname) {
+	printf("%s [-h] [-p <PATH_TO_DRM_DEV>] [-l <LAYOUT>] [-n <FRAMES>] [-m <MODE>]\n", progname);
+	printf("Options:\n-h = prints this help message\
+			\n-p = provide path to drm device (default /dev/dri/card0)\
+			\n-l = row, column or mirror (default row)\
+			\n-n = frames to show (default 600)\
+			\n-m = mode preferred, refresh, bandwidth or WIDTHxHEIGHT[@HZ] (default preferred)\n");
+}
+
+int main(int argc, char **argv) {
+	const char *dev_path = "/dev/dri/card0";
+	span_layout_t layout = SPAN_LAYOUT_ROW;
+	state_t s = { .frames = 600, .dx = 12, .dy = 7 };
+	mode_request_t req;
+	int arg;
+
+	while((arg = getopt(argc, argv, ":p:l:n:m:h")) != -1) {
+		switch(arg) {
+		case 'p':
+			dev_path = optarg;
+			break;
+		case 'l':
+			if(span_layout_from_str(optarg, &layout)) {
+				printf("Unknown layout %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'm':
+			if(mode_request_from_str(optarg, &req)) {
+				printf("Unknown mode %s\n", optarg);
+				return 1;
+			}
+			mode_set_default(&req);
+			break;
+		case 'n':
+			s.frames = strtoull(optarg, NULL, 0);
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 1;
+		case ':':
+			printf("-%c requires an argument\n", optopt);
+			return 1;
+		case '?':
+			printf("Unknown argument used -%c\n", optopt);
+			return 1;
+		}
+	}
+
+	int fd = open_drm(dev_path, DRM_CAP_DUMB_BUFFER);
+	if(fd < 0) {
+		return 1;
+	}
+
+	loop_t *loop = loop_create();
+	s.span = loop ? span_create(fd, layout) : NULL;
+	if(!s.span) {
+		loop_destroy(loop);
+		close(fd);
+		return 1;
+	}
+
+	report(s.span);
+	loop_add_signal(loop, SIGINT, on_signal, &s);
+	loop_add_signal(loop, SIGTERM, on_signal, &s);
+	loop_add_fd(loop, fd, EPOLLIN, on_drm, &s);
+
+	kick(loop, &s);
+	if(s.span->pending >= 0) {
+		loop_run(loop);
+	}
+
+	for(uint32_t i = 0; i < s.span->count; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "connector %u", s.span->outputs[i].conn_id);
+		timing_summary(&s.span->outputs[i].timing, name);
+	}
+
+	span_destroy(s.span);
+	loop_destroy(loop);
+	close(fd);
+	return 0;
+}
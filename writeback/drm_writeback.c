@@ -0,0 +1,181 @@
+/*
+ * Program: drm_writeback
+ *
+ * Record the composed output of a CRTC through a writeback connector
+ * (vkms has one) and report how many frames made it and how many vblanks
+ * were dropped along the way
+ */
+
+#include "drm.h"
+#include "drm_mode.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <log.h>
+#include <drm_common.h>
+#include <encode.h>
+#include <writeback.h>
+
+typedef struct consumer {
+	uint32_t save_every;
+	uint64_t frames;
+	uint64_t checksum;
+	uint64_t first_ns;
+	uint64_t last_ns;
+} consumer_t;
+
+static void on_frame(writeback_t *wb, writeback_frame_t *frame, void *user) {
+	consumer_t *con = user;
+	bo_t *bo = frame->bo;
+
+	if(!con->frames) {
+		con->first_ns = frame->timestamp_ns;
+	}
+	con->last_ns = frame->timestamp_ns;
+	con->frames++;
+
+	//Touch the frame in place, this is where a real consumer would encode it
+	const uint32_t *px = bo->buffer;
+	for(uint32_t x = 0; x < bo->width; x += 64) {
+		con->checksum += px[x];
+	}
+
+	if(con->save_every && con->frames % con->save_every == 0) {
+		char path[64];
+		image_t img = {
+			.width = bo->width,
+			.height = bo->height,
+			.pitch = bo->pitch,
+			.format = frame->format,
+			.data = bo->buffer,
+		};
+
+		snprintf(path, sizeof(path), "writeback-%06lu.qoi", frame->sequence);
+		FILE *out = fopen(path, "wb");
+		if(out) {
+			encode_image(NULL, &img, ENCODE_QOI, 0, out);
+			fclose(out);
+		}
+	}
+}
+
+static uint32_t find_active_crtc(int fd) {
+	drmModeResPtr res = drmModeGetResources(fd);
+	uint32_t id = 0;
+
+	if(!res) {
+		return 0;
+	}
+
+	for(int i = 0; i < res->count_crtcs && !id; i++) {
+		drmModeCrtcPtr crtc = drmModeGetCrtc(fd, res->crtcs[i]);
+		if(crtc && crtc->mode_valid) {
+			id = crtc->crtc_id;
+		}
+		drmModeFreeCrtc(crtc);
+	}
+
+	drmModeFreeResources(res);
+	return id;
+}
+
+void usage(const char *progname) {
+	printf("%s [-h] [-p <PATH_TO_DRM_DEV>] [-c <CRTC_ID>] [-n <FRAMES>] [-r <SLOTS>] [-s <N>]\n", progname);
+	printf("Options:\n-h = prints this help message\
+			\n-p = path to drm device (default /dev/dri/card0)\
+			\n-c = CRTC to record (default first active CRTC)\
+			\n-n = number of frames to capture (default 300)\
+			\n-r = buffers in the writeback ring (default 3)\
+			\n-s = save every Nth frame as QOI (default off)\n");
+}
+
+int main(int argc, char **argv) {
+	const char *dev_path = "/dev/dri/card0";
+	consumer_t con = { 0 };
+	uint32_t crtc_id = 0;
+	uint32_t slots = 3;
+	uint64_t frames = 300;
+	int arg;
+
+	while((arg = getopt(argc, argv, ":p:c:n:r:s:h")) != -1) {
+		switch(arg) {
+		case 'p':
+			dev_path = optarg;
+			break;
+		case 'c':
+			crtc_id = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			frames = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			slots = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			con.save_every = strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 1;
+		case ':':
+			printf("-%c requires an argument\n", optopt);
+			return 1;
+		case '?':
+			printf("Unknown argument used -%c\n", optopt);
+			return 1;
+		}
+	}
+
+	int fd = open_drm(dev_path, DRM_CAP_DUMB_BUFFER);
+	if(fd < 0) {
+		return 1;
+	}
+
+	if(!crtc_id) {
+		crtc_id = find_active_crtc(fd);
+	}
+
+	writeback_t *wb = writeback_create(fd, crtc_id, slots, on_frame, &con);
+	if(!wb) {
+		close(fd);
+		return 1;
+	}
+
+	if(writeback_start(wb)) {
+		logger_fatal("Failed to start writeback on CRTC %u", crtc_id);
+		writeback_destroy(wb);
+		close(fd);
+		return 1;
+	}
+
+	int ret = 0;
+	while(con.frames < frames) {
+		ret = writeback_dispatch(wb, 1000);
+		if(ret) {
+			logger_error("Writeback on CRTC %u stopped after %lu frames: %s", crtc_id, con.frames,
+					strerror(-ret));
+			break;
+		}
+	}
+
+	writeback_stats_t stats;
+	writeback_get_stats(wb, &stats);
+
+	double secs = (con.last_ns - con.first_ns) / 1e9;
+	logger_info("CRTC %u: %lu frames in %.2fs (%.2f fps)", crtc_id, con.frames, secs,
+			secs > 0 ? (con.frames - 1) / secs : 0.0);
+	logger_info("commits %lu | captured %lu | dropped vblanks %lu | ring full %lu | checksum %lx",
+			stats.committed, stats.captured, stats.dropped, stats.ring_full, con.checksum);
+
+	writeback_destroy(wb);
+	close(fd);
+	return ret ? 1 : 0;
+}